@@ -0,0 +1,61 @@
+#ifndef BENCH_BENCH_UTIL_H_
+#define BENCH_BENCH_UTIL_H_
+
+#include <string.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <memory>
+
+#include "Message.h"
+
+namespace ptxchat {
+
+/**
+ * \brief Message with a body of len bytes, as a client sends it
+ */
+inline std::shared_ptr<ChatMsg> MakeBenchMsg(MsgType type, size_t len) {
+  auto msg = std::make_shared<ChatMsg>();
+  msg->hdr = ChatMsgHdr{};
+  msg->hdr.type = type;
+  snprintf(msg->hdr.from, MAX_NICKNAME_LEN, "bench-sender");
+  snprintf(msg->hdr.to, MAX_NICKNAME_LEN, "bench-receiver");
+  msg->hdr.buf_len = len;
+  msg->hdr.seq = 1;
+  msg->hdr.ts = 1;
+  if (len) {
+    msg->buf = reinterpret_cast<uint8_t*>(malloc(len));
+    memset(msg->buf, 'x', len);
+  }
+  return msg;
+}
+
+/**
+ * \brief Raise open files limit to hold fds descriptors
+ * \return false if the hard limit is lower
+ */
+inline bool ReserveFds(rlim_t fds) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+    return false;
+  if (rl.rlim_cur >= fds)
+    return true;
+  if (rl.rlim_max < fds)
+    return false;
+  rl.rlim_cur = fds;
+  return setrlimit(RLIMIT_NOFILE, &rl) == 0;
+}
+
+/**
+ * \brief Read and discard everything buffered in a nonblocking socket
+ */
+inline void DrainSocket(int fd) {
+  uint8_t buf[16384];
+  while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {}
+}
+
+}  // namespace ptxchat
+
+#endif  // BENCH_BENCH_UTIL_H_
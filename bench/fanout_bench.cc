@@ -0,0 +1,150 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Batch.h"
+#include "server.h"
+#include "connections.h"
+#include "bench_util.h"
+
+namespace ptxchat {
+
+/**
+ * \brief Registers socketpair clients in a server that is not started
+ */
+class PtxChatServerBench {
+ public:
+  PtxChatServerBench() {
+    /* Ephemeral listen port, status endpoint is off by default */
+    server_ = std::make_unique<PtxChatServer>(INADDR_ANY, 0);
+  }
+
+  ~PtxChatServerBench() {
+    Clear();
+  }
+
+  bool AddClients(size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      int sv[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+        return false;
+      /* As the server sets accepted sockets */
+      Connection::makeNonBlocking(sv[0]);
+      auto conn = std::make_shared<Connection>(sv[0], 0, 0);
+      conn->Register("bench-" + std::to_string(i));
+      server_->clients_.emplace(conn->GetNickname(), conn);
+      peers_.push_back(sv[1]);
+    }
+    return true;
+  }
+
+  void SendMsgToAll(std::shared_ptr<ChatMsg> msg) {
+    server_->SendMsgToAll(std::move(msg));
+  }
+
+  void ParseClientMsg(std::unique_ptr<ChatMsg>&& msg) {
+    server_->ParseClientMsg(std::move(msg));
+  }
+
+  void DrainPeers() {
+    for (int fd : peers_)
+      DrainSocket(fd);
+  }
+
+  void Clear() {
+    /* Client sockets are closed with their connections */
+    server_->clients_.clear();
+    for (int fd : peers_)
+      close(fd);
+    peers_.clear();
+  }
+
+ private:
+  std::unique_ptr<PtxChatServer> server_;
+  std::vector<int> peers_;  /**< Receiving ends of client sockets */
+};
+
+/**
+ * Public message fan-out, arg is the amount of registered clients
+ */
+static void BM_SendMsgToAll(benchmark::State& state) {
+  static PtxChatServerBench bench;
+  size_t n = static_cast<size_t>(state.range(0));
+  if (!ReserveFds(static_cast<rlim_t>(2 * n + 64))) {
+    state.SkipWithError("RLIMIT_NOFILE is too low");
+    return;
+  }
+  if (!bench.AddClients(n)) {
+    bench.Clear();
+    state.SkipWithError("socketpair() failed");
+    return;
+  }
+
+  auto msg = MakeBenchMsg(MsgType::PUBLIC_DATA, 64);
+  for (auto _ : state) {
+    bench.SendMsgToAll(msg);
+    /* Keep socket buffers from filling up */
+    state.PauseTiming();
+    bench.DrainPeers();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * n));
+  bench.Clear();
+}
+BENCHMARK(BM_SendMsgToAll)->Arg(10)->Arg(1000)->Arg(10000)->Unit(benchmark::kMicrosecond);
+
+static constexpr size_t BENCH_BATCH_MSGS = 64;
+
+/**
+ * One producer sends BENCH_BATCH_MSGS public messages of 64 bytes
+ * through the processing path, one by one (arg 0 = 0) or as one batch
+ * (arg 0 = 1). Arg 1 is the amount of registered clients. Storage is
+ * not connected, so only routing and fan-out are measured.
+ */
+static void BM_ProcessPublicMsgs(benchmark::State& state) {
+  static PtxChatServerBench bench;
+  bool batched = state.range(0) != 0;
+  size_t n = static_cast<size_t>(state.range(1));
+  if (!ReserveFds(static_cast<rlim_t>(2 * n + 64))) {
+    state.SkipWithError("RLIMIT_NOFILE is too low");
+    return;
+  }
+  if (!bench.AddClients(n)) {
+    bench.Clear();
+    state.SkipWithError("socketpair() failed");
+    return;
+  }
+
+  auto proto = MakeBenchMsg(MsgType::PUBLIC_DATA, 64);
+  snprintf(proto->hdr.from, MAX_NICKNAME_LEN, "bench-0");
+  for (auto _ : state) {
+    if (batched) {
+      BatchEncoder enc(proto->hdr.from);
+      for (size_t i = 0; i < BENCH_BATCH_MSGS; ++i)
+        enc.Add(*proto);
+      bench.ParseClientMsg(enc.Msg());
+    } else {
+      for (size_t i = 0; i < BENCH_BATCH_MSGS; ++i) {
+        auto msg = std::make_unique<ChatMsg>();
+        msg->hdr = proto->hdr;
+        msg->buf = reinterpret_cast<uint8_t*>(malloc(proto->hdr.buf_len));
+        memcpy(msg->buf, proto->buf, proto->hdr.buf_len);
+        bench.ParseClientMsg(std::move(msg));
+      }
+    }
+    state.PauseTiming();
+    bench.DrainPeers();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * BENCH_BATCH_MSGS));
+  bench.Clear();
+}
+BENCHMARK(BM_ProcessPublicMsgs)->Args({0, 10})->Args({1, 10})->Args({0, 1000})->Args({1, 1000})
+    ->Unit(benchmark::kMicrosecond);
+
+}  // namespace ptxchat
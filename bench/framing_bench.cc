@@ -0,0 +1,82 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+
+#include <memory>
+#include <vector>
+
+#include "Frame.h"
+#include "connections.h"
+#include "bench_util.h"
+
+namespace ptxchat {
+
+/* Frames written ahead per batch, they have to fit in the socket buffer */
+static constexpr size_t FRAMES_PER_BATCH = 64;
+
+/**
+ * Server side framing: every message takes a header and a body recv()
+ */
+static void BM_RecvMsgFromConn(benchmark::State& state) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+    state.SkipWithError("socketpair() failed");
+    return;
+  }
+  auto conn = std::make_shared<Connection>(sv[1], 0, 0);
+  auto msg = MakeBenchMsg(MsgType::PUBLIC_DATA, static_cast<size_t>(state.range(0)));
+  std::vector<frame_t> batch(FRAMES_PER_BATCH, EncodeFrame(*msg));
+  auto writer = std::make_shared<Connection>(sv[0], 0, 0);
+
+  size_t pending = 0;
+  for (auto _ : state) {
+    if (!pending) {
+      state.PauseTiming();
+      Connection::SendFramesToConn(batch, writer);
+      pending = FRAMES_PER_BATCH;
+      state.ResumeTiming();
+    }
+    auto m = Connection::RecvMsgFromConn(conn);
+    benchmark::DoNotOptimize(m);
+    --pending;
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * batch[0]->size()));
+  /* Sockets are closed by conn and writer */
+}
+BENCHMARK(BM_RecvMsgFromConn)->Arg(0)->Arg(64)->Arg(MAX_MSG_BUFFER_SIZE);
+
+/**
+ * Client side framing: one recv() of the whole batch split by FrameDecoder
+ */
+static void BM_FrameDecoder(benchmark::State& state) {
+  auto msg = MakeBenchMsg(MsgType::PUBLIC_DATA, static_cast<size_t>(state.range(0)));
+  frame_t f = EncodeFrame(*msg);
+  std::vector<uint8_t> chunk;
+  for (size_t i = 0; i < FRAMES_PER_BATCH; ++i)
+    chunk.insert(chunk.end(), f->begin(), f->end());
+
+  FrameDecoder dec;
+  bool error;
+  for (auto _ : state) {
+    dec.Append(chunk.data(), chunk.size());
+    while (auto m = dec.Next(error))
+      benchmark::DoNotOptimize(m);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * FRAMES_PER_BATCH));
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * chunk.size()));
+}
+BENCHMARK(BM_FrameDecoder)->Arg(0)->Arg(64)->Arg(MAX_MSG_BUFFER_SIZE);
+
+static void BM_EncodeFrame(benchmark::State& state) {
+  auto msg = MakeBenchMsg(MsgType::PUBLIC_DATA, static_cast<size_t>(state.range(0)));
+  for (auto _ : state) {
+    frame_t f = EncodeFrame(*msg);
+    benchmark::DoNotOptimize(f);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_EncodeFrame)->Arg(0)->Arg(64)->Arg(MAX_MSG_BUFFER_SIZE);
+
+}  // namespace ptxchat
@@ -0,0 +1,7 @@
+#include <benchmark/benchmark.h>
+
+/*
+ * Results for regression tracking:
+ *   ptx-bench --benchmark_out=bench.json --benchmark_out_format=json
+ */
+BENCHMARK_MAIN();
@@ -0,0 +1,92 @@
+#include <benchmark/benchmark.h>
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "Message.h"
+#include "SharedUDeque.h"
+#include "BoundedRing.h"
+#include "PtxGuiBackend.h"
+#include "observer.h"
+#include "bench_util.h"
+
+namespace ptxchat {
+
+static constexpr size_t BENCH_QUEUE_LEN = 4096;
+
+/**
+ * Every thread pushes one message and pops one back, so the
+ * queue never waits empty and all threads contend on its lock
+ */
+static void BM_SharedUDequePushPop(benchmark::State& state) {
+  static SharedUDeque<ChatMsg> q(BENCH_QUEUE_LEN);
+  auto item = std::make_unique<ChatMsg>();
+  for (auto _ : state) {
+    q.push_back(std::move(item));
+    item = q.front();
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_SharedUDequePushPop)->ThreadRange(1, 8)->UseRealTime();
+
+/**
+ * Same pattern on the lock-free ring of the server observer
+ */
+static void BM_BoundedRingPushPop(benchmark::State& state) {
+  static BoundedRing<std::unique_ptr<ChatMsg>> q(BENCH_QUEUE_LEN);
+  auto item = std::make_unique<ChatMsg>();
+  for (auto _ : state) {
+    q.Push(std::move(item));
+    /* A producer may have claimed a slot and not filled it yet */
+    while (!q.Pop(item)) {}
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_BoundedRingPushPop)->ThreadRange(1, 8)->UseRealTime();
+
+/**
+ * Client event path: one event per message, drained by UI once per frame
+ */
+static void BM_PushGuiEvent(benchmark::State& state) {
+  GUIBackend gui;
+  auto msg = MakeBenchMsg(MsgType::PUBLIC_DATA, 64);
+  std::vector<std::unique_ptr<GuiEvent>> events;
+  size_t pushed = 0;
+  for (auto _ : state) {
+    gui.PushGuiEvent(GuiEvType::PUBLIC_MSG, msg);
+    if (++pushed == MAX_GUI_EVENTS_BATCH) {
+      state.PauseTiming();
+      events.clear();
+      gui.PopGuiEvents(events);
+      pushed = 0;
+      state.ResumeTiming();
+    }
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_PushGuiEvent);
+
+/**
+ * Server event path, arg is the sampling rate of message events
+ */
+static void BM_ObserverNotify(benchmark::State& state) {
+  ServerObserver observer(static_cast<uint32_t>(state.range(0)));
+  auto msg = MakeBenchMsg(MsgType::PUBLIC_DATA, 64);
+  std::vector<GuiEvent> events;
+  size_t notified = 0;
+  for (auto _ : state) {
+    observer.Notify(GuiEvType::PUBLIC_MSG, msg);
+    if (++notified == DEF_OBSERVER_RING_LEN) {
+      state.PauseTiming();
+      events.clear();
+      observer.Poll(events, DEF_OBSERVER_RING_LEN);
+      notified = 0;
+      state.ResumeTiming();
+    }
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_ObserverNotify)->Arg(1)->Arg(100);
+
+}  // namespace ptxchat
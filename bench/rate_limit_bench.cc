@@ -0,0 +1,39 @@
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+#include "rate_limit.h"
+
+namespace ptxchat {
+
+static constexpr uint64_t BENCH_MSG_GAP_NS = 1000;
+
+/**
+ * Reactor side cost of one message under the limits, time advances by
+ * a fixed step so most messages pass. Arg 0 checks the connection
+ * bucket only, 1 also the bucket of one of range(1) nicknames.
+ */
+static void BM_RateLimitCheck(benchmark::State& state) {
+  RateLimitConfig cfg;
+  cfg.conn_rate = 1e6;
+  if (state.range(0))
+    cfg.user_rate = 1e6;
+  RateLimiter limiter(cfg);
+  std::vector<uint64_t> users;
+  for (int64_t i = 0; i < state.range(1); ++i)
+    users.push_back(RateLimiter::UserKey(("user" + std::to_string(i)).c_str()));
+  RateBucket conn;
+  uint64_t now = 0;
+  size_t n = 0;
+  for (auto _ : state) {
+    now += BENCH_MSG_GAP_NS;
+    benchmark::DoNotOptimize(limiter.Check(conn, users[n], now));
+    if (++n == users.size())
+      n = 0;
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_RateLimitCheck)->Args({0, 1})->Args({1, 1})->Args({1, 10000});
+
+}  // namespace ptxchat
@@ -0,0 +1,32 @@
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+#include "server_storage.h"
+#include "bench_util.h"
+
+namespace ptxchat {
+
+static void BM_PublicMsgDoc(benchmark::State& state) {
+  auto msg = MakeBenchMsg(MsgType::PUBLIC_DATA, static_cast<size_t>(state.range(0)));
+  for (auto _ : state) {
+    auto doc = ServerStorage::PublicMsgDoc(*msg);
+    benchmark::DoNotOptimize(doc);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_PublicMsgDoc)->Arg(0)->Arg(64)->Arg(MAX_MSG_BUFFER_SIZE);
+
+static void BM_PrivateMsgDoc(benchmark::State& state) {
+  auto msg = MakeBenchMsg(MsgType::PRIVATE_DATA, static_cast<size_t>(state.range(0)));
+  for (auto _ : state) {
+    /* Key is built per message in AddPrivateMsg as well */
+    std::string conv = ConversationKey(msg->hdr.from, msg->hdr.to);
+    auto doc = ServerStorage::PrivateMsgDoc(*msg, conv);
+    benchmark::DoNotOptimize(doc);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_PrivateMsgDoc)->Arg(0)->Arg(64)->Arg(MAX_MSG_BUFFER_SIZE);
+
+}  // namespace ptxchat
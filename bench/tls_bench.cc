@@ -0,0 +1,214 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Frame.h"
+#include "Tls.h"
+#include "connections.h"
+#include "bench_util.h"
+
+namespace ptxchat {
+
+static constexpr size_t TLS_FRAMES_PER_BATCH = 64;
+
+/**
+ * Self-signed P-256 certificate and key in temporary PEM files
+ */
+static bool MakeSelfSigned(std::string& cert_path, std::string& key_path) {
+  char cert_tmpl[] = "/tmp/ptx-bench-cert-XXXXXX";
+  char key_tmpl[] = "/tmp/ptx-bench-key-XXXXXX";
+  int cert_fd = mkstemp(cert_tmpl);
+  int key_fd = mkstemp(key_tmpl);
+  if (cert_fd < 0 || key_fd < 0)
+    return false;
+  cert_path = cert_tmpl;
+  key_path = key_tmpl;
+
+  EVP_PKEY* pkey = EVP_EC_gen("P-256");
+  X509* x = X509_new();
+  ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+  X509_gmtime_adj(X509_getm_notBefore(x), 0);
+  X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+  X509_set_pubkey(x, pkey);
+  X509_NAME* name = X509_get_subject_name(x);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"),
+                             -1, -1, 0);
+  X509_set_issuer_name(x, name);
+  bool ok = pkey && X509_sign(x, pkey, EVP_sha256()) > 0;
+
+  FILE* cert = fdopen(cert_fd, "w");
+  FILE* key = fdopen(key_fd, "w");
+  ok = ok && PEM_write_X509(cert, x) && PEM_write_PrivateKey(key, pkey, nullptr, nullptr, 0, nullptr, nullptr);
+  fclose(cert);
+  fclose(key);
+  X509_free(x);
+  EVP_PKEY_free(pkey);
+  return ok;
+}
+
+/**
+ * \brief Loopback TCP connection, server side sends
+ */
+struct BenchLink {
+  int tx = -1;
+  int rx = -1;
+
+  ~BenchLink() {
+    if (tx >= 0)
+      close(tx);
+    if (rx >= 0)
+      close(rx);
+  }
+};
+
+static bool OpenLink(BenchLink& l, bool tls, std::string& err) {
+  int lst = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if (bind(lst, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(lst, 1) < 0 ||
+      getsockname(lst, reinterpret_cast<sockaddr*>(&addr), &len) < 0) {
+    err = "cannot listen on loopback";
+    close(lst);
+    return false;
+  }
+  l.rx = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(l.rx, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    err = "cannot connect over loopback";
+    close(lst);
+    return false;
+  }
+  l.tx = accept(lst, nullptr, nullptr);
+  close(lst);
+  int one = 1;
+  setsockopt(l.tx, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (!tls)
+    return true;
+
+  std::string cert, key;
+  bool made = MakeSelfSigned(cert, key);
+  auto srv_ctx = made ? TlsContext::NewServer(cert, key, err) : nullptr;
+  unlink(cert.c_str());
+  unlink(key.c_str());
+  auto cl_ctx = TlsContext::NewClient("", "", err);
+  if (!srv_ctx || !cl_ctx) {
+    if (!made)
+      err = "cannot make self-signed certificate";
+    return false;
+  }
+  TlsSession srv(*srv_ctx, l.tx);
+  TlsSession cl(*cl_ctx, l.rx);
+  TlsStep srv_step = TlsStep::FAILED;
+  std::thread t([&srv, &srv_step] { srv_step = srv.Handshake(); });
+  TlsStep cl_step = cl.Handshake();
+  t.join();
+  if (srv_step != TlsStep::DONE || cl_step != TlsStep::DONE) {
+    err = "TLS handshake failed: " + srv.Error() + cl.Error();
+    return false;
+  }
+  if (!srv.KernelOffload() || !cl.KernelOffload()) {
+    err = "no kernel TLS offload (modprobe tls)";
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Fan-out path of one recipient: batches of frames through writev(),
+ * a reader thread drains the other side. With kTLS the kernel encrypts
+ * on send and decrypts on recv.
+ */
+static void SendFramesOverLink(benchmark::State& state, bool tls) {
+  BenchLink link;
+  std::string err;
+  if (!OpenLink(link, tls, err)) {
+    state.SkipWithError(err.c_str());
+    return;
+  }
+  auto msg = MakeBenchMsg(MsgType::PUBLIC_DATA, static_cast<size_t>(state.range(0)));
+  std::vector<frame_t> batch(TLS_FRAMES_PER_BATCH, EncodeFrame(*msg));
+  auto conn = std::make_shared<Connection>(link.tx, 0, 0);
+  link.tx = -1;   /* Closed by conn */
+
+  std::thread reader([fd = link.rx] {
+    std::vector<uint8_t> buf(64 * 1024);
+    while (recv(fd, buf.data(), buf.size(), 0) > 0) {}
+  });
+  for (auto _ : state) {
+    if (!Connection::SendFramesToConn(batch, conn)) {
+      state.SkipWithError("send failed");
+      break;
+    }
+  }
+  shutdown(conn->GetSocket(), SHUT_WR);
+  reader.join();
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * TLS_FRAMES_PER_BATCH));
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * TLS_FRAMES_PER_BATCH * batch[0]->size()));
+}
+
+static void BM_SendFrames_Tcp(benchmark::State& state) {
+  SendFramesOverLink(state, false);
+}
+BENCHMARK(BM_SendFrames_Tcp)->Arg(64)->Arg(MAX_MSG_BUFFER_SIZE)->UseRealTime();
+
+static void BM_SendFrames_Ktls(benchmark::State& state) {
+  SendFramesOverLink(state, true);
+}
+BENCHMARK(BM_SendFrames_Ktls)->Arg(64)->Arg(MAX_MSG_BUFFER_SIZE)->UseRealTime();
+
+/**
+ * Cost of TLS connection setup, certificate is made once
+ */
+static void BM_TlsHandshake(benchmark::State& state) {
+  std::string cert, key, err;
+  if (!MakeSelfSigned(cert, key)) {
+    state.SkipWithError("cannot make self-signed certificate");
+    return;
+  }
+  auto srv_ctx = TlsContext::NewServer(cert, key, err);
+  auto cl_ctx = TlsContext::NewClient("", "", err);
+  unlink(cert.c_str());
+  unlink(key.c_str());
+  if (!srv_ctx || !cl_ctx) {
+    state.SkipWithError(err.c_str());
+    return;
+  }
+  for (auto _ : state) {
+    state.PauseTiming();
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    state.ResumeTiming();
+    bool ok;
+    {
+      TlsSession srv(*srv_ctx, sv[0]);
+      TlsSession cl(*cl_ctx, sv[1]);
+      std::thread t([&srv] { srv.Handshake(); });
+      ok = cl.Handshake() == TlsStep::DONE;
+      t.join();
+    }
+    close(sv[0]);
+    close(sv[1]);
+    if (!ok) {
+      state.SkipWithError("TLS handshake failed");
+      break;
+    }
+  }
+}
+BENCHMARK(BM_TlsHandshake)->UseRealTime();
+
+}  // namespace ptxchat
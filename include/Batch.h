@@ -0,0 +1,140 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <string.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Message.h"
+#include "Frame.h"
+
+namespace ptxchat {
+
+inline bool IsBatchable(MsgType t) {
+  return t == MsgType::PRIVATE_DATA || t == MsgType::PUBLIC_DATA;
+}
+
+/**
+ * \brief Packs data messages of one sender into a BATCH message
+ *
+ * Server takes the batch as one unit: one queue slot, one storage
+ * write and one send per recipient for all of its messages.
+ */
+class BatchEncoder {
+ public:
+  explicit BatchEncoder(const std::string& from) noexcept: hdr_{}, count_(0) {
+    hdr_.type = MsgType::BATCH;
+    strncpy(hdr_.from, from.c_str(), MAX_NICKNAME_LEN - 1);
+  }
+
+  /**
+   * \return false if the batch is full or message cannot be batched
+   */
+  bool Add(MsgType t, const char* to, const uint8_t* buf, size_t len) {
+    size_t to_len = strnlen(to, MAX_NICKNAME_LEN);
+    if (!IsBatchable(t) || len > MAX_MSG_BUFFER_SIZE || count_ == MAX_BATCH_MSGS ||
+        body_.size() + sizeof(BatchEntry) + to_len + len > MAX_BATCH_BUFFER_SIZE)
+      return false;
+    BatchEntry e{t, static_cast<uint8_t>(to_len), static_cast<uint16_t>(len)};
+    auto p = reinterpret_cast<const uint8_t*>(&e);
+    body_.insert(body_.end(), p, p + sizeof(e));
+    body_.insert(body_.end(), to, to + to_len);
+    body_.insert(body_.end(), buf, buf + len);
+    ++count_;
+    return true;
+  }
+
+  bool Add(const ChatMsg& msg) { return Add(msg.hdr.type, msg.hdr.to, msg.buf, msg.hdr.buf_len); }
+
+  [[nodiscard]] size_t Count() const { return count_; }
+
+  void Clear() {
+    body_.clear();
+    count_ = 0;
+  }
+
+  /**
+   * \brief BATCH message for queues of messages
+   */
+  [[nodiscard]] std::unique_ptr<ChatMsg> Msg() const {
+    auto msg = std::make_unique<ChatMsg>();
+    msg->hdr = hdr_;
+    msg->hdr.buf_len = body_.size();
+    msg->buf = reinterpret_cast<uint8_t*>(malloc(body_.size()));
+    memcpy(msg->buf, body_.data(), body_.size());
+    return msg;
+  }
+
+  /**
+   * \brief BATCH message as it is sent over the wire
+   */
+  [[nodiscard]] frame_t Frame() const {
+    auto f = std::make_shared<std::vector<uint8_t>>(sizeof(ChatMsgHdr) + body_.size());
+    ChatMsgHdr hdr = hdr_;
+    hdr.buf_len = body_.size();
+    memcpy(f->data(), &hdr, sizeof(hdr));
+    memcpy(f->data() + sizeof(hdr), body_.data(), body_.size());
+    return f;
+  }
+
+ private:
+  ChatMsgHdr hdr_;
+  std::vector<uint8_t> body_;
+  size_t count_;
+};
+
+/**
+ * \brief Amount of messages in a BATCH body, without copying them
+ * \return 0 if the body is malformed
+ */
+inline size_t BatchCount(const uint8_t* buf, size_t len) {
+  size_t off = 0;
+  size_t n = 0;
+  while (off < len) {
+    BatchEntry e;
+    if (len - off < sizeof(e) || ++n > MAX_BATCH_MSGS)
+      return 0;
+    memcpy(&e, buf + off, sizeof(e));
+    off += sizeof(e) + e.to_len + e.buf_len;
+    if (!IsBatchable(e.type) || e.to_len >= MAX_NICKNAME_LEN || e.buf_len > MAX_MSG_BUFFER_SIZE || off > len)
+      return 0;
+  }
+  return n;
+}
+
+/**
+ * \brief Unpack a BATCH message, every message gets sender and source of the batch
+ * \return false if the body is malformed
+ */
+inline bool DecodeBatch(const ChatMsg& batch, std::vector<std::shared_ptr<ChatMsg>>& out) {
+  size_t n = BatchCount(batch.buf, batch.hdr.buf_len);
+  if (!n)
+    return false;
+  out.reserve(out.size() + n);
+  size_t off = 0;
+  for (size_t i = 0; i < n; ++i) {
+    BatchEntry e;
+    memcpy(&e, batch.buf + off, sizeof(e));
+    off += sizeof(e);
+    auto msg = std::make_shared<ChatMsg>();
+    msg->hdr = ChatMsgHdr{};
+    msg->hdr.type = e.type;
+    msg->hdr.src_ip = batch.hdr.src_ip;
+    msg->hdr.src_port = batch.hdr.src_port;
+    memcpy(msg->hdr.from, batch.hdr.from, MAX_NICKNAME_LEN);
+    memcpy(msg->hdr.to, batch.buf + off, e.to_len);
+    off += e.to_len;
+    msg->hdr.buf_len = e.buf_len;
+    msg->buf = reinterpret_cast<uint8_t*>(malloc(e.buf_len));
+    memcpy(msg->buf, batch.buf + off, e.buf_len);
+    off += e.buf_len;
+    out.push_back(std::move(msg));
+  }
+  return true;
+}
+
+}  // namespace ptxchat
+
+#endif  // BATCH_H_
@@ -0,0 +1,101 @@
+#ifndef BOUNDEDRING_H_
+#define BOUNDEDRING_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace ptxchat {
+
+/**
+ * \brief Bounded lock-free queue for many producers and consumers
+ *
+ * Every slot carries a sequence number telling whose turn it is,
+ * so producers and consumers only contend on their own position
+ * counter. Capacity is rounded up to a power of two. Push() never
+ * waits: it fails when the ring is full.
+ */
+template<typename T>
+class BoundedRing {
+ public:
+  explicit BoundedRing(size_t capacity) noexcept {
+    size_t cap = 2;
+    while (cap < capacity)
+      cap <<= 1;
+    mask_ = cap - 1;
+    slots_ = std::make_unique<Slot[]>(cap);
+    for (size_t i = 0; i < cap; ++i)
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  BoundedRing(const BoundedRing&) = delete;
+  BoundedRing& operator=(const BoundedRing&) = delete;
+
+  /**
+   * \return false if the ring is full
+   */
+  bool Push(T&& v) {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    Slot* s;
+    while (1) {
+      s = &slots_[pos & mask_];
+      size_t seq = s->seq.load(std::memory_order_acquire);
+      auto dif = static_cast<std::ptrdiff_t>(seq - pos);
+      if (dif == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+    s->val = std::move(v);
+    s->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * \return false if the ring is empty
+   */
+  bool Pop(T& v) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    Slot* s;
+    while (1) {
+      s = &slots_[pos & mask_];
+      size_t seq = s->seq.load(std::memory_order_acquire);
+      auto dif = static_cast<std::ptrdiff_t>(seq - (pos + 1));
+      if (dif == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    v = std::move(s->val);
+    s->seq.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  [[nodiscard]] size_t Capacity() const { return mask_ + 1; }
+
+ private:
+  struct Slot {
+    std::atomic<size_t> seq;
+    T val;
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+  size_t mask_;
+  alignas(64) std::atomic<size_t> head_{0};  /**< Next position to push */
+  alignas(64) std::atomic<size_t> tail_{0};  /**< Next position to pop */
+};
+
+}  // namespace ptxchat
+
+#endif  // BOUNDEDRING_H_
@@ -0,0 +1,50 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "Message.h"
+
+namespace ptxchat {
+
+/*
+ * Capture file: CaptureFileHdr, then records in the order the server saw
+ * them. Every record is CaptureRecHdr followed by len bytes: a wire frame
+ * (ChatMsgHdr and buffer) for FRAME, nothing for OPEN and CLOSE.
+ * Fields are in host byte order, captures are replayed on the same arch.
+ */
+constexpr char CAPTURE_MAGIC[8] = {'P', 'T', 'X', 'C', 'A', 'P', '\0', '\0'};
+constexpr uint32_t CAPTURE_VERSION = 1;
+
+enum class CaptureEv : uint8_t {
+  OPEN,    /**< Connection accepted */
+  FRAME,   /**< Message received from connection */
+  CLOSE,   /**< Connection closed */
+};
+
+#pragma pack(push, 1)
+struct CaptureFileHdr {
+  char magic[8];
+  uint32_t version;
+  uint32_t msg_hdr_size;   /**< sizeof(ChatMsgHdr) of the server that wrote it */
+  uint64_t start_us;       /**< Wall clock when capture started */
+};
+
+struct CaptureRecHdr {
+  uint64_t t_us;   /**< Since capture start */
+  uint32_t conn;   /**< Connection id, unique within a capture */
+  uint8_t ev;      /**< CaptureEv */
+  uint8_t pad[3];
+  uint32_t len;
+};
+#pragma pack(pop)
+
+inline bool CaptureHdrValid(const CaptureFileHdr& h) {
+  return !memcmp(h.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) && h.version == CAPTURE_VERSION &&
+         h.msg_hdr_size == sizeof(ChatMsgHdr);
+}
+
+}  // namespace ptxchat
+
+#endif  // CAPTURE_H_
@@ -0,0 +1,103 @@
+#ifndef FRAME_H_
+#define FRAME_H_
+
+#include <string.h>
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "Message.h"
+
+namespace ptxchat {
+
+/**
+ * Message serialized as it is sent over the wire: header followed by buffer.
+ * Immutable, so one frame may be shared by many senders.
+ */
+typedef std::shared_ptr<const std::vector<uint8_t>> frame_t;
+
+/**
+ * \brief Serialize message into a wire frame
+ */
+inline frame_t EncodeFrame(const ChatMsg& msg) {
+  auto f = std::make_shared<std::vector<uint8_t>>(sizeof(ChatMsgHdr) + msg.hdr.buf_len);
+  memcpy(f->data(), &msg.hdr, sizeof(ChatMsgHdr));
+  if (msg.hdr.buf_len)
+    memcpy(f->data() + sizeof(ChatMsgHdr), msg.buf, msg.hdr.buf_len);
+  return f;
+}
+
+/**
+ * \brief Splits a received byte stream into messages
+ *
+ * Bytes may be appended in chunks of any size: a chunk may hold
+ * several frames or a part of one.
+ */
+class FrameDecoder {
+ public:
+  FrameDecoder() noexcept: rd_(0) {}
+
+  /**
+   * \brief Append received bytes
+   */
+  void Append(const uint8_t* data, size_t len) {
+    /* Move the incomplete tail to the front once the consumed part dominates */
+    if (rd_ && rd_ >= buf_.size() / 2) {
+      buf_.erase(buf_.begin(), buf_.begin() + static_cast<std::ptrdiff_t>(rd_));
+      rd_ = 0;
+    }
+    buf_.insert(buf_.end(), data, data + len);
+  }
+
+  /**
+   * \brief Decode the next complete message
+   * \param error set to true if the stream is malformed
+   * \return nullptr if no complete message is buffered
+   */
+  std::unique_ptr<ChatMsg> Next(bool& error) {
+    error = false;
+    size_t avail = buf_.size() - rd_;
+    if (avail < sizeof(ChatMsgHdr))
+      return nullptr;
+
+    auto msg = std::make_unique<ChatMsg>();
+    memcpy(&msg->hdr, buf_.data() + rd_, sizeof(ChatMsgHdr));
+    size_t buf_len = msg->hdr.buf_len;
+    if (buf_len > MaxBufLen(msg->hdr.type)) {
+      error = true;
+      return nullptr;
+    }
+    if (avail < sizeof(ChatMsgHdr) + buf_len)
+      return nullptr;
+
+    if (buf_len) {
+      msg->buf = reinterpret_cast<uint8_t*>(malloc(buf_len));
+      memcpy(msg->buf, buf_.data() + rd_ + sizeof(ChatMsgHdr), buf_len);
+    }
+    rd_ += sizeof(ChatMsgHdr) + buf_len;
+    if (rd_ == buf_.size()) {
+      buf_.clear();
+      rd_ = 0;
+    }
+    return msg;
+  }
+
+  /**
+   * \brief Amount of buffered bytes not decoded yet
+   */
+  [[nodiscard]] size_t Pending() const { return buf_.size() - rd_; }
+
+  void Clear() {
+    buf_.clear();
+    rd_ = 0;
+  }
+
+ private:
+  std::vector<uint8_t> buf_;
+  size_t rd_;  /**< Offset of the first not decoded byte */
+};
+
+}  // namespace ptxchat
+
+#endif  // FRAME_H_
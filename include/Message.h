@@ -2,13 +2,18 @@
 #define MESSAGE_H_
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <memory>
+#include <string>
 #include <utility>
 
 namespace ptxchat {
 
 constexpr size_t MAX_MSG_BUFFER_SIZE = 256;
 constexpr size_t MAX_NICKNAME_LEN = 64;
+constexpr uint32_t DEF_HISTORY_PAGE = 50;
+constexpr uint32_t MAX_HISTORY_PAGE = 200;
+constexpr size_t RESUME_TOKEN_LEN = 32;
 
 enum class MsgType {
   REGISTER,     REGISTERED,   ERR_REGISTERED,
@@ -17,8 +22,55 @@ enum class MsgType {
   ERR_UNKNOWN,
   QUIT,  // TODO: impl
   PING, PONG,  // TODO: impl
+  HISTORY_REQ,  HISTORY_END,
+  BATCH,        /**< Several data messages of one sender, body is BatchEntry records */
+  MCAST_JOIN,   MCAST_INFO,
 };
 
+constexpr size_t MSG_TYPE_CNT = static_cast<size_t>(MsgType::MCAST_INFO) + 1;
+
+/**
+ * \brief Names of message types in logs, metrics and traces
+ */
+inline const char* const MSG_TYPE_NAMES[MSG_TYPE_CNT] = {
+  "register",     "registered",   "err_registered",
+  "unregister",   "unregistered", "err_unregistered",
+  "private_data", "public_data",
+  "err_unknown",
+  "quit",
+  "ping",         "pong",
+  "history_req",  "history_end",
+  "batch",
+  "mcast_join",   "mcast_info",
+};
+
+inline const char* MsgTypeName(MsgType t) {
+  size_t i = static_cast<size_t>(t);
+  return i < MSG_TYPE_CNT ? MSG_TYPE_NAMES[i] : "unknown";
+}
+
+enum class HistoryScope : uint8_t {
+  PUBLIC,
+  PRIVATE,  /**< Conversation with peer, or all private messages of the client if peer is empty */
+};
+
+/**
+ * Conversation of a message: public chat or a pair of clients.
+ * Sequence numbers are counted per conversation.
+ */
+inline const std::string PUBLIC_CONVERSATION = "";
+
+/**
+ * \brief Key of private conversation, same for both sides
+ *
+ * Nicknames cannot contain control characters, so '\n' separates them.
+ */
+inline std::string ConversationKey(const std::string& a, const std::string& b) {
+  if (a < b)
+    return a + '\n' + b;
+  return b + '\n' + a;
+}
+
 enum class GuiEvType {
   Q_EMPTY,
   CLIENT_REG,
@@ -51,18 +103,118 @@ struct ChatMsgHdr {
   char from[MAX_NICKNAME_LEN];
   char to[MAX_NICKNAME_LEN];
   size_t buf_len;
+  uint64_t seq;                /**< Filled by server, monotonic per conversation */
+  uint64_t ts;                 /**< Filled by server, us since epoch, unique per server */
+};
+
+/**
+ * \brief Body of HISTORY_REQ message
+ *
+ * Server replies with up to limit newest stored messages between
+ * after and before (oldest first, of their original type), followed
+ * by a HISTORY_END message. Bounds are sequence numbers of a single
+ * conversation, or server timestamps when all private messages are
+ * requested.
+ */
+struct HistoryReq {
+  HistoryScope scope;
+  char peer[MAX_NICKNAME_LEN]; /**< Other side of private conversation */
+  uint64_t before;             /**< Exclusive upper bound, 0 for the newest */
+  uint64_t after;              /**< Exclusive lower bound, last seen message for delta sync */
+  uint32_t limit;              /**< Page size, capped by MAX_HISTORY_PAGE */
+};
+
+/**
+ * \brief Body of HISTORY_END message
+ */
+struct HistoryEnd {
+  HistoryScope scope;
+  uint64_t next;               /**< Value of before for the next (older) page */
+  uint64_t after;              /**< Lower bound of the request */
+  uint32_t count;              /**< Amount of messages sent in this page */
+  uint8_t has_more;            /**< Non-zero if older messages after the bound are stored */
+};
+
+/**
+ * \brief Optional body of REGISTER message
+ *
+ * A client that lost its connection presents the token of its session
+ * and the last messages it has seen. If the token is valid, server
+ * registers it again (replacing a stale registration of the same
+ * nickname) and replays only newer messages, as history pages with
+ * after set to these bounds.
+ */
+struct ResumeReq {
+  char token[RESUME_TOKEN_LEN];
+  uint64_t public_seq;         /**< Last seen public sequence number */
+  uint64_t private_ts;         /**< Last seen private message timestamp */
+};
+
+/**
+ * \brief Record of BATCH message body
+ *
+ * Followed by to_len bytes of recipient nickname (not terminated) and
+ * buf_len bytes of message buffer. Sender is the one of the batch, only
+ * PRIVATE_DATA and PUBLIC_DATA may be batched.
+ */
+struct BatchEntry {
+  MsgType type;
+  uint8_t to_len;
+  uint16_t buf_len;
 };
 
+/**
+ * \brief Body of MCAST_INFO message
+ *
+ * Reply to MCAST_JOIN: public messages then come to the client once
+ * per message on this group instead of its TCP connection. While no
+ * public messages are sent, server repeats it on the group as heartbeat.
+ * Public sequence numbers have no gaps: a client that sees one, or a
+ * heartbeat with newer last_seq, requests the missing messages as a
+ * public history page after its last seen one.
+ */
+struct McastInfo {
+  uint32_t group;              /**< IPv4 address, network order */
+  uint16_t port;               /**< UDP port, host order */
+  uint64_t last_seq;           /**< Last public sequence number sent to the group */
+};
+
+/**
+ * \brief Body of REGISTERED message
+ */
+struct SessionInfo {
+  char token[RESUME_TOKEN_LEN]; /**< Presented in ResumeReq after reconnect */
+  uint8_t resumed;             /**< Non-zero if missed messages are replayed */
+  uint64_t public_seq;         /**< Last public sequence number at registration */
+  uint64_t ts;                 /**< Server time at registration */
+  uint64_t mailbox_ts;         /**< Oldest offline message sent right after this reply, 0 if none */
+};
+
+#pragma pack(pop)
+
+constexpr size_t MAX_BATCH_MSGS = 64;
+constexpr size_t MAX_BATCH_BUFFER_SIZE = MAX_BATCH_MSGS * (sizeof(BatchEntry) + MAX_NICKNAME_LEN + MAX_MSG_BUFFER_SIZE);
+
+/**
+ * \brief Largest buffer a message of type may carry
+ */
+inline size_t MaxBufLen(MsgType t) {
+  return t == MsgType::BATCH ? MAX_BATCH_BUFFER_SIZE : MAX_MSG_BUFFER_SIZE;
+}
+
+struct MsgTrace;
+
 struct ChatMsg {
-  ChatMsg() noexcept: buf(nullptr) {}
+  ChatMsg() noexcept: buf(nullptr), queued_ns(0), conn(0) {}
   ~ChatMsg() { if (buf) free(buf); }
 
   ChatMsgHdr hdr;
   uint8_t* buf;
+  std::shared_ptr<MsgTrace> trace;  /**< Set by server on sampled messages only */
+  uint64_t queued_ns;               /**< Set by server when queued for processing, steady_clock */
+  uint64_t conn;                    /**< Set by server: handle of the connection it came from */
 };
 
-#pragma pack(push)
-
 } // namespace ptxchat
 
 #endif // MESSAGE_H_
@@ -10,6 +10,8 @@
 
 namespace ptxchat {
 
+constexpr size_t MAX_GUI_EVENTS_BATCH = 1000;
+
 class GUIBackend {
  public:
   GUIBackend() {
@@ -22,6 +24,14 @@ class GUIBackend {
    */
   std::unique_ptr<GuiEvent> PopGuiEvent();
 
+  /**
+   * \brief Move pending gui events to out without waiting
+   *
+   * Meant to be called by UI thread once per frame.
+   * \return Amount of moved events
+   */
+  size_t PopGuiEvents(std::vector<std::unique_ptr<GuiEvent>>& out, size_t max = MAX_GUI_EVENTS_BATCH);
+
   /**
    * \brief Push gui event to the queue
    * \param t type of event
@@ -0,0 +1,67 @@
+#ifndef SCROLLBACK_H_
+#define SCROLLBACK_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ptxchat {
+
+constexpr size_t DEF_SCROLLBACK_LINES = 5000;
+
+/**
+ * \brief Ring of the latest chat lines
+ *
+ * Lines are addressed by absolute index: the n-th appended line keeps
+ * index n after older lines are evicted, so a view scrolled back stays
+ * on the same text. Not thread safe, owned by UI thread.
+ */
+class Scrollback {
+ public:
+  explicit Scrollback(size_t max_lines = DEF_SCROLLBACK_LINES) noexcept:
+    lines_(max_lines ? max_lines : 1),
+    total_(0) {}
+
+  void Append(std::string line) {
+    lines_[total_ % lines_.size()] = std::move(line);
+    ++total_;
+  }
+
+  void Clear() {
+    /* Indices keep growing, so views do not show old lines at new indices */
+    for (auto& l : lines_)
+      l.clear();
+    first_ = total_;
+  }
+
+  /**
+   * \brief Absolute index of the oldest kept line
+   */
+  [[nodiscard]] uint64_t First() const {
+    uint64_t ring_first = total_ > lines_.size() ? total_ - lines_.size() : 0;
+    return ring_first > first_ ? ring_first : first_;
+  }
+
+  /**
+   * \brief Absolute index after the newest line
+   */
+  [[nodiscard]] uint64_t End() const { return total_; }
+
+  [[nodiscard]] size_t Size() const { return static_cast<size_t>(End() - First()); }
+
+  /**
+   * \brief Line by absolute index in [First(), End())
+   */
+  [[nodiscard]] const std::string& Line(uint64_t i) const { return lines_[i % lines_.size()]; }
+
+ private:
+  std::vector<std::string> lines_;
+  uint64_t total_;       /**< Lines ever appended */
+  uint64_t first_ = 0;   /**< Index of the first line after Clear() */
+};
+
+}  // namespace ptxchat
+
+#endif  // SCROLLBACK_H_
@@ -0,0 +1,67 @@
+#ifndef SCROLLBACKVIEW_H_
+#define SCROLLBACKVIEW_H_
+
+#include <stdint.h>
+#include <nanogui/screen.h>
+#include <nanogui/widget.h>
+
+#include <functional>
+#include <string>
+#include <utility>
+
+#include "Scrollback.h"
+
+namespace ptxchat {
+
+constexpr int DEF_SCROLLBACK_ROWS = 5;
+constexpr int SCROLL_LINES_STEP = 3;    /**< Lines scrolled by one wheel step */
+
+/**
+ * \brief Virtualized list of scrollback lines
+ *
+ * Draws only the rows that fit the widget, so its cost does not depend
+ * on the scrollback length. Follows the newest line unless the user
+ * scrolls back; scrolling to the bottom follows again.
+ */
+class ScrollbackView : public nanogui::Widget {
+ public:
+  ScrollbackView(nanogui::Widget* parent, const Scrollback* lines, int rows = DEF_SCROLLBACK_ROWS);
+
+  void draw(NVGcontext* ctx) override;
+  bool scrollEvent(const Eigen::Vector2i& p, const Eigen::Vector2f& rel) override;
+  Eigen::Vector2i preferredSize(NVGcontext* ctx) const override;
+
+ private:
+  const Scrollback* lines_;
+  int rows_;           /**< Rows asked for in preferred size */
+  bool follow_;        /**< Stick to the newest line */
+  uint64_t top_;       /**< Absolute index of the first visible line when not following */
+
+  [[nodiscard]] int VisibleRows() const;
+  [[nodiscard]] float LineHeight() const;
+};
+
+/**
+ * \brief Screen that runs a callback on UI thread once per frame
+ *
+ * GUI events are drained there, so widgets are changed only
+ * by UI thread and right before they are drawn.
+ */
+class ChatScreen : public nanogui::Screen {
+ public:
+  using nanogui::Screen::Screen;
+
+  void SetFrameCallback(std::function<void()> cb) { frame_cb_ = std::move(cb); }
+
+  void drawContents() override {
+    if (frame_cb_)
+      frame_cb_();
+  }
+
+ private:
+  std::function<void()> frame_cb_;
+};
+
+}  // namespace ptxchat
+
+#endif  // SCROLLBACKVIEW_H_
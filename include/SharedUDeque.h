@@ -3,11 +3,13 @@
 
 #include <stdint.h>
 
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 #include <deque>
 #include <memory>
 #include <utility>
+#include <vector>
 
 namespace ptxchat {
 
@@ -64,6 +66,21 @@ class SharedUDeque {
     return t;
   }
 
+  /**
+   * \brief Like back(), but waits at most timeout
+   * \return nullptr on timeout or if the queue is stopped
+   */
+  template <typename Rep, typename Period>
+  [[nodiscard]] std::unique_ptr<T> back_for(const std::chrono::duration<Rep, Period>& timeout) {
+    std::unique_lock<std::mutex> lc_q(mtx_);
+    if (!cond_.wait_for(lc_q, timeout, [this] { return !deque_.empty() || stop_; }) || stop_)
+      return nullptr;
+
+    std::unique_ptr<T> t = std::move(deque_.back());
+    deque_.pop_back();
+    return t;
+  }
+
   /**
    * \brief Push element to the front
    * 
@@ -75,7 +92,7 @@ class SharedUDeque {
       return false;
 
     deque_.push_front(std::move(i));
-    mtx_.unlock();
+    lc_q.unlock();
     cond_.notify_one();
     return true;
   }
@@ -91,19 +108,70 @@ class SharedUDeque {
       return false;
 
     deque_.push_back(std::move(i));
-    mtx_.unlock();
+    lc_q.unlock();
     cond_.notify_one();
     return true;
   }
 
+  /**
+   * \brief Move up to max elements from the back to out
+   *
+   * Blocks calling thread until the queue is not empty. Unlike back(),
+   * elements left in a stopped queue are still returned, so a consumer
+   * can drain it before exit.
+   * \return Amount of moved elements, 0 if the queue is stopped and empty
+   */
+  size_t pop_all_back(std::vector<std::unique_ptr<T>>& out, size_t max) {
+    std::unique_lock<std::mutex> lc_q(mtx_);
+    cond_.wait(lc_q, [this] {
+                return (!deque_.empty() || stop_);
+              });
+
+    size_t n = 0;
+    while (!deque_.empty() && n < max) {
+      out.push_back(std::move(deque_.back()));
+      deque_.pop_back();
+      ++n;
+    }
+    return n;
+  }
+
+  /**
+   * \brief Move up to max elements from the front to out without waiting
+   * \return Amount of moved elements
+   */
+  size_t try_pop_all_front(std::vector<std::unique_ptr<T>>& out, size_t max) {
+    std::unique_lock<std::mutex> lc_q(mtx_);
+    size_t n = 0;
+    while (!deque_.empty() && n < max) {
+      out.push_back(std::move(deque_.front()));
+      deque_.pop_front();
+      ++n;
+    }
+    return n;
+  }
+
   /**
    * \brief Set stop flag on all waiting threads
    */
   void stop(bool s) {
-    stop_ = s;
+    {
+      std::unique_lock<std::mutex> lc_q(mtx_);
+      stop_ = s;
+    }
     cond_.notify_all();
   }
 
+  [[nodiscard]] bool stopped() const {
+    std::unique_lock<std::mutex> lc_q(mtx_);
+    return stop_;
+  }
+
+  [[nodiscard]] size_t size() const {
+    std::unique_lock<std::mutex> lc_q(mtx_);
+    return deque_.size();
+  }
+
   /**
    * \brief Clear queue
    */
@@ -1,48 +1,161 @@
 #ifndef STORAGE_H_
 #define STORAGE_H_
 
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <string>
 
 #include <mongocxx/instance.hpp>
 #include <mongocxx/client.hpp>
+#include <mongocxx/pool.hpp>
+#include <mongocxx/uri.hpp>
 #include <mongocxx/database.hpp>
 #include <mongocxx/collection.hpp>
 #include <mongocxx/exception/exception.hpp>
+#include <bsoncxx/builder/stream/document.hpp>
 
 #include "Message.h"
 
 namespace ptxchat {
 
+inline const char* DEF_STORAGE_URI = "mongodb://localhost:27017";
+static constexpr size_t DEF_STORAGE_POOL_SIZE = 8;
+inline const char* STORAGE_DB_NAME = "ptx-chat";
+
+struct StoragePoolStats {
+  size_t pool_size;          /**< Max clients in the pool */
+  uint64_t in_use;           /**< Clients checked out now */
+  uint64_t checkouts;        /**< Total checkouts */
+  uint64_t checkout_us;      /**< Total time waiting for a client */
+  uint64_t max_checkout_us;  /**< Longest wait for a client */
+};
+
+/**
+ * \brief Connection pool to chat database
+ *
+ * Any thread may check out its own client with Acquire(), so storage
+ * objects can be shared by processing and persistence threads.
+ */
 class StorageBase {
  public:
-  StorageBase() {
-    instance_ = std::make_unique<mongocxx::instance>();
+  explicit StorageBase(const std::string& uri = DEF_STORAGE_URI, size_t pool_size = DEF_STORAGE_POOL_SIZE):
+    uri_(uri),
+    pool_size_(pool_size) {
+    Instance();
+  }
+
+  /**
+   * \brief Create connection pool and check the server is there
+   *
+   * Blocks until the server replies or the driver gives up.
+   * May be called again after a failure, or after a call lost the
+   * server: the pool is kept and reconnects by itself.
+   * \return true if connected
+   */
+  virtual bool Connect() {
+    if (isConnected)
+      return true;
+    std::string full_uri = uri_ + (uri_.find('?') == std::string::npos ? "?" : "&") +
+                           "maxPoolSize=" + std::to_string(pool_size_);
     try {
-      client_ = std::make_unique<mongocxx::client>(mongocxx::uri{});
+      /* Other threads may still hold clients of a pool that lost the server */
+      if (!pool_)
+        pool_ = std::make_unique<mongocxx::pool>(mongocxx::uri{full_uri});
+      /* Pool connects lazily, so check the server is there */
+      auto s = Acquire();
+      s.Db().run_command(bsoncxx::builder::stream::document{} << "ping" << 1
+                                                              << bsoncxx::builder::stream::finalize);
+      if (!s.Db().has_collection("messages"))
+        s.Db().create_collection("messages");
     } catch (mongocxx::exception& ex) {
-      isConnected = false;
-      return;
-    }
-    chat_db_ = std::make_unique<mongocxx::database>(client_->database("ptx-chat"));
-    if (!chat_db_->has_collection("messages")) {
-      chat_db_->create_collection("messages");
+      return false;
     }
-    msg_coll_ = std::make_unique<mongocxx::collection>(chat_db_->collection("messages"));
     isConnected = true;
+    return true;
   }
 
   virtual ~StorageBase() {
 
   }
 
+  [[nodiscard]] bool IsConnected() const { return isConnected; }
+
+  [[nodiscard]] StoragePoolStats GetPoolStats() const {
+    StoragePoolStats s;
+    s.pool_size = pool_size_;
+    s.in_use = in_use_;
+    s.checkouts = checkouts_;
+    s.checkout_us = checkout_us_;
+    s.max_checkout_us = max_checkout_us_;
+    return s;
+  }
+
  protected:
-  std::unique_ptr<mongocxx::instance> instance_;
-  std::unique_ptr<mongocxx::client> client_;
-  std::unique_ptr<mongocxx::database> chat_db_;
-  std::unique_ptr<mongocxx::collection> msg_coll_;
-  bool isConnected;
+  /**
+   * \brief Client checked out of the pool, returned on destruction
+   */
+  class Session {
+   public:
+    Session(mongocxx::pool::entry&& e, std::atomic<uint64_t>& in_use) noexcept:
+      entry_(std::move(e)),
+      in_use_(in_use) { ++in_use_; }
+    Session(Session&& r) noexcept:
+      entry_(std::move(r.entry_)),
+      in_use_(r.in_use_) { ++in_use_; }
+    Session(const Session&) = delete;
+    ~Session() { --in_use_; }
+
+    mongocxx::database Db() { return (*entry_)[STORAGE_DB_NAME]; }
+    mongocxx::collection Collection(const char* name) { return Db()[name]; }
+
+   private:
+    mongocxx::pool::entry entry_;
+    std::atomic<uint64_t>& in_use_;
+  };
+
+  /**
+   * \brief Check out a client, blocks while all pool_size clients are in use
+   */
+  Session Acquire() {
+    auto start = std::chrono::steady_clock::now();
+    auto entry = pool_->acquire();
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+    ++checkouts_;
+    checkout_us_ += us;
+    uint64_t max = max_checkout_us_;
+    while (us > max && !max_checkout_us_.compare_exchange_weak(max, us)) {}
+    return Session(std::move(entry), in_use_);
+  }
+
+  /**
+   * \brief Driver instance, the driver allows only one per process
+   */
+  static mongocxx::instance& Instance() {
+    static mongocxx::instance instance{};
+    return instance;
+  }
+
+  /**
+   * \brief Called when an operation fails, storage is unused until Connect() succeeds again
+   */
+  void Lost() { isConnected = false; }
+
+  std::unique_ptr<mongocxx::pool> pool_;  /**< Never replaced once created */
+  const std::string uri_;
+  const size_t pool_size_;
+  std::atomic<bool> isConnected{false};  /**< Set once pool_ is ready to use, cleared by Lost() */
+
+ private:
+  std::atomic<uint64_t> in_use_{0};
+  std::atomic<uint64_t> checkouts_{0};
+  std::atomic<uint64_t> checkout_us_{0};
+  std::atomic<uint64_t> max_checkout_us_{0};
 };
 
 } // namespace ptxchat
 
-#endif // STORAGE_H_
\ No newline at end of file
+#endif // STORAGE_H_
@@ -0,0 +1,96 @@
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <memory>
+#include <string>
+
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_st SSL;
+
+namespace ptxchat {
+
+enum class TlsStep {
+  DONE,
+  WANT_READ,    /**< Call Handshake() again when the socket is readable */
+  WANT_WRITE,   /**< Call Handshake() again when the socket is writable */
+  FAILED,
+};
+
+/**
+ * \brief TLS settings of one side of connections
+ *
+ * Only TLS 1.2 with AES-GCM is negotiated: OpenSSL 3.0 can hand these
+ * sessions over to kernel TLS in both directions.
+ */
+class TlsContext {
+ public:
+  /**
+   * \return nullptr with err set if the certificate or key cannot be used
+   */
+  static std::unique_ptr<TlsContext> NewServer(const std::string& cert_path, const std::string& key_path,
+                                               std::string& err);
+
+  /**
+   * \param ca_path CA to verify the server with, empty skips verification (self-signed test setups)
+   * \param host DNS name or IP address the server certificate must be issued for, checked with ca_path only
+   */
+  static std::unique_ptr<TlsContext> NewClient(const std::string& ca_path, const std::string& host,
+                                               std::string& err);
+
+  ~TlsContext();
+
+  TlsContext(const TlsContext&) = delete;
+  TlsContext& operator=(const TlsContext&) = delete;
+
+ private:
+  friend class TlsSession;
+
+  TlsContext(SSL_CTX* ctx, bool server, std::string host = "") noexcept:
+    ctx_(ctx), server_(server), host_(std::move(host)) {}
+
+  SSL_CTX* ctx_;
+  bool server_;
+  std::string host_;    /**< Name every session of a client checks, empty if not verified */
+};
+
+/**
+ * \brief Handshake of one connection, done in userspace
+ *
+ * When it is done and KernelOffload() is true, the socket encrypts and
+ * decrypts records itself: plain send(), writev() and recv() carry TLS
+ * from then on, and the session can be destroyed. The socket is not
+ * closed with it.
+ */
+class TlsSession {
+ public:
+  TlsSession(const TlsContext& ctx, int fd) noexcept;
+  ~TlsSession();
+
+  TlsSession(const TlsSession&) = delete;
+  TlsSession& operator=(const TlsSession&) = delete;
+
+  /**
+   * \brief Advance the handshake, completes in one call on a blocking socket
+   */
+  TlsStep Handshake();
+
+  /**
+   * \brief True if the kernel took over records in both directions
+   */
+  [[nodiscard]] bool KernelOffload() const;
+
+  [[nodiscard]] const std::string& Error() const { return err_; }
+
+ private:
+  SSL* ssl_;
+  std::string err_;
+};
+
+/**
+ * \brief True if the kernel has TLS support loaded (tls module)
+ */
+bool KernelTlsAvailable();
+
+}  // namespace ptxchat
+
+#endif  // TLS_H_
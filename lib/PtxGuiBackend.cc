@@ -8,6 +8,10 @@ std::unique_ptr<GuiEvent> GUIBackend::PopGuiEvent() {
   return gui_events_->front();
 }
 
+size_t GUIBackend::PopGuiEvents(std::vector<std::unique_ptr<GuiEvent>>& out, size_t max) {
+  return gui_events_->try_pop_all_front(out, max);
+}
+
 bool GUIBackend::PushGuiEvent(GuiEvType t, std::shared_ptr<ChatMsg> msg) {
   std::unique_ptr<GuiEvent> e = std::make_unique<GuiEvent>();
   e->type = t;
@@ -0,0 +1,92 @@
+#include "ScrollbackView.h"
+
+#include <nanogui/opengl.h>
+#include <nanogui/theme.h>
+
+#include <algorithm>
+
+namespace ptxchat {
+
+ScrollbackView::ScrollbackView(nanogui::Widget* parent, const Scrollback* lines, int rows):
+  nanogui::Widget(parent),
+  lines_(lines),
+  rows_(rows),
+  follow_(true),
+  top_(0) {
+
+}
+
+float ScrollbackView::LineHeight() const {
+  return static_cast<float>(fontSize()) * 1.2f;
+}
+
+int ScrollbackView::VisibleRows() const {
+  return std::max(1, static_cast<int>(static_cast<float>(mSize.y()) / LineHeight()));
+}
+
+Eigen::Vector2i ScrollbackView::preferredSize(NVGcontext* /* ctx */) const {
+  return Eigen::Vector2i(200, static_cast<int>(LineHeight() * static_cast<float>(rows_)) + 2);
+}
+
+bool ScrollbackView::scrollEvent(const Eigen::Vector2i& /* p */, const Eigen::Vector2f& rel) {
+  uint64_t rows = static_cast<uint64_t>(VisibleRows());
+  uint64_t first = lines_->First();
+  uint64_t last_top = lines_->End() > first + rows ? lines_->End() - rows : first;
+  uint64_t top = follow_ ? last_top : std::max(top_, first);
+
+  int step = static_cast<int>(rel.y() * SCROLL_LINES_STEP);
+  if (step > 0)
+    top = top > first + static_cast<uint64_t>(step) ? top - static_cast<uint64_t>(step) : first;
+  else
+    top = std::min(last_top, top + static_cast<uint64_t>(-step));
+
+  follow_ = top >= last_top;
+  top_ = top;
+  return true;
+}
+
+void ScrollbackView::draw(NVGcontext* ctx) {
+  nanogui::Widget::draw(ctx);
+
+  uint64_t rows = static_cast<uint64_t>(VisibleRows());
+  uint64_t first = lines_->First();
+  uint64_t end = lines_->End();
+  uint64_t last_top = end > first + rows ? end - rows : first;
+  /* Lines scrolled back to may have been evicted meanwhile */
+  uint64_t top = follow_ ? last_top : std::min(std::max(top_, first), last_top);
+
+  nvgSave(ctx);
+  nvgIntersectScissor(ctx, mPos.x(), mPos.y(), mSize.x(), mSize.y());
+
+  nvgBeginPath(ctx);
+  nvgRect(ctx, mPos.x(), mPos.y(), mSize.x(), mSize.y());
+  nvgFillColor(ctx, mTheme->mTextBoxFocusedColor);
+  nvgFill(ctx);
+
+  nvgFontSize(ctx, static_cast<float>(fontSize()));
+  nvgFontFace(ctx, "sans");
+  nvgFillColor(ctx, mTheme->mTextColor);
+  nvgTextAlign(ctx, NVG_ALIGN_LEFT | NVG_ALIGN_TOP);
+  float y = static_cast<float>(mPos.y()) + 1;
+  for (uint64_t i = top; i < end && i < top + rows; ++i) {
+    const std::string& line = lines_->Line(i);
+    nvgText(ctx, static_cast<float>(mPos.x()) + 4, y, line.data(), line.data() + line.size());
+    y += LineHeight();
+  }
+
+  /* Scrollbar shows the visible part of the scrollback */
+  uint64_t total = end - first;
+  if (total > rows) {
+    float h = static_cast<float>(mSize.y());
+    float bar_h = std::max(8.0f, h * static_cast<float>(rows) / static_cast<float>(total));
+    float bar_y = (h - bar_h) * static_cast<float>(top - first) / static_cast<float>(total - rows);
+    nvgBeginPath(ctx);
+    nvgRoundedRect(ctx, static_cast<float>(mPos.x() + mSize.x()) - 5, static_cast<float>(mPos.y()) + bar_y,
+                   4, bar_h, 2);
+    nvgFillColor(ctx, mTheme->mBorderLight);
+    nvgFill(ctx);
+  }
+  nvgRestore(ctx);
+}
+
+}  // namespace ptxchat
@@ -0,0 +1,142 @@
+#include "Tls.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+namespace ptxchat {
+
+/* Ciphers the kernel implements */
+static const char* TLS_CIPHERS = "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+                                 "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384";
+
+/**
+ * First error of the OpenSSL queue of this thread, the rest is dropped
+ */
+static std::string TakeError() {
+  unsigned long e = ERR_get_error();
+  ERR_clear_error();
+  if (!e)
+    return "unknown error";
+  char buf[256];
+  ERR_error_string_n(e, buf, sizeof(buf));
+  return buf;
+}
+
+static SSL_CTX* NewCtx(bool server, std::string& err) {
+  SSL_CTX* ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+  if (!ctx) {
+    err = TakeError();
+    return nullptr;
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_COMPRESSION);
+  if (!SSL_CTX_set_cipher_list(ctx, TLS_CIPHERS)) {
+    err = TakeError();
+    SSL_CTX_free(ctx);
+    return nullptr;
+  }
+  return ctx;
+}
+
+std::unique_ptr<TlsContext> TlsContext::NewServer(const std::string& cert_path, const std::string& key_path,
+                                                  std::string& err) {
+  SSL_CTX* ctx = NewCtx(true, err);
+  if (!ctx)
+    return nullptr;
+  if (SSL_CTX_use_certificate_chain_file(ctx, cert_path.c_str()) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx, key_path.c_str(), SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    err = TakeError();
+    SSL_CTX_free(ctx);
+    return nullptr;
+  }
+  return std::unique_ptr<TlsContext>(new TlsContext(ctx, true));
+}
+
+std::unique_ptr<TlsContext> TlsContext::NewClient(const std::string& ca_path, const std::string& host,
+                                                  std::string& err) {
+  if (!ca_path.empty() && host.empty()) {
+    /* A valid chain alone would accept any certificate the CA has issued */
+    err = "server name to verify is not set";
+    return nullptr;
+  }
+  SSL_CTX* ctx = NewCtx(false, err);
+  if (!ctx)
+    return nullptr;
+  if (ca_path.empty()) {
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+    return std::unique_ptr<TlsContext>(new TlsContext(ctx, false));
+  }
+  if (SSL_CTX_load_verify_locations(ctx, ca_path.c_str(), nullptr) != 1) {
+    err = TakeError();
+    SSL_CTX_free(ctx);
+    return nullptr;
+  }
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+  return std::unique_ptr<TlsContext>(new TlsContext(ctx, false, host));
+}
+
+TlsContext::~TlsContext() {
+  SSL_CTX_free(ctx_);
+}
+
+TlsSession::TlsSession(const TlsContext& ctx, int fd) noexcept:
+  ssl_(SSL_new(ctx.ctx_)) {
+  if (!ssl_) {
+    err_ = TakeError();
+    return;
+  }
+  /* Socket BIO does not close fd */
+  SSL_set_fd(ssl_, fd);
+  if (ctx.server_) {
+    SSL_set_accept_state(ssl_);
+    return;
+  }
+  SSL_set_connect_state(ssl_);
+  /* Takes IP addresses too, those are checked against IP entries of the certificate */
+  if (!ctx.host_.empty() && SSL_set1_host(ssl_, ctx.host_.c_str()) != 1) {
+    err_ = TakeError();
+    SSL_free(ssl_);
+    ssl_ = nullptr;
+  }
+}
+
+TlsSession::~TlsSession() {
+  SSL_free(ssl_);
+}
+
+TlsStep TlsSession::Handshake() {
+  if (!ssl_)
+    return TlsStep::FAILED;
+  int r = SSL_do_handshake(ssl_);
+  if (r == 1)
+    return TlsStep::DONE;
+  switch (SSL_get_error(ssl_, r)) {
+    case SSL_ERROR_WANT_READ:
+      return TlsStep::WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+      return TlsStep::WANT_WRITE;
+    case SSL_ERROR_SYSCALL:
+      err_ = errno ? strerror(errno) : "connection closed";
+      ERR_clear_error();
+      return TlsStep::FAILED;
+    default:
+      err_ = TakeError();
+      return TlsStep::FAILED;
+  }
+}
+
+bool TlsSession::KernelOffload() const {
+  return ssl_ && BIO_get_ktls_send(SSL_get_wbio(ssl_)) && BIO_get_ktls_recv(SSL_get_rbio(ssl_));
+}
+
+bool KernelTlsAvailable() {
+  return access("/sys/module/tls", F_OK) == 0;
+}
+
+}  // namespace ptxchat
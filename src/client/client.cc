@@ -5,13 +5,22 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <memory>
 #include <iostream>
+#include <random>
+#include <vector>
 #include <string.h>
 
 #include "Message.h"
+#include "Frame.h"
+#include "Batch.h"
 #include "log.h"
 
 namespace ptxchat {
@@ -24,8 +33,17 @@ PtxChatClient::PtxChatClient() noexcept {
   msg_in_ = std::make_unique<SharedUDeque<ChatMsg>>();
   msg_out_ = std::make_unique<SharedUDeque<ChatMsg>>();
   registered_ = false;
+  connected_ = false;
+  last_public_seq_ = 0;
+  last_private_ts_ = 0;
+  replaying_ = false;
+  mcast_on_ = false;
+  mcast_if_.s_addr = INADDR_ANY;
+  mcast_fd_ = -1;
+  repair_seq_ = 0;
+  mcast_resync_ = false;
+  wake_fd_ = eventfd(0, EFD_NONBLOCK);
   InitRotatingLogger("PTX Client");
-  InitStorage();
 }
 
 PtxChatClient::PtxChatClient(const std::string& ip, uint16_t port) noexcept {
@@ -38,11 +56,20 @@ PtxChatClient::PtxChatClient(const std::string& ip, uint16_t port) noexcept {
   msg_in_ = std::make_unique<SharedUDeque<ChatMsg>>();
   msg_out_ = std::make_unique<SharedUDeque<ChatMsg>>();
   registered_ = false;
+  connected_ = false;
+  last_public_seq_ = 0;
+  last_private_ts_ = 0;
+  replaying_ = false;
+  mcast_on_ = false;
+  mcast_if_.s_addr = INADDR_ANY;
+  mcast_fd_ = -1;
+  repair_seq_ = 0;
+  mcast_resync_ = false;
+  wake_fd_ = eventfd(0, EFD_NONBLOCK);
   InitRotatingLogger("PTX Client");
-  InitStorage();
 }
 
-void PtxChatClient::LogIn(const std::string& nick) {
+int PtxChatClient::Connect() {
   struct sockaddr_in serv_addr = sockaddr_in{
     AF_INET,
     htons(server_port_),
@@ -52,134 +79,515 @@ void PtxChatClient::LogIn(const std::string& nick) {
 
   int skt = socket(AF_INET, SOCK_STREAM, 0);
   if (skt < 0) {
-    logger_->log(spdlog::level::critical, "LogIn: socket() " + std::string(strerror(errno)));
-    return;
+    logger_->log(spdlog::level::critical, "Connect: socket() " + std::string(strerror(errno)));
+    return -1;
   }
 
   if (connect(skt, reinterpret_cast<struct sockaddr*>(&serv_addr), sizeof(serv_addr)) < 0) {
-    logger_->log(spdlog::level::critical, "LogIn: connect() " + std::string(strerror(errno)));
-    return;
+    logger_->log(spdlog::level::critical, "Connect: connect() " + std::string(strerror(errno)));
+    close(skt);
+    return -1;
   }
-
+  int flags = fcntl(skt, F_GETFL, 0);
+  fcntl(skt, F_SETFL, flags | O_NONBLOCK);
   serv_addr_ = serv_addr;
-  socket_ = skt;
-  nick_ = nick;
-  auto msg = std::make_unique<ChatMsg>();
-  strcpy(msg->hdr.from, nick_.c_str());
-  msg->hdr.type = MsgType::REGISTER;
-  msg->hdr.buf_len = 0;
+  return skt;
+}
 
-  /* Send sync message */
-  SendMsgToServer(std::move(msg));
+void PtxChatClient::LogIn(const std::string& nick) {
+  LogOut();
+  int skt = Connect();
+  if (skt < 0)
+    return;
 
-  /* Load messages */
-  for (auto msg_p : storage_->GetPrivateMsgs(nick))
-    ProcessIncomingPrivateMsg(msg_p);
-  for (auto msg_p : storage_->GetPublicMsgs())
-    ProcessIncomingPublicMsg(msg_p);
+  nick_ = nick;
+  token_.clear();
+  last_public_seq_ = 0;
+  last_private_ts_ = 0;
+  replaying_ = false;
+  repair_seq_ = 0;
+  mcast_resync_ = false;
+  {
+    std::unique_lock<std::mutex> lc(conn_mtx_);
+    socket_ = skt;
+    connected_ = true;
+  }
 
   /* Handle messages async */
+  uint64_t wake;
+  while (read(wake_fd_, &wake, sizeof(wake)) > 0) {}
+  msg_in_->stop(false);
+  msg_out_->stop(false);
   msg_in_thread_.stop = 0;
   msg_in_thread_.thread = std::thread(&PtxChatClient::ReceiveMessagesTask, this);
-  msg_in_thread_.thread.detach();
 
   msg_out_thread_.stop = 0;
   msg_out_thread_.thread = std::thread(&PtxChatClient::SendMessagesTask, this);
-  msg_out_thread_.thread.detach();
+
+  /* Send sync message, history is requested when registered */
+  PushMsg(MakeMsg(MsgType::REGISTER, 0));
 }
 
-void PtxChatClient::SendMsg(const std::string& text) {
-  auto msg = std::make_unique<ChatMsg>();
-  strcpy(msg->hdr.from, nick_.c_str());
-  msg->hdr.type = MsgType::PUBLIC_DATA;
-  msg->hdr.buf_len = text.length();
-  msg->buf = reinterpret_cast<uint8_t*>(malloc(msg->hdr.buf_len));
+bool PtxChatClient::SendMsg(const std::string& text) {
+  auto msg = MakeMsg(MsgType::PUBLIC_DATA, text.length());
   memcpy(msg->buf, text.data(), text.length());
-  msg_out_->push_front(std::move(msg));
+  return PushMsg(std::move(msg));
 }
 
-void PtxChatClient::SendMsgTo(const std::string& to, const std::string& text) {
-  auto msg = std::make_unique<ChatMsg>();
-  strcpy(msg->hdr.from, nick_.c_str());
-  strcpy(msg->hdr.to, to.c_str());
-  msg->hdr.type = MsgType::PRIVATE_DATA;
-  msg->hdr.buf_len = text.length();
-  msg->buf = reinterpret_cast<uint8_t*>(malloc(msg->hdr.buf_len));
+bool PtxChatClient::SendMsgTo(const std::string& to, const std::string& text) {
+  auto msg = MakeMsg(MsgType::PRIVATE_DATA, text.length());
+  strncpy(msg->hdr.to, to.c_str(), MAX_NICKNAME_LEN - 1);
   memcpy(msg->buf, text.data(), text.length());
-  msg_out_->push_front(std::move(msg));
+  return PushMsg(std::move(msg));
+}
+
+std::unique_ptr<ChatMsg> PtxChatClient::MakeMsg(MsgType t, size_t buf_len) {
+  auto msg = std::make_unique<ChatMsg>();
+  msg->hdr = ChatMsgHdr{};
+  msg->hdr.type = t;
+  strncpy(msg->hdr.from, nick_.c_str(), MAX_NICKNAME_LEN - 1);
+  msg->hdr.buf_len = buf_len;
+  if (buf_len)
+    msg->buf = reinterpret_cast<uint8_t*>(malloc(buf_len));
+  return msg;
+}
+
+bool PtxChatClient::PushMsg(std::unique_ptr<ChatMsg>&& msg) {
+  if (!msg_out_->push_front(std::move(msg))) {
+    logger_->log(spdlog::level::warn, "PushMsg: outgoing queue is full");
+    return false;
+  }
+  return true;
+}
+
+void PtxChatClient::RequestHistory(HistoryScope scope, const std::string& peer, uint64_t before, uint64_t after,
+                                   uint32_t limit) {
+  HistoryReq req{};
+  req.scope = scope;
+  strncpy(req.peer, peer.c_str(), MAX_NICKNAME_LEN - 1);
+  req.before = before;
+  req.after = after;
+  req.limit = limit;
+
+  auto msg = MakeMsg(MsgType::HISTORY_REQ, sizeof(req));
+  memcpy(msg->buf, &req, sizeof(req));
+  PushMsg(std::move(msg));
 }
 
 void PtxChatClient::SendMessagesTask() {
-  while (!msg_out_thread_.stop) {
-    std::unique_ptr<ChatMsg> msg = std::move(msg_out_->back());
-    if (!msg)
+  std::vector<std::unique_ptr<ChatMsg>> batch;
+  batch.reserve(MAX_SEND_BATCH);
+  /* Queue is drained after Stop(), so messages pushed before are sent */
+  while (msg_out_->pop_all_back(batch, MAX_SEND_BATCH)) {
+    std::unique_lock<std::mutex> lc(conn_mtx_);
+    /* While reconnecting the batch waits for the resumed session */
+    conn_cv_.wait(lc, [this] { return connected_ || msg_out_thread_.stop; });
+    if (!connected_) {
+      logger_->log(spdlog::level::err, "SendMessagesTask: " + std::to_string(batch.size()) + " messages lost");
       return;
-    std::shared_ptr<ChatMsg> s_msg(msg.release());
-    SendMsgToServer(s_msg);
+    }
+    PackBatches(batch);
+    if (!WriteFrames(batch))
+      logger_->log(spdlog::level::err, "SendMessagesTask: " + std::to_string(batch.size()) +
+                   " messages lost with connection");
+    batch.clear();
   }
 }
 
+void PtxChatClient::PackBatches(std::vector<std::unique_ptr<ChatMsg>>& batch) {
+  std::vector<std::unique_ptr<ChatMsg>> packed;
+  packed.reserve(batch.size());
+  BatchEncoder enc(nick_);
+  size_t first = 0;  /**< Message of batch that is the first one in enc */
+  auto flush = [&]() {
+    /* A single message goes as it is */
+    if (enc.Count() > 1)
+      packed.push_back(enc.Msg());
+    else if (enc.Count() == 1)
+      packed.push_back(std::move(batch[first]));
+    enc.Clear();
+  };
+  for (size_t i = 0; i < batch.size(); ++i) {
+    if (IsBatchable(batch[i]->hdr.type)) {
+      if (enc.Count() && enc.Add(*batch[i]))
+        continue;
+      flush();
+      if (enc.Add(*batch[i])) {
+        first = i;
+        continue;
+      }
+    } else {
+      flush();
+    }
+    packed.push_back(std::move(batch[i]));
+  }
+  flush();
+  batch.swap(packed);
+}
+
+bool PtxChatClient::WriteFrames(const std::vector<std::unique_ptr<ChatMsg>>& batch) {
+  /* Header and buffer of every message, written with as few syscalls as possible */
+  struct iovec iov[2 * MAX_SEND_BATCH];
+  int iov_cnt = 0;
+  for (auto& msg : batch) {
+    iov[iov_cnt].iov_base = &msg->hdr;
+    iov[iov_cnt++].iov_len = sizeof(ChatMsgHdr);
+    if (msg->hdr.buf_len) {
+      iov[iov_cnt].iov_base = msg->buf;
+      iov[iov_cnt++].iov_len = msg->hdr.buf_len;
+    }
+  }
+
+  struct iovec* cur = iov;
+  while (iov_cnt > 0) {
+    /* sendmsg() is writev() that does not raise SIGPIPE on a dropped connection */
+    struct msghdr mh{};
+    mh.msg_iov = cur;
+    mh.msg_iovlen = iov_cnt;
+    ssize_t sz = sendmsg(socket_, &mh, MSG_NOSIGNAL);
+    if (sz < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        struct pollfd pfd;
+        pfd.fd = socket_;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, SEND_TIMEOUT) <= 0) {
+          logger_->log(spdlog::level::err, "WriteFrames: server does not read");
+          return false;
+        }
+        continue;
+      }
+      logger_->log(spdlog::level::err, "WriteFrames: sendmsg() " + std::string(strerror(errno)));
+      return false;
+    }
+
+    /* Skip written parts, the first unwritten one may be partial */
+    size_t left = static_cast<size_t>(sz);
+    while (iov_cnt > 0 && left >= cur->iov_len) {
+      left -= cur->iov_len;
+      ++cur;
+      --iov_cnt;
+    }
+    if (iov_cnt > 0) {
+      cur->iov_base = reinterpret_cast<uint8_t*>(cur->iov_base) + left;
+      cur->iov_len -= left;
+    }
+  }
+
+  logger_->log(spdlog::level::debug, "WriteFrames: " + std::to_string(batch.size()) + " messages sent");
+  return true;
+}
+
 void PtxChatClient::ReceiveMessagesTask() {
+  struct pollfd pfd[3];
+  pfd[0].fd = socket_;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = wake_fd_;
+  pfd[1].events = POLLIN;
+  pfd[2].events = POLLIN;
+  FrameDecoder decoder;
+  std::vector<uint8_t> buf(RECV_BUFFER_SIZE);
+
   while (!msg_in_thread_.stop) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(MSG_THREAD_SLEEP));
-    uint8_t buf[sizeof(struct ChatMsgHdr) + MAX_MSG_BUFFER_SIZE];
-    ssize_t bytes_in = recv(socket_, buf, sizeof(buf), 0);
-    if (bytes_in < 0) {
-      logger_->log(spdlog::level::err, "ReceiveMessagesTask: recv() " + std::string(strerror(errno)));
+    pfd[0].fd = socket_;
+    /* Negative fd is skipped by poll() */
+    pfd[2].fd = mcast_fd_;
+    if (poll(pfd, 3, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      logger_->log(spdlog::level::err, "ReceiveMessagesTask: poll() " + std::string(strerror(errno)));
+      return;
+    }
+    if (pfd[1].revents)
+      break;
+    if (pfd[2].revents)
+      ReadMulticast();
+    if (!pfd[0].revents)
       continue;
+
+    /* Read everything available, then decode every complete frame */
+    bool closed = false;
+    while (1) {
+      ssize_t bytes_in = recv(socket_, buf.data(), buf.size(), MSG_DONTWAIT);
+      if (bytes_in > 0) {
+        decoder.Append(buf.data(), static_cast<size_t>(bytes_in));
+        if (static_cast<size_t>(bytes_in) < buf.size())
+          break;
+        continue;
+      }
+      if (bytes_in == 0) {
+        closed = true;
+        break;
+      }
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        logger_->log(spdlog::level::err, "ReceiveMessagesTask: recv() " + std::string(strerror(errno)));
+        closed = true;
+      }
+      break;
     }
-    if (bytes_in == 0) {
-      Stop();
+
+    bool error = false;
+    while (auto msg = decoder.Next(error))
+      ProcessIncomingMsg(std::shared_ptr<ChatMsg>(msg.release()));
+    if (error) {
+      logger_->log(spdlog::level::critical, "ReceiveMessagesTask: malformed frame from server");
+      closed = true;
+    }
+
+    if (closed) {
       logger_->log(spdlog::level::critical, "ReceiveMessagesTask: server disconnected");
-      return; // TODO: reconnect
+      decoder.Clear();
+      if (!Reconnect())
+        return;
     }
+  }
+}
+
+bool PtxChatClient::Reconnect() {
+  registered_ = false;
+  /* Until the new connection joins again, public messages come over TCP */
+  CloseMulticast();
+  /* Sending thread fails fast and releases the socket */
+  shutdown(socket_, SHUT_RDWR);
+  {
+    std::unique_lock<std::mutex> lc(conn_mtx_);
+    connected_ = false;
+    close(socket_);
+    socket_ = 0;
+  }
 
-    auto msg = std::make_shared<ChatMsg>();
-    msg->hdr = *reinterpret_cast<ChatMsgHdr*>(buf);
-    size_t buf_len = msg->hdr.buf_len;
-    if (buf_len > MAX_MSG_BUFFER_SIZE)
+  std::mt19937 gen{std::random_device{}()};
+  int delay = RECONNECT_MIN_MS;
+  while (1) {
+    /* Jitter spreads reconnects of all clients after server restart */
+    std::uniform_int_distribution<int> jitter(delay / 2, delay);
+    if (!WaitReconnect(jitter(gen)))
+      return false;
+    delay = std::min(delay * 2, RECONNECT_MAX_MS);
+
+    int skt = Connect();
+    if (skt < 0)
       continue;
-    if (buf_len != 0) {
-      msg->buf = reinterpret_cast<uint8_t*>(malloc(buf_len));
-      memcpy(msg->buf, buf+sizeof(ChatMsgHdr), buf_len);
-      std::string text = std::string(reinterpret_cast<char*>(msg->buf));
-      logger_->log(spdlog::level::debug, "ReceiveMessagesTask: received message from " + std::string(msg->hdr.from) + ": " + text);
-    }
 
-    switch (msg->hdr.type) {
-      case MsgType::PUBLIC_DATA:
-        ProcessIncomingPublicMsg(msg);
-        break;
-      case MsgType::PRIVATE_DATA:
-        ProcessIncomingPrivateMsg(msg);
-        break;
-      case MsgType::REGISTERED:
-        ProcessRegisteredMsg(msg);
-        break;
-      case MsgType::UNREGISTERED:
-        ProcessUnregisteredMsg(msg);
-        break;
-      default:
-        ProcessErrorMsg(msg);
-        break;
+    /* Register goes first, queued messages follow it on the new connection */
+    auto reg = MakeMsg(MsgType::REGISTER, token_.empty() ? 0 : sizeof(ResumeReq));
+    if (!token_.empty()) {
+      ResumeReq req{};
+      memcpy(req.token, token_.data(), std::min(token_.size(), RESUME_TOKEN_LEN));
+      req.public_seq = last_public_seq_;
+      req.private_ts = last_private_ts_;
+      memcpy(reg->buf, &req, sizeof(req));
+    }
+    std::vector<std::unique_ptr<ChatMsg>> batch;
+    batch.push_back(std::move(reg));
+
+    std::unique_lock<std::mutex> lc(conn_mtx_);
+    socket_ = skt;
+    if (!WriteFrames(batch)) {
+      close(skt);
+      socket_ = 0;
+      continue;
     }
+    connected_ = true;
+    lc.unlock();
+    conn_cv_.notify_all();
+    logger_->log(spdlog::level::info, "Reconnect: connected, " +
+                 std::string(token_.empty() ? "registering" : "resuming session"));
+    return true;
+  }
+}
+
+bool PtxChatClient::WaitReconnect(int ms) {
+  struct pollfd pfd;
+  pfd.fd = wake_fd_;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, ms) > 0)
+    return false;
+  return !msg_in_thread_.stop;
+}
+
+void PtxChatClient::ProcessIncomingMsg(std::shared_ptr<ChatMsg> msg) {
+  if (msg->hdr.buf_len != 0 && msg->hdr.type != MsgType::HISTORY_END) {
+    std::string text = std::string(reinterpret_cast<char*>(msg->buf), msg->hdr.buf_len);
+    logger_->log(spdlog::level::debug, "ReceiveMessagesTask: received message from " + std::string(msg->hdr.from) + ": " + text);
+  }
+
+  switch (msg->hdr.type) {
+    case MsgType::PUBLIC_DATA:
+      ProcessIncomingPublicMsg(msg);
+      break;
+    case MsgType::PRIVATE_DATA:
+      ProcessIncomingPrivateMsg(msg);
+      break;
+    case MsgType::REGISTERED:
+      ProcessRegisteredMsg(msg);
+      break;
+    case MsgType::UNREGISTERED:
+      ProcessUnregisteredMsg(msg);
+      break;
+    case MsgType::HISTORY_END:
+      ProcessHistoryEndMsg(msg);
+      break;
+    case MsgType::MCAST_INFO:
+      ProcessMcastInfoMsg(msg);
+      break;
+    default:
+      ProcessErrorMsg(msg);
+      break;
   }
 }
 
 void PtxChatClient::ProcessIncomingPublicMsg(std::shared_ptr<ChatMsg> msg) {
+  if (msg->hdr.seq > last_public_seq_)
+    last_public_seq_ = msg->hdr.seq;
   PushGuiEvent(GuiEvType::PUBLIC_MSG, msg);
 }
 
 void PtxChatClient::ProcessIncomingPrivateMsg(std::shared_ptr<ChatMsg> msg) {
+  if (msg->hdr.ts > last_private_ts_)
+    last_private_ts_ = msg->hdr.ts;
+  /* Own messages are not echoed live, so they are not shown on replay */
+  if (replaying_ && nick_ == msg->hdr.from)
+    return;
   PushGuiEvent(GuiEvType::PRIVATE_MSG, msg);
 }
 
 void PtxChatClient::ProcessRegisteredMsg(std::shared_ptr<ChatMsg> msg) {
-  if (strcmp(msg->hdr.from, "Server"))
+  if (nick_ != msg->hdr.from)
     return;
   registered_ = true;
+
+  SessionInfo info{};
+  if (msg->hdr.buf_len == sizeof(info))
+    memcpy(&info, msg->buf, sizeof(info));
+  token_ = std::string(info.token, strnlen(info.token, RESUME_TOKEN_LEN));
+  if (mcast_on_)
+    PushMsg(MakeMsg(MsgType::MCAST_JOIN, 0));
+  if (info.resumed) {
+    replaying_ = true;
+    logger_->log(spdlog::level::info, "ProcessRegisteredMsg: session resumed, replaying missed messages");
+    return;
+  }
+
+  /* New session, history is loaded anew */
+  last_public_seq_ = info.public_seq;
+  last_private_ts_ = info.ts;
+  replaying_ = false;
   logger_->log(spdlog::level::info, "ProcessRegisteredMsg: client registered on server");
-  // TODO: push to GUI
+  PushGuiEvent(GuiEvType::CLEAR, nullptr);
+  /* Offline messages newer than that come from the mailbox */
+  RequestHistory(HistoryScope::PRIVATE, "", info.mailbox_ts);
+  RequestHistory(HistoryScope::PUBLIC, "", 0);
+}
+
+void PtxChatClient::ProcessMcastInfoMsg(std::shared_ptr<ChatMsg> msg) {
+  if (msg->hdr.buf_len != sizeof(McastInfo)) {
+    ProcessErrorMsg(msg);
+    return;
+  }
+  McastInfo info;
+  memcpy(&info, msg->buf, sizeof(info));
+  mcast_resync_ = false;
+  if (mcast_fd_ < 0) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int one = 1;
+    /* Several clients on one host share the port */
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = info.group;
+    addr.sin_port = htons(info.port);
+    struct ip_mreq mreq{};
+    mreq.imr_multiaddr.s_addr = info.group;
+    mreq.imr_interface = mcast_if_;
+    if (fd < 0 || bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+      logger_->log(spdlog::level::err, "ProcessMcastInfoMsg: cannot join group " + std::string(strerror(errno)));
+      if (fd >= 0)
+        close(fd);
+      return;
+    }
+    mcast_fd_ = fd;
+    logger_->log(spdlog::level::info, "ProcessMcastInfoMsg: public messages come by multicast");
+  }
+  /* Messages sent between join and now were missed */
+  RepairPublic(info.last_seq + 1);
+}
+
+void PtxChatClient::ReadMulticast() {
+  uint8_t dgram[RECV_BUFFER_SIZE];
+  while (1) {
+    struct sockaddr_in from{};
+    socklen_t from_len = sizeof(from);
+    ssize_t sz = recvfrom(mcast_fd_, dgram, sizeof(dgram), MSG_DONTWAIT,
+                          reinterpret_cast<struct sockaddr*>(&from), &from_len);
+    if (sz < 0 && errno == EINTR)
+      continue;
+    if (sz <= 0)
+      return;
+    /* Anyone on the LAN can send to the group */
+    if (from.sin_addr.s_addr != serv_addr_.sin_addr.s_addr)
+      continue;
+    /* Every datagram holds whole frames */
+    FrameDecoder decoder;
+    decoder.Append(dgram, static_cast<size_t>(sz));
+    bool error = false;
+    while (auto msg = decoder.Next(error)) {
+      uint64_t seq;
+      if (msg->hdr.type == MsgType::MCAST_INFO && msg->hdr.buf_len == sizeof(McastInfo)) {
+        McastInfo info;
+        memcpy(&info, msg->buf, sizeof(info));
+        seq = info.last_seq + 1;
+      } else if (msg->hdr.type == MsgType::PUBLIC_DATA) {
+        seq = msg->hdr.seq;
+      } else {
+        continue;
+      }
+      uint64_t last = last_public_seq_;
+      if (seq <= last)
+        continue;
+      if (seq - last > MCAST_MAX_SEQ_JUMP) {
+        /* Forged or a long outage, the server tells which over TCP */
+        if (!mcast_resync_) {
+          mcast_resync_ = true;
+          logger_->log(spdlog::level::warn, "ReadMulticast: seq " + std::to_string(seq) + " is too far ahead of " +
+                       std::to_string(last) + ", asking server");
+          PushMsg(MakeMsg(MsgType::MCAST_JOIN, 0));
+        }
+        continue;
+      }
+      RepairPublic(seq);
+      if (msg->hdr.type == MsgType::PUBLIC_DATA)
+        ProcessIncomingPublicMsg(std::shared_ptr<ChatMsg>(msg.release()));
+    }
+  }
+}
+
+void PtxChatClient::RepairPublic(uint64_t before) {
+  uint64_t last = last_public_seq_;
+  if (before <= last + 1 || before <= repair_seq_)
+    return;
+  repair_seq_ = before;
+  logger_->log(spdlog::level::info, "RepairPublic: requesting public messages " + std::to_string(last + 1) +
+               " to " + std::to_string(before - 1));
+  RequestHistory(HistoryScope::PUBLIC, "", before, last, MAX_HISTORY_PAGE);
+}
+
+void PtxChatClient::CloseMulticast() {
+  if (mcast_fd_ < 0)
+    return;
+  close(mcast_fd_);
+  mcast_fd_ = -1;
+}
+
+bool PtxChatClient::EnableMulticast(const std::string& iface) {
+  if (inet_pton(AF_INET, iface.c_str(), &mcast_if_) != 1)
+    return false;
+  mcast_on_ = true;
+  return true;
 }
 
 void PtxChatClient::ProcessUnregisteredMsg(std::shared_ptr<ChatMsg> msg) {
@@ -195,36 +603,43 @@ void PtxChatClient::ProcessErrorMsg(std::shared_ptr<ChatMsg> msg) {
   // TODO: push to GUI
 }
 
-void PtxChatClient::LogOut() {
-  if (!socket_)
+void PtxChatClient::ProcessHistoryEndMsg(std::shared_ptr<ChatMsg> msg) {
+  if (msg->hdr.buf_len != sizeof(HistoryEnd)) {
+    ProcessErrorMsg(msg);
     return;
-  
-  auto msg = std::make_shared<ChatMsg>();
-  strcpy(msg->hdr.from, nick_.c_str());
-  msg->hdr.type = MsgType::UNREGISTER;
-  msg->hdr.buf_len = 0;
-  SendMsgToServer(msg);
-  PushGuiEvent(GuiEvType::CLEAR, nullptr);
-  shutdown(socket_, SHUT_RD);
-  close(socket_);
-  socket_ = 0;
+  }
+  HistoryEnd end;
+  memcpy(&end, msg->buf, sizeof(end));
+  std::string scope = end.scope == HistoryScope::PUBLIC ? "public" : "private";
+  logger_->log(spdlog::level::info, "ProcessHistoryEndMsg: loaded " + std::to_string(end.count) + " " + scope +
+               " messages, next page before " + std::to_string(end.next) + (end.has_more ? "" : " (no more)"));
+
+  /* Pages down to a lower bound are fetched until the gap is filled */
+  if (end.after && end.has_more)
+    RequestHistory(end.scope, "", end.next, end.after, MAX_HISTORY_PAGE);
+  else if (end.scope == HistoryScope::PRIVATE)
+    replaying_ = false;
 }
 
-void PtxChatClient::SendMsgToServer(std::shared_ptr<ChatMsg> msg) {
-  if (send(socket_, &msg->hdr, sizeof(msg->hdr), 0) < 0) {
-    logger_->log(spdlog::level::err, "SendMsgToServer: send(hdr) " + std::string(strerror(errno)));
+void PtxChatClient::LogOut() {
+  if (!msg_out_thread_.thread.joinable())
     return;
-  }
 
-  if (!msg->hdr.buf_len)
-    return;
+  PushMsg(MakeMsg(MsgType::UNREGISTER, 0));
+  /* Sending thread writes everything queued before it exits */
+  Stop();
+  msg_out_thread_.thread.join();
+  msg_in_thread_.thread.join();
 
-  if (send(socket_, msg->buf, msg->hdr.buf_len, 0) < 0) {
-    logger_->log(spdlog::level::err, "SendMsgToServer: send(buf) " + std::string(strerror(errno)));
-    return;
+  PushGuiEvent(GuiEvType::CLEAR, nullptr);
+  CloseMulticast();
+  std::unique_lock<std::mutex> lc(conn_mtx_);
+  connected_ = false;
+  if (socket_) {
+    shutdown(socket_, SHUT_RD);
+    close(socket_);
+    socket_ = 0;
   }
-  std::string text = std::string(reinterpret_cast<char*>(msg->buf));
-  logger_->log(spdlog::level::debug, "SendMsgToServer: send(buf) " + text);
 }
 
 bool PtxChatClient::SetIP_i(uint32_t ip) {
@@ -254,20 +669,23 @@ bool PtxChatClient::SetPort_s(const std::string& port) {
 }
 
 void PtxChatClient::Stop() {
+  uint64_t wake = 1;
+  if (write(wake_fd_, &wake, sizeof(wake)) < 0)
+    logger_->log(spdlog::level::err, "Stop: write(wake_fd) " + std::string(strerror(errno)));
   msg_in_->stop(true);
   msg_out_->stop(true);
 
   msg_out_thread_.stop = 1;
   msg_in_thread_.stop = 1;
-}
-
-void PtxChatClient::InitStorage() {
-  storage_ = std::make_unique<ClientStorage>();
+  {
+    std::unique_lock<std::mutex> lc(conn_mtx_);
+  }
+  conn_cv_.notify_all();
 }
 
 PtxChatClient::~PtxChatClient() {
-  Stop();
   LogOut();
+  close(wake_fd_);
 }
 
 } // namespace ptxchat
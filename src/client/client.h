@@ -8,7 +8,10 @@
 #include <string>
 #include <memory>
 #include <deque>
+#include <vector>
 #include <utility>
+#include <atomic>
+#include <condition_variable>
 #include <fstream>
 #include <mutex>
 
@@ -16,13 +19,17 @@
 #include "Threads.h"
 #include "PtxGuiBackend.h"
 #include "SharedUDeque.h"
-#include "client_storage.h"
 
 namespace ptxchat {
 
 constexpr uint32_t DEFAULT_SERVER_IP = 2130706433;
 constexpr uint16_t DEFAULT_SERVER_PORT = 1488;
-constexpr uint64_t MSG_THREAD_SLEEP = 100;
+constexpr size_t RECV_BUFFER_SIZE = 64 * 1024;
+constexpr size_t MAX_SEND_BATCH = 256;     /**< Messages written with one writev() */
+constexpr int SEND_TIMEOUT = 5000;         /**< ms to wait for socket to become writable */
+constexpr int RECONNECT_MIN_MS = 250;      /**< First reconnect delay, doubled on every failure */
+constexpr int RECONNECT_MAX_MS = 30000;
+constexpr uint64_t MCAST_MAX_SEQ_JUMP = 10000; /**< Datagram further ahead of the last public seq is not trusted */
 
 class PtxChatClient : public GUIBackend {
  public:
@@ -62,13 +69,35 @@ class PtxChatClient : public GUIBackend {
 
   /**
    * \brief Send private message
+   * \return false if outgoing queue is full
    */
-  void SendMsgTo(const std::string& to, const std::string& text);
+  bool SendMsgTo(const std::string& to, const std::string& text);
 
   /**
    * \brief Send public message
+   * \return false if outgoing queue is full
    */
-  void SendMsg(const std::string& text);
+  bool SendMsg(const std::string& text);
+
+  /**
+   * \brief Ask server for a page of stored messages
+   * \param scope public chat or private messages
+   * \param peer private conversation partner, empty for all private messages
+   * \param before exclusive upper bound (sequence number or timestamp), 0 for the newest
+   * \param after exclusive lower bound, last seen message for delta sync
+   * \param limit page size
+   */
+  void RequestHistory(HistoryScope scope, const std::string& peer, uint64_t before, uint64_t after = 0,
+                      uint32_t limit = DEF_HISTORY_PAGE);
+
+  /**
+   * \brief Receive public messages from the server multicast group, if it has one
+   *
+   * Must be called before LogIn(). Lost messages are requested over TCP.
+   * \param iface address of the interface to join on, "0.0.0.0" for default route
+   * \return false if address is bad
+   */
+  bool EnableMulticast(const std::string& iface);
 
  private:
   uint32_t server_ip_;                     /**< Chat server ip (default=127.0.0.1) */
@@ -76,28 +105,82 @@ class PtxChatClient : public GUIBackend {
   std::string nick_;                       /**< Nickname on server if logged in */
   std::mutex chat_log_mtx_;
   bool registered_;
-  std::unique_ptr<ClientStorage> storage_;
 
   int socket_;
+  int wake_fd_;                            /**< Wakes up receiving thread on Stop() */
   sockaddr_in serv_addr_;
 
+  /**
+   * Receiving thread reconnects, sending thread waits for it.
+   * Only the holder of conn_mtx_ writes to the socket.
+   */
+  std::mutex conn_mtx_;
+  std::condition_variable conn_cv_;
+  bool connected_;
+
+  std::string token_;                       /**< Resume token of the session */
+  std::atomic<uint64_t> last_public_seq_;   /**< Newest public message seen */
+  std::atomic<uint64_t> last_private_ts_;   /**< Newest private message seen */
+  std::atomic<bool> replaying_;             /**< Missed private messages are being replayed */
+
+  /* Multicast state is touched by the receiving thread only */
+  bool mcast_on_;                           /**< Join server group after registration */
+  in_addr mcast_if_;
+  int mcast_fd_;                            /**< Joined group socket or -1 */
+  uint64_t repair_seq_;                     /**< Public messages before it are requested already */
+  bool mcast_resync_;                       /**< MCAST_JOIN is sent to learn the last seq over TCP */
+
   ThreadState msg_in_thread_;
   ThreadState msg_out_thread_;
 
   std::unique_ptr<SharedUDeque<ChatMsg>> msg_in_;
   std::unique_ptr<SharedUDeque<ChatMsg>> msg_out_;
 
-  void SendMsgToServer(std::shared_ptr<ChatMsg> msg);
+  /**
+   * Every outgoing message goes through msg_out_, only
+   * SendMessagesTask() writes to the socket
+   */
+  std::unique_ptr<ChatMsg> MakeMsg(MsgType t, size_t buf_len);
+  bool PushMsg(std::unique_ptr<ChatMsg>&& msg);
+  bool WriteFrames(const std::vector<std::unique_ptr<ChatMsg>>& batch);
+  /**
+   * Runs of data messages become BATCH messages, server then
+   * handles each run as one unit
+   */
+  void PackBatches(std::vector<std::unique_ptr<ChatMsg>>& batch);
   void ProcessRegisteredMsg(std::shared_ptr<ChatMsg> msg);
   void ProcessUnregisteredMsg(std::shared_ptr<ChatMsg> msg);
   void ProcessErrorMsg(std::shared_ptr<ChatMsg> msg);
+  void ProcessHistoryEndMsg(std::shared_ptr<ChatMsg> msg);
+  void ProcessIncomingMsg(std::shared_ptr<ChatMsg> msg);
   void ProcessIncomingPublicMsg(std::shared_ptr<ChatMsg> msg);
   void ProcessIncomingPrivateMsg(std::shared_ptr<ChatMsg> msg);
+  void ProcessMcastInfoMsg(std::shared_ptr<ChatMsg> msg);
+  /**
+   * Datagrams of the group, public messages and heartbeats
+   *
+   * Only datagrams from the server address are read. Sequence numbers
+   * over MCAST_MAX_SEQ_JUMP ahead are dropped, the server is asked for
+   * the last one over TCP instead.
+   */
+  void ReadMulticast();
+  void CloseMulticast();
+  /**
+   * Request public messages between the last seen one and before over TCP
+   */
+  void RepairPublic(uint64_t before);
+
+  int Connect();
+  /**
+   * Reconnect with jittered exponential backoff and resume the session
+   * \return false if stopped before reconnecting
+   */
+  bool Reconnect();
+  bool WaitReconnect(int ms);
 
   void ReceiveMessagesTask();
   void SendMessagesTask();
   void Stop();
-  void InitStorage();
 };
 
 }  // namespace ptxchat
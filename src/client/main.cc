@@ -4,11 +4,14 @@
 #include <string.h>
 #include <nanogui/nanogui.h>
 
-#include <thread>
 #include <iostream>
+#include <memory>
+#include <vector>
 
 #include "client.h"
 #include "Message.h"
+#include "Scrollback.h"
+#include "ScrollbackView.h"
 
 static ptxchat::PtxChatClient client;
 
@@ -25,41 +28,46 @@ using ptxchat::GuiEvType;
 using ptxchat::GuiEvent;
 using ptxchat::MAX_MSG_BUFFER_SIZE;
 
-typedef std::vector<TextBox*> text_box_t;
+using ptxchat::Scrollback;
+using ptxchat::ScrollbackView;
+
 static constexpr int chat_lines = 5;
+static constexpr int chat_width = 250;
+
+/**
+ * Nickname fills the whole field without a terminating NUL
+ */
+static int FromLen(const ptxchat::ChatMsg& msg) {
+  return static_cast<int>(strnlen(msg.hdr.from, ptxchat::MAX_NICKNAME_LEN));
+}
 
-void ProcessChatEvents(text_box_t pub, text_box_t priv) {
-  while (1) {
-    char text[MAX_MSG_BUFFER_SIZE + 32];
-    std::unique_ptr<struct GuiEvent> e = client.PopGuiEvent();
-    text_box_t* target;
+/**
+ * Runs on UI thread once per frame: everything received since
+ * the previous frame is appended at once
+ */
+void ProcessChatEvents(Scrollback* pub, Scrollback* priv) {
+  std::vector<std::unique_ptr<GuiEvent>> events;
+  client.PopGuiEvents(events);
+  for (auto& e : events) {
+    char text[MAX_MSG_BUFFER_SIZE + 2 * ptxchat::MAX_NICKNAME_LEN];
     switch (e->type) {
-      case GuiEvType::Q_EMPTY:
-        break;
       case GuiEvType::PUBLIC_MSG:
-        snprintf(text, MAX_MSG_BUFFER_SIZE, "%s: %s\n", e->msg->hdr.from, e->msg->buf);
-        target = &pub;
+        snprintf(text, sizeof(text), "%.*s: %.*s", FromLen(*e->msg), e->msg->hdr.from,
+                 static_cast<int>(e->msg->hdr.buf_len), e->msg->buf);
+        pub->Append(text);
         break;
       case GuiEvType::PRIVATE_MSG:
-        snprintf(text, MAX_MSG_BUFFER_SIZE, "%s: %s\n", e->msg->hdr.from, e->msg->buf);
-        target = &priv;
+        snprintf(text, sizeof(text), "%.*s: %.*s", FromLen(*e->msg), e->msg->hdr.from,
+                 static_cast<int>(e->msg->hdr.buf_len), e->msg->buf);
+        priv->Append(text);
         break;
       case GuiEvType::CLEAR:
-        for (size_t i = 0; i < chat_lines; ++i) {
-          pub[i]->setValue("");
-          priv[i]->setValue("");
-        }
-        continue;
-      case GuiEvType::SRV_START:
-      case GuiEvType::SRV_STOP:
-      case GuiEvType::CLIENT_REG:
-      case GuiEvType::CLIENT_UNREG:
+        pub->Clear();
+        priv->Clear();
+        break;
+      default:
         break;
     }
-
-    for (size_t i = chat_lines - 1; i > 0; --i)
-      (*target)[i]->setValue((*target)[i-1]->value());
-    (*target)[0]->setValue(std::string(text));
   }
 }
 
@@ -68,7 +76,10 @@ int main(int /* argc */, char** /* argv */) {
   uint16_t port_ = 1488;
   nanogui::init();
   {
-    nanogui::Screen* screen = new nanogui::Screen({600, 600}, "PTX Chat");
+    /* Owned by UI thread, outlive the main loop */
+    Scrollback pub_lines;
+    Scrollback prv_lines;
+    ptxchat::ChatScreen* screen = new ptxchat::ChatScreen({600, 600}, "PTX Chat");
     FormHelper* gui = new FormHelper(screen);
 
     /* Server settings window */
@@ -120,32 +131,19 @@ int main(int /* argc */, char** /* argv */) {
     /* Public chat */
     ref<Window> pub_chat_window = gui->addWindow({100, 200}, "Public chat");
     pub_chat_window->setLayout(new GroupLayout);
-    std::vector<TextBox*> pub_chat;
-    for (int i = 0; i < chat_lines; ++i) {
-      TextBox* t = new TextBox(pub_chat_window, "");
-      t->setEnabled(true);
-      t->setAlignment(TextBox::Alignment::Left);
-      t->setSpinnable(false);
-      t->setFixedWidth(100);
-      pub_chat.push_back(t);
-    }
+    auto pub_chat = new ScrollbackView(pub_chat_window, &pub_lines, chat_lines);
+    pub_chat->setFixedWidth(chat_width);
 
     /* Private chat */
     ref<Window> prv_chat_window = gui->addWindow({150, 300}, "Private chat");
     prv_chat_window->setLayout(new GroupLayout);
     prv_chat_window->setSize({300, 300});
-    std::vector<TextBox*> prv_chat;
-    for (int i = 0; i < chat_lines; ++i) {
-      TextBox* t = new TextBox(prv_chat_window, "");
-      t->setEnabled(true);
-      t->setAlignment(TextBox::Alignment::Left);
-      t->setSpinnable(false);
-      t->setFixedWidth(100);
-      prv_chat.push_back(t);
-    }
+    auto prv_chat = new ScrollbackView(prv_chat_window, &prv_lines, chat_lines);
+    prv_chat->setFixedWidth(chat_width);
 
-    std::thread chat_thread(ProcessChatEvents, pub_chat, prv_chat);
-    chat_thread.detach();
+    screen->SetFrameCallback([&pub_lines, &prv_lines]{
+      ProcessChatEvents(&pub_lines, &prv_lines);
+    });
     screen->performLayout();
     screen->setVisible(true);
     nanogui::mainloop();
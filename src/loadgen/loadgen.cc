@@ -0,0 +1,761 @@
+#include "loadgen.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <utility>
+
+#include "Frame.h"
+#include "Batch.h"
+
+namespace ptxchat {
+
+static constexpr int LOADGEN_MAX_EVENTS = 256;
+static constexpr int LOADGEN_POLL_MS = 100;
+static constexpr size_t LOADGEN_RECV_SIZE = 64 * 1024;
+static constexpr uint64_t MCAST_EVENT = UINT64_MAX;   /**< epoll data of the group socket */
+
+/* Body of data messages: "ptxload <run id> <send time ns>" padded with '.' */
+static const char STAMP_PREFIX[] = "ptxload ";
+static constexpr size_t STAMP_PREFIX_LEN = sizeof(STAMP_PREFIX) - 1;
+static constexpr size_t STAMP_LEN = STAMP_PREFIX_LEN + 16 + 1 + 16;
+
+static const char* ACTION_NAMES[] = {"public", "private", "register", "idle"};
+
+static uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool LoadMix::Parse(const std::string& s) {
+  uint32_t parsed[static_cast<size_t>(LoadAction::COUNT)] = {};
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    size_t colon = item.find(':');
+    if (colon == std::string::npos)
+      return false;
+    std::string name = item.substr(0, colon);
+    size_t a = 0;
+    for (; a < static_cast<size_t>(LoadAction::COUNT); ++a)
+      if (name == ACTION_NAMES[a])
+        break;
+    if (a == static_cast<size_t>(LoadAction::COUNT))
+      return false;
+    parsed[a] = static_cast<uint32_t>(atoi(item.c_str() + colon + 1));
+  }
+
+  uint32_t total = 0;
+  for (auto w : parsed)
+    total += w;
+  if (!total)
+    return false;
+  std::copy(std::begin(parsed), std::end(parsed), weights);
+  return true;
+}
+
+std::string LoadMix::ToString() const {
+  std::string res;
+  for (size_t a = 0; a < static_cast<size_t>(LoadAction::COUNT); ++a) {
+    if (a)
+      res += ',';
+    res += std::string(ACTION_NAMES[a]) + ':' + std::to_string(weights[a]);
+  }
+  return res;
+}
+
+LatencyHistogram::LatencyHistogram():
+  buckets_(SUB_CNT * (GROUPS + 1), 0),
+  count_(0),
+  max_(0),
+  sum_(0) {
+
+}
+
+size_t LatencyHistogram::Index(uint64_t us) {
+  if (us < SUB_CNT)
+    return us;
+  /* Group g holds [SUB_CNT << (g-1), SUB_CNT << g) with step 1 << (g-1) */
+  size_t g = static_cast<size_t>(63 - __builtin_clzll(us)) - SUB_BITS + 1;
+  if (g > GROUPS)
+    return (GROUPS + 1) * SUB_CNT - 1;
+  return g * SUB_CNT + ((us >> (g - 1)) - SUB_CNT);
+}
+
+uint64_t LatencyHistogram::Value(size_t idx) {
+  if (idx < SUB_CNT)
+    return idx;
+  size_t g = idx / SUB_CNT;
+  return (SUB_CNT + idx % SUB_CNT) << (g - 1);
+}
+
+void LatencyHistogram::Record(uint64_t us) {
+  ++buckets_[Index(us)];
+  ++count_;
+  sum_ += us;
+  max_ = std::max(max_, us);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& h) {
+  for (size_t i = 0; i < buckets_.size(); ++i)
+    buckets_[i] += h.buckets_[i];
+  count_ += h.count_;
+  sum_ += h.sum_;
+  max_ = std::max(max_, h.max_);
+}
+
+double LatencyHistogram::Mean() const {
+  return count_ ? static_cast<double>(sum_) / static_cast<double>(count_) : 0;
+}
+
+void LatencyHistogram::PrintDistribution(FILE* out) const {
+  fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    if (!buckets_[i])
+      continue;
+    seen += buckets_[i];
+    double p = static_cast<double>(seen) / static_cast<double>(count_);
+    if (seen == count_)
+      fprintf(out, "%12.3f %1.12f %10llu\n", static_cast<double>(std::min(Value(i), max_)), p,
+              static_cast<unsigned long long>(seen));
+    else
+      fprintf(out, "%12.3f %1.12f %10llu %14.2f\n", static_cast<double>(Value(i)), p,
+              static_cast<unsigned long long>(seen), 1 / (1 - p));
+  }
+  fprintf(out, "#[Mean    = %12.3f]\n", Mean());
+  fprintf(out, "#[Max     = %12.3f, Total count    = %12llu]\n", static_cast<double>(max_),
+          static_cast<unsigned long long>(count_));
+}
+
+uint64_t LatencyHistogram::Percentile(double p) const {
+  if (!count_)
+    return 0;
+  uint64_t rank = static_cast<uint64_t>(std::ceil(p * static_cast<double>(count_)));
+  rank = std::max<uint64_t>(rank, 1);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    seen += buckets_[i];
+    if (seen >= rank)
+      return std::min(Value(i), max_);
+  }
+  return max_;
+}
+
+/**
+ * Owns a share of sessions. Everything but the counters
+ * is touched only by the worker thread.
+ */
+class LoadGenerator::Worker {
+ public:
+  Worker(LoadGenerator* gen, size_t first, size_t cnt) noexcept:
+    gen_(gen),
+    first_(first),
+    epoll_fd_(-1),
+    mcast_fd_(-1),
+    mcast_members_(0),
+    rnd_(gen->cfg_.seed ? gen->cfg_.seed + first : std::random_device{}()) {
+    sessions_.resize(cnt);
+  }
+
+  ~Worker() {
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+  void Start() { thread_ = std::thread(&Worker::Run, this); }
+  void Join() { if (thread_.joinable()) thread_.join(); }
+
+  LoadCounters counters;
+  LatencyHistogram pub_latency;       /**< Send to delivery of public messages */
+  LatencyHistogram priv_latency;      /**< Send to delivery of private messages */
+  LatencyHistogram reg_latency;       /**< REGISTER to REGISTERED */
+
+ private:
+  struct Session {
+    int fd = -1;
+    std::string nick;
+    bool registered = false;
+    uint64_t reg_sent = 0;
+    FrameDecoder decoder;
+    std::vector<uint8_t> out;
+    size_t out_off = 0;
+    bool want_out = false;
+    bool mcast = false;               /**< Gets public messages from the group */
+  };
+
+  LoadGenerator* gen_;
+  size_t first_;                      /**< Global index of the first session */
+  int epoll_fd_;
+  int mcast_fd_;                      /**< Group socket shared by sessions of the worker */
+  size_t mcast_members_;              /**< Sessions that joined the group */
+  std::mt19937_64 rnd_;
+  std::thread thread_;
+  std::vector<Session> sessions_;
+  /* Next action time of every session, earliest first */
+  std::priority_queue<std::pair<uint64_t, size_t>,
+                      std::vector<std::pair<uint64_t, size_t>>,
+                      std::greater<std::pair<uint64_t, size_t>>> due_;
+
+  void Run();
+  bool Connect(Session& s);
+  void Close(Session& s);
+  void Act(Session& s, uint64_t due);
+  void Schedule(size_t idx, uint64_t from);
+  void Append(Session& s, MsgType t, const std::string& to, const std::string& body);
+  void AppendBatch(Session& s, LoadAction action, uint64_t sent);
+  void Flush(Session& s);
+  void Read(Session& s);
+  void Handle(Session& s, const ChatMsg& msg);
+  void HandleMcastInfo(Session& s, const ChatMsg& msg);
+  void ReadMulticast();
+  void Deliver(const ChatMsg& msg, uint64_t cnt);
+  std::string Stamp(uint64_t t);
+};
+
+void LoadGenerator::Worker::Run() {
+  epoll_fd_ = epoll_create1(0);
+  if (epoll_fd_ < 0) {
+    perror("epoll_create1");
+    counters.errors += sessions_.size();
+    return;
+  }
+
+  for (size_t i = 0; i < sessions_.size(); ++i) {
+    auto& s = sessions_[i];
+    s.nick = gen_->cfg_.prefix + "-" + std::to_string(first_ + i);
+    if (!Connect(s)) {
+      ++counters.errors;
+      continue;
+    }
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = i;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, s.fd, &ev);
+    s.reg_sent = NowNs();
+    Append(s, MsgType::REGISTER, "", "");
+    Flush(s);
+  }
+
+  struct epoll_event events[LOADGEN_MAX_EVENTS];
+  bool traffic = false;
+  while (!gen_->stop_) {
+    uint64_t now = NowNs();
+    if (!traffic && gen_->traffic_) {
+      traffic = true;
+      for (size_t i = 0; i < sessions_.size(); ++i)
+        Schedule(i, now);
+    }
+
+    int timeout = LOADGEN_POLL_MS;
+    if (traffic && !due_.empty()) {
+      uint64_t wait_ns = due_.top().first > now ? due_.top().first - now : 0;
+      timeout = std::min<int>(timeout, static_cast<int>((wait_ns + 999999) / 1000000));
+    }
+    int n = epoll_wait(epoll_fd_, events, LOADGEN_MAX_EVENTS, timeout);
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      break;
+    }
+    for (int i = 0; i < n; ++i) {
+      if (events[i].data.u64 == MCAST_EVENT) {
+        ReadMulticast();
+        continue;
+      }
+      auto& s = sessions_[events[i].data.u64];
+      if (s.fd < 0)
+        continue;
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        ++counters.errors;
+        Close(s);
+        continue;
+      }
+      if (events[i].events & EPOLLOUT)
+        Flush(s);
+      if (s.fd >= 0 && (events[i].events & EPOLLIN))
+        Read(s);
+    }
+
+    if (!traffic)
+      continue;
+    now = NowNs();
+    while (!due_.empty() && due_.top().first <= now) {
+      uint64_t due = due_.top().first;
+      size_t idx = due_.top().second;
+      due_.pop();
+      if (sessions_[idx].fd < 0)
+        continue;
+      Act(sessions_[idx], due);
+      /* Corrected mode keeps the schedule even if actions run late */
+      Schedule(idx, gen_->cfg_.co_correct ? due : now);
+    }
+  }
+
+  for (auto& s : sessions_)
+    Close(s);
+  if (mcast_fd_ >= 0)
+    close(mcast_fd_);
+  close(epoll_fd_);
+}
+
+bool LoadGenerator::Worker::Connect(Session& s) {
+  struct sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(gen_->cfg_.port);
+  addr.sin_addr.s_addr = htonl(gen_->cfg_.ip);
+
+  s.fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (s.fd < 0) {
+    perror("socket");
+    return false;
+  }
+  if (connect(s.fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+    perror("connect");
+    close(s.fd);
+    s.fd = -1;
+    return false;
+  }
+  int one = 1;
+  setsockopt(s.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (gen_->tls_) {
+    /* Socket is still blocking, handshake completes in one step */
+    TlsSession tls(*gen_->tls_, s.fd);
+    if (tls.Handshake() != TlsStep::DONE || !tls.KernelOffload()) {
+      fprintf(stderr, "tls: %s\n", tls.Error().empty() ? "kernel did not take the session" : tls.Error().c_str());
+      close(s.fd);
+      s.fd = -1;
+      return false;
+    }
+  }
+  int flags = fcntl(s.fd, F_GETFL, 0);
+  fcntl(s.fd, F_SETFL, flags | O_NONBLOCK);
+  return true;
+}
+
+void LoadGenerator::Worker::Close(Session& s) {
+  if (s.fd < 0)
+    return;
+  if (s.registered)
+    --counters.registered;
+  s.registered = false;
+  if (s.mcast)
+    --mcast_members_;
+  s.mcast = false;
+  close(s.fd);
+  s.fd = -1;
+}
+
+void LoadGenerator::Worker::Schedule(size_t idx, uint64_t from) {
+  /* Exponential intervals make a Poisson process */
+  std::exponential_distribution<double> interval(gen_->cfg_.rate);
+  due_.emplace(from + static_cast<uint64_t>(interval(rnd_) * 1e9), idx);
+}
+
+void LoadGenerator::Worker::Act(Session& s, uint64_t due) {
+  if (s.out.size() - s.out_off > MAX_SESSION_BACKLOG) {
+    ++counters.skipped;
+    return;
+  }
+
+  const auto& w = gen_->cfg_.mix.weights;
+  std::discrete_distribution<size_t> pick(std::begin(w), std::end(w));
+  auto action = static_cast<LoadAction>(pick(rnd_));
+  /* Client waits for REGISTERED before acting again */
+  if (!s.registered && action != LoadAction::IDLE)
+    return;
+
+  uint64_t sent = gen_->cfg_.co_correct ? due : NowNs();
+  if (gen_->cfg_.batch > 1 && (action == LoadAction::PUBLIC || action == LoadAction::PRIVATE)) {
+    AppendBatch(s, action, sent);
+    Flush(s);
+    return;
+  }
+  switch (action) {
+    case LoadAction::PUBLIC:
+      Append(s, MsgType::PUBLIC_DATA, "", Stamp(sent));
+      ++counters.sent;
+      break;
+    case LoadAction::PRIVATE: {
+      std::uniform_int_distribution<size_t> peer(0, gen_->cfg_.clients - 1);
+      Append(s, MsgType::PRIVATE_DATA, gen_->cfg_.prefix + "-" + std::to_string(peer(rnd_)), Stamp(sent));
+      ++counters.sent;
+      break;
+    }
+    case LoadAction::REGISTER:
+      Append(s, MsgType::UNREGISTER, "", "");
+      s.registered = false;
+      --counters.registered;
+      /* New registration gets public messages over TCP until it joins again */
+      if (s.mcast)
+        --mcast_members_;
+      s.mcast = false;
+      s.reg_sent = sent;
+      Append(s, MsgType::REGISTER, "", "");
+      break;
+    default:
+      return;
+  }
+  Flush(s);
+}
+
+std::string LoadGenerator::Worker::Stamp(uint64_t t) {
+  char stamp[STAMP_LEN + 1];
+  snprintf(stamp, sizeof(stamp), "%s%016llx %016llx", STAMP_PREFIX,
+           static_cast<unsigned long long>(gen_->run_id_), static_cast<unsigned long long>(t));
+  std::string body(stamp, STAMP_LEN);
+  if (gen_->cfg_.msg_size > STAMP_LEN)
+    body.append(gen_->cfg_.msg_size - STAMP_LEN, '.');
+  return body;
+}
+
+void LoadGenerator::Worker::Append(Session& s, MsgType t, const std::string& to, const std::string& body) {
+  ChatMsgHdr hdr{};
+  hdr.type = t;
+  strncpy(hdr.from, s.nick.c_str(), MAX_NICKNAME_LEN - 1);
+  strncpy(hdr.to, to.c_str(), MAX_NICKNAME_LEN - 1);
+  hdr.buf_len = body.size();
+  auto p = reinterpret_cast<const uint8_t*>(&hdr);
+  s.out.insert(s.out.end(), p, p + sizeof(hdr));
+  s.out.insert(s.out.end(), body.begin(), body.end());
+}
+
+void LoadGenerator::Worker::AppendBatch(Session& s, LoadAction action, uint64_t sent) {
+  BatchEncoder enc(s.nick);
+  std::uniform_int_distribution<size_t> peer(0, gen_->cfg_.clients - 1);
+  for (size_t i = 0; i < gen_->cfg_.batch; ++i) {
+    std::string body = Stamp(sent);
+    bool ok;
+    if (action == LoadAction::PUBLIC) {
+      ok = enc.Add(MsgType::PUBLIC_DATA, "", reinterpret_cast<const uint8_t*>(body.data()), body.size());
+    } else {
+      std::string to = gen_->cfg_.prefix + "-" + std::to_string(peer(rnd_));
+      ok = enc.Add(MsgType::PRIVATE_DATA, to.c_str(), reinterpret_cast<const uint8_t*>(body.data()), body.size());
+    }
+    if (!ok)
+      break;
+    ++counters.sent;
+  }
+  frame_t f = enc.Frame();
+  s.out.insert(s.out.end(), f->begin(), f->end());
+}
+
+void LoadGenerator::Worker::Flush(Session& s) {
+  while (s.out_off < s.out.size()) {
+    ssize_t sz = send(s.fd, s.out.data() + s.out_off, s.out.size() - s.out_off, MSG_NOSIGNAL);
+    if (sz < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      ++counters.errors;
+      Close(s);
+      return;
+    }
+    s.out_off += static_cast<size_t>(sz);
+  }
+
+  bool want_out = s.out_off < s.out.size();
+  if (!want_out) {
+    s.out.clear();
+    s.out_off = 0;
+  }
+  if (want_out != s.want_out) {
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    if (want_out)
+      ev.events |= EPOLLOUT;
+    ev.data.u64 = static_cast<uint64_t>(&s - sessions_.data());
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, s.fd, &ev);
+    s.want_out = want_out;
+  }
+}
+
+void LoadGenerator::Worker::Read(Session& s) {
+  uint8_t buf[LOADGEN_RECV_SIZE];
+  while (1) {
+    ssize_t sz = recv(s.fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (sz > 0) {
+      s.decoder.Append(buf, static_cast<size_t>(sz));
+      continue;
+    }
+    if (sz < 0 && errno == EINTR)
+      continue;
+    if (sz < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    /* Closed by server or failed */
+    ++counters.errors;
+    Close(s);
+    return;
+  }
+
+  bool error = false;
+  while (auto msg = s.decoder.Next(error))
+    Handle(s, *msg);
+  if (error) {
+    ++counters.errors;
+    Close(s);
+  }
+}
+
+void LoadGenerator::Worker::Handle(Session& s, const ChatMsg& msg) {
+  switch (msg.hdr.type) {
+    case MsgType::REGISTERED:
+      if (!s.registered) {
+        s.registered = true;
+        ++counters.registered;
+        if (gen_->recording_)
+          reg_latency.Record((NowNs() - s.reg_sent) / 1000);
+        if (!gen_->cfg_.mcast_if.empty() && !s.mcast) {
+          Append(s, MsgType::MCAST_JOIN, "", "");
+          Flush(s);
+        }
+      }
+      break;
+    case MsgType::ERR_REGISTERED:
+      ++counters.errors;
+      break;
+    case MsgType::MCAST_INFO:
+      HandleMcastInfo(s, msg);
+      break;
+    case MsgType::PUBLIC_DATA:
+    case MsgType::PRIVATE_DATA:
+      Deliver(msg, 1);
+      break;
+    default:
+      break;
+  }
+}
+
+void LoadGenerator::Worker::Deliver(const ChatMsg& msg, uint64_t cnt) {
+  if (msg.hdr.buf_len < STAMP_LEN || memcmp(msg.buf, STAMP_PREFIX, STAMP_PREFIX_LEN))
+    return;
+  std::string stamp(reinterpret_cast<const char*>(msg.buf) + STAMP_PREFIX_LEN, STAMP_LEN - STAMP_PREFIX_LEN);
+  uint64_t run_id = strtoull(stamp.substr(0, 16).c_str(), nullptr, 16);
+  uint64_t sent = strtoull(stamp.substr(17, 16).c_str(), nullptr, 16);
+  if (run_id != gen_->run_id_)
+    return;
+  counters.received += cnt;
+  if (!gen_->recording_)
+    return;
+  uint64_t now = NowNs();
+  auto& h = msg.hdr.type == MsgType::PUBLIC_DATA ? pub_latency : priv_latency;
+  h.Record(now > sent ? (now - sent) / 1000 : 0);
+}
+
+void LoadGenerator::Worker::HandleMcastInfo(Session& s, const ChatMsg& msg) {
+  if (msg.hdr.buf_len != sizeof(McastInfo) || s.mcast)
+    return;
+  McastInfo info;
+  memcpy(&info, msg.buf, sizeof(info));
+  if (mcast_fd_ < 0) {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = info.group;
+    addr.sin_port = htons(info.port);
+    struct ip_mreq mreq{};
+    mreq.imr_multiaddr.s_addr = info.group;
+    inet_pton(AF_INET, gen_->cfg_.mcast_if.c_str(), &mreq.imr_interface);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int one = 1;
+    /* Every worker joins with its own socket */
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (fd < 0 || bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+      perror("multicast join");
+      if (fd >= 0)
+        close(fd);
+      ++counters.errors;
+      return;
+    }
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = MCAST_EVENT;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+    mcast_fd_ = fd;
+  }
+  s.mcast = true;
+  ++mcast_members_;
+}
+
+void LoadGenerator::Worker::ReadMulticast() {
+  uint8_t dgram[LOADGEN_RECV_SIZE];
+  while (1) {
+    ssize_t sz = recv(mcast_fd_, dgram, sizeof(dgram), MSG_DONTWAIT);
+    if (sz < 0 && errno == EINTR)
+      continue;
+    if (sz <= 0)
+      return;
+    FrameDecoder decoder;
+    decoder.Append(dgram, static_cast<size_t>(sz));
+    bool error = false;
+    while (auto msg = decoder.Next(error))
+      if (msg->hdr.type == MsgType::PUBLIC_DATA && mcast_members_)
+        Deliver(*msg, mcast_members_);
+  }
+}
+
+LoadGenerator::LoadGenerator(const LoadConfig& cfg):
+  cfg_(cfg),
+  run_id_(std::random_device{}()) {
+  cfg_.threads = std::max<size_t>(1, std::min(cfg_.threads, cfg_.clients));
+  cfg_.msg_size = std::min(std::max(cfg_.msg_size, STAMP_LEN), MAX_MSG_BUFFER_SIZE);
+}
+
+LoadGenerator::~LoadGenerator() {
+  stop_ = true;
+}
+
+LoadTotals LoadGenerator::Sum() const {
+  LoadTotals t{};
+  for (auto& w : workers_) {
+    t.sent += w->counters.sent;
+    t.received += w->counters.received;
+    t.registered += w->counters.registered;
+    t.skipped += w->counters.skipped;
+    t.errors += w->counters.errors;
+  }
+  return t;
+}
+
+bool LoadGenerator::Run() {
+  if (cfg_.tls) {
+    std::string err;
+    std::string name = cfg_.tls_name;
+    if (name.empty()) {
+      char ip[INET_ADDRSTRLEN];
+      struct in_addr addr{htonl(cfg_.ip)};
+      name = inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+    }
+    tls_ = TlsContext::NewClient(cfg_.tls_ca, name, err);
+    if (!tls_) {
+      fprintf(stderr, "tls: %s\n", err.c_str());
+      return false;
+    }
+  }
+  size_t per_worker = cfg_.clients / cfg_.threads;
+  size_t first = 0;
+  for (size_t i = 0; i < cfg_.threads; ++i) {
+    size_t cnt = per_worker + (i < cfg_.clients % cfg_.threads ? 1 : 0);
+    workers_.push_back(std::make_unique<Worker>(this, first, cnt));
+    first += cnt;
+  }
+  for (auto& w : workers_)
+    w->Start();
+
+  /* Traffic starts when every client is registered */
+  auto start = std::chrono::steady_clock::now();
+  LoadTotals t = Sum();
+  while (t.registered < cfg_.clients) {
+    if (std::chrono::steady_clock::now() - start > std::chrono::seconds(LOADGEN_REG_TIMEOUT) ||
+        t.errors >= cfg_.clients) {
+      std::cout << "Registered " << t.registered << " of " << cfg_.clients << " clients, "
+                << t.errors << " errors" << std::endl;
+      stop_ = true;
+      for (auto& w : workers_)
+        w->Join();
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(LOADGEN_POLL_MS));
+    t = Sum();
+  }
+  double reg_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << "Registered " << cfg_.clients << " clients in " << reg_s << " s" << std::endl;
+
+  recording_ = cfg_.warmup <= 0;
+  traffic_ = true;
+  start = std::chrono::steady_clock::now();
+  LoadTotals prev = Sum();
+  for (int sec = 1; sec <= cfg_.warmup + cfg_.duration; ++sec) {
+    std::this_thread::sleep_until(start + std::chrono::seconds(sec));
+    if (sec == cfg_.warmup)
+      recording_ = true;
+    t = Sum();
+    printf("%4d s  sent %8llu/s  received %9llu/s  registered %6llu  skipped %llu  errors %llu\n", sec,
+           static_cast<unsigned long long>(t.sent - prev.sent),
+           static_cast<unsigned long long>(t.received - prev.received),
+           static_cast<unsigned long long>(t.registered),
+           static_cast<unsigned long long>(t.skipped),
+           static_cast<unsigned long long>(t.errors));
+    fflush(stdout);
+    prev = t;
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  stop_ = true;
+  for (auto& w : workers_)
+    w->Join();
+  Report(seconds);
+  return true;
+}
+
+void LoadGenerator::Report(double seconds) const {
+  LoadTotals t = Sum();
+  LatencyHistogram pub_latency;
+  LatencyHistogram priv_latency;
+  LatencyHistogram reg_latency;
+  for (auto& w : workers_) {
+    pub_latency.Merge(w->pub_latency);
+    priv_latency.Merge(w->priv_latency);
+    reg_latency.Merge(w->reg_latency);
+  }
+  const std::pair<const char*, const LatencyHistogram*> kinds[] = {
+    {"public", &pub_latency},
+    {"private", &priv_latency},
+    {"register", &reg_latency},
+  };
+
+  printf("\n%zu clients, %zu threads, %.1f s, %.2f actions/s per client, %zu byte messages, mix %s\n",
+         cfg_.clients, cfg_.threads, seconds, cfg_.rate, cfg_.msg_size, cfg_.mix.ToString().c_str());
+  printf("sent       %10llu  %10.1f msg/s\n", static_cast<unsigned long long>(t.sent),
+         static_cast<double>(t.sent) / seconds);
+  printf("received   %10llu  %10.1f msg/s\n", static_cast<unsigned long long>(t.received),
+         static_cast<double>(t.received) / seconds);
+  printf("skipped    %10llu\nerrors     %10llu\n", static_cast<unsigned long long>(t.skipped),
+         static_cast<unsigned long long>(t.errors));
+
+  static const double PERCENTILES[] = {0.5, 0.9, 0.99, 0.999, 0.9999};
+  printf("latency, us%s, after %d s warmup\n",
+         cfg_.co_correct ? " (corrected for coordinated omission)" : "", cfg_.warmup);
+  printf("%-10s %10s %10s %9s %9s %9s %9s %9s %9s\n", "", "samples", "mean",
+         "p50", "p90", "p99", "p99.9", "p99.99", "max");
+  for (auto& k : kinds) {
+    const LatencyHistogram& h = *k.second;
+    printf("%-10s %10llu %10.1f", k.first, static_cast<unsigned long long>(h.Count()), h.Mean());
+    for (double p : PERCENTILES)
+      printf(" %9llu", static_cast<unsigned long long>(h.Percentile(p)));
+    printf(" %9llu\n", static_cast<unsigned long long>(h.Max()));
+  }
+
+  if (cfg_.hgrm_prefix.empty())
+    return;
+  for (auto& k : kinds) {
+    std::string path = cfg_.hgrm_prefix + "-" + k.first + ".hgrm";
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+      perror(path.c_str());
+      continue;
+    }
+    k.second->PrintDistribution(f);
+    fclose(f);
+  }
+}
+
+}  // namespace ptxchat
@@ -0,0 +1,172 @@
+#ifndef LOADGEN_LOADGEN_H_
+#define LOADGEN_LOADGEN_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Message.h"
+#include "Tls.h"
+
+namespace ptxchat {
+
+constexpr size_t DEF_LOADGEN_CLIENTS =     1000;
+constexpr size_t DEF_LOADGEN_THREADS =     4;
+constexpr int DEF_LOADGEN_DURATION =       30;       /**< s of traffic after every client registered */
+constexpr double DEF_LOADGEN_RATE =        1.0;      /**< Actions per second of every client */
+constexpr size_t DEF_LOADGEN_MSG_SIZE =    64;
+constexpr int LOADGEN_REG_TIMEOUT =        30;       /**< s to wait for registration of all clients */
+constexpr size_t MAX_SESSION_BACKLOG =     1 << 20;  /**< Unsent bytes of a session before it skips actions */
+inline const char* DEF_LOADGEN_PREFIX =    "lg";
+
+enum class LoadAction {
+  PUBLIC,    /**< Public message */
+  PRIVATE,   /**< Private message to a random simulated client */
+  REGISTER,  /**< Unregister and register again */
+  IDLE,      /**< Do nothing, only receive */
+  COUNT,
+};
+
+/**
+ * \brief Relative weights of client actions
+ */
+struct LoadMix {
+  uint32_t weights[static_cast<size_t>(LoadAction::COUNT)] = {60, 30, 5, 5};
+
+  /**
+   * \brief Parse "public:60,private:30,register:5,idle:5", missing actions get 0
+   */
+  bool Parse(const std::string& s);
+  [[nodiscard]] std::string ToString() const;
+};
+
+struct LoadConfig {
+  uint32_t ip = 2130706433;    /**< Server ip, host order (default = 127.0.0.1) */
+  uint16_t port = 1488;
+  size_t clients = DEF_LOADGEN_CLIENTS;
+  size_t threads = DEF_LOADGEN_THREADS;
+  int duration = DEF_LOADGEN_DURATION;
+  double rate = DEF_LOADGEN_RATE;
+  size_t msg_size = DEF_LOADGEN_MSG_SIZE;
+  size_t batch = 1;            /**< Data messages sent as one BATCH frame per action */
+  std::string prefix = DEF_LOADGEN_PREFIX;  /**< Nicknames are prefix-N */
+  LoadMix mix;
+  int warmup = 0;              /**< s of traffic before samples are recorded */
+  uint64_t seed = 0;           /**< Seed of action schedule, 0 for random */
+  /**
+   * Measure from the time an action was due instead of when it was sent,
+   * and keep the schedule when the generator falls behind. Stalls of the
+   * server then count for every message that should have been sent meanwhile.
+   */
+  bool co_correct = false;
+  std::string hgrm_prefix;     /**< Write prefix-<kind>.hgrm percentile files if set */
+  bool tls = false;            /**< Connect with TLS, offloaded to the kernel */
+  std::string tls_ca;          /**< CA to verify server with, empty accepts any certificate */
+  std::string tls_name;        /**< Name the server certificate must have, empty for the server address */
+  std::string mcast_if;        /**< Join server multicast group on this interface if set */
+};
+
+/**
+ * \brief HDR histogram of microseconds
+ *
+ * Log-linear buckets keep three significant digits (within 0.05%)
+ * from 1 us to days with a fixed footprint.
+ */
+class LatencyHistogram {
+ public:
+  LatencyHistogram();
+
+  void Record(uint64_t us);
+  void Merge(const LatencyHistogram& h);
+
+  /**
+   * \brief Value below which the given fraction of samples lies
+   */
+  [[nodiscard]] uint64_t Percentile(double p) const;
+  [[nodiscard]] uint64_t Count() const { return count_; }
+  [[nodiscard]] uint64_t Max() const { return max_; }
+  [[nodiscard]] double Mean() const;
+
+  /**
+   * \brief Write percentile distribution in HdrHistogram .hgrm format
+   */
+  void PrintDistribution(FILE* out) const;
+
+ private:
+  static constexpr int SUB_BITS = 11;
+  static constexpr size_t SUB_CNT = 1 << SUB_BITS;
+  static constexpr size_t GROUPS = 30;
+
+  std::vector<uint64_t> buckets_;
+  uint64_t count_;
+  uint64_t max_;
+  uint64_t sum_;
+
+  static size_t Index(uint64_t us);
+  static uint64_t Value(size_t idx);
+};
+
+/**
+ * \brief Counters of one worker, read by the reporting thread
+ */
+struct LoadCounters {
+  std::atomic<uint64_t> sent{0};        /**< Data messages written */
+  std::atomic<uint64_t> received{0};    /**< Data messages delivered to simulated clients */
+  std::atomic<uint64_t> registered{0};  /**< Clients registered now */
+  std::atomic<uint64_t> skipped{0};     /**< Actions skipped because server does not read */
+  std::atomic<uint64_t> errors{0};      /**< Dropped connections and rejected registrations */
+};
+
+struct LoadTotals {
+  uint64_t sent;
+  uint64_t received;
+  uint64_t registered;
+  uint64_t skipped;
+  uint64_t errors;
+};
+
+/**
+ * \brief Simulates many chat clients over the real wire format
+ *
+ * Every worker thread drives its share of sessions with one epoll set.
+ * Sessions act with exponentially distributed intervals, so the load is
+ * a Poisson process of the configured rate. Message bodies carry the send
+ * time, so every delivery to a simulated client gives an end-to-end latency
+ * sample (a public message gives one per recipient). Public, private and
+ * registration latencies are kept in separate histograms. With multicast
+ * a worker joins the group once for all its sessions, and a datagram
+ * counts as a delivery to each of them but gives one latency sample.
+ */
+class LoadGenerator {
+ public:
+  explicit LoadGenerator(const LoadConfig& cfg);
+  ~LoadGenerator();
+
+  /**
+   * \brief Connect, register every client, run traffic and print a report
+   * \return false if clients could not be connected or registered
+   */
+  bool Run();
+
+ private:
+  class Worker;
+
+  LoadConfig cfg_;
+  std::unique_ptr<TlsContext> tls_;
+  uint64_t run_id_;                      /**< Tells samples of this run from stale mailbox messages */
+  std::atomic<bool> traffic_{false};
+  std::atomic<bool> recording_{false};   /**< Latency samples are taken after warmup */
+  std::atomic<bool> stop_{false};
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  [[nodiscard]] LoadTotals Sum() const;
+  void Report(double seconds) const;
+};
+
+}  // namespace ptxchat
+
+#endif  // LOADGEN_LOADGEN_H_
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include <iostream>
+#include <string>
+
+#include "loadgen.h"
+#include "server_process.h"
+
+using ptxchat::LoadConfig;
+using ptxchat::LoadGenerator;
+using ptxchat::ServerProcess;
+
+static void Usage(const char* name) {
+  LoadConfig def;
+  std::cout << "Usage: " << name << " [options]\n"
+            << "  -a, --address IP     server address (default 127.0.0.1)\n"
+            << "  -p, --port PORT      server port (default " << def.port << ")\n"
+            << "  -c, --clients N      simulated clients (default " << def.clients << ")\n"
+            << "  -t, --threads N      worker threads (default " << def.threads << ")\n"
+            << "  -d, --duration S     seconds of traffic (default " << def.duration << ")\n"
+            << "  -r, --rate R         actions per second of every client (default " << def.rate << ")\n"
+            << "  -s, --size B         message body size (default " << def.msg_size << ")\n"
+            << "  -b, --batch N        send data messages N at a time in one batch frame, up to "
+            << ptxchat::MAX_BATCH_MSGS << " (default " << def.batch << ")\n"
+            << "  -m, --mix MIX        action weights (default " << def.mix.ToString() << ")\n"
+            << "  -n, --prefix P       nickname prefix (default " << def.prefix << ")\n"
+            << "  -w, --warmup S       seconds of traffic before latency is recorded (default " << def.warmup << ")\n"
+            << "  -e, --seed N         seed of action schedule, 0 for random (default " << def.seed << ")\n"
+            << "  -C, --co-correct     measure latency from when actions were due (coordinated omission)\n"
+            << "  -H, --hgrm PREFIX    write PREFIX-{public,private,register}.hgrm percentile files\n"
+            << "  -S, --server PATH    run headless ptx-server on --port for the run\n"
+            << "  -T, --tls            connect with TLS (kernel offloaded)\n"
+            << "  -A, --tls-ca FILE    verify server certificate with CA, implies --tls\n"
+            << "  -N, --tls-name NAME  name the server certificate must have (default --address)\n"
+            << "  -M, --multicast IF   get public messages from server multicast group, joined on interface IF\n";
+}
+
+int main(int argc, char** argv) {
+  static const struct option opts[] = {
+    {"address",  required_argument, nullptr, 'a'},
+    {"port",     required_argument, nullptr, 'p'},
+    {"clients",  required_argument, nullptr, 'c'},
+    {"threads",  required_argument, nullptr, 't'},
+    {"duration", required_argument, nullptr, 'd'},
+    {"rate",     required_argument, nullptr, 'r'},
+    {"size",     required_argument, nullptr, 's'},
+    {"batch",    required_argument, nullptr, 'b'},
+    {"mix",      required_argument, nullptr, 'm'},
+    {"prefix",   required_argument, nullptr, 'n'},
+    {"warmup",   required_argument, nullptr, 'w'},
+    {"seed",     required_argument, nullptr, 'e'},
+    {"co-correct", no_argument,     nullptr, 'C'},
+    {"hgrm",     required_argument, nullptr, 'H'},
+    {"server",   required_argument, nullptr, 'S'},
+    {"tls",      no_argument,       nullptr, 'T'},
+    {"tls-ca",   required_argument, nullptr, 'A'},
+    {"tls-name", required_argument, nullptr, 'N'},
+    {"multicast", required_argument, nullptr, 'M'},
+    {"help",     no_argument,       nullptr, 'h'},
+    {nullptr,    0,                 nullptr, 0},
+  };
+
+  LoadConfig cfg;
+  std::string server_path;
+  int c;
+  while ((c = getopt_long(argc, argv, "a:p:c:t:d:r:s:b:m:n:w:e:CH:S:TA:N:M:h", opts, nullptr)) != -1) {
+    switch (c) {
+      case 'a': {
+        struct in_addr addr;
+        if (inet_pton(AF_INET, optarg, &addr) <= 0) {
+          std::cout << "Error: bad ip address: " << optarg << std::endl;
+          return 1;
+        }
+        cfg.ip = ntohl(addr.s_addr);
+        break;
+      }
+      case 'p':
+        cfg.port = static_cast<uint16_t>(atoi(optarg));
+        break;
+      case 'c':
+        cfg.clients = strtoul(optarg, nullptr, 10);
+        break;
+      case 't':
+        cfg.threads = strtoul(optarg, nullptr, 10);
+        break;
+      case 'd':
+        cfg.duration = atoi(optarg);
+        break;
+      case 'r':
+        cfg.rate = atof(optarg);
+        break;
+      case 's':
+        cfg.msg_size = strtoul(optarg, nullptr, 10);
+        break;
+      case 'b':
+        cfg.batch = strtoul(optarg, nullptr, 10);
+        break;
+      case 'm':
+        if (!cfg.mix.Parse(optarg)) {
+          std::cout << "Error: bad mix: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'n':
+        cfg.prefix = optarg;
+        break;
+      case 'w':
+        cfg.warmup = atoi(optarg);
+        break;
+      case 'e':
+        cfg.seed = strtoull(optarg, nullptr, 10);
+        break;
+      case 'C':
+        cfg.co_correct = true;
+        break;
+      case 'H':
+        cfg.hgrm_prefix = optarg;
+        break;
+      case 'S':
+        server_path = optarg;
+        break;
+      case 'T':
+        cfg.tls = true;
+        break;
+      case 'A':
+        cfg.tls = true;
+        cfg.tls_ca = optarg;
+        break;
+      case 'N':
+        cfg.tls_name = optarg;
+        break;
+      case 'M': {
+        struct in_addr addr;
+        if (inet_pton(AF_INET, optarg, &addr) <= 0) {
+          std::cout << "Error: bad interface address: " << optarg << std::endl;
+          return 1;
+        }
+        cfg.mcast_if = optarg;
+        break;
+      }
+      default:
+        Usage(argv[0]);
+        return c == 'h' ? 0 : 1;
+    }
+  }
+  if (!cfg.clients || !cfg.port || cfg.rate <= 0 || cfg.duration <= 0 || cfg.warmup < 0 ||
+      !cfg.batch || cfg.batch > ptxchat::MAX_BATCH_MSGS) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  ServerProcess server;
+  if (!server_path.empty() && !server.Start(server_path, cfg.port)) {
+    std::cout << "Error: " << server_path << " does not accept on port " << cfg.port << std::endl;
+    return 1;
+  }
+  LoadGenerator gen(cfg);
+  return gen.Run() ? 0 : 1;
+}
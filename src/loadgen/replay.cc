@@ -0,0 +1,236 @@
+#include "replay.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <chrono>
+
+namespace ptxchat {
+
+static constexpr int REPLAY_MAX_EVENTS = 256;
+static constexpr size_t REPLAY_RECV_SIZE = 64 * 1024;
+
+static uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Replayer::Replayer(const ReplayConfig& cfg):
+  cfg_(cfg),
+  in_(nullptr),
+  epoll_fd_(epoll_create1(0)),
+  scratch_(REPLAY_RECV_SIZE) {
+
+}
+
+Replayer::~Replayer() {
+  for (auto& c : conns_)
+    if (c.second >= 0)
+      close(c.second);
+  if (epoll_fd_ >= 0)
+    close(epoll_fd_);
+  if (in_)
+    fclose(in_);
+}
+
+bool Replayer::Run() {
+  in_ = fopen(cfg_.path.c_str(), "rb");
+  if (!in_) {
+    perror(cfg_.path.c_str());
+    return false;
+  }
+  CaptureFileHdr hdr;
+  if (fread(&hdr, sizeof(hdr), 1, in_) != 1 || !CaptureHdrValid(hdr)) {
+    fprintf(stderr, "%s: not a capture of this ptx-server version\n", cfg_.path.c_str());
+    return false;
+  }
+
+  uint64_t start = NowNs();
+  CaptureRecHdr rec;
+  bool truncated = false;
+  while (fread(&rec, sizeof(rec), 1, in_) == 1) {
+    if (rec.len > sizeof(ChatMsgHdr) + MAX_MSG_BUFFER_SIZE) {
+      fprintf(stderr, "%s: corrupted record at %ld\n", cfg_.path.c_str(), ftell(in_));
+      truncated = true;
+      break;
+    }
+    frame_.resize(rec.len);
+    if (rec.len && fread(frame_.data(), 1, rec.len, in_) != rec.len) {
+      truncated = true;
+      break;
+    }
+    stats_.capture_us = rec.t_us;
+
+    if (cfg_.speed > 0) {
+      uint64_t due = start + static_cast<uint64_t>(static_cast<double>(rec.t_us) * 1000 / cfg_.speed);
+      WaitUntil(due);
+      lag_.Record((NowNs() - due) / 1000);
+    } else {
+      Drain(0);
+    }
+
+    switch (static_cast<CaptureEv>(rec.ev)) {
+      case CaptureEv::OPEN:
+        Connect(rec.conn);
+        break;
+      case CaptureEv::FRAME:
+        SendFrame(rec.conn);
+        break;
+      case CaptureEv::CLOSE:
+        Close(rec.conn);
+        break;
+    }
+  }
+  double seconds = static_cast<double>(NowNs() - start) / 1e9;
+  if (truncated)
+    fprintf(stderr, "%s: capture ends with a partial record\n", cfg_.path.c_str());
+
+  /* Let the server process what was sent before connections go away */
+  uint64_t linger_end = NowNs() + static_cast<uint64_t>(REPLAY_LINGER_MS) * 1000000;
+  WaitUntil(linger_end);
+  Report(seconds);
+  return true;
+}
+
+int Replayer::Connect(uint32_t conn) {
+  Close(conn);
+  struct sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(cfg_.port);
+  addr.sin_addr.s_addr = htonl(cfg_.ip);
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0) {
+    ++stats_.errors;
+    conns_[conn] = -1;
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+  struct epoll_event e{};
+  e.events = EPOLLIN;
+  e.data.u64 = (static_cast<uint64_t>(conn) << 32) | static_cast<uint32_t>(fd);
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &e);
+  conns_[conn] = fd;
+  ++stats_.conns;
+  return fd;
+}
+
+void Replayer::Close(uint32_t conn) {
+  auto it = conns_.find(conn);
+  if (it == conns_.end())
+    return;
+  if (it->second >= 0) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, it->second, nullptr);
+    close(it->second);
+  }
+  conns_.erase(it);
+}
+
+void Replayer::SendFrame(uint32_t conn) {
+  auto it = conns_.find(conn);
+  /* Capture may have lost the record of accept */
+  int fd = it == conns_.end() ? Connect(conn) : it->second;
+  if (fd < 0) {
+    ++stats_.skipped;
+    return;
+  }
+  if (!Send(fd)) {
+    ++stats_.errors;
+    Close(conn);
+    conns_[conn] = -1;
+    return;
+  }
+  ++stats_.frames;
+  stats_.bytes += frame_.size();
+}
+
+bool Replayer::Send(int fd) {
+  size_t off = 0;
+  while (off < frame_.size()) {
+    ssize_t sz = send(fd, frame_.data() + off, frame_.size() - off, MSG_NOSIGNAL);
+    if (sz < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return false;
+      /* Server does not read until it has written its replies */
+      Drain(1);
+      continue;
+    }
+    off += static_cast<size_t>(sz);
+  }
+  return true;
+}
+
+void Replayer::Drain(int timeout_ms) {
+  struct epoll_event events[REPLAY_MAX_EVENTS];
+  int n = epoll_wait(epoll_fd_, events, REPLAY_MAX_EVENTS, timeout_ms);
+  for (int i = 0; i < n; ++i) {
+    int fd = static_cast<int>(events[i].data.u64 & 0xffffffff);
+    auto conn = static_cast<uint32_t>(events[i].data.u64 >> 32);
+    while (1) {
+      ssize_t sz = recv(fd, scratch_.data(), scratch_.size(), 0);
+      if (sz > 0)
+        continue;
+      if (sz < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        break;
+      if (sz < 0 && errno == EINTR)
+        continue;
+      /* Closed by server, later messages of this connection are skipped */
+      Close(conn);
+      conns_[conn] = -1;
+      break;
+    }
+  }
+}
+
+void Replayer::WaitUntil(uint64_t due_ns) {
+  while (1) {
+    uint64_t now = NowNs();
+    if (now >= due_ns)
+      return;
+    /* Sleep in epoll while reading replies, spin through the last ms */
+    auto left_ms = static_cast<int>((due_ns - now) / 1000000);
+    Drain(left_ms > 1 ? left_ms - 1 : 0);
+  }
+}
+
+void Replayer::Report(double seconds) const {
+  double capture_s = static_cast<double>(stats_.capture_us) / 1e6;
+  printf("\n%s: %.1f s of capture replayed in %.1f s", cfg_.path.c_str(), capture_s, seconds);
+  if (cfg_.speed > 0)
+    printf(" at %.2fx\n", cfg_.speed);
+  else
+    printf(" at max speed\n");
+  printf("connections %10llu\n", static_cast<unsigned long long>(stats_.conns));
+  printf("sent        %10llu  %10.1f msg/s  %8.2f MB/s\n", static_cast<unsigned long long>(stats_.frames),
+         static_cast<double>(stats_.frames) / seconds, static_cast<double>(stats_.bytes) / seconds / 1e6);
+  printf("skipped     %10llu\nerrors      %10llu\n", static_cast<unsigned long long>(stats_.skipped),
+         static_cast<unsigned long long>(stats_.errors));
+  if (cfg_.speed <= 0 || !lag_.Count())
+    return;
+
+  static const double PERCENTILES[] = {0.5, 0.9, 0.99, 0.999};
+  printf("behind schedule, us: mean %.1f", lag_.Mean());
+  for (double p : PERCENTILES)
+    printf("  p%g %llu", p * 100, static_cast<unsigned long long>(lag_.Percentile(p)));
+  printf("  max %llu\n", static_cast<unsigned long long>(lag_.Max()));
+}
+
+}  // namespace ptxchat
@@ -0,0 +1,79 @@
+#ifndef LOADGEN_REPLAY_H_
+#define LOADGEN_REPLAY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Capture.h"
+#include "loadgen.h"
+
+namespace ptxchat {
+
+constexpr double DEF_REPLAY_SPEED =  1.0;
+constexpr int REPLAY_LINGER_MS =     500;   /**< ms to keep reading replies after the last record */
+
+struct ReplayConfig {
+  std::string path;            /**< Capture file written by ptx-server --capture */
+  uint32_t ip = 2130706433;    /**< Server ip, host order (default = 127.0.0.1) */
+  uint16_t port = 1488;
+  double speed = DEF_REPLAY_SPEED;  /**< Capture time is divided by it, 0 sends as fast as possible */
+};
+
+struct ReplayStats {
+  uint64_t conns = 0;        /**< Connections opened */
+  uint64_t frames = 0;       /**< Messages sent */
+  uint64_t bytes = 0;
+  uint64_t skipped = 0;      /**< Messages of connections that failed */
+  uint64_t errors = 0;       /**< Failed connects and sends, connections closed by server */
+  uint64_t capture_us = 0;   /**< Time of the last record */
+};
+
+/**
+ * \brief Feeds a capture back into a server over real connections
+ *
+ * Records are replayed in capture order from one thread, so every run
+ * sends the same bytes over the same connections in the same order.
+ * Records are due at their capture time divided by speed; how late they
+ * were actually sent is kept in a histogram to tell whether the replay
+ * itself kept up. Replies of the server are read and discarded.
+ */
+class Replayer {
+ public:
+  explicit Replayer(const ReplayConfig& cfg);
+  ~Replayer();
+
+  Replayer(const Replayer&) = delete;
+  Replayer& operator=(const Replayer&) = delete;
+
+  /**
+   * \brief Replay the whole capture and print a report
+   * \return false if the capture cannot be read
+   */
+  bool Run();
+
+ private:
+  ReplayConfig cfg_;
+  FILE* in_;
+  int epoll_fd_;
+  std::unordered_map<uint32_t, int> conns_;  /**< Capture connection id to socket, -1 if failed */
+  std::vector<uint8_t> frame_;
+  std::vector<uint8_t> scratch_;
+  ReplayStats stats_;
+  LatencyHistogram lag_;                     /**< us behind schedule */
+
+  int Connect(uint32_t conn);
+  void Close(uint32_t conn);
+  void SendFrame(uint32_t conn);
+  bool Send(int fd);
+  void Drain(int timeout_ms);
+  void WaitUntil(uint64_t due_ns);
+  void Report(double seconds) const;
+};
+
+}  // namespace ptxchat
+
+#endif  // LOADGEN_REPLAY_H_
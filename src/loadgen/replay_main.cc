@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include <iostream>
+#include <string>
+
+#include "replay.h"
+#include "server_process.h"
+
+using ptxchat::ReplayConfig;
+using ptxchat::Replayer;
+using ptxchat::ServerProcess;
+
+static void Usage(const char* name) {
+  ReplayConfig def;
+  std::cout << "Usage: " << name << " [options] CAPTURE\n"
+            << "  -a, --address IP     server address (default 127.0.0.1)\n"
+            << "  -p, --port PORT      server port (default " << def.port << ")\n"
+            << "  -x, --speed N        replay N times faster than captured, 0 for max speed (default "
+            << def.speed << ")\n"
+            << "  -S, --server PATH    run headless ptx-server on --port for the run\n";
+}
+
+int main(int argc, char** argv) {
+  static const struct option opts[] = {
+    {"address",  required_argument, nullptr, 'a'},
+    {"port",     required_argument, nullptr, 'p'},
+    {"speed",    required_argument, nullptr, 'x'},
+    {"server",   required_argument, nullptr, 'S'},
+    {"help",     no_argument,       nullptr, 'h'},
+    {nullptr,    0,                 nullptr, 0},
+  };
+
+  ReplayConfig cfg;
+  std::string server_path;
+  int c;
+  while ((c = getopt_long(argc, argv, "a:p:x:S:h", opts, nullptr)) != -1) {
+    switch (c) {
+      case 'a': {
+        struct in_addr addr;
+        if (inet_pton(AF_INET, optarg, &addr) <= 0) {
+          std::cout << "Error: bad ip address: " << optarg << std::endl;
+          return 1;
+        }
+        cfg.ip = ntohl(addr.s_addr);
+        break;
+      }
+      case 'p':
+        cfg.port = static_cast<uint16_t>(atoi(optarg));
+        break;
+      case 'x':
+        cfg.speed = atof(optarg);
+        break;
+      case 'S':
+        server_path = optarg;
+        break;
+      default:
+        Usage(argv[0]);
+        return c == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc - 1 || !cfg.port || cfg.speed < 0) {
+    Usage(argv[0]);
+    return 1;
+  }
+  cfg.path = argv[optind];
+
+  ServerProcess server;
+  if (!server_path.empty() && !server.Start(server_path, cfg.port)) {
+    std::cout << "Error: " << server_path << " does not accept on port " << cfg.port << std::endl;
+    return 1;
+  }
+  Replayer replayer(cfg);
+  return replayer.Run() ? 0 : 1;
+}
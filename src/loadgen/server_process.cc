@@ -0,0 +1,84 @@
+#include "server_process.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <thread>
+
+namespace ptxchat {
+
+static constexpr int SERVER_POLL_MS = 50;
+
+bool ServerProcess::Start(const std::string& path, uint16_t port) {
+  Stop();
+  std::string port_s = std::to_string(port);
+  pid_ = fork();
+  if (pid_ < 0) {
+    perror("fork");
+    return false;
+  }
+  if (pid_ == 0) {
+    /* Status endpoint is off, so runs do not collide on its port */
+    execl(path.c_str(), path.c_str(), "--port", port_s.c_str(), "--status-port", "0",
+          static_cast<char*>(nullptr));
+    perror(path.c_str());
+    _exit(127);
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(SERVER_START_TIMEOUT);
+  while (std::chrono::steady_clock::now() < deadline) {
+    if (Exited())
+      return false;
+    if (Accepts(port))
+      return true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(SERVER_POLL_MS));
+  }
+  Stop();
+  return false;
+}
+
+void ServerProcess::Stop() {
+  if (pid_ <= 0)
+    return;
+  kill(pid_, SIGTERM);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(SERVER_STOP_TIMEOUT);
+  while (std::chrono::steady_clock::now() < deadline) {
+    if (Exited())
+      return;
+    std::this_thread::sleep_for(std::chrono::milliseconds(SERVER_POLL_MS));
+  }
+  kill(pid_, SIGKILL);
+  waitpid(pid_, nullptr, 0);
+  pid_ = -1;
+}
+
+bool ServerProcess::Exited() {
+  int status;
+  if (waitpid(pid_, &status, WNOHANG) != pid_)
+    return false;
+  pid_ = -1;
+  return true;
+}
+
+bool ServerProcess::Accepts(uint16_t port) {
+  struct sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return false;
+  bool res = connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0;
+  close(fd);
+  return res;
+}
+
+}  // namespace ptxchat
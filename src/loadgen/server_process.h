@@ -0,0 +1,48 @@
+#ifndef LOADGEN_SERVER_PROCESS_H_
+#define LOADGEN_SERVER_PROCESS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+
+namespace ptxchat {
+
+constexpr int SERVER_START_TIMEOUT = 10;   /**< s to wait until spawned server accepts */
+constexpr int SERVER_STOP_TIMEOUT = 5;     /**< s to wait after SIGTERM before SIGKILL */
+
+/**
+ * \brief Headless ptx-server run as a child process
+ *
+ * Gives every benchmark run a fresh server on a known port,
+ * stopped with the generator.
+ */
+class ServerProcess {
+ public:
+  ServerProcess() noexcept: pid_(-1) {}
+  ~ServerProcess() { Stop(); }
+
+  ServerProcess(const ServerProcess&) = delete;
+  ServerProcess& operator=(const ServerProcess&) = delete;
+
+  /**
+   * \brief Run server executable on port and wait until it accepts connections
+   * \return false if it exited or did not accept in time
+   */
+  bool Start(const std::string& path, uint16_t port);
+
+  /**
+   * \brief SIGTERM the server and reap it
+   */
+  void Stop();
+
+ private:
+  pid_t pid_;
+
+  [[nodiscard]] bool Exited();
+  static bool Accepts(uint16_t port);
+};
+
+}  // namespace ptxchat
+
+#endif  // LOADGEN_SERVER_PROCESS_H_
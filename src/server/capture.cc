@@ -0,0 +1,92 @@
+#include "capture.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+#include <utility>
+
+namespace ptxchat {
+
+/**
+ * Capture holds private message bodies and resume tokens: owner only
+ */
+static FILE* OpenPrivate(const std::string& path) {
+  int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return nullptr;
+  /* Mode applies on creation only, an existing file keeps its own */
+  if (fchmod(fd, 0600) < 0) {
+    close(fd);
+    return nullptr;
+  }
+  FILE* f = fdopen(fd, "wb");
+  if (!f)
+    close(fd);
+  return f;
+}
+
+static uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+CaptureWriter::CaptureWriter(const std::string& path, size_t ring_len) noexcept:
+  out_(OpenPrivate(path)),
+  start_ns_(NowNs()),
+  ring_(ring_len) {
+  if (!out_)
+    return;
+  CaptureFileHdr hdr{};
+  memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+  hdr.version = CAPTURE_VERSION;
+  hdr.msg_hdr_size = sizeof(ChatMsgHdr);
+  hdr.start_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::system_clock::now().time_since_epoch()).count();
+  fwrite(&hdr, sizeof(hdr), 1, out_);
+  writer_.stop = 0;
+  writer_.thread = std::thread(&CaptureWriter::Write, this);
+}
+
+CaptureWriter::~CaptureWriter() {
+  if (!out_)
+    return;
+  writer_.stop = 1;
+  if (writer_.thread.joinable())
+    writer_.thread.join();
+  fclose(out_);
+}
+
+void CaptureWriter::Put(CaptureEv ev, uint32_t conn, frame_t frame) {
+  if (!out_)
+    return;
+  Rec r{};
+  r.hdr.t_us = (NowNs() - start_ns_) / 1000;
+  r.hdr.conn = conn;
+  r.hdr.ev = static_cast<uint8_t>(ev);
+  r.hdr.len = frame ? static_cast<uint32_t>(frame->size()) : 0;
+  r.frame = std::move(frame);
+  if (!ring_.Push(std::move(r)))
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CaptureWriter::Write() {
+  Rec r;
+  while (1) {
+    bool stop = writer_.stop;
+    while (ring_.Pop(r)) {
+      fwrite(&r.hdr, sizeof(r.hdr), 1, out_);
+      if (r.frame)
+        fwrite(r.frame->data(), 1, r.frame->size(), out_);
+      r.frame.reset();
+    }
+    fflush(out_);
+    if (stop)
+      break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(CAPTURE_FLUSH_MS));
+  }
+}
+
+}  // namespace ptxchat
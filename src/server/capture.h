@@ -0,0 +1,61 @@
+#ifndef SERVER_CAPTURE_H_
+#define SERVER_CAPTURE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <string>
+
+#include "Capture.h"
+#include "Frame.h"
+#include "BoundedRing.h"
+#include "Threads.h"
+
+namespace ptxchat {
+
+constexpr size_t DEF_CAPTURE_RING_LEN =  1 << 16;
+constexpr int CAPTURE_FLUSH_MS =         100;
+
+/**
+ * \brief Records inbound traffic to a capture file for ptx-replay
+ *
+ * Records are stamped by the receiving thread and go through a
+ * lock-free ring to a writer thread. When the writer falls behind
+ * records are dropped and counted, and the replay loses fidelity.
+ */
+class CaptureWriter {
+ public:
+  explicit CaptureWriter(const std::string& path, size_t ring_len = DEF_CAPTURE_RING_LEN) noexcept;
+  ~CaptureWriter();
+
+  CaptureWriter(const CaptureWriter&) = delete;
+  CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+  [[nodiscard]] bool IsOpen() const { return out_ != nullptr; }
+
+  void Open(uint32_t conn) { Put(CaptureEv::OPEN, conn, nullptr); }
+  void Frame(uint32_t conn, const ChatMsg& msg) { Put(CaptureEv::FRAME, conn, EncodeFrame(msg)); }
+  void Close(uint32_t conn) { Put(CaptureEv::CLOSE, conn, nullptr); }
+
+  [[nodiscard]] uint64_t Dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+ private:
+  struct Rec {
+    CaptureRecHdr hdr;
+    frame_t frame;
+  };
+
+  FILE* out_;
+  uint64_t start_ns_;   /**< steady_clock */
+  std::atomic<uint64_t> dropped_{0};
+  BoundedRing<Rec> ring_;
+  ThreadState writer_;
+
+  void Put(CaptureEv ev, uint32_t conn, frame_t frame);
+  void Write();
+};
+
+}  // namespace ptxchat
+
+#endif  // SERVER_CAPTURE_H_
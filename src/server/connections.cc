@@ -1,9 +1,15 @@
 #include "connections.h"
 
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+
+#include <algorithm>
 
 #include "Threads.h"
+#include "probes.h"
 
 namespace ptxchat {
 
@@ -12,6 +18,8 @@ std::shared_ptr<spdlog::logger> conn_logger_ = spdlog::rotating_logger_mt("Conne
                                                                           10000000,
                                                                           10);
 
+std::atomic<uint32_t> Connection::next_id_{1};
+
 int Connection::makeNonBlocking(int fd) {
   int flags;
   flags = fcntl(fd, F_GETFL, 0);
@@ -22,167 +30,399 @@ int Connection::makeNonBlocking(int fd) {
   return 0;
 }
 
-int Connection::addEventToEpoll(int epoll_fd, int fd, uint32_t ev) {
+int Connection::addEventToEpoll(int epoll_fd, int fd, uint32_t ev, uint64_t data) {
   struct epoll_event e;
-  e.data.fd = fd;
+  e.data.u64 = data;
   e.events = ev;
   if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &e) == -1)
     return -1;
   return 0;
 }
 
+int Connection::modEventInEpoll(int epoll_fd, int fd, uint32_t ev, uint64_t data) {
+  struct epoll_event e;
+  e.data.u64 = data;
+  e.events = ev;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &e) == -1)
+    return -1;
+  return 0;
+}
+
+int Connection::delEventFromEpoll(int epoll_fd, int fd) {
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr) == -1)
+    return -1;
+  return 0;
+}
+
+ConnTable::ConnTable() noexcept {
+  size_t size = MAX_CONN_SLOTS;
+  struct rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur != RLIM_INFINITY)
+    size = std::min<size_t>(size, lim.rlim_cur);
+  slots_.resize(size);
+}
+
+ConnHandle ConnTable::Add(std::shared_ptr<Connection> conn) {
+  int fd = conn->GetSocket();
+  if (fd < 0 || static_cast<size_t>(fd) >= slots_.size())
+    return NO_CONN;
+  Slot& slot = slots_[fd];
+  /* Generation 0 is never used, so no handle equals NO_CONN */
+  if (!++slot.gen)
+    ++slot.gen;
+  ConnHandle h = (static_cast<ConnHandle>(slot.gen) << 32) | static_cast<uint32_t>(fd);
+  conn->handle_ = h;
+  std::atomic_store(&slot.conn, std::move(conn));
+  return h;
+}
+
+std::shared_ptr<Connection> ConnTable::Remove(ConnHandle h) {
+  auto conn = Get(h);
+  if (conn)
+    std::atomic_store(&slots_[static_cast<uint32_t>(h)].conn, std::shared_ptr<Connection>());
+  return conn;
+}
+
+std::shared_ptr<Connection> ConnTable::Get(ConnHandle h) const {
+  uint32_t fd = static_cast<uint32_t>(h);
+  if (fd >= slots_.size())
+    return nullptr;
+  auto conn = std::atomic_load(&slots_[fd].conn);
+  /* Handle is set before the connection is published */
+  if (!conn || conn->handle_ != h)
+    return nullptr;
+  return conn;
+}
+
+void ConnTable::Clear() {
+  for (auto& slot : slots_)
+    std::atomic_store(&slot.conn, std::shared_ptr<Connection>());
+}
+
+RecvBufferPool::~RecvBufferPool() {
+  for (auto b : small_)
+    free(b);
+  for (auto b : large_)
+    free(b);
+}
+
+uint8_t* RecvBufferPool::Get(size_t need, size_t& cap) {
+  cap = need <= RECV_BUF_SMALL ? RECV_BUF_SMALL : RECV_BUF_LARGE;
+  in_use_.fetch_add(1, std::memory_order_relaxed);
+  {
+    std::unique_lock<std::mutex> lc(mtx_);
+    auto& free_bufs = cap == RECV_BUF_SMALL ? small_ : large_;
+    if (!free_bufs.empty()) {
+      uint8_t* buf = free_bufs.back();
+      free_bufs.pop_back();
+      return buf;
+    }
+  }
+  bytes_.fetch_add(cap, std::memory_order_relaxed);
+  return static_cast<uint8_t*>(malloc(cap));
+}
+
+void RecvBufferPool::Put(uint8_t* buf, size_t cap) {
+  in_use_.fetch_sub(1, std::memory_order_relaxed);
+  {
+    std::unique_lock<std::mutex> lc(mtx_);
+    auto& free_bufs = cap == RECV_BUF_SMALL ? small_ : large_;
+    if (free_bufs.size() < RECV_POOL_KEEP) {
+      free_bufs.push_back(buf);
+      return;
+    }
+  }
+  bytes_.fetch_sub(cap, std::memory_order_relaxed);
+  free(buf);
+}
+
+RecvBufferPool Connection::recv_pool_;
+
+ssize_t Connection::RecvSome(uint8_t* dst, size_t len) {
+  ssize_t sz = recv(socket_, dst, len, 0);
+  if (sz > 0)
+    return sz;
+  if (sz == 0) {
+    status_ = ConnStatus::CLOSED;
+    conn_logger_->log(spdlog::level::info, "Client " + std::to_string(socket_) + ": disconnected");
+    return -1;
+  }
+  if (errno == EAGAIN || errno == EWOULDBLOCK)
+    return 0;
+
+  if (errno == ECONNREFUSED) {
+    status_ = ConnStatus::ERROR;
+    conn_logger_->log(spdlog::level::err, "Client " + std::to_string(socket_) + ": connection refused");
+    return -1;
+  }
+
+  /* Kernel TLS: alert record (e.g. close_notify) or a record that failed to decrypt */
+  if (errno == EIO || errno == EBADMSG) {
+    status_ = ConnStatus::ERROR;
+    conn_logger_->log(spdlog::level::info, "Client " + std::to_string(socket_) + ": TLS record rejected");
+    return -1;
+  }
+
+  conn_logger_->log(spdlog::level::critical, "recv() for client " + std::to_string(socket_) +
+              " returned errno: " + strerror(errno));
+  PtxChatCrash();
+  return -1;
+}
+
+void Connection::Stash(const uint8_t* data, size_t len, size_t frame_len) {
+  size_t cap;
+  recv_data_ = recv_pool_.Get(frame_len, cap);
+  recv_cap_ = static_cast<uint16_t>(cap);
+  memcpy(recv_data_, data, len);
+  recv_data_sz_ = static_cast<uint32_t>(len);
+}
+
+void Connection::ReleaseRecvBuf() {
+  if (!recv_data_)
+    return;
+  recv_pool_.Put(recv_data_, recv_cap_);
+  recv_data_ = nullptr;
+  recv_data_sz_ = 0;
+}
+
 std::unique_ptr<ChatMsg> Connection::RecvMsgFromConn(std::shared_ptr<Connection> conn) {
   int client_fd = conn->socket_;
-  if (conn->recv_data_sz_ < sizeof(ChatMsgHdr)) {
-    uint8_t raw_hdr[sizeof(ChatMsgHdr)];
-    ssize_t rec_bytes_hdr = recv(client_fd, raw_hdr, sizeof(raw_hdr), 0);
-    if (rec_bytes_hdr == 0) {
-      conn->status_ = ConnStatus::CLOSED;
-      conn_logger_->log(spdlog::level::info, "Client " + std::to_string(client_fd) + ": disconnected");
+  ChatMsgHdr hdr;
+  uint8_t* hdr_bytes = reinterpret_cast<uint8_t*>(&hdr);
+  if (!conn->recv_data_) {
+    ssize_t sz = conn->RecvSome(hdr_bytes, sizeof(hdr));
+    if (sz <= 0)
+      return nullptr;
+    if (static_cast<size_t>(sz) < sizeof(hdr)) {
+      conn->Stash(hdr_bytes, sz, sizeof(hdr));
       return nullptr;
     }
-    if (rec_bytes_hdr < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK)
+  } else {
+    if (conn->recv_data_sz_ < sizeof(hdr)) {
+      ssize_t sz = conn->RecvSome(conn->recv_data_ + conn->recv_data_sz_, sizeof(hdr) - conn->recv_data_sz_);
+      if (sz <= 0)
         return nullptr;
-
-      if (errno == ECONNREFUSED) {
-        conn->status_ = ConnStatus::ERROR;
-        conn_logger_->log(spdlog::level::err, "Client " + std::to_string(client_fd) + ": connection refused");
-        return nullptr;
-      }
-
-      conn_logger_->log(spdlog::level::critical, "recv() for client " + std::to_string(client_fd) +
-                  " returned errno: " + strerror(errno));
-      PtxChatCrash();
-    } else if (rec_bytes_hdr < sizeof(ChatMsgHdr)) {
-      if (conn->recv_data_sz_ == 0)
-        conn->recv_data_ = (uint8_t*)malloc(rec_bytes_hdr);
-      else
-        conn->recv_data_ = (uint8_t*)realloc(conn->recv_data_, conn->recv_data_sz_ + rec_bytes_hdr);
-      memcpy(conn->recv_data_ + conn->recv_data_sz_, raw_hdr, rec_bytes_hdr);
-      conn->recv_data_sz_ += rec_bytes_hdr;
-      if (conn->recv_data_sz_ != sizeof(ChatMsgHdr))
+      conn->recv_data_sz_ += sz;
+      if (conn->recv_data_sz_ < sizeof(hdr))
         return nullptr;
-    } else {
-      conn->recv_data_ = (uint8_t*)malloc(rec_bytes_hdr);
-      memcpy(conn->recv_data_, raw_hdr, sizeof(raw_hdr));
-      conn->recv_data_sz_ = sizeof(raw_hdr);
     }
+    memcpy(&hdr, conn->recv_data_, sizeof(hdr));
   }
-  /* Заголовок полностью в буфере */
-  size_t buf_len = reinterpret_cast<ChatMsgHdr*>(conn->recv_data_)->buf_len;
-  if (buf_len > MAX_MSG_BUFFER_SIZE) {
+  /* Заголовок полностью получен */
+  size_t buf_len = hdr.buf_len;
+  if (buf_len > MaxBufLen(hdr.type)) {
     conn->status_ = ConnStatus::ERROR;
     return nullptr;
   }
 
-  if (buf_len != 0) {
-    uint8_t* raw_body = (uint8_t*)malloc(buf_len);
-    ssize_t rec_bytes_body = recv(client_fd, raw_body, buf_len, 0);
-    if (rec_bytes_body == 0) {
-      conn->status_ = ConnStatus::CLOSED;
-      conn_logger_->log(spdlog::level::info, "Client " + std::to_string(client_fd) + ": disconnected");
-      free(raw_body);
+  uint8_t* body;
+  if (!conn->recv_data_) {
+    /* Common case: body is read right into the message */
+    body = static_cast<uint8_t*>(malloc(buf_len));
+    ssize_t sz = buf_len ? conn->RecvSome(body, buf_len) : 0;
+    if (sz < 0) {
+      free(body);
       return nullptr;
     }
-    if (rec_bytes_body < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        free(raw_body);
-        return nullptr;
-      }
-
-      if (errno == ECONNREFUSED) {
-        conn->status_ = ConnStatus::ERROR;
-        conn_logger_->log(spdlog::level::err, "Client " + std::to_string(client_fd) + ": connection refused");
-        free(raw_body);
+    if (static_cast<size_t>(sz) < buf_len) {
+      conn->Stash(hdr_bytes, sizeof(hdr), sizeof(hdr) + buf_len);
+      memcpy(conn->recv_data_ + sizeof(hdr), body, sz);
+      conn->recv_data_sz_ += sz;
+      free(body);
+      return nullptr;
+    }
+  } else {
+    size_t frame_len = sizeof(hdr) + buf_len;
+    if (frame_len > conn->recv_cap_) {
+      /* Header of a batch came into a small buffer */
+      uint8_t* small = conn->recv_data_;
+      size_t small_cap = conn->recv_cap_;
+      conn->Stash(small, conn->recv_data_sz_, frame_len);
+      recv_pool_.Put(small, small_cap);
+    }
+    if (conn->recv_data_sz_ < frame_len) {
+      ssize_t sz = conn->RecvSome(conn->recv_data_ + conn->recv_data_sz_, frame_len - conn->recv_data_sz_);
+      if (sz <= 0)
         return nullptr;
-      }
-
-      conn_logger_->log(spdlog::level::critical, "recv() for client " + std::to_string(client_fd) +
-                " returned errno: " + strerror(errno));
-      PtxChatCrash();
-    } else if (rec_bytes_body < buf_len) {
-      conn->recv_data_ = (uint8_t*)realloc(conn->recv_data_, conn->recv_data_sz_ + rec_bytes_body);
-      memcpy(conn->recv_data_ + conn->recv_data_sz_, raw_body, rec_bytes_body);
-      conn->recv_data_sz_ += rec_bytes_body;
-      if (conn->recv_data_sz_ != sizeof(ChatMsgHdr) + buf_len) {
-        free(raw_body);
+      conn->recv_data_sz_ += sz;
+      if (conn->recv_data_sz_ < frame_len)
         return nullptr;
-      }
-    } else {
-      conn->recv_data_ = (uint8_t*)realloc(conn->recv_data_, sizeof(ChatMsgHdr) + buf_len);
-      memcpy(conn->recv_data_ + sizeof(ChatMsgHdr), raw_body, buf_len);
-      conn->recv_data_sz_ = sizeof(ChatMsgHdr) + buf_len;
     }
-    free(raw_body);
+    body = static_cast<uint8_t*>(malloc(buf_len));
+    memcpy(body, conn->recv_data_ + sizeof(hdr), buf_len);
+    conn->ReleaseRecvBuf();
   }
 
-  ChatMsgHdr* hdr = reinterpret_cast<ChatMsgHdr*>(conn->recv_data_);
   auto msg = std::make_unique<ChatMsg>();
   sockaddr_in cl_addr;
   socklen_t sock_len = sizeof(cl_addr);
   getpeername(client_fd, reinterpret_cast<sockaddr*>(&cl_addr), &sock_len);
-  memcpy(&msg->hdr, hdr, sizeof(ChatMsgHdr));
+  msg->hdr = hdr;
   msg->hdr.src_ip = cl_addr.sin_addr.s_addr;
   msg->hdr.src_port = cl_addr.sin_port;
-  msg->buf = (uint8_t*)malloc(msg->hdr.buf_len);
-  memcpy(msg->buf, conn->recv_data_ + sizeof(ChatMsgHdr), msg->hdr.buf_len);
-  free(conn->recv_data_);
-  conn->recv_data_sz_ = 0;
+  msg->buf = body;
 
+  PTX_PROBE(frame_decode, client_fd, static_cast<int>(msg->hdr.type), msg->hdr.buf_len);
   conn_logger_->log(spdlog::level::debug, "Recv message buf from client " + std::to_string(client_fd));
   return msg;
 }
 
 bool Connection::SendMsgToConn(std::shared_ptr<ChatMsg> msg, std::shared_ptr<Connection> conn) {
-    ssize_t bytes_sent = 0;
-    while (bytes_sent != sizeof(ChatMsgHdr)) {
-      ssize_t sz = send(conn->socket_, &msg->hdr + bytes_sent, sizeof(ChatMsgHdr) - bytes_sent, 0);
-
-      if (sz == 0) {
-        conn->status_ = ConnStatus::CLOSED;
-        conn_logger_->log(spdlog::level::info, "Cannot send private message to " + std::string(msg->hdr.to) + ": client disconnected");
-        return false;
-      }
-      if (sz < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-          continue;
-        if (errno == ECONNRESET) {
-          conn->status_ = ConnStatus::ERROR;
-          conn_logger_->log(spdlog::level::err, "Cannot send private message to " + std::string(msg->hdr.to) + ": connection reset");
-          return false;
-        }
-        conn_logger_->log(spdlog::level::err, "Cannot send private message to " + std::string(msg->hdr.to) + ": " + strerror(errno));
-        PtxChatCrash();
-      }
-      bytes_sent += sz;
+  if (!SendFramesToConn({EncodeFrame(*msg)}, conn))
+    return false;
+  conn_logger_->log(spdlog::level::debug, "Message from " + std::string(msg->hdr.from) + " sent to " + std::string(msg->hdr.to));
+  return true;
+}
+
+/**
+ * Write frames from byte off of frames[first] until all are sent or the socket is full
+ * \return false if connection failed, errno is 0 if client disconnected
+ */
+template <typename Frames>
+static bool WriteFrames(int fd, const Frames& frames, size_t& first, size_t& off, size_t& sent) {
+  struct iovec iov[IOV_MAX];
+  while (first < frames.size()) {
+    int iov_cnt = 0;
+    for (size_t i = first; i < frames.size() && iov_cnt < IOV_MAX; ++i, ++iov_cnt) {
+      size_t o = iov_cnt == 0 ? off : 0;
+      iov[iov_cnt].iov_base = const_cast<uint8_t*>(frames[i]->data()) + o;
+      iov[iov_cnt].iov_len = frames[i]->size() - o;
+    }
+
+    ssize_t sz = writev(fd, iov, iov_cnt);
+    if (sz == 0) {
+      errno = 0;
+      return false;
     }
+    if (sz < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    sent += static_cast<size_t>(sz);
+
+    /* Skip fully sent frames, remember offset in partially sent one */
+    size_t left = static_cast<size_t>(sz);
+    for (int i = 0; i < iov_cnt && left >= iov[i].iov_len; ++i) {
+      left -= iov[i].iov_len;
+      ++first;
+      off = 0;
+    }
+    off += left;
+  }
+  return true;
+}
 
-    bytes_sent = 0;
-    while (bytes_sent != msg->hdr.buf_len) {
-      ssize_t sz = send(conn->socket_, msg->buf + bytes_sent, msg->hdr.buf_len - bytes_sent, 0);
-
-      if (sz == 0) {
-        conn->status_ = ConnStatus::CLOSED;
-        conn_logger_->log(spdlog::level::info, "Cannot send private message to " + std::string(msg->hdr.to) + ": client disconnected");
-        return false;
-      }
-      if (sz < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-          continue;
-        if (errno == ECONNRESET) {
-          conn->status_ = ConnStatus::ERROR;
-          conn_logger_->log(spdlog::level::err, "Cannot send private message to " + std::string(msg->hdr.to) + ": connection reset");
-          return false;
-        }
-        conn_logger_->log(spdlog::level::err, "Cannot send private message to " + std::string(msg->hdr.to) + ": " + strerror(errno));
-        PtxChatCrash();
-      }
-      bytes_sent += sz;
+void Connection::SendFailed(size_t sent) {
+  /* Type -1 stands for a stream of frames */
+  PTX_PROBE(send_done, socket_, -1, sent, 0);
+  if (!errno) {
+    status_ = ConnStatus::CLOSED;
+    conn_logger_->log(spdlog::level::info, "Cannot send frames to " + std::to_string(socket_) + ": client disconnected");
+    return;
+  }
+  status_ = ConnStatus::ERROR;
+  conn_logger_->log(spdlog::level::err, "Cannot send frames to " + std::to_string(socket_) + ": " + strerror(errno));
+}
+
+bool Connection::SendFramesToConn(const std::vector<frame_t>& frames, std::shared_ptr<Connection> conn) {
+  std::unique_lock<std::mutex> lc(conn->send_mtx_);
+  size_t next = 0;
+  size_t off = 0;
+  size_t sent = 0;
+  /* Queued output goes first, so new frames wait behind it */
+  if (!conn->send_q_) {
+    if (!WriteFrames(conn->socket_, frames, next, off, sent)) {
+      conn->SendFailed(sent);
+      return false;
     }
+    if (next == frames.size()) {
+      PTX_PROBE(send_done, conn->socket_, -1, sent, 1);
+      conn_logger_->log(spdlog::level::debug, std::to_string(frames.size()) + " frames sent to " + std::to_string(conn->socket_));
+      return true;
+    }
+    conn->send_q_ = std::make_unique<SendQueue>();
+    conn->send_q_->off = off;
+    conn->UpdateEvents();
+  }
 
-    conn_logger_->log(spdlog::level::debug, "Message from " + std::string(msg->hdr.from) + " sent to " + std::string(msg->hdr.to));
+  /* off is 0 unless the socket took part of frames[next] just now */
+  auto& q = *conn->send_q_;
+  for (size_t i = next; i < frames.size(); ++i) {
+    q.frames.push_back(frames[i]);
+    q.bytes += frames[i]->size() - (i == next ? off : 0);
+  }
+  if (q.bytes > MAX_SEND_QUEUE_BYTES) {
+    conn->status_ = ConnStatus::ERROR;
+    PTX_PROBE(send_done, conn->socket_, -1, sent, 0);
+    conn_logger_->log(spdlog::level::warn, "Cannot send frames to " + std::to_string(conn->socket_) + ": over " +
+                      std::to_string(MAX_SEND_QUEUE_BYTES) + " bytes queued, client reads too slowly");
+    return false;
+  }
+  PTX_PROBE(send_done, conn->socket_, -1, sent, 1);
+  conn_logger_->log(spdlog::level::debug, std::to_string(frames.size() - next) + " frames queued for " +
+                    std::to_string(conn->socket_));
+  return true;
+}
+
+bool Connection::Flush() {
+  std::unique_lock<std::mutex> lc(send_mtx_);
+  if (!send_q_)
     return true;
+  auto& q = *send_q_;
+  size_t next = 0;
+  size_t sent = 0;
+  if (!WriteFrames(socket_, q.frames, next, q.off, sent)) {
+    SendFailed(sent);
+    return false;
+  }
+  q.bytes -= sent;
+  q.frames.erase(q.frames.begin(), q.frames.begin() + static_cast<std::ptrdiff_t>(next));
+  if (q.frames.empty()) {
+    /* Idle connections hold no queue */
+    send_q_.reset();
+    UpdateEvents();
   }
+  return true;
+}
+
+bool Connection::Register(const std::string& nn) {
+  if (nn.length() <= 1)
+    return false;
+  /* Control characters are used as separators in conversation keys */
+  for (char c : nn)
+    if (static_cast<unsigned char>(c) < 0x20)
+      return false;
+  nickname_ = nn;
+  registered_ = true;
+  return true;
+}
+
+int Connection::Watch(int epoll_fd, uint32_t ev) {
+  std::unique_lock<std::mutex> lc(send_mtx_);
+  epoll_fd_ = epoll_fd;
+  events_ = ev;
+  return addEventToEpoll(epoll_fd_, socket_, events_ | (send_q_ ? static_cast<uint32_t>(EPOLLOUT) : 0u), handle_);
+}
+
+int Connection::SetEvents(uint32_t ev) {
+  std::unique_lock<std::mutex> lc(send_mtx_);
+  events_ = ev;
+  return UpdateEvents();
+}
+
+void Connection::Unwatch() {
+  std::unique_lock<std::mutex> lc(send_mtx_);
+  if (epoll_fd_ >= 0)
+    delEventFromEpoll(epoll_fd_, socket_);
+  epoll_fd_ = -1;
+  send_q_.reset();
+}
+
+int Connection::UpdateEvents() {
+  if (epoll_fd_ < 0)
+    return 0;
+  return modEventInEpoll(epoll_fd_, socket_, events_ | (send_q_ ? static_cast<uint32_t>(EPOLLOUT) : 0u), handle_);
+}
 
-} // namespace ptxchat
\ No newline at end of file
+} // namespace ptxchat
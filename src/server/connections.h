@@ -7,15 +7,68 @@
 #include <unistd.h>
 #include <errno.h>
 
+#include <atomic>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include "Message.h"
+#include "Frame.h"
+#include "Tls.h"
+#include "rate_limit.h"
 #include "spdlog/spdlog.h"
 #include "spdlog/sinks/rotating_file_sink.h"
 
 namespace ptxchat {
 
-enum ConnStatus {
+/**
+ * \brief Socket and slot generation of a connection, (gen << 32) | fd
+ *
+ * Stale once the connection is closed, even if its socket number is
+ * reused by a new connection.
+ */
+using ConnHandle = uint64_t;
+constexpr ConnHandle NO_CONN = 0;           /**< No connection, generations start at 1 */
+constexpr size_t MAX_CONN_SLOTS = 1 << 18;  /**< Upper bound of connection table size */
+constexpr size_t RECV_BUF_SMALL = sizeof(ChatMsgHdr) + MAX_MSG_BUFFER_SIZE;    /**< Holds any frame but batch */
+constexpr size_t RECV_BUF_LARGE = sizeof(ChatMsgHdr) + MAX_BATCH_BUFFER_SIZE;  /**< Holds any frame */
+constexpr size_t RECV_POOL_KEEP = 256;      /**< Free buffers of each size kept for reuse */
+constexpr size_t MAX_SEND_QUEUE_BYTES = 16 << 20;  /**< Output queued for a slow client, over it the connection fails */
+
+/**
+ * \brief Receive buffers lent to connections while a frame is partly read
+ *
+ * Whole frames are read without a buffer of the connection, so an idle
+ * connection holds none. Thread safe, but in practice used by the
+ * reactor thread only.
+ */
+class RecvBufferPool {
+ public:
+  ~RecvBufferPool();
+
+  /**
+   * \return buffer of RECV_BUF_SMALL or RECV_BUF_LARGE bytes, cap is set to its size
+   */
+  uint8_t* Get(size_t need, size_t& cap);
+  void Put(uint8_t* buf, size_t cap);
+
+  [[nodiscard]] size_t InUse() const { return in_use_.load(std::memory_order_relaxed); }
+  /**
+   * \brief Memory of lent and free buffers
+   */
+  [[nodiscard]] size_t Bytes() const { return bytes_.load(std::memory_order_relaxed); }
+
+ private:
+  std::mutex mtx_;
+  std::vector<uint8_t*> small_;
+  std::vector<uint8_t*> large_;
+  std::atomic<size_t> in_use_{0};
+  std::atomic<size_t> bytes_{0};
+};
+
+enum ConnStatus : uint8_t {
   UP,
   CLOSED,
   ERROR,
@@ -26,32 +79,226 @@ class Connection {
   Connection(int skt, uint32_t ip, uint16_t port) :
     socket_(skt),
     ip_(ip),
+    id_(next_id_.fetch_add(1, std::memory_order_relaxed)),
+    recv_data_sz_(0),
+    recv_cap_(0),
     port_(port),
-    status_(UP),
-    recv_data_sz_(0)
+    status_(UP)
     {}
+  /**
+   * Socket is closed with the last reference, so senders that still
+   * hold the connection never write to a reused socket number
+   */
+  ~Connection() {
+    ReleaseRecvBuf();
+    if (socket_ >= 0)
+      close(socket_);
+  }
+
+  Connection(const Connection&) = delete;
+  Connection& operator=(const Connection&) = delete;
 
   static std::unique_ptr<ChatMsg> RecvMsgFromConn(std::shared_ptr<Connection> conn);
 
   static bool SendMsgToConn(std::shared_ptr<ChatMsg> msg, std::shared_ptr<Connection> conn);
 
+  /**
+   * \brief Send encoded frames with as few syscalls as possible
+   *
+   * What the socket does not take is queued and sent by Flush() once the
+   * socket is writable again, so the sender never waits for the client.
+   * \return false if connection failed or its queue is over MAX_SEND_QUEUE_BYTES (status is set)
+   */
+  static bool SendFramesToConn(const std::vector<frame_t>& frames, std::shared_ptr<Connection> conn);
+
+  /**
+   * \brief Send queued output, called by the reactor thread on EPOLLOUT
+   * \return false if connection failed (status is set)
+   */
+  bool Flush();
+
   static int makeNonBlocking(int fd);
 
-  static int addEventToEpoll(int epoll_fd, int fd, uint32_t ev);
+  /**
+   * \param data returned with events of fd, handle of its connection
+   */
+  static int addEventToEpoll(int epoll_fd, int fd, uint32_t ev, uint64_t data);
+
+  static int modEventInEpoll(int epoll_fd, int fd, uint32_t ev, uint64_t data);
+
+  static int delEventFromEpoll(int epoll_fd, int fd);
+
+  /**
+   * \brief Add socket to epoll with events ev and handle as data
+   *
+   * EPOLLOUT is waited for as well while output is queued.
+   */
+  int Watch(int epoll_fd, uint32_t ev);
+  /**
+   * \brief Change events the reactor waits for, EPOLLOUT of queued output is kept
+   */
+  int SetEvents(uint32_t ev);
+  /**
+   * \brief Remove socket from epoll and drop queued output
+   */
+  void Unwatch();
+
+  /**
+   * \brief Start server side TLS handshake, no messages are read until it is done
+   */
+  void StartTls(const TlsContext& ctx) { tls_ = std::make_unique<TlsSession>(ctx, socket_); }
+  void EndTls() { tls_.reset(); }
+  [[nodiscard]] TlsSession* Handshake() { return tls_.get(); }
+
+  /**
+   * \brief Message rate state, used by the reactor thread only
+   */
+  [[nodiscard]] RateBucket& Rate() { return rate_; }
+  /**
+   * \brief RateLimiter::UserKey() of the nickname registered on the connection, 0 if none
+   *
+   * Set by the processing thread, read by the reactor thread
+   */
+  void SetRateUser(uint64_t key) { rate_user_.store(key, std::memory_order_relaxed); }
+  [[nodiscard]] uint64_t RateUser() const { return rate_user_.load(std::memory_order_relaxed); }
+
+  /**
+   * \brief Nickname of the client, the key of the connection in clients of the server
+   *
+   * Set under the clients mutex of the server, never changed while the
+   * connection is in its clients.
+   */
+  [[nodiscard]] const std::string& GetNickname() const { return nickname_; }
+  [[nodiscard]] bool IsRegistered() const { return registered_; }
+  /**
+   * \return false if the nickname is too short or has control characters
+   */
+  bool Register(const std::string& nn);
+  void Unregister() { registered_ = false; }
+  /**
+   * \brief Public messages go to the multicast group instead of the connection
+   */
+  void SetMulticast(bool on) { multicast_ = on; }
+  [[nodiscard]] bool IsMulticast() const { return multicast_; }
 
   [[nodiscard]] int GetSocket() const { return socket_; }
   [[nodiscard]] uint32_t GetIP() const { return ip_; }
   [[nodiscard]] uint16_t GetPort() const { return port_; }
-  [[nodiscard]] ConnStatus& Status() { return status_; }
+  /**
+   * \brief Set by whichever thread sees the connection fail, only the reactor thread closes it
+   */
+  [[nodiscard]] ConnStatus Status() const { return status_.load(std::memory_order_relaxed); }
+  void SetStatus(ConnStatus s) { status_.store(s, std::memory_order_relaxed); }
+  /**
+   * \brief Unlike socket, never reused by another connection
+   */
+  [[nodiscard]] uint32_t GetId() const { return id_; }
+  /**
+   * \brief Handle in connection table, NO_CONN if not added
+   */
+  [[nodiscard]] ConnHandle GetHandle() const { return handle_; }
+
+  /**
+   * \brief Receive buffers of all connections
+   */
+  static const RecvBufferPool& RecvPool() { return recv_pool_; }
 
  private:
+  friend class ConnTable;
+
+  /* Largest fields first: tens of thousands of these stay alive */
+  ConnHandle handle_ = NO_CONN;
+  RateBucket rate_;
+  std::atomic<uint64_t> rate_user_{0};
+  std::unique_ptr<TlsSession> tls_;   /**< Set while TLS handshake is in progress */
+  /** Output the socket did not take yet */
+  struct SendQueue {
+    std::deque<frame_t> frames;
+    size_t off = 0;    /**< Sent bytes of frames.front() */
+    size_t bytes = 0;  /**< Unsent bytes of all frames */
+  };
+  std::mutex send_mtx_;                /**< Guards writes to socket, send_q_, epoll_fd_ and events_ */
+  std::unique_ptr<SendQueue> send_q_;  /**< Set only while output is queued */
+  std::string nickname_;               /**< Client state lives here, no object of its own per connection */
+  uint8_t* recv_data_ = nullptr;      /**< Partly received frame, from recv_pool_ */
+  int epoll_fd_ = -1;   /**< Watching the socket, -1 if none */
+  uint32_t events_ = 0; /**< Waited for by the reactor, EPOLLOUT of send_q_ aside */
   int socket_;
   uint32_t ip_;
+  uint32_t id_;
+  uint32_t recv_data_sz_;
+  uint16_t recv_cap_;
   uint16_t port_;
-  ConnStatus status_;
+  std::atomic<ConnStatus> status_;
+  bool registered_ = false;
+  bool multicast_ = false;
 
-  uint8_t* recv_data_;
-  uint32_t recv_data_sz_;
+  static std::atomic<uint32_t> next_id_;
+  static RecvBufferPool recv_pool_;
+
+  /**
+   * \return bytes read, 0 if none are ready, -1 if connection is closed or failed (status is set)
+   */
+  ssize_t RecvSome(uint8_t* dst, size_t len);
+  /**
+   * \brief Keep partly received frame until the rest of it arrives
+   */
+  void Stash(const uint8_t* data, size_t len, size_t frame_len);
+  void ReleaseRecvBuf();
+  /**
+   * \brief Wait for EPOLLOUT if output is queued, send_mtx_ must be held
+   */
+  int UpdateEvents();
+  /**
+   * \brief Log and set status of a failed send, errno 0 if client disconnected
+   */
+  void SendFailed(size_t sent);
+};
+
+static_assert(RECV_BUF_LARGE <= UINT16_MAX, "receive buffer size must fit Connection::recv_cap_");
+
+/**
+ * \brief Connections in a flat array indexed by socket
+ *
+ * Every slot has a generation that grows when a connection is added to
+ * it, so a handle outlives its connection safely: events and messages of
+ * a closed connection never reach the one that got its socket next.
+ * Connections are added and removed by the reactor thread only, Get()
+ * is safe from any thread and takes no lock.
+ */
+class ConnTable {
+ public:
+  /**
+   * Size is the open files limit, capped by MAX_CONN_SLOTS
+   */
+  ConnTable() noexcept;
+
+  /**
+   * \return handle of the connection, NO_CONN if its socket is over table size
+   */
+  ConnHandle Add(std::shared_ptr<Connection> conn);
+
+  /**
+   * \return the connection, nullptr if the handle is stale
+   */
+  std::shared_ptr<Connection> Remove(ConnHandle h);
+
+  /**
+   * \return the connection, nullptr if the handle is stale
+   */
+  [[nodiscard]] std::shared_ptr<Connection> Get(ConnHandle h) const;
+
+  void Clear();
+  [[nodiscard]] size_t Capacity() const { return slots_.size(); }
+  [[nodiscard]] size_t Bytes() const { return slots_.size() * sizeof(Slot); }
+
+ private:
+  struct Slot {
+    std::shared_ptr<Connection> conn;   /**< Accessed with atomic_load/atomic_store */
+    uint32_t gen = 0;                   /**< Generation of the last connection, reactor thread only */
+  };
+
+  std::vector<Slot> slots_;
 };
 
 } // namespace ptxchat
@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <nanogui/nanogui.h>
+
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "server.h"
+#include "Message.h"
+#include "Scrollback.h"
+#include "ScrollbackView.h"
+
+using nanogui::TextBox;
+using nanogui::FormHelper;
+using nanogui::Window;
+using nanogui::Screen;
+using nanogui::ref;
+using nanogui::GroupLayout;
+using nanogui::Widget;
+using nanogui::GridLayout;
+using nanogui::Label;
+using nanogui::Button;
+using nanogui::BoxLayout;
+
+using Eigen::Vector2i;
+
+using ptxchat::GuiEvType;
+using ptxchat::GuiEvent;
+using ptxchat::MAX_MSG_BUFFER_SIZE;
+using ptxchat::ChatScreen;
+using ptxchat::Scrollback;
+using ptxchat::ScrollbackView;
+using ptxchat::ServerObserver;
+
+static constexpr int h = 250;
+static constexpr int w = 300;
+static constexpr int box_w = w/2;
+static constexpr int box_add = 10;
+static constexpr int log_add = 50;
+static constexpr int log_lines = 5;
+
+/**
+ * Runs on UI thread once per frame: everything happened since
+ * the previous frame is appended at once
+ */
+void ProcessChatEvents(ServerObserver* observer, Scrollback* log) {
+  std::vector<GuiEvent> events;
+  observer->Poll(events, ptxchat::DEF_OBSERVER_RING_LEN);
+  for (auto& e : events) {
+    char text[MAX_MSG_BUFFER_SIZE + 2 * ptxchat::MAX_NICKNAME_LEN + 32];
+    switch (e.type) {
+      case GuiEvType::SRV_START:
+        snprintf(text, sizeof(text), "[SRV] start");
+        break;
+      case GuiEvType::SRV_STOP:
+        snprintf(text, sizeof(text), "[SRV] stop");
+        break;
+      case GuiEvType::CLIENT_REG:
+        snprintf(text, sizeof(text), "[REG] %s", e.msg->hdr.from);
+        break;
+      case GuiEvType::CLIENT_UNREG:
+        snprintf(text, sizeof(text), "[UNR] %s", e.msg->hdr.from);
+        break;
+      case GuiEvType::PUBLIC_MSG:
+        snprintf(text, sizeof(text), "[PUB] %s says: %.*s", e.msg->hdr.from,
+                 static_cast<int>(e.msg->hdr.buf_len), e.msg->buf);
+        break;
+      case GuiEvType::PRIVATE_MSG:
+        snprintf(text, sizeof(text), "[PRV] %s to %s", e.msg->hdr.from, e.msg->hdr.to);
+        break;
+      default:
+        continue;
+    }
+    log->Append(text);
+  }
+}
+
+int main(int /* argc */, char** /* argv */) {
+  nanogui::init();
+  {
+    /* Owned by UI thread, outlive the main loop */
+    Scrollback log;
+    ptxchat::PtxChatServer server;
+    server.SetStatusPort(ptxchat::DEF_STATUS_PORT);
+    auto observer = std::make_shared<ServerObserver>();
+    server.SetObserver(observer);
+    ChatScreen* screen = new ChatScreen({w, h}, "PTX Server", false);
+    Window *window = new Window(screen, "PTX Server Control Panel");
+    window->setPosition({0, 0});
+    window->setFixedSize({w, h});
+    window->setLayout(new BoxLayout(nanogui::Orientation::Horizontal, nanogui::Alignment::Middle, 0, 0));
+    auto set_wrapper = new Widget(window);
+    set_wrapper->setFixedSize({box_w, h});
+    set_wrapper->setLayout(new GroupLayout());
+
+    new Label(set_wrapper, "IP");
+
+    TextBox* ip_text = new TextBox(set_wrapper, "0.0.0.0");
+    ip_text->setFixedWidth(box_w/2 + box_add);
+    ip_text->setEditable(true);
+    ip_text->setCallback([&server](const std::string& ip){
+      return server.SetIP_s(ip);
+    });
+
+    new Label(set_wrapper, "Port");
+    TextBox* port_text = new TextBox(set_wrapper, "1488");
+    port_text->setFixedWidth(box_w/2 + box_add);
+    port_text->setEditable(true);
+    port_text->setCallback([&server](const std::string& port){
+      return server.SetPort_s(port);
+    });
+
+    Button* start_btn = new Button(set_wrapper, "Start server");
+    start_btn->setFixedWidth(box_w/2 + box_add);
+    start_btn->setCallback([&server]{
+      server.Start();
+    });
+    Button* stop_btn = new Button(set_wrapper, "Stop server");
+    stop_btn->setFixedWidth(box_w/2 + box_add);
+    stop_btn->setCallback([&server]{
+      server.Stop();
+    });
+
+    Widget* log_wrapper = new Widget(window);
+    log_wrapper->setFixedSize({w/2, h});
+    log_wrapper->setLayout(new GroupLayout());
+
+    new Label(log_wrapper, "Server Log");
+    auto log_view = new ScrollbackView(log_wrapper, &log, log_lines);
+    log_view->setFixedWidth(box_w/2 + 30);
+    screen->SetFrameCallback([observer, &log]{
+      ProcessChatEvents(observer.get(), &log);
+    });
+
+    screen->performLayout();
+    screen->setVisible(true);
+    nanogui::mainloop();
+  }
+  nanogui::shutdown();
+  return 0;
+}
@@ -0,0 +1,188 @@
+#include "history_cache.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace ptxchat {
+
+std::shared_ptr<HistoryCache::Ring> HistoryCache::GetRing(const std::string& key, bool create) {
+  std::unique_lock<std::mutex> lc(mtx_);
+  auto it = rings_.find(key);
+  if (it == rings_.end()) {
+    if (!create)
+      return nullptr;
+    auto r = std::make_shared<Ring>();
+    lru_.push_front(key);
+    r->lru = lru_.begin();
+    rings_.emplace(key, r);
+    return r;
+  }
+  auto r = it->second;
+  lru_.splice(lru_.begin(), lru_, r->lru);
+  return r;
+}
+
+void HistoryCache::PushFrame(Ring& r, uint64_t seq, frame_t f) {
+  size_t f_size = f->size();
+  r.frames.push_back(Entry{seq, std::move(f)});
+  r.size += f_size;
+  size_ += f_size;
+  ++frames_cnt_;
+  if (r.frames.size() > ring_len_) {
+    size_t old_size = r.frames.front().frame->size();
+    r.frames.pop_front();
+    r.size -= old_size;
+    size_ -= old_size;
+    --frames_cnt_;
+    r.complete = false;
+  }
+}
+
+void HistoryCache::Evict(const std::string& keep) {
+  if (size_ <= max_size_)
+    return;
+  std::unique_lock<std::mutex> lc(mtx_);
+  while (size_ > max_size_ && !lru_.empty() && lru_.back() != keep) {
+    RemoveRing(rings_.find(lru_.back()));
+    ++evictions_;
+  }
+}
+
+void HistoryCache::Drop(const std::string& key) {
+  std::unique_lock<std::mutex> lc(mtx_);
+  auto it = rings_.find(key);
+  if (it != rings_.end())
+    RemoveRing(it);
+}
+
+void HistoryCache::RemoveRing(std::unordered_map<std::string, std::shared_ptr<Ring>>::iterator it) {
+  auto r = it->second;
+  {
+    std::unique_lock<std::mutex> lc_r(r->mtx);
+    size_ -= r->size;
+    frames_cnt_ -= r->frames.size();
+    r->frames.clear();
+    r->size = 0;
+    r->warm = false;
+    r->evicted = true;
+  }
+  lru_.erase(r->lru);
+  rings_.erase(it);
+}
+
+void HistoryCache::Append(const std::string& key, const ChatMsg& msg) {
+  auto r = GetRing(key, false);
+  if (!r)
+    return;
+  {
+    std::unique_lock<std::mutex> lc(r->mtx);
+    if (!r->warm)
+      return;
+    if (!r->frames.empty() && r->frames.back().seq >= msg.hdr.seq)
+      return;
+    PushFrame(*r, msg.hdr.seq, EncodeFrame(msg));
+  }
+  Evict(key);
+}
+
+bool HistoryCache::Get(const std::string& key, uint64_t before, uint64_t after, uint32_t limit,
+                       const loader_t& load, std::vector<frame_t>& frames, bool& has_more) {
+  if (limit > ring_len_) {
+    ++misses_;
+    return false;
+  }
+
+  auto r = GetRing(key, true);
+  std::unique_lock<std::mutex> lc(r->mtx);
+  /*
+   * Ring evicted between lookup and lock would keep loaded frames out of
+   * rings_ while they stay counted in size_. Once the lock is held,
+   * eviction waits for it and accounts for whatever is loaded.
+   */
+  while (r->evicted) {
+    lc.unlock();
+    r = GetRing(key, true);
+    lc = std::unique_lock<std::mutex>(r->mtx);
+  }
+  /* A request that had to load a cold ring from storage is a miss */
+  bool loaded = false;
+  if (!r->warm) {
+    std::vector<std::shared_ptr<ChatMsg>> page;
+    if (!load(static_cast<uint32_t>(ring_len_), page)) {
+      ++misses_;
+      return false;
+    }
+    for (auto& m : page)
+      PushFrame(*r, m->hdr.seq, EncodeFrame(*m));
+    r->warm = true;
+    r->complete = page.size() < ring_len_;
+    loaded = true;
+  }
+
+  auto by_seq = [](const Entry& e, uint64_t s) { return e.seq < s; };
+  auto& f = r->frames;
+  size_t first = std::lower_bound(f.begin(), f.end(), after + 1, by_seq) - f.begin();
+  size_t end = before ? std::lower_bound(f.begin(), f.end(), before, by_seq) - f.begin() : f.size();
+  if (end < first)
+    end = first;
+  size_t begin = end - first > limit ? end - limit : first;
+
+  /*
+   * The ring holds every message since its oldest one, so the page is
+   * right unless it starts at the ring start and may continue before it
+   */
+  uint64_t oldest = f.empty() ? 0 : f.front().seq;
+  bool reaches_start = begin == 0 && !r->complete && !f.empty() && oldest > after + 1;
+  if (reaches_start && end - begin < limit) {
+    ++misses_;
+    return false;
+  }
+
+  frames.clear();
+  for (size_t i = begin; i < end; ++i)
+    frames.push_back(f[i].frame);
+  has_more = begin > first || reaches_start;
+  lc.unlock();
+
+  if (loaded)
+    ++misses_;
+  else
+    ++hits_;
+  Evict(key);
+  return true;
+}
+
+bool HistoryCache::Warm(const std::string& key, const loader_t& load) {
+  std::vector<frame_t> frames;
+  bool has_more;
+  return Get(key, 0, 0, 0, load, frames, has_more);
+}
+
+void HistoryCache::Clear() {
+  std::unique_lock<std::mutex> lc(mtx_);
+  for (auto& it : rings_) {
+    std::unique_lock<std::mutex> lc_r(it.second->mtx);
+    it.second->frames.clear();
+    it.second->size = 0;
+    it.second->warm = false;
+    it.second->evicted = true;
+  }
+  rings_.clear();
+  lru_.clear();
+  size_ = 0;
+  frames_cnt_ = 0;
+}
+
+HistoryCacheStats HistoryCache::GetStats() const {
+  HistoryCacheStats s;
+  s.hits = hits_;
+  s.misses = misses_;
+  s.evictions = evictions_;
+  s.bytes = size_;
+  s.frames = frames_cnt_;
+  std::unique_lock<std::mutex> lc(mtx_);
+  s.rings = rings_.size();
+  return s;
+}
+
+}  // namespace ptxchat
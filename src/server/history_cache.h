@@ -0,0 +1,131 @@
+#ifndef SERVER_HISTORY_CACHE_H_
+#define SERVER_HISTORY_CACHE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Message.h"
+#include "Frame.h"
+
+namespace ptxchat {
+
+static constexpr size_t DEF_HISTORY_RING_LEN =    500;
+static constexpr size_t DEF_HISTORY_CACHE_SIZE =  64 * 1024 * 1024;
+
+struct HistoryCacheStats {
+  uint64_t hits;       /**< Requests answered from memory only */
+  uint64_t misses;     /**< Requests that had to read storage */
+  uint64_t evictions;  /**< Rings dropped to fit the memory cap */
+  uint64_t bytes;      /**< Bytes of frames held by all rings */
+  uint64_t frames;     /**< Frames held by all rings */
+  uint64_t rings;      /**< Conversations held in memory */
+};
+
+/**
+ * \brief Recent history of every conversation as encoded frames
+ *
+ * Each conversation (the public chat or a pair of clients) gets a ring of
+ * its last ring_len messages, loaded from storage on the first request and
+ * appended on every delivered message. Rings of the least recently used
+ * conversations are dropped when all rings together exceed max_size bytes.
+ */
+class HistoryCache {
+ public:
+  /**
+   * Load newest limit messages of a conversation, oldest first.
+   * Returns false if storage is not available.
+   */
+  typedef std::function<bool(uint32_t limit, std::vector<std::shared_ptr<ChatMsg>>& page)> loader_t;
+
+  explicit HistoryCache(size_t ring_len = DEF_HISTORY_RING_LEN,
+                        size_t max_size = DEF_HISTORY_CACHE_SIZE) noexcept:
+    ring_len_(ring_len),
+    max_size_(max_size) {}
+
+  /**
+   * \brief Add delivered message to the ring of conversation
+   *
+   * Does nothing if the ring was not loaded yet: the message
+   * will be read from storage with the rest of history.
+   */
+  void Append(const std::string& key, const ChatMsg& msg);
+
+  /**
+   * \brief Get a page of recent history
+   * \param before exclusive upper bound of sequence number, 0 for the newest
+   * \param after exclusive lower bound of sequence number
+   * \param limit max amount of messages in the page
+   * \param load reads the ring from storage when conversation is not in memory
+   * \param frames receives page frames, oldest first
+   * \param has_more receives true if older messages exist in the range
+   * \return false if the page is older than the ring holds
+   */
+  bool Get(const std::string& key, uint64_t before, uint64_t after, uint32_t limit, const loader_t& load,
+           std::vector<frame_t>& frames, bool& has_more);
+
+  /**
+   * \brief Load the ring of conversation ahead of requests
+   * \return false if storage is not available
+   */
+  bool Warm(const std::string& key, const loader_t& load);
+
+  /**
+   * \brief Drop the ring of conversation, next request loads it from storage
+   */
+  void Drop(const std::string& key);
+
+  /**
+   * \brief Drop all rings
+   */
+  void Clear();
+
+  [[nodiscard]] HistoryCacheStats GetStats() const;
+
+ private:
+  struct Entry {
+    uint64_t seq;
+    frame_t frame;
+  };
+
+  struct Ring {
+    std::mutex mtx;
+    std::deque<Entry> frames;     /**< Ordered by sequence number */
+    std::atomic<size_t> size{0};  /**< Bytes of frames */
+    bool warm = false;            /**< Loaded from storage, receives appends */
+    bool complete = false;        /**< Holds whole conversation */
+    bool evicted = false;         /**< Removed from rings_, must not get frames */
+    std::list<std::string>::iterator lru;
+  };
+
+  const size_t ring_len_;
+  const size_t max_size_;
+
+  mutable std::mutex mtx_;  /**< Guards rings_ and lru_ */
+  std::unordered_map<std::string, std::shared_ptr<Ring>> rings_;
+  std::list<std::string> lru_;  /**< Most recently used first */
+
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+  std::atomic<uint64_t> evictions_{0};
+  std::atomic<uint64_t> size_{0};
+  std::atomic<uint64_t> frames_cnt_{0};
+
+  std::shared_ptr<Ring> GetRing(const std::string& key, bool create);
+  void PushFrame(Ring& r, uint64_t seq, frame_t f);
+  void Evict(const std::string& keep);
+  /** Caller holds mtx_ */
+  void RemoveRing(std::unordered_map<std::string, std::shared_ptr<Ring>>::iterator it);
+};
+
+}  // namespace ptxchat
+
+#endif  // SERVER_HISTORY_CACHE_H_
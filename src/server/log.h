@@ -1,10 +1,14 @@
 #ifndef SERVER_LOG_H_
 #define SERVER_LOG_H_
 
+#include <string.h>
+#include <unistd.h>
+
 #include <memory>
 #include <string>
 
 #include "spdlog/spdlog.h"
+#include "spdlog/sinks/rotating_file_sink.h"
 
 namespace ptxchat {
 
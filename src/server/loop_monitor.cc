@@ -0,0 +1,158 @@
+#include "loop_monitor.h"
+
+#include <errno.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "log.h"
+
+namespace ptxchat {
+
+/* Single slot filled by the stalled thread in its signal handler */
+static void* stall_stack[STALL_STACK_DEPTH];
+static std::atomic<int> stall_stack_depth{-1};
+
+static void TakeStack(int /* sig */) {
+  int saved = errno;
+  stall_stack_depth.store(backtrace(stall_stack, STALL_STACK_DEPTH), std::memory_order_release);
+  errno = saved;
+}
+
+static uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+LoopMonitor::LoopMonitor(const char* name, Histogram* iteration, Histogram* lag) noexcept:
+  name_(name),
+  iteration_(iteration),
+  lag_(lag),
+  thread_(),
+  stall_ns_(UINT64_MAX) {
+  SetStallThreshold(DEF_STALL_MS);
+}
+
+void LoopMonitor::Attach() {
+  std::lock_guard<std::mutex> lk(thread_mtx_);
+  thread_ = pthread_self();
+  attached_ = true;
+}
+
+void LoopMonitor::Detach() {
+  std::lock_guard<std::mutex> lk(thread_mtx_);
+  attached_ = false;
+}
+
+void LoopMonitor::Begin() {
+  handler_.store(nullptr, std::memory_order_relaxed);
+  iter_.store(iter_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  start_ns_.store(NowNs(), std::memory_order_release);
+}
+
+void LoopMonitor::End() {
+  uint64_t ns = NowNs() - start_ns_.load(std::memory_order_relaxed);
+  start_ns_.store(0, std::memory_order_release);
+  iteration_->Observe(ns / 1000);
+  if (ns < stall_ns_.load(std::memory_order_relaxed))
+    return;
+  stalls_.fetch_add(1, std::memory_order_relaxed);
+  /* Already logged with its stack while it was running */
+  if (!ClaimLog(iter_.load(std::memory_order_relaxed)))
+    return;
+  const char* handler = handler_.load(std::memory_order_relaxed);
+  logger_->log(spdlog::level::warn, std::string(name_) + " loop stalled for " + std::to_string(ns / 1000000) +
+               " ms in " + (handler ? handler : "loop body"));
+}
+
+StallDetector::StallDetector(uint32_t stall_ms) noexcept:
+  stall_ms_(stall_ms) {
+  /* First backtrace() loads libgcc, which is not safe in a signal handler */
+  void* warm[1];
+  backtrace(warm, 1);
+
+  struct sigaction sa{};
+  sa.sa_handler = TakeStack;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR2, &sa, nullptr);
+  watchdog_.stop = 1;
+}
+
+StallDetector::~StallDetector() {
+  Stop();
+}
+
+void StallDetector::Add(LoopMonitor* loop) {
+  loop->SetStallThreshold(stall_ms_);
+  loops_.push_back(loop);
+}
+
+void StallDetector::Start() {
+  if (!stall_ms_ || !watchdog_.stop)
+    return;
+  watchdog_.stop = 0;
+  watchdog_.thread = std::thread(&StallDetector::Watch, this);
+}
+
+void StallDetector::Stop() {
+  watchdog_.stop = 1;
+  if (watchdog_.thread.joinable())
+    watchdog_.thread.join();
+}
+
+void StallDetector::Watch() {
+  auto period = std::chrono::milliseconds(stall_ms_ > 1 ? stall_ms_ / 2 : 1);
+  while (!watchdog_.stop) {
+    std::this_thread::sleep_for(period);
+    for (LoopMonitor* loop : loops_) {
+      uint64_t start = loop->start_ns_.load(std::memory_order_acquire);
+      uint64_t iter = loop->iter_.load(std::memory_order_relaxed);
+      if (!start || iter == loop->logged_iter_.load(std::memory_order_acquire))
+        continue;
+      uint64_t now = NowNs();
+      if (now < start || now - start < loop->stall_ns_.load(std::memory_order_relaxed))
+        continue;
+      if (loop->ClaimLog(iter))
+        Report(loop, iter, now - start);
+    }
+  }
+}
+
+void StallDetector::Report(LoopMonitor* loop, uint64_t iter, uint64_t busy_ns) {
+  const char* handler = loop->handler_.load(std::memory_order_relaxed);
+  std::string msg = std::string(loop->name_) + " loop stalled for " + std::to_string(busy_ns / 1000000) +
+                    " ms in " + (handler ? handler : "loop body");
+
+  stall_stack_depth.store(-1, std::memory_order_relaxed);
+  {
+    /* pthread_t of a finished thread must not be used */
+    std::lock_guard<std::mutex> lk(loop->thread_mtx_);
+    if (!loop->attached_ || pthread_kill(loop->thread_, SIGUSR2) != 0) {
+      logger_->log(spdlog::level::warn, msg);
+      return;
+    }
+  }
+  int depth = -1;
+  for (int i = 0; i < STALL_STACK_WAIT_MS && (depth = stall_stack_depth.load(std::memory_order_acquire)) < 0; ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+  /* Stack of the next iteration would point at the wrong code */
+  if (depth <= 0 || loop->iter_.load(std::memory_order_relaxed) != iter ||
+      !loop->start_ns_.load(std::memory_order_acquire)) {
+    logger_->log(spdlog::level::warn, msg + ", ended before its stack was taken");
+    return;
+  }
+  char** symbols = backtrace_symbols(stall_stack, depth);
+  /* Frames 0-1 are the signal handler and the signal trampoline */
+  for (int i = 2; i < depth; ++i)
+    msg += "\n  #" + std::to_string(i - 2) + " " + (symbols ? symbols[i] : "?");
+  free(symbols);
+  logger_->log(spdlog::level::warn, msg);
+}
+
+}  // namespace ptxchat
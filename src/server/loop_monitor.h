@@ -0,0 +1,124 @@
+#ifndef SERVER_LOOP_MONITOR_H_
+#define SERVER_LOOP_MONITOR_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "metrics.h"
+#include "Threads.h"
+
+namespace ptxchat {
+
+constexpr uint32_t DEF_STALL_MS =      0;     /**< Stall detection is off unless asked for */
+constexpr size_t STALL_STACK_DEPTH =   32;
+constexpr int STALL_STACK_WAIT_MS =    100;   /**< ms to wait for the stalled thread to take its stack */
+
+/**
+ * Upper bounds of loop iteration and lag buckets, us
+ */
+inline const std::vector<uint64_t> LOOP_LATENCY_BOUNDS = {
+  10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000,
+};
+
+/**
+ * \brief Timing of one server loop thread
+ *
+ * The loop brackets every iteration with Begin() and End() and names
+ * each handler it calls with Enter(). Iteration time and lag (how long
+ * work waited before its handler ran) go to histograms; iterations over
+ * the stall threshold are counted and logged once with the last handler:
+ * by the StallDetector while they run, otherwise by End().
+ */
+class LoopMonitor {
+ public:
+  LoopMonitor(const char* name, Histogram* iteration, Histogram* lag) noexcept;
+
+  /**
+   * \brief Called by the loop thread before its first iteration
+   */
+  void Attach();
+
+  /**
+   * \brief Called by the loop thread before it exits, no signals after that
+   */
+  void Detach();
+
+  void Begin();
+  void Enter(const char* handler) { handler_.store(handler, std::memory_order_relaxed); }
+  void End();
+  void Lag(uint64_t us) { lag_->Observe(us); }
+
+  /**
+   * \param ms 0 disables stall logging
+   */
+  void SetStallThreshold(uint32_t ms) { stall_ns_.store(ms ? static_cast<uint64_t>(ms) * 1000000 : UINT64_MAX); }
+  [[nodiscard]] const char* Name() const { return name_; }
+  [[nodiscard]] uint64_t Stalls() const { return stalls_.load(std::memory_order_relaxed); }
+
+ private:
+  friend class StallDetector;
+
+  const char* name_;
+  Histogram* iteration_;
+  Histogram* lag_;
+  pthread_t thread_;
+  std::mutex thread_mtx_;                     /**< Keeps the thread attached while it is signalled */
+  bool attached_ = false;
+  std::atomic<uint64_t> stall_ns_;
+  std::atomic<uint64_t> start_ns_{0};         /**< 0 while the loop waits for work */
+  std::atomic<uint64_t> iter_{0};
+  std::atomic<const char*> handler_{nullptr};
+  std::atomic<uint64_t> stalls_{0};
+  std::atomic<uint64_t> logged_iter_{0};      /**< Last stalled iteration that was logged */
+
+  /**
+   * \return true if the caller is the first to log iteration iter
+   */
+  bool ClaimLog(uint64_t iter) { return logged_iter_.exchange(iter, std::memory_order_acq_rel) != iter; }
+};
+
+/**
+ * \brief Watchdog that takes the stack of a loop while it is stalled
+ *
+ * Checks the loops every half of their stall threshold. When an
+ * iteration runs over it, the loop thread is sent SIGUSR2 and records
+ * its own backtrace, which is logged with the running handler. Only one
+ * detector per process: the signal handler has a single stack slot.
+ * The handler is SA_RESTART, but sleeps and waits of a stalled thread
+ * may still end early with EINTR.
+ */
+class StallDetector {
+ public:
+  /**
+   * \param stall_ms 0 never starts the watchdog
+   */
+  explicit StallDetector(uint32_t stall_ms) noexcept;
+  ~StallDetector();
+
+  StallDetector(const StallDetector&) = delete;
+  StallDetector& operator=(const StallDetector&) = delete;
+
+  /**
+   * \brief Watch a loop, must be called before Start()
+   */
+  void Add(LoopMonitor* loop);
+  void Start();
+  void Stop();
+
+ private:
+  uint32_t stall_ms_;
+  std::vector<LoopMonitor*> loops_;
+  ThreadState watchdog_;
+
+  void Watch();
+  void Report(LoopMonitor* loop, uint64_t iter, uint64_t busy_ns);
+};
+
+}  // namespace ptxchat
+
+#endif  // SERVER_LOOP_MONITOR_H_
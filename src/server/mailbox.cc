@@ -0,0 +1,105 @@
+#include "mailbox.h"
+
+#include <utility>
+
+namespace ptxchat {
+
+void Mailboxes::Put(const std::string& nick, const ChatMsg& msg) {
+  frame_t frame = EncodeFrame(msg);
+  bool spill;
+  {
+    std::unique_lock<std::mutex> lc(mtx_);
+    auto& box = boxes_[nick];
+    box.push_back(frame);
+    ++depth_;
+    bytes_ += frame->size();
+    spill = box.size() > box_len_ || depth_ > total_len_ || bytes_ > max_bytes_;
+  }
+  if (spill)
+    Spill(nick);
+  if (bytes_ <= max_bytes_)
+    return;
+
+  /* Storage is down and memory is full */
+  std::unique_lock<std::mutex> lc(mtx_);
+  auto it = boxes_.find(nick);
+  if (it == boxes_.end() || it->second.empty() || it->second.back() != frame)
+    return;
+  it->second.pop_back();
+  --depth_;
+  bytes_ -= frame->size();
+  ++dropped_;
+  if (it->second.empty())
+    boxes_.erase(it);
+}
+
+void Mailboxes::Spill(const std::string& nick) {
+  std::vector<frame_t> frames;
+  {
+    std::unique_lock<std::mutex> lc(mtx_);
+    auto it = boxes_.find(nick);
+    if (it == boxes_.end())
+      return;
+    frames.assign(it->second.begin(), it->second.end());
+    boxes_.erase(it);
+  }
+  size_t bytes = 0;
+  for (auto& f : frames)
+    bytes += f->size();
+  if (storage_->AddMailboxFrames(nick, frames)) {
+    spilled_ += frames.size();
+    depth_ -= frames.size();
+    bytes_ -= bytes;
+    return;
+  }
+
+  /* Storage is down, keep the newest frames in memory, older than any put meanwhile */
+  std::unique_lock<std::mutex> lc(mtx_);
+  auto& box = boxes_[nick];
+  box.insert(box.begin(), frames.begin(), frames.end());
+  while (box.size() > MAX_MAILBOX_LEN) {
+    bytes_ -= box.front()->size();
+    box.pop_front();
+    --depth_;
+    ++dropped_;
+  }
+}
+
+std::vector<frame_t> Mailboxes::Take(const std::string& nick) {
+  /* Stored frames are older than the ones in memory */
+  std::vector<frame_t> frames = storage_->TakeMailboxFrames(nick);
+
+  std::unique_lock<std::mutex> lc(mtx_);
+  auto it = boxes_.find(nick);
+  if (it == boxes_.end())
+    return frames;
+  frames.insert(frames.end(), it->second.begin(), it->second.end());
+  depth_ -= it->second.size();
+  for (auto& f : it->second)
+    bytes_ -= f->size();
+  boxes_.erase(it);
+  return frames;
+}
+
+void Mailboxes::AddDelivery(size_t frames, uint64_t us) {
+  delivered_ += frames;
+  ++deliveries_;
+  delivery_us_ += us;
+  uint64_t max = max_delivery_us_;
+  while (us > max && !max_delivery_us_.compare_exchange_weak(max, us)) {}
+}
+
+MailboxStats Mailboxes::GetStats() const {
+  MailboxStats s;
+  s.depth = depth_;
+  s.bytes = bytes_;
+  s.spilled = spilled_;
+  s.dropped = dropped_;
+  s.delivered = delivered_;
+  s.deliveries = deliveries_;
+  s.delivery_us = delivery_us_;
+  s.max_delivery_us = max_delivery_us_;
+  return s;
+}
+
+}  // namespace ptxchat
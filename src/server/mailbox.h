@@ -0,0 +1,100 @@
+#ifndef SERVER_MAILBOX_H_
+#define SERVER_MAILBOX_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Message.h"
+#include "Frame.h"
+#include "server_storage.h"
+
+namespace ptxchat {
+
+static constexpr size_t DEF_MAILBOX_LEN =         64;      /**< Frames of one client kept in memory */
+static constexpr size_t DEF_MAILBOXES_TOTAL_LEN = 100000;  /**< Frames of all clients kept in memory */
+static constexpr size_t MAX_MAILBOX_LEN =         10000;   /**< Frames of one client if storage is down */
+static constexpr size_t DEF_MAILBOXES_MAX_BYTES = 64 << 20; /**< Frames of all clients in memory, hard cap */
+
+struct MailboxStats {
+  uint64_t depth;            /**< Frames waiting in memory */
+  uint64_t bytes;            /**< Size of frames waiting in memory */
+  uint64_t spilled;          /**< Frames moved to storage */
+  uint64_t dropped;          /**< Frames lost because storage was down */
+  uint64_t delivered;        /**< Frames delivered on login */
+  uint64_t deliveries;       /**< Logins with non-empty mailbox */
+  uint64_t delivery_us;      /**< Total time spent delivering */
+  uint64_t max_delivery_us;  /**< Longest delivery */
+};
+
+/**
+ * \brief Private messages of clients that are offline
+ *
+ * The newest messages of every client are kept in memory as encoded
+ * frames. When a mailbox or all of them grow too large, the frames of the
+ * client are moved to storage. On login everything is taken at once,
+ * older (stored) frames first, so it can be sent as one stream.
+ * Storage is never called under the lock. Over max_bytes in memory (when
+ * storage is down) new frames are dropped.
+ */
+class Mailboxes {
+ public:
+  explicit Mailboxes(ServerStorage* storage,
+                     size_t box_len = DEF_MAILBOX_LEN,
+                     size_t total_len = DEF_MAILBOXES_TOTAL_LEN,
+                     size_t max_bytes = DEF_MAILBOXES_MAX_BYTES) noexcept:
+    storage_(storage),
+    box_len_(box_len),
+    total_len_(total_len),
+    max_bytes_(max_bytes) {}
+
+  /**
+   * \brief Put message for offline client, the caller checks that the nickname exists
+   */
+  void Put(const std::string& nick, const ChatMsg& msg);
+
+  /**
+   * \brief Take all waiting messages of client
+   * \return Frames ordered from oldest to newest
+   */
+  std::vector<frame_t> Take(const std::string& nick);
+
+  /**
+   * \brief Account one delivery of frames taken by Take()
+   */
+  void AddDelivery(size_t frames, uint64_t us);
+
+  [[nodiscard]] MailboxStats GetStats() const;
+
+ private:
+  ServerStorage* storage_;
+  const size_t box_len_;
+  const size_t total_len_;
+  const size_t max_bytes_;
+
+  std::mutex mtx_;
+  std::unordered_map<std::string, std::deque<frame_t>> boxes_;
+
+  std::atomic<uint64_t> depth_{0};
+  std::atomic<uint64_t> bytes_{0};           /**< Size of frames in memory */
+  std::atomic<uint64_t> spilled_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> delivered_{0};
+  std::atomic<uint64_t> deliveries_{0};
+  std::atomic<uint64_t> delivery_us_{0};
+  std::atomic<uint64_t> max_delivery_us_{0};
+
+  /**
+   * \brief Move frames of nick to storage, called without the lock
+   */
+  void Spill(const std::string& nick);
+};
+
+}  // namespace ptxchat
+
+#endif  // SERVER_MAILBOX_H_
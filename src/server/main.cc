@@ -1,142 +1,223 @@
 #include <stdlib.h>
 #include <stdio.h>
-#include <unistd.h>
-#include <string.h>
-#include <nanogui/nanogui.h>
+#include <signal.h>
+#include <getopt.h>
 
-#include <thread>
 #include <iostream>
-#include <vector>
+#include <string>
 
 #include "server.h"
-#include "Message.h"
 
-static ptxchat::PtxChatServer server;
-
-using nanogui::TextBox;
-using nanogui::FormHelper;
-using nanogui::Window;
-using nanogui::Screen;
-using nanogui::ref;
-using nanogui::GroupLayout;
-using nanogui::Widget;
-using nanogui::VScrollPanel;
-using nanogui::GridLayout;
-using nanogui::Label;
-using nanogui::Button;
-using nanogui::BoxLayout;
-
-using Eigen::Vector2i;
-
-using ptxchat::GuiEvType;
-using ptxchat::GuiEvent;
-using ptxchat::MAX_MSG_BUFFER_SIZE;
-
-static constexpr int h = 250;
-static constexpr int w = 300;
-static constexpr int box_w = w/2;
-static constexpr int box_add = 10;
-static constexpr int log_add = 50;
-static constexpr int log_lines = 5;
+static void Usage(const char* name) {
+  std::cout << "Usage: " << name << " [options]\n"
+            << "  -a, --address IP       listen address (default 0.0.0.0)\n"
+            << "  -p, --port PORT        listen port (default 1488)\n"
+            << "  -q, --listen-queue N   listen queue length (default " << ptxchat::DEF_LISTEN_Q_LEN << ")\n"
+            << "  -s, --storage URI      MongoDB uri (default " << ptxchat::DEF_STORAGE_URI << ")\n"
+            << "  -n, --pool N           storage connections (default " << ptxchat::DEF_STORAGE_POOL_SIZE << ")\n"
+            << "  -m, --status-port PORT status endpoint port, 0 disables it (default "
+            << ptxchat::DEF_STATUS_PORT << ")\n"
+            << "  -t, --trace FILE       write sampled message traces in Chrome trace format\n"
+            << "  -T, --trace-sample N   trace one of N received messages (default "
+            << ptxchat::DEF_TRACE_SAMPLE << ")\n"
+            << "  -c, --capture FILE     record received messages for ptx-replay; the file holds private\n"
+            << "                         messages and resume tokens and is created with mode 0600\n"
+            << "  -L, --stall-ms MS      log loop stalls over MS with a stack (default 0, off); the stalled\n"
+            << "                         thread gets SIGUSR2, which may end its sleeps with EINTR\n"
+            << "  -C, --tls-cert FILE    accept only TLS connections with this PEM certificate chain\n"
+            << "  -K, --tls-key FILE     PEM private key of --tls-cert (needs the tls kernel module)\n"
+            << "  -r, --rate-conn R[:B]  limit every connection to R messages/s with bursts of B (default R)\n"
+            << "  -u, --rate-user R[:B]  limit every nickname to R messages/s over all its connections\n"
+            << "  -R, --rate-action A    over a limit: delay (stop reading), drop or disconnect (default drop)\n"
+            << "  -B, --ban N[:SECS]     refuse connections of an address for SECS (default 60) after\n"
+            << "                         N violations within " << ptxchat::RATE_BAN_WINDOW_S << " s\n"
+            << "  -M, --multicast G:PORT send public messages of joined clients once to UDP group G,\n"
+            << "                         in clear text (not with --tls-cert)\n"
+            << "  -I, --multicast-if IP  address of the multicast sending interface (default route)\n"
+            << "  -l, --multicast-ttl N  multicast hop limit (default " << ptxchat::DEF_MCAST_TTL << ")\n"
+            << "  -b, --sock-buf BYTES   fixed receive and send buffer size of client sockets, for many idle\n"
+            << "                         clients (default: kernel autotuning)\n";
+}
 
-void ProcessChatEvents(std::vector<TextBox*> log) {
-  while (1) {
-    char text[MAX_MSG_BUFFER_SIZE + 32];
-    std::unique_ptr<struct GuiEvent> e = server.PopGuiEvent();
-    // if (e->type == GuiEvType::Q_EMPTY)
-    //   break;
-    switch (e->type) {
-      case GuiEvType::Q_EMPTY:
+int main(int argc, char** argv) {
+  static const struct option opts[] = {
+    {"address",      required_argument, nullptr, 'a'},
+    {"port",         required_argument, nullptr, 'p'},
+    {"listen-queue", required_argument, nullptr, 'q'},
+    {"storage",      required_argument, nullptr, 's'},
+    {"pool",         required_argument, nullptr, 'n'},
+    {"status-port",  required_argument, nullptr, 'm'},
+    {"trace",        required_argument, nullptr, 't'},
+    {"trace-sample", required_argument, nullptr, 'T'},
+    {"capture",      required_argument, nullptr, 'c'},
+    {"stall-ms",     required_argument, nullptr, 'L'},
+    {"tls-cert",     required_argument, nullptr, 'C'},
+    {"tls-key",      required_argument, nullptr, 'K'},
+    {"rate-conn",    required_argument, nullptr, 'r'},
+    {"rate-user",    required_argument, nullptr, 'u'},
+    {"rate-action",  required_argument, nullptr, 'R'},
+    {"ban",          required_argument, nullptr, 'B'},
+    {"multicast",    required_argument, nullptr, 'M'},
+    {"multicast-if", required_argument, nullptr, 'I'},
+    {"multicast-ttl", required_argument, nullptr, 'l'},
+    {"sock-buf",     required_argument, nullptr, 'b'},
+    {"help",         no_argument,       nullptr, 'h'},
+    {nullptr,        0,                 nullptr, 0},
+  };
+
+  std::string ip = "0.0.0.0";
+  uint16_t port = 1488;
+  int listen_q = ptxchat::DEF_LISTEN_Q_LEN;
+  std::string storage_uri = ptxchat::DEF_STORAGE_URI;
+  size_t pool_size = ptxchat::DEF_STORAGE_POOL_SIZE;
+  int status_port = ptxchat::DEF_STATUS_PORT;
+  std::string trace_path;
+  uint32_t trace_sample = ptxchat::DEF_TRACE_SAMPLE;
+  std::string capture_path;
+  uint32_t stall_ms = ptxchat::DEF_STALL_MS;
+  std::string tls_cert;
+  std::string tls_key;
+  ptxchat::RateLimitConfig rate;
+  std::string mcast_group;
+  uint16_t mcast_port = 0;
+  std::string mcast_if;
+  int mcast_ttl = ptxchat::DEF_MCAST_TTL;
+  int sock_buf = 0;
+  int c;
+  while ((c = getopt_long(argc, argv, "a:p:q:s:n:m:t:T:c:L:C:K:r:u:R:B:M:I:l:b:h", opts, nullptr)) != -1) {
+    switch (c) {
+      case 'a':
+        ip = optarg;
+        break;
+      case 'p':
+        port = static_cast<uint16_t>(atoi(optarg));
+        break;
+      case 'q':
+        listen_q = atoi(optarg);
+        break;
+      case 's':
+        storage_uri = optarg;
+        break;
+      case 'n':
+        pool_size = strtoul(optarg, nullptr, 10);
+        break;
+      case 'm':
+        status_port = atoi(optarg);
+        break;
+      case 't':
+        trace_path = optarg;
+        break;
+      case 'T':
+        trace_sample = static_cast<uint32_t>(strtoul(optarg, nullptr, 10));
+        break;
+      case 'c':
+        capture_path = optarg;
+        break;
+      case 'L':
+        stall_ms = static_cast<uint32_t>(strtoul(optarg, nullptr, 10));
+        break;
+      case 'C':
+        tls_cert = optarg;
+        break;
+      case 'K':
+        tls_key = optarg;
+        break;
+      case 'r':
+        if (!ptxchat::ParseRate(optarg, rate.conn_rate, rate.conn_burst)) {
+          std::cout << "Error: bad rate " << optarg << std::endl;
+          return 1;
+        }
         break;
-      case GuiEvType::SRV_START:
-        snprintf(text, MAX_MSG_BUFFER_SIZE, "[SRV] start\n");
+      case 'u':
+        if (!ptxchat::ParseRate(optarg, rate.user_rate, rate.user_burst)) {
+          std::cout << "Error: bad rate " << optarg << std::endl;
+          return 1;
+        }
         break;
-      case GuiEvType::SRV_STOP:
-        snprintf(text, MAX_MSG_BUFFER_SIZE, "[SRV] stop\n");
+      case 'R':
+        if (!ptxchat::ParseLimitAction(optarg, rate.action)) {
+          std::cout << "Error: bad rate action " << optarg << std::endl;
+          return 1;
+        }
         break;
-      case GuiEvType::CLIENT_REG:
-        snprintf(text, MAX_MSG_BUFFER_SIZE, "[REG] %s\n", e->msg->hdr.from);
+      case 'B': {
+        char* end;
+        rate.ban_after = static_cast<uint32_t>(strtoul(optarg, &end, 10));
+        if (*end == ':')
+          rate.ban_secs = static_cast<uint32_t>(strtoul(end + 1, nullptr, 10));
         break;
-      case GuiEvType::CLIENT_UNREG:
-        snprintf(text, MAX_MSG_BUFFER_SIZE, "[UNR] %s\n", e->msg->hdr.from);
+      }
+      case 'M': {
+        std::string g = optarg;
+        size_t colon = g.rfind(':');
+        if (colon == std::string::npos) {
+          std::cout << "Error: multicast group needs a port: " << g << std::endl;
+          return 1;
+        }
+        mcast_group = g.substr(0, colon);
+        mcast_port = static_cast<uint16_t>(atoi(g.c_str() + colon + 1));
         break;
-      case GuiEvType::PUBLIC_MSG:
-        snprintf(text, MAX_MSG_BUFFER_SIZE, "[PUB] %s says: %s\n", e->msg->hdr.from, e->msg->buf);
+      }
+      case 'I':
+        mcast_if = optarg;
         break;
-      case GuiEvType::PRIVATE_MSG:
-        snprintf(text, MAX_MSG_BUFFER_SIZE, "[PRV] %s to %s\n", e->msg->hdr.from, e->msg->hdr.to);
+      case 'l':
+        mcast_ttl = atoi(optarg);
         break;
+      case 'b':
+        sock_buf = atoi(optarg);
+        break;
+      default:
+        Usage(argv[0]);
+        return c == 'h' ? 0 : 1;
     }
-
-    for (size_t i = log_lines - 1; i > 0; --i)
-      log[i]->setValue(log[i-1]->value());
-    log[0]->setValue(std::string(text));
   }
-}
-
-int main(int /* argc */, char** /* argv */) {
-  nanogui::init();
-  {
-    Screen* screen = new Screen({w, h}, "PTX Server", false);
-    Window *window = new Window(screen, "PTX Server Control Panel");
-    window->setPosition({0, 0});
-    window->setFixedSize({w, h});
-    window->setLayout(new BoxLayout(nanogui::Orientation::Horizontal, nanogui::Alignment::Middle, 0, 0));
-    auto set_wrapper = new Widget(window);
-    set_wrapper->setFixedSize({box_w, h});
-    set_wrapper->setLayout(new GroupLayout());
-
-    new Label(set_wrapper, "IP");
-
-    TextBox* ip_text = new TextBox(set_wrapper, "0.0.0.0");
-    ip_text->setFixedWidth(box_w/2 + box_add);
-    ip_text->setEditable(true);
-    ip_text->setCallback([](const std::string& ip){
-      return server.SetIP_s(ip);
-    });
-
-    new Label(set_wrapper, "Port");
-    TextBox* port_text = new TextBox(set_wrapper, "1488");
-    port_text->setFixedWidth(box_w/2 + box_add);
-    port_text->setEditable(true);
-    port_text->setCallback([](const std::string& port){
-      return server.SetPort_s(port);
-    });
-
-    Button* start_btn = new Button(set_wrapper, "Start server");
-    start_btn->setFixedWidth(box_w/2 + box_add);
-    start_btn->setCallback([]{
-      server.Start();
-    });
-    Button* stop_btn = new Button(set_wrapper, "Stop server");
-    stop_btn->setFixedWidth(box_w/2 + box_add);
-    stop_btn->setCallback([]{
-      server.Stop();
-    });
 
-    Widget* log_wrapper = new Widget(window);
-    auto v = new VScrollPanel(window);
-    v->setFixedSize({w/2, h});
-    log_wrapper->setFixedSize({w/2, h});
-    log_wrapper->setLayout(new GroupLayout());
-
-    new Label(log_wrapper, "Server Log");
-    std::vector<TextBox*> log;
-    for (int i = 0; i < log_lines; ++i) {
-      TextBox* t = new TextBox(log_wrapper, "");
-      t->setEnabled(true);
-      t->setAlignment(TextBox::Alignment::Left);
-      t->setSpinnable(false);
-      t->setFixedWidth(box_w/2 + 30);
-      log.push_back(t);
-    }
-    std::thread chat_thread(ProcessChatEvents, log);
-    chat_thread.detach();
-
-    screen->performLayout();
-    screen->setVisible(true);
-    nanogui::mainloop();
+  /* Signals are taken by sigwait() below, threads inherit the mask */
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+
+  ptxchat::PtxChatServer server(ip, port);
+  server.SetListenQueueSize(listen_q);
+  if (storage_uri != ptxchat::DEF_STORAGE_URI || pool_size != ptxchat::DEF_STORAGE_POOL_SIZE)
+    server.SetStorageOptions(storage_uri, pool_size);
+  if (status_port && !server.SetStatusPort(static_cast<uint16_t>(status_port))) {
+    std::cout << "Error: cannot bind status port " << status_port << std::endl;
+    return 1;
+  }
+  if (!trace_path.empty() && !server.SetTraceOptions(trace_path, trace_sample)) {
+    std::cout << "Error: cannot trace to " << trace_path << std::endl;
+    return 1;
+  }
+  if (!capture_path.empty() && !server.SetCaptureOptions(capture_path)) {
+    std::cout << "Error: cannot capture to " << capture_path << std::endl;
+    return 1;
+  }
+  if ((!tls_cert.empty() || !tls_key.empty()) && !mcast_group.empty()) {
+    std::cout << "Error: --multicast sends public messages in clear text, it cannot be used with TLS" << std::endl;
+    return 1;
+  }
+  if ((!tls_cert.empty() || !tls_key.empty()) && !server.SetTlsOptions(tls_cert, tls_key.empty() ? tls_cert : tls_key)) {
+    std::cout << "Error: cannot use TLS, see ptx_server.log" << std::endl;
+    return 1;
+  }
+  server.SetRateLimitOptions(rate);
+  if (!mcast_group.empty() && !server.SetMulticastOptions(mcast_group, mcast_port, mcast_if, mcast_ttl)) {
+    std::cout << "Error: cannot send to multicast group " << mcast_group << ", see ptx_server.log" << std::endl;
+    return 1;
   }
-  nanogui::shutdown();
+  server.SetSocketBufferSize(sock_buf);
+  server.SetStallThreshold(stall_ms);
+  server.Start();
+  std::cout << "ptx-server listening on " << ip << ":" << port << std::endl;
+
+  int sig = 0;
+  sigwait(&sigs, &sig);
+  std::cout << "Stopping on signal " << sig << std::endl;
+  server.Stop();
   return 0;
 }
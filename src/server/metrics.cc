@@ -0,0 +1,114 @@
+#include "metrics.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+namespace ptxchat {
+
+size_t Counter::ShardIndex() {
+  static std::atomic<size_t> next{0};
+  static thread_local size_t idx = next.fetch_add(1, std::memory_order_relaxed) % METRIC_SHARDS;
+  return idx;
+}
+
+uint64_t Counter::Value() const {
+  uint64_t v = 0;
+  for (auto& s : shards_)
+    v += s.v.load(std::memory_order_relaxed);
+  return v;
+}
+
+Histogram::Histogram(const std::vector<uint64_t>& bounds):
+  bounds_(bounds),
+  buckets_(std::make_unique<std::atomic<uint64_t>[]>(bounds.size() + 1)) {
+  std::sort(bounds_.begin(), bounds_.end());
+  for (size_t i = 0; i <= bounds_.size(); ++i)
+    buckets_[i].store(0, std::memory_order_relaxed);
+}
+
+void Histogram::Observe(uint64_t us) {
+  size_t i = static_cast<size_t>(std::lower_bound(bounds_.begin(), bounds_.end(), us) - bounds_.begin());
+  buckets_[i].fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(us, std::memory_order_relaxed);
+}
+
+MetricsRegistry::Series& MetricsRegistry::AddSeries(const std::string& name, const std::string& help,
+                                                    const char* type, const std::string& labels) {
+  auto f = std::find_if(families_.begin(), families_.end(), [&name](const Family& v) { return v.name == name; });
+  if (f == families_.end()) {
+    families_.push_back(Family{name, help, type, {}});
+    f = families_.end() - 1;
+  }
+  f->series.emplace_back();
+  f->series.back().labels = labels;
+  return f->series.back();
+}
+
+Counter* MetricsRegistry::AddCounter(const std::string& name, const std::string& help, const std::string& labels) {
+  auto& s = AddSeries(name, help, "counter", labels);
+  s.counter = std::make_unique<Counter>();
+  return s.counter.get();
+}
+
+void MetricsRegistry::AddCounter(const std::string& name, const std::string& help, value_fn_t fn,
+                                 const std::string& labels) {
+  AddSeries(name, help, "counter", labels).fn = std::move(fn);
+}
+
+void MetricsRegistry::AddGauge(const std::string& name, const std::string& help, value_fn_t fn,
+                               const std::string& labels) {
+  AddSeries(name, help, "gauge", labels).fn = std::move(fn);
+}
+
+Histogram* MetricsRegistry::AddHistogram(const std::string& name, const std::string& help,
+                                         const std::vector<uint64_t>& bounds, const std::string& labels) {
+  auto& s = AddSeries(name, help, "histogram", labels);
+  s.histogram = std::make_unique<Histogram>(bounds);
+  return s.histogram.get();
+}
+
+static std::string Labels(const std::string& labels, const std::string& extra = "") {
+  if (labels.empty() && extra.empty())
+    return "";
+  if (labels.empty() || extra.empty())
+    return "{" + labels + extra + "}";
+  return "{" + labels + "," + extra + "}";
+}
+
+static std::string Number(double v, const char* fmt = "%.17g") {
+  char buf[32];
+  snprintf(buf, sizeof(buf), fmt, v);
+  return buf;
+}
+
+void MetricsRegistry::Render(std::string& out) const {
+  for (auto& f : families_) {
+    out += "# HELP " + f.name + " " + f.help + "\n";
+    out += "# TYPE " + f.name + " " + f.type + "\n";
+    for (auto& s : f.series) {
+      if (s.counter) {
+        out += f.name + Labels(s.labels) + " " + std::to_string(s.counter->Value()) + "\n";
+        continue;
+      }
+      if (s.fn) {
+        out += f.name + Labels(s.labels) + " " + Number(s.fn()) + "\n";
+        continue;
+      }
+      /* Buckets are cumulative, bounds are converted to seconds */
+      const Histogram& h = *s.histogram;
+      uint64_t cnt = 0;
+      for (size_t i = 0; i < h.Bounds().size(); ++i) {
+        cnt += h.Bucket(i);
+        out += f.name + "_bucket" + Labels(s.labels, "le=\"" + Number(static_cast<double>(h.Bounds()[i]) / 1e6, "%g") + "\"") +
+               " " + std::to_string(cnt) + "\n";
+      }
+      cnt += h.Bucket(h.Bounds().size());
+      out += f.name + "_bucket" + Labels(s.labels, "le=\"+Inf\"") + " " + std::to_string(cnt) + "\n";
+      out += f.name + "_sum" + Labels(s.labels) + " " + Number(static_cast<double>(h.Sum()) / 1e6) + "\n";
+      out += f.name + "_count" + Labels(s.labels) + " " + std::to_string(cnt) + "\n";
+    }
+  }
+}
+
+}  // namespace ptxchat
@@ -0,0 +1,110 @@
+#ifndef SERVER_METRICS_H_
+#define SERVER_METRICS_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace ptxchat {
+
+static constexpr size_t METRIC_SHARDS = 16;
+
+/**
+ * Upper bounds of latency buckets, us
+ */
+inline const std::vector<uint64_t> DEF_LATENCY_BOUNDS = {
+  50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000,
+};
+
+/**
+ * \brief Monotonic counter, cheap to bump from many threads
+ *
+ * Every thread adds to its own cache line, shards are summed on scrape.
+ */
+class Counter {
+ public:
+  void Add(uint64_t n = 1) { shards_[ShardIndex()].v.fetch_add(n, std::memory_order_relaxed); }
+  [[nodiscard]] uint64_t Value() const;
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> v{0};
+  };
+  Shard shards_[METRIC_SHARDS];
+
+  static size_t ShardIndex();
+};
+
+/**
+ * \brief Lock-free histogram of microseconds with fixed buckets
+ */
+class Histogram {
+ public:
+  explicit Histogram(const std::vector<uint64_t>& bounds);
+
+  void Observe(uint64_t us);
+
+  [[nodiscard]] const std::vector<uint64_t>& Bounds() const { return bounds_; }
+  /**
+   * \brief Samples of bucket i, the last one is above every bound
+   */
+  [[nodiscard]] uint64_t Bucket(size_t i) const { return buckets_[i].load(std::memory_order_relaxed); }
+  [[nodiscard]] uint64_t Sum() const { return sum_.load(std::memory_order_relaxed); }
+
+ private:
+  std::vector<uint64_t> bounds_;
+  std::unique_ptr<std::atomic<uint64_t>[]> buckets_;
+  std::atomic<uint64_t> sum_{0};
+};
+
+/**
+ * \brief Named metrics rendered in Prometheus text format
+ *
+ * Metrics are added before the server starts and live as long as the
+ * registry. Series of one name differ by labels, e.g. "type=\"public\"",
+ * help of the first series is used for all of them. Callback metrics
+ * read existing stats only when scraped.
+ */
+class MetricsRegistry {
+ public:
+  typedef std::function<double()> value_fn_t;
+
+  Counter* AddCounter(const std::string& name, const std::string& help, const std::string& labels = "");
+  void AddCounter(const std::string& name, const std::string& help, value_fn_t fn, const std::string& labels = "");
+  void AddGauge(const std::string& name, const std::string& help, value_fn_t fn, const std::string& labels = "");
+  /**
+   * \brief Histogram of microseconds, exported in seconds
+   */
+  Histogram* AddHistogram(const std::string& name, const std::string& help,
+                          const std::vector<uint64_t>& bounds = DEF_LATENCY_BOUNDS, const std::string& labels = "");
+
+  /**
+   * \brief Append every metric to out, may be called from any thread
+   */
+  void Render(std::string& out) const;
+
+ private:
+  struct Series {
+    std::string labels;
+    std::unique_ptr<Counter> counter;
+    std::unique_ptr<Histogram> histogram;
+    value_fn_t fn;
+  };
+  struct Family {
+    std::string name;
+    std::string help;
+    const char* type;
+    std::vector<Series> series;
+  };
+  std::vector<Family> families_;
+
+  Series& AddSeries(const std::string& name, const std::string& help, const char* type, const std::string& labels);
+};
+
+}  // namespace ptxchat
+
+#endif  // SERVER_METRICS_H_
@@ -0,0 +1,102 @@
+#include "multicast.h"
+
+#include <sys/socket.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+
+namespace ptxchat {
+
+static uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+MulticastSender::MulticastSender(uint32_t group, uint16_t port, uint32_t iface, int ttl) noexcept:
+  fd_(socket(AF_INET, SOCK_DGRAM, 0)),
+  group_{} {
+  if (fd_ < 0)
+    return;
+  group_.sin_family = AF_INET;
+  group_.sin_addr.s_addr = group;
+  group_.sin_port = htons(port);
+
+  in_addr if_addr{};
+  if_addr.s_addr = iface;
+  unsigned char mttl = static_cast<unsigned char>(ttl);
+  /* Receivers on this host (and loopback tests) get the datagrams too */
+  unsigned char loop = 1;
+  if (setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_IF, &if_addr, sizeof(if_addr)) < 0 ||
+      setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_TTL, &mttl, sizeof(mttl)) < 0 ||
+      setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0) {
+    close(fd_);
+    fd_ = -1;
+    return;
+  }
+  heartbeat_.stop = 0;
+  heartbeat_.thread = std::thread(&MulticastSender::Heartbeat, this);
+}
+
+MulticastSender::~MulticastSender() {
+  if (fd_ < 0)
+    return;
+  heartbeat_.stop = 1;
+  if (heartbeat_.thread.joinable())
+    heartbeat_.thread.join();
+  close(fd_);
+}
+
+void MulticastSender::Send(const std::vector<frame_t>& frames, uint64_t last_seq) {
+  uint8_t dgram[MCAST_MAX_DATAGRAM];
+  size_t len = 0;
+  for (auto& f : frames) {
+    if (len + f->size() > sizeof(dgram)) {
+      SendDatagram(dgram, len);
+      len = 0;
+    }
+    /* Frames are smaller than a datagram */
+    memcpy(dgram + len, f->data(), f->size());
+    len += f->size();
+  }
+  if (len)
+    SendDatagram(dgram, len);
+  last_seq_.store(last_seq, std::memory_order_relaxed);
+  last_send_ns_.store(NowNs(), std::memory_order_relaxed);
+}
+
+McastInfo MulticastSender::Info() const {
+  McastInfo info{};
+  info.group = group_.sin_addr.s_addr;
+  info.port = ntohs(group_.sin_port);
+  info.last_seq = last_seq_.load(std::memory_order_relaxed);
+  return info;
+}
+
+void MulticastSender::SendDatagram(const uint8_t* data, size_t len) {
+  if (sendto(fd_, data, len, 0, reinterpret_cast<const sockaddr*>(&group_), sizeof(group_)) < 0) {
+    errors_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  datagrams_.fetch_add(1, std::memory_order_relaxed);
+  bytes_.fetch_add(len, std::memory_order_relaxed);
+}
+
+void MulticastSender::Heartbeat() {
+  ChatMsg msg;
+  msg.hdr = ChatMsgHdr{MsgType::MCAST_INFO, 0, 0, "ChatServer", "", sizeof(McastInfo), 0, 0};
+  msg.buf = reinterpret_cast<uint8_t*>(malloc(sizeof(McastInfo)));
+  const uint64_t period_ns = static_cast<uint64_t>(MCAST_HEARTBEAT_MS) * 1000000;
+  while (!heartbeat_.stop) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(MCAST_HEARTBEAT_MS));
+    if (NowNs() - last_send_ns_.load(std::memory_order_relaxed) < period_ns)
+      continue;
+    McastInfo info = Info();
+    memcpy(msg.buf, &info, sizeof(info));
+    frame_t f = EncodeFrame(msg);
+    SendDatagram(f->data(), f->size());
+  }
+}
+
+}  // namespace ptxchat
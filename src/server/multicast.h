@@ -0,0 +1,72 @@
+#ifndef SERVER_MULTICAST_H_
+#define SERVER_MULTICAST_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <atomic>
+#include <vector>
+
+#include "Message.h"
+#include "Frame.h"
+#include "Threads.h"
+
+namespace ptxchat {
+
+constexpr size_t MCAST_MAX_DATAGRAM =  1472;  /**< UDP payload that fits Ethernet MTU */
+constexpr int MCAST_HEARTBEAT_MS =     200;   /**< Heartbeat period while group is idle */
+constexpr int DEF_MCAST_TTL =          1;     /**< Stays in the local subnet */
+
+/**
+ * \brief Sends public messages once to a UDP multicast group
+ *
+ * Frames are packed back to back into datagrams. Send() is called by
+ * the processing thread, a heartbeat thread announces the last sequence
+ * number while nothing is sent, so loss of the last messages is noticed.
+ */
+class MulticastSender {
+ public:
+  /**
+   * \param group IPv4 group address, network order
+   * \param port UDP port, host order
+   * \param iface address of sending interface, network order, INADDR_ANY for default route
+   */
+  MulticastSender(uint32_t group, uint16_t port, uint32_t iface, int ttl = DEF_MCAST_TTL) noexcept;
+  ~MulticastSender();
+
+  MulticastSender(const MulticastSender&) = delete;
+  MulticastSender& operator=(const MulticastSender&) = delete;
+
+  [[nodiscard]] bool IsOpen() const { return fd_ >= 0; }
+
+  /**
+   * \param last_seq public sequence number of the last frame
+   */
+  void Send(const std::vector<frame_t>& frames, uint64_t last_seq);
+
+  /**
+   * \brief Group address and last sent sequence number, as sent to joining clients
+   */
+  [[nodiscard]] McastInfo Info() const;
+
+  [[nodiscard]] uint64_t Datagrams() const { return datagrams_.load(std::memory_order_relaxed); }
+  [[nodiscard]] uint64_t Bytes() const { return bytes_.load(std::memory_order_relaxed); }
+  [[nodiscard]] uint64_t Errors() const { return errors_.load(std::memory_order_relaxed); }
+
+ private:
+  int fd_;
+  sockaddr_in group_;
+  std::atomic<uint64_t> last_seq_{0};
+  std::atomic<uint64_t> last_send_ns_{0};
+  std::atomic<uint64_t> datagrams_{0};
+  std::atomic<uint64_t> bytes_{0};
+  std::atomic<uint64_t> errors_{0};
+  ThreadState heartbeat_;
+
+  void SendDatagram(const uint8_t* data, size_t len);
+  void Heartbeat();
+};
+
+}  // namespace ptxchat
+
+#endif  // SERVER_MULTICAST_H_
@@ -0,0 +1,47 @@
+#include "observer.h"
+
+#include <utility>
+
+namespace ptxchat {
+
+ServerObserver::ServerObserver(uint32_t sample_every, size_t ring_len) noexcept:
+  sample_every_(sample_every ? sample_every : 1),
+  ring_(ring_len) {
+
+}
+
+void ServerObserver::Notify(GuiEvType t, const std::shared_ptr<ChatMsg>& msg) {
+  bool is_msg = t == GuiEvType::PUBLIC_MSG || t == GuiEvType::PRIVATE_MSG;
+  if (is_msg && msg_cnt_.fetch_add(1, std::memory_order_relaxed) % sample_every_) {
+    sampled_out_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  if (!ring_.Push(Event{t, msg})) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  observed_.fetch_add(1, std::memory_order_relaxed);
+}
+
+size_t ServerObserver::Poll(std::vector<GuiEvent>& out, size_t max) {
+  size_t n = 0;
+  Event e;
+  while (n < max && ring_.Pop(e)) {
+    GuiEvent ge;
+    ge.type = e.type;
+    ge.msg = std::move(e.msg);
+    out.push_back(std::move(ge));
+    ++n;
+  }
+  return n;
+}
+
+ObserverStats ServerObserver::GetStats() const {
+  return ObserverStats{
+    observed_.load(std::memory_order_relaxed),
+    sampled_out_.load(std::memory_order_relaxed),
+    dropped_.load(std::memory_order_relaxed),
+  };
+}
+
+}  // namespace ptxchat
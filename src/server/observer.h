@@ -0,0 +1,65 @@
+#ifndef SERVER_OBSERVER_H_
+#define SERVER_OBSERVER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "Message.h"
+#include "BoundedRing.h"
+
+namespace ptxchat {
+
+constexpr size_t DEF_OBSERVER_RING_LEN = 4096;
+constexpr uint32_t DEF_OBSERVER_SAMPLE = 1;   /**< Every message is observed */
+
+struct ObserverStats {
+  uint64_t observed;      /**< Events put to the ring */
+  uint64_t sampled_out;   /**< Message events skipped by sampling */
+  uint64_t dropped;       /**< Events lost because the ring was full */
+};
+
+/**
+ * \brief Optional tap on server events for a control panel
+ *
+ * Server threads never wait on it: events go to a lock-free ring and
+ * are dropped when the consumer falls behind. Only every n-th message
+ * event is taken; start, stop and (un)registration events always are.
+ */
+class ServerObserver {
+ public:
+  explicit ServerObserver(uint32_t sample_every = DEF_OBSERVER_SAMPLE,
+                          size_t ring_len = DEF_OBSERVER_RING_LEN) noexcept;
+
+  /**
+   * \brief Called by server threads
+   */
+  void Notify(GuiEvType t, const std::shared_ptr<ChatMsg>& msg);
+
+  /**
+   * \brief Move up to max pending events to out, called by the consumer
+   * \return Amount of moved events
+   */
+  size_t Poll(std::vector<GuiEvent>& out, size_t max);
+
+  [[nodiscard]] ObserverStats GetStats() const;
+
+ private:
+  struct Event {
+    GuiEvType type;
+    std::shared_ptr<ChatMsg> msg;
+  };
+
+  uint32_t sample_every_;
+  BoundedRing<Event> ring_;
+  std::atomic<uint64_t> msg_cnt_{0};
+  std::atomic<uint64_t> observed_{0};
+  std::atomic<uint64_t> sampled_out_{0};
+  std::atomic<uint64_t> dropped_{0};
+};
+
+}  // namespace ptxchat
+
+#endif  // SERVER_OBSERVER_H_
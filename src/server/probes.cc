@@ -0,0 +1,13 @@
+#include "probes.h"
+
+#ifdef PTXCHAT_USDT
+
+/* Tracers increment a semaphore while they are attached to its probe */
+#define PTX_PROBE_DEFINE(name) \
+  __attribute__((section(".probes"))) volatile unsigned short PTX_PROBE_SEMAPHORE(name) = 0;
+extern "C" {
+PTX_PROBE_LIST(PTX_PROBE_DEFINE)
+}
+#undef PTX_PROBE_DEFINE
+
+#endif  // PTXCHAT_USDT
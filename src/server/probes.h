@@ -0,0 +1,45 @@
+#ifndef SERVER_PROBES_H_
+#define SERVER_PROBES_H_
+
+/*
+ * USDT probes of provider "ptxchat", list them with
+ *   bpftrace -l 'usdt:./ptx-server:ptxchat:*'
+ *
+ * conn_accept(fd, ip, port)          connection accepted
+ * conn_close(fd)                     connection closed by server
+ * frame_decode(fd, type, body_len)   whole message read from connection
+ * queue_push(type, depth, ok)        message pushed to client_msgs_, ok = 0 if dropped
+ * queue_pop(type, depth)             message taken by processing thread
+ * route(type, from, to, fd)          recipient chosen: fd, -1 for mailbox, -2 for every client
+ * send_done(fd, type, bytes, ok)     message or stream of frames sent to a client
+ * storage_flush(type, seq, us)       message committed to storage
+ *
+ * A probe is a NOP until a tracer attaches. Arguments that cost
+ * something to compute are guarded by PTX_PROBE_ENABLED(name).
+ * Built only when sys/sdt.h is found (systemtap-sdt-dev).
+ */
+#ifdef PTXCHAT_USDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define PTX_PROBE_SEMAPHORE(name) ptxchat_##name##_semaphore
+#define PTX_PROBE_ENABLED(name) __builtin_expect(PTX_PROBE_SEMAPHORE(name) != 0, 0)
+#define PTX_PROBE(name, ...) STAP_PROBEV(ptxchat, name, ##__VA_ARGS__)
+
+#define PTX_PROBE_LIST(X) \
+  X(conn_accept) X(conn_close) X(frame_decode) X(queue_push) \
+  X(queue_pop) X(route) X(send_done) X(storage_flush)
+
+#define PTX_PROBE_DECLARE(name) extern "C" volatile unsigned short PTX_PROBE_SEMAPHORE(name);
+PTX_PROBE_LIST(PTX_PROBE_DECLARE)
+#undef PTX_PROBE_DECLARE
+
+#else
+
+#define PTX_PROBE_ENABLED(name) false
+#define PTX_PROBE(name, ...) do {} while (0)
+
+#endif  // PTXCHAT_USDT
+
+#endif  // SERVER_PROBES_H_
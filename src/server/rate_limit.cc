@@ -0,0 +1,120 @@
+#include "rate_limit.h"
+
+#include <stdlib.h>
+
+#include "Message.h"
+
+namespace ptxchat {
+
+static constexpr uint64_t NS_IN_S = 1000000000;
+
+/**
+ * Interval of one token and how far ahead of now a bucket of burst
+ * tokens may be drained
+ */
+static void BucketParams(double rate, double burst, uint64_t& interval, uint64_t& tolerance) {
+  if (rate <= 0) {
+    interval = tolerance = 0;
+    return;
+  }
+  if (burst <= 0)
+    burst = rate;
+  if (burst < 1)
+    burst = 1;
+  interval = static_cast<uint64_t>(NS_IN_S / rate);
+  tolerance = static_cast<uint64_t>((burst - 1) * static_cast<double>(interval));
+}
+
+RateLimiter::RateLimiter(const RateLimitConfig& cfg) noexcept:
+  cfg_(cfg),
+  users_(MAX_RATE_USERS),
+  addrs_(MAX_RATE_IPS) {
+  BucketParams(cfg.conn_rate, cfg.conn_burst, conn_interval_, conn_tolerance_);
+  BucketParams(cfg.user_rate, cfg.user_burst, user_interval_, user_tolerance_);
+}
+
+uint64_t RateLimiter::Check(RateBucket& conn, uint64_t user, uint64_t now, uint32_t cost) {
+  if (conn_interval_) {
+    uint64_t wait = conn.Take(now, conn_interval_, conn_tolerance_, cost);
+    if (wait)
+      return wait;
+  }
+  if (!user_interval_ || !user)
+    return 0;
+
+  /* Bucket that is full again is the same as no bucket. Evicted busy one
+   * only gets its burst back: it is the least recently used of all */
+  uint64_t tolerance = user_tolerance_;
+  RateBucket* bucket = users_.Get(user, [now, tolerance](const RateBucket& b) {
+    return b.tat_ns + tolerance <= now;
+  }, true);
+  return bucket->Take(now, user_interval_, user_tolerance_, cost);
+}
+
+bool RateLimiter::Violation(uint32_t ip, uint64_t now) {
+  if (!cfg_.ban_after)
+    return false;
+  /* Evicting a live record would lift a ban early */
+  AddrRecord* r = addrs_.Get(ip, [now](const AddrRecord& a) {
+    return a.window_end <= now && a.banned_until <= now;
+  }, false);
+  if (!r)
+    return false;
+  auto& rec = *r;
+  if (rec.window_end <= now) {
+    rec.strikes = 0;
+    rec.window_end = now + RATE_BAN_WINDOW_S * NS_IN_S;
+  }
+  if (++rec.strikes < cfg_.ban_after || rec.banned_until > now)
+    return false;
+  rec.banned_until = now + cfg_.ban_secs * NS_IN_S;
+  rec.strikes = 0;
+  return true;
+}
+
+bool RateLimiter::Banned(uint32_t ip, uint64_t now) const {
+  if (addrs_.Empty())
+    return false;
+  const AddrRecord* rec = addrs_.Find(ip);
+  return rec && rec->banned_until > now;
+}
+
+uint64_t RateLimiter::UserKey(const char* nick) {
+  /* FNV-1a, nickname is not terminated if it has max length */
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < MAX_NICKNAME_LEN && nick[i]; ++i) {
+    h ^= static_cast<uint8_t>(nick[i]);
+    h *= 1099511628211ULL;
+  }
+  /* 0 stands for no user */
+  return h ? h : 1;
+}
+
+bool ParseRate(const std::string& s, double& rate, double& burst) {
+  char* end;
+  rate = strtod(s.c_str(), &end);
+  burst = 0;
+  if (end == s.c_str() || rate < 0)
+    return false;
+  if (*end == ':') {
+    const char* b = end + 1;
+    burst = strtod(b, &end);
+    if (end == b || burst < 0)
+      return false;
+  }
+  return *end == '\0';
+}
+
+bool ParseLimitAction(const std::string& s, LimitAction& action) {
+  if (s == "delay")
+    action = LimitAction::DELAY;
+  else if (s == "drop")
+    action = LimitAction::DROP;
+  else if (s == "disconnect")
+    action = LimitAction::DISCONNECT;
+  else
+    return false;
+  return true;
+}
+
+}  // namespace ptxchat
@@ -0,0 +1,185 @@
+#ifndef SERVER_RATE_LIMIT_H_
+#define SERVER_RATE_LIMIT_H_
+
+#include <stdint.h>
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace ptxchat {
+
+constexpr size_t MAX_RATE_USERS =        1 << 16;  /**< Least recently used user bucket is evicted over that */
+constexpr size_t MAX_RATE_IPS =          1 << 16;  /**< New violators are not tracked over that */
+constexpr int RATE_PRUNE_STEP =          2;        /**< Idle records freed per lookup */
+constexpr uint64_t RATE_BAN_WINDOW_S =   60;       /**< Violations of an address are counted within it */
+
+enum class LimitAction {
+  DELAY,       /**< Stop reading the connection until it is within its rate again */
+  DROP,        /**< Discard the message */
+  DISCONNECT,  /**< Close the connection */
+};
+
+struct RateLimitConfig {
+  double conn_rate = 0;       /**< Messages per second of a connection, 0 disables */
+  double conn_burst = 0;      /**< Messages taken at once, 0 for one second worth of rate */
+  double user_rate = 0;       /**< Messages per second of a nickname over all its connections, 0 disables */
+  double user_burst = 0;
+  LimitAction action = LimitAction::DROP;
+  uint32_t ban_after = 0;     /**< Violations of an address within RATE_BAN_WINDOW_S that ban it, 0 disables */
+  uint32_t ban_secs = 60;     /**< New connections of banned address are refused that long */
+
+  [[nodiscard]] bool Enabled() const { return conn_rate > 0 || user_rate > 0; }
+};
+
+/**
+ * \brief Token bucket kept as the time its next token is due (GCRA)
+ *
+ * Same result as a bucket refilled continuously, but a message costs
+ * one compare and one add: no refill arithmetic, no division.
+ */
+struct RateBucket {
+  uint64_t tat_ns = 0;   /**< Theoretical arrival time of the next message */
+
+  /**
+   * \param interval_ns time of one token
+   * \param tolerance_ns (burst - 1) * interval_ns
+   * \param cost tokens to take, the bucket may go into debt for them
+   * \return 0 if tokens were taken, else ns until the next one
+   */
+  uint64_t Take(uint64_t now, uint64_t interval_ns, uint64_t tolerance_ns, uint32_t cost = 1) {
+    uint64_t tat = tat_ns > now ? tat_ns : now;
+    if (tat - now > tolerance_ns)
+      return tat - now - tolerance_ns;
+    tat_ns = tat + interval_ns * cost;
+    return 0;
+  }
+};
+
+/**
+ * \brief Records with a hard size cap, most recently used first
+ *
+ * Every lookup frees up to RATE_PRUNE_STEP idle records from the old end,
+ * so the table shrinks back after a spike without a full scan.
+ */
+template <typename K, typename V>
+class LruTable {
+ public:
+  explicit LruTable(size_t cap) noexcept : cap_(cap) {}
+
+  /**
+   * \brief Record of key, created if missing
+   * \param idle tells if a record is the same as no record
+   * \param evict_busy take the oldest record for key when the table is full
+   * even if it is not idle
+   * \return nullptr if the table is full and nothing could be evicted
+   */
+  template <typename Idle>
+  V* Get(const K& key, Idle idle, bool evict_busy) {
+    for (int i = 0; i < RATE_PRUNE_STEP && !order_.empty() && idle(order_.back().second); ++i)
+      Evict();
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      order_.splice(order_.begin(), order_, it->second);
+      return &it->second->second;
+    }
+    if (index_.size() >= cap_) {
+      if (!evict_busy)
+        return nullptr;
+      Evict();
+    }
+    order_.emplace_front(key, V{});
+    index_.emplace(key, order_.begin());
+    return &order_.front().second;
+  }
+
+  /**
+   * \brief Record of key without making it recent, nullptr if missing
+   */
+  [[nodiscard]] const V* Find(const K& key) const {
+    auto it = index_.find(key);
+    return it == index_.end() ? nullptr : &it->second->second;
+  }
+
+  [[nodiscard]] bool Empty() const { return index_.empty(); }
+  [[nodiscard]] size_t Size() const { return index_.size(); }
+
+ private:
+  using Order = std::list<std::pair<K, V>>;
+
+  size_t cap_;
+  Order order_;
+  std::unordered_map<K, typename Order::iterator> index_;
+
+  void Evict() {
+    index_.erase(order_.back().first);
+    order_.pop_back();
+  }
+};
+
+/**
+ * \brief Per-connection and per-user message rate limits at ingress
+ *
+ * Connection buckets live in connections, user buckets are keyed by a
+ * hash of the nickname the connection registered. Addresses that keep
+ * violating limits are banned for a while. Both tables are capped.
+ * Not thread safe: used by the reactor thread only.
+ */
+class RateLimiter {
+ public:
+  explicit RateLimiter(const RateLimitConfig& cfg) noexcept;
+
+  /**
+   * \param user UserKey() of the registered nickname of the connection,
+   * 0 before registration: only the connection bucket is checked
+   * \param cost amount of messages in the frame
+   * \return 0 if message may pass, else ns until the sender is within its rate
+   */
+  uint64_t Check(RateBucket& conn, uint64_t user, uint64_t now, uint32_t cost = 1);
+
+  /**
+   * \brief Count a violation of address
+   * \return true if the address got banned by it; false also if all
+   * MAX_RATE_IPS records are live and the address is not tracked
+   */
+  bool Violation(uint32_t ip, uint64_t now);
+
+  [[nodiscard]] bool Banned(uint32_t ip, uint64_t now) const;
+  [[nodiscard]] LimitAction Action() const { return cfg_.action; }
+
+  /**
+   * \param nick nickname, may be not terminated
+   * \return key of user bucket of nick, never 0
+   */
+  static uint64_t UserKey(const char* nick);
+
+ private:
+  struct AddrRecord {
+    uint32_t strikes;
+    uint64_t window_end;
+    uint64_t banned_until;
+  };
+
+  RateLimitConfig cfg_;
+  uint64_t conn_interval_;
+  uint64_t conn_tolerance_;
+  uint64_t user_interval_;
+  uint64_t user_tolerance_;
+  LruTable<uint64_t, RateBucket> users_;
+  LruTable<uint32_t, AddrRecord> addrs_;
+};
+
+/**
+ * \brief Parse "rate" or "rate:burst"
+ */
+bool ParseRate(const std::string& s, double& rate, double& burst);
+
+/**
+ * \brief Parse "delay", "drop" or "disconnect"
+ */
+bool ParseLimitAction(const std::string& s, LimitAction& action);
+
+}  // namespace ptxchat
+
+#endif  // SERVER_RATE_LIMIT_H_
@@ -3,52 +3,83 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <chrono>
 #include <string>
 #include <fstream>
 
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+
 #include "Message.h"
+#include "Batch.h"
 #include "connections.h"
 #include "log.h"
+#include "probes.h"
 
 namespace ptxchat {
 
+static uint64_t SteadyNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 PtxChatServer::PtxChatServer() noexcept:
                             ip_(INADDR_ANY),
                             port_(1488),
                             listen_q_len_(DEF_LISTEN_Q_LEN),
                             socket_(0),
-                            is_running_(false) {
+                            is_running_(false),
+                            storage_uri_(DEF_STORAGE_URI),
+                            storage_pool_size_(DEF_STORAGE_POOL_SIZE),
+                            status_port_(0),
+                            stall_ms_(DEF_STALL_MS),
+                            sock_buf_(0) {
   client_msgs_ = std::make_unique<SharedUDeque<struct ChatMsg>>();
+  InitRotatingLogger("PTX Server");
   InitSocket();
   InitStorage();
-  InitRotatingLogger("PTX Server");
+  InitMetrics();
+  InitStatus();
 }
 
 PtxChatServer::PtxChatServer(uint32_t ip, uint16_t port) noexcept:
                             ip_(ip),
                             listen_q_len_(DEF_LISTEN_Q_LEN),
                             socket_(0),
-                            is_running_(false) {
+                            is_running_(false),
+                            storage_uri_(DEF_STORAGE_URI),
+                            storage_pool_size_(DEF_STORAGE_POOL_SIZE),
+                            status_port_(0),
+                            stall_ms_(DEF_STALL_MS),
+                            sock_buf_(0) {
   CheckPortRange(port);
   port_ = port;
   client_msgs_ = std::make_unique<SharedUDeque<ChatMsg>>();
+  InitRotatingLogger("PTX Server");
   InitSocket();
   InitStorage();
-  InitRotatingLogger("PTX Server");
+  InitMetrics();
+  InitStatus();
 }
 
 PtxChatServer::PtxChatServer(const std::string& ip, uint16_t port) noexcept:
                             listen_q_len_(DEF_LISTEN_Q_LEN),
                             socket_(0),
-                            is_running_(false) {
+                            is_running_(false),
+                            storage_uri_(DEF_STORAGE_URI),
+                            storage_pool_size_(DEF_STORAGE_POOL_SIZE),
+                            status_port_(0),
+                            stall_ms_(DEF_STALL_MS),
+                            sock_buf_(0) {
   CheckPortRange(port);
   struct in_addr ip_addr;
   if (inet_pton(AF_INET, ip.c_str(), &ip_addr) <= 0) {
@@ -58,9 +89,11 @@ PtxChatServer::PtxChatServer(const std::string& ip, uint16_t port) noexcept:
   ip_ = ip_addr.s_addr;
   port_ = port;
   client_msgs_ = std::make_unique<SharedUDeque<ChatMsg>>();
+  InitRotatingLogger("PTX Server");
   InitSocket();
   InitStorage();
-  InitRotatingLogger("PTX Server");
+  InitMetrics();
+  InitStatus();
 }
 
 void PtxChatServer::SetListenQueueSize(int size) {
@@ -142,6 +175,10 @@ void PtxChatServer::Start() {
   }
   is_running_ = true;
   client_msgs_->stop(false);
+  if (wake_fd_ < 0 && (wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    logger_->log(spdlog::level::critical, "Cannot create wake event: " + std::string(strerror(errno)));
+    PtxChatCrash();
+  }
 
   accept_conn_thread_.stop = 0;
   accept_conn_thread_.thread = std::thread(&PtxChatServer::AcceptClients, this);
@@ -151,7 +188,15 @@ void PtxChatServer::Start() {
   process_msg_thread_.thread = std::thread(&PtxChatServer::ProcessMessages, this);
   process_msg_thread_.thread.detach();
 
-  PushGuiEvent(GuiEvType::SRV_START, nullptr);
+  if (stall_ms_ && !stall_) {
+    stall_ = std::make_unique<StallDetector>(stall_ms_);
+    stall_->Add(accept_loop_.get());
+    stall_->Add(process_loop_.get());
+  }
+  if (stall_)
+    stall_->Start();
+
+  Notify(GuiEvType::SRV_START, nullptr);
   logger_->log(spdlog::level::info, "Server started");
 }
 
@@ -161,34 +206,56 @@ void PtxChatServer::AcceptClients() {
     logger_->log(spdlog::level::critical, "AcceptClients cannot create epoll");
     PtxChatCrash();
   }
-  if (Connection::addEventToEpoll(epoll_fd_, socket_, EPOLLIN) == -1) {
+  /* Listening socket is the only one without a connection */
+  if (Connection::addEventToEpoll(epoll_fd_, socket_, EPOLLIN, NO_CONN) == -1) {
     logger_->log(spdlog::level::critical, "AcceptClients cannot add EPOLLIN event to connection socket");
     PtxChatCrash();
   }
+  if (Connection::addEventToEpoll(epoll_fd_, wake_fd_, EPOLLIN, WAKE_EVENT) == -1) {
+    logger_->log(spdlog::level::critical, "AcceptClients cannot add EPOLLIN event to wake event");
+    PtxChatCrash();
+  }
 
   epoll_event* events = (epoll_event*)calloc(MAX_EVENTS_NUM, sizeof(epoll_event));
   logger_->log(spdlog::level::debug, "AcceptClients thread started");
+  accept_loop_->Attach();
   while (!accept_conn_thread_.stop) {
-    int ev_num = epoll_wait(epoll_fd_, events, MAX_EVENTS_NUM, 100);
+    uint64_t now = SteadyNs();
+    int timeout = paused_.empty() ? 100 : ResumePaused(now);
+    if (!handshakes_.empty())
+      timeout = std::min(timeout, ExpireHandshakes(now));
+    int ev_num = epoll_wait(epoll_fd_, events, MAX_EVENTS_NUM, timeout);
     if (ev_num == -1 && errno != EINTR) {
       logger_->log(spdlog::level::critical, "AcceptClients error in epoll: " + std::string(strerror(errno)));
       PtxChatCrash();
     }
+    if (ev_num <= 0)
+      continue;
 
+    uint64_t woke = SteadyNs();
+    accept_loop_->Begin();
     for (int i = 0; i < ev_num; ++i) {
+      accept_loop_->Lag((SteadyNs() - woke) / 1000);
+      ConnHandle h = events[i].data.u64;
+      if (h == WAKE_EVENT) {
+        accept_loop_->Enter("CloseRequested");
+        CloseRequested();
+        continue;
+      }
       if (events[i].events & (EPOLLHUP | EPOLLERR)) {
-        if (events[i].data.fd == socket_) {
+        if (h == NO_CONN) {
           logger_->log(spdlog::level::critical, "AcceptClients error connection socket: " + std::string(strerror(errno)));
           PtxChatCrash();
         }
-        auto conn = connections_[events[i].data.fd];
-        CloseConnection(conn->GetSocket());
+        accept_loop_->Enter("CloseConnection");
+        CloseConnection(h);
         continue;
       }
 
-      int event_fd = events[i].data.fd;
-      if (events[i].events & EPOLLIN) {
-        if (event_fd == socket_) {
+      /* EPOLLOUT is waited for during TLS handshake and while output is queued */
+      if (events[i].events & (EPOLLIN | EPOLLOUT)) {
+        if (h == NO_CONN) {
+          accept_loop_->Enter("accept");
           while (1) {
             sockaddr_in cl_addr;
             socklen_t cl_len = sizeof(cl_addr);
@@ -199,52 +266,240 @@ void PtxChatServer::AcceptClients() {
               logger_->log(spdlog::level::critical, strerror(errno));
               PtxChatCrash();
             }
+            if (limiter_ && limiter_->Banned(cl_addr.sin_addr.s_addr, SteadyNs())) {
+              close(cl_fd);
+              m_.conn_refused->Add();
+              continue;
+            }
+            auto conn = std::make_shared<Connection>(cl_fd, cl_addr.sin_addr.s_addr, cl_addr.sin_port);
+            ConnHandle cl_h = connections_.Add(conn);
+            if (cl_h == NO_CONN) {
+              logger_->log(spdlog::level::err, "Client skt " + std::to_string(cl_fd) + " refused: over " +
+                           std::to_string(connections_.Capacity()) + " connection slots");
+              /* Socket is closed with conn */
+              m_.conn_refused_slots->Add();
+              continue;
+            }
             Connection::makeNonBlocking(cl_fd);// todo: handle errors
-            Connection::addEventToEpoll(epoll_fd_, cl_fd, EPOLLIN);
+            if (sock_buf_) {
+              setsockopt(cl_fd, SOL_SOCKET, SO_RCVBUF, &sock_buf_, sizeof(sock_buf_));
+              setsockopt(cl_fd, SOL_SOCKET, SO_SNDBUF, &sock_buf_, sizeof(sock_buf_));
+            }
+            conn->Watch(epoll_fd_, EPOLLIN);
             logger_->log(spdlog::level::info, "Client " + std::to_string(cl_addr.sin_addr.s_addr) + ":" +
                         std::to_string(cl_addr.sin_port) + ", skt " + std::to_string(cl_fd) + " accepted");
-            auto conn = std::make_shared<Connection>(cl_fd, cl_addr.sin_addr.s_addr, cl_addr.sin_port);
-            std::unique_lock<std::mutex> lc(conn_mtx_);
-            connections_.emplace(cl_fd, conn);
+            m_.conn_accepted->Add();
+            if (capture_)
+              capture_->Open(conn->GetId());
+            if (tls_) {
+              conn->StartTls(*tls_);
+              handshakes_.emplace_back(SteadyNs() + TLS_HANDSHAKE_MS * 1000000ull, cl_h);
+            }
+            PTX_PROBE(conn_accept, cl_fd, cl_addr.sin_addr.s_addr, ntohs(cl_addr.sin_port));
           }
           continue;
         }
 
-        auto conn = connections_[event_fd];
+        /* Event of a connection closed earlier in this batch */
+        auto conn = connections_.Get(h);
+        if (!conn)
+          continue;
         if (conn->Status() != ConnStatus::UP) {
-          CloseConnection(conn->GetSocket());
+          accept_loop_->Enter("CloseConnection");
+          CloseConnection(h);
+          continue;
+        }
+        if (conn->Handshake()) {
+          accept_loop_->Enter("ContinueTls");
+          if (!ContinueTls(conn))
+            CloseConnection(h);
           continue;
         }
+        if (events[i].events & EPOLLOUT) {
+          accept_loop_->Enter("Flush");
+          if (!conn->Flush()) {
+            CloseConnection(h);
+            continue;
+          }
+        }
+        /* Paused connections wait for EPOLLOUT only */
+        if (!(events[i].events & EPOLLIN))
+          continue;
+        accept_loop_->Enter("AddMsgFromConn");
         if (!AddMsgFromConn(conn))
-          CloseConnection(event_fd);
+          CloseConnection(h);
       }
     }
+    accept_loop_->End();
   }
+  accept_loop_->Detach();
   free(events);
   logger_->log(spdlog::level::debug, "AcceptClients thread finished");
 }
 
 bool PtxChatServer::AddMsgFromConn(std::shared_ptr<Connection> conn) {
+  std::shared_ptr<MsgTrace> trace;
+  if (tracer_ && (trace = tracer_->Sample()))
+    trace->Mark(TraceStage::RECV, conn->GetSocket());
   auto msg = Connection::RecvMsgFromConn(conn);
   if (!msg) {
     if (conn->Status() == ConnStatus::UP)
       return true;
     return false;
   }
-  client_msgs_->push_front(std::move(msg));
+  if (capture_)
+    capture_->Frame(conn->GetId(), *msg);
+  size_t t = static_cast<size_t>(msg->hdr.type);
+  if (t < MSG_TYPE_CNT)
+    m_.msgs_in[t]->Add();
+  m_.bytes_in->Add(sizeof(ChatMsgHdr) + msg->hdr.buf_len);
+  if (msg->hdr.type == MsgType::BATCH && !BatchCount(msg->buf, msg->hdr.buf_len)) {
+    logger_->log(spdlog::level::info, "Connection " + std::to_string(conn->GetSocket()) + " closed: malformed batch");
+    return false;
+  }
+  uint64_t now = SteadyNs();
+  if (limiter_ && !CheckRate(conn, *msg, now))
+    return conn->Status() == ConnStatus::UP;
+  if (trace) {
+    trace->Mark(TraceStage::ENQUEUE);
+    msg->trace = std::move(trace);
+  }
+  msg->queued_ns = now;
+  msg->conn = conn->GetHandle();
+  bool pushed = client_msgs_->push_front(std::move(msg));
+  PTX_PROBE(queue_push, static_cast<int>(t), PTX_PROBE_ENABLED(queue_push) ? client_msgs_->size() : 0, pushed);
+  if (!pushed) {
+    m_.drop_queue_full->Add();
+    logger_->log(spdlog::level::warn, "Message from connection " + std::to_string(conn->GetSocket()) +
+                 " dropped: queue is full");
+  }
+  return true;
+}
+
+bool PtxChatServer::CheckRate(std::shared_ptr<Connection> conn, const ChatMsg& msg, uint64_t now) {
+  /* Batch costs as many tokens as it has messages */
+  uint32_t cost = msg.hdr.type == MsgType::BATCH ? static_cast<uint32_t>(BatchCount(msg.buf, msg.hdr.buf_len)) : 1;
+  /* Sender name in the header is not trusted, the bucket is of the nickname the connection registered */
+  uint64_t wait = limiter_->Check(conn->Rate(), conn->RateUser(), now, cost);
+  if (!wait)
+    return true;
+  m_.rate_limited->Add();
+  uint32_t ip = conn->GetIP();
+  if (limiter_->Violation(ip, now)) {
+    m_.banned->Add();
+    logger_->log(spdlog::level::warn, "Client " + std::to_string(ip) + " banned for repeated rate limit violations");
+  }
+  switch (limiter_->Action()) {
+    case LimitAction::DELAY:
+      /* Rest of the flood stays in the socket buffer and slows the sender down */
+      conn->SetEvents(0);
+      paused_.emplace(now + wait, conn->GetHandle());
+      return true;
+    case LimitAction::DROP:
+      m_.drop_rate_limited->Add();
+      return false;
+    case LimitAction::DISCONNECT:
+      m_.rate_disconnects->Add();
+      logger_->log(spdlog::level::info, "Connection " + std::to_string(conn->GetSocket()) +
+                   " closed: over rate limit");
+      conn->SetStatus(ConnStatus::CLOSED);
+      return false;
+  }
+  return true;
+}
+
+int PtxChatServer::ResumePaused(uint64_t now) {
+  while (!paused_.empty() && paused_.top().first <= now) {
+    ConnHandle h = paused_.top().second;
+    paused_.pop();
+    if (auto conn = connections_.Get(h))
+      conn->SetEvents(EPOLLIN);
+  }
+  if (paused_.empty())
+    return 100;
+  return static_cast<int>(std::min<uint64_t>(100, (paused_.top().first - now) / 1000000 + 1));
+}
+
+int PtxChatServer::ExpireHandshakes(uint64_t now) {
+  while (!handshakes_.empty() && handshakes_.front().first <= now) {
+    ConnHandle h = handshakes_.front().second;
+    handshakes_.pop_front();
+    auto conn = connections_.Get(h);
+    /* Closed or through the handshake already */
+    if (!conn || !conn->Handshake())
+      continue;
+    m_.tls_timeout->Add();
+    logger_->log(spdlog::level::info, "TLS handshake with " + std::to_string(conn->GetSocket()) + " timed out");
+    CloseConnection(h);
+  }
+  if (handshakes_.empty())
+    return 100;
+  return static_cast<int>(std::min<uint64_t>(100, (handshakes_.front().first - now) / 1000000 + 1));
+}
+
+bool PtxChatServer::ContinueTls(std::shared_ptr<Connection> conn) {
+  TlsSession* tls = conn->Handshake();
+  int fd = conn->GetSocket();
+  switch (tls->Handshake()) {
+    case TlsStep::WANT_READ:
+      conn->SetEvents(EPOLLIN);
+      return true;
+    case TlsStep::WANT_WRITE:
+      conn->SetEvents(EPOLLIN | EPOLLOUT);
+      return true;
+    case TlsStep::FAILED:
+      m_.tls_failed->Add();
+      logger_->log(spdlog::level::info, "TLS handshake with " + std::to_string(fd) + " failed: " + tls->Error());
+      return false;
+    case TlsStep::DONE:
+      break;
+  }
+  if (!tls->KernelOffload()) {
+    m_.tls_failed->Add();
+    logger_->log(spdlog::level::err, "Cannot use TLS with " + std::to_string(fd) + ": kernel did not take the session");
+    return false;
+  }
+  /* Records are handled by the socket now, userspace state is not needed */
+  conn->EndTls();
+  conn->SetEvents(EPOLLIN);
+  m_.tls_done->Add();
+  logger_->log(spdlog::level::debug, "TLS established with " + std::to_string(fd));
   return true;
 }
 
 void PtxChatServer::ProcessMessages() {
   logger_->log(spdlog::level::debug, "ProcessMessages thread started");
+  process_loop_->Attach();
   while (!process_msg_thread_.stop) {
-    std::unique_ptr<struct ChatMsg> msg = std::move(client_msgs_->back());
+    bool store = !unstored_.empty() && storage_->IsConnected();
+    if (seqs_loaded_ || store) {
+      process_loop_->Begin();
+      process_loop_->Enter("StoreUnstored");
+      if (seqs_loaded_)
+        ApplyLoadedSeqs();
+      if (store)
+        StoreUnstored();
+      process_loop_->End();
+    }
+    /* Unstored messages wait for storage, not for the next message */
+    std::unique_ptr<struct ChatMsg> msg = unstored_.empty() ? client_msgs_->back() :
+                                          client_msgs_->back_for(std::chrono::milliseconds(STORE_RETRY_MS));
+    if (!msg && !unstored_.empty() && !client_msgs_->stopped())
+      continue;
     if (!msg) {
       logger_->log(spdlog::level::debug, "Client messages queue stopped");
+      process_loop_->Detach();
       return;
     }
+    if (msg->trace)
+      msg->trace->Mark(TraceStage::DEQUEUE);
+    PTX_PROBE(queue_pop, static_cast<int>(msg->hdr.type), PTX_PROBE_ENABLED(queue_pop) ? client_msgs_->size() : 0);
+    process_loop_->Begin();
+    process_loop_->Lag((SteadyNs() - msg->queued_ns) / 1000);
     ParseClientMsg(std::move(msg));
+    process_loop_->End();
   }
+  process_loop_->Detach();
   logger_->log(spdlog::level::debug, "ProcessMessages thread finished");
 }
 
@@ -253,35 +508,199 @@ void PtxChatServer::ProcessRegMsg(std::shared_ptr<ChatMsg> msg) {
   uint32_t ip = msg->hdr.src_ip;
   uint16_t port = msg->hdr.src_port;
 
-  std::unique_lock<std::mutex> lc_cl(clients_mtx_);
-  auto res = clients_.find(nick);
-  if (res != clients_.end()) {
-    logger_->log(spdlog::level::info, "Client already registered with given nickname: " + std::string(nick));
+  /* Reconnected client presents its session */
+  ResumeReq resume{};
+  bool resumed = false;
+  if (msg->hdr.buf_len == sizeof(ResumeReq)) {
+    memcpy(&resume, msg->buf, sizeof(resume));
+    resumed = CheckSessionToken(nick, std::string(resume.token, RESUME_TOKEN_LEN));
+    if (!resumed)
+      logger_->log(spdlog::level::info, "Cannot resume session of " + std::string(nick) + ": bad token");
+  }
+  SessionInfo info{};
+  /* Token of a new session is saved only once the nickname is ours */
+  std::string token = resumed ? std::string(resume.token, RESUME_TOKEN_LEN) : NewSessionToken();
+  if (token.empty()) {
+    logger_->log(spdlog::level::err, "Cannot register client " + std::string(nick) + ": no random bytes for a token");
     return;
   }
+  memcpy(info.token, token.data(), RESUME_TOKEN_LEN);
+  info.resumed = resumed;
+  info.public_seq = GetLastPublicSeq();
+  info.ts = last_ts_.load();
 
-  std::unique_lock<std::mutex> lc_conn(conn_mtx_);
-  for (auto it = connections_.begin(); it != connections_.end(); ++it) {
-    auto conn = it->second;
-    if (conn->GetIP() == ip && conn->GetPort() == port) {
-      auto reply = std::make_shared<ChatMsg>();
-      auto client = std::make_shared<Client>(conn);
-      if (!client->Register(nick)) {
-        logger_->log(spdlog::level::info, "Cannot register client with given nickname: " + std::string(nick));
-        reply->hdr = ChatMsgHdr{MsgType::ERR_REGISTERED, ip_, port_, "ChatServer", "", 0};
-      } else {
-        clients_.emplace(nick, client);
-        reply->hdr = ChatMsgHdr{MsgType::REGISTERED, ip_, port_, "ChatServer", "", 0};
-        PushGuiEvent(GuiEvType::CLIENT_REG, reply);
-        logger_->log(spdlog::level::info, "Client registered: " + std::string(nick));
+  std::shared_ptr<Connection> registered;
+  {
+    std::unique_lock<std::mutex> lc_cl(clients_mtx_);
+    auto res = clients_.find(nick);
+    if (res != clients_.end()) {
+      if (!resumed) {
+        m_.reg_rejected->Add();
+        logger_->log(spdlog::level::info, "Client already registered with given nickname: " + std::string(nick));
+        return;
       }
+      /* Connection of the old session is dead, but not closed yet */
+      logger_->log(spdlog::level::info, "Client " + std::string(nick) + " resumed session from another connection");
+      RequestClose(res->second);
+      clients_.erase(res);
+    }
+
+    /* Connection is closed if the handle is stale, even if its socket is reused */
+    auto conn = connections_.Get(msg->conn);
+    if (!conn || conn->GetIP() != ip || conn->GetPort() != port) {
+      logger_->log(spdlog::level::err, "Cannot register client " + std::string(nick) + ": no such connection");
+      return;
+    }
+    if (conn->IsRegistered()) {
+      m_.reg_rejected->Add();
+      logger_->log(spdlog::level::info, "Cannot register client " + std::string(nick) + ": connection is registered as " +
+                   conn->GetNickname());
+      return;
+    }
+    if (!conn->Register(nick)) {
+      m_.reg_rejected->Add();
+      logger_->log(spdlog::level::info, "Cannot register client with given nickname: " + std::string(nick));
+      auto reply = std::make_shared<ChatMsg>();
+      reply->hdr = ChatMsgHdr{MsgType::ERR_REGISTERED, ip_, port_, "ChatServer", "", 0, 0, 0};
       std::strcpy(reply->hdr.from, nick);
-      SendMsgToClient(reply, client);
+      SendMsgToClient(reply, conn);
       return;
     }
+    clients_.emplace(conn->GetNickname(), conn);
+    conn->SetRateUser(RateLimiter::UserKey(nick));
+    if (!resumed) {
+      std::unique_lock<std::mutex> lc(session_mtx_);
+      sessions_[nick] = token;
+    }
+    registered = conn;
+  }
+
+  /* Without storage the session only survives reconnects to this server */
+  if (!resumed)
+    storage_->SetSessionToken(nick, token);
+  /* Client asks for private history older than its mailbox, so nothing comes twice */
+  std::vector<frame_t> mail;
+  if (!resumed)
+    mail = mailbox_->Take(nick);
+  if (!mail.empty()) {
+    ChatMsgHdr oldest;
+    memcpy(&oldest, mail.front()->data(), sizeof(oldest));
+    info.mailbox_ts = oldest.ts;
+  }
+
+  auto reply = std::make_shared<ChatMsg>();
+  reply->hdr = ChatMsgHdr{MsgType::REGISTERED, ip_, port_, "ChatServer", "", sizeof(info), 0, 0};
+  std::strcpy(reply->hdr.from, nick);
+  reply->buf = (uint8_t*)malloc(sizeof(info));
+  memcpy(reply->buf, &info, sizeof(info));
+  (resumed ? m_.reg_resumed : m_.reg_new)->Add();
+  Notify(GuiEvType::CLIENT_REG, reply);
+  logger_->log(spdlog::level::info, "Client registered: " + std::string(nick));
+  SendMsgToClient(reply, registered);
+
+  if (resumed)
+    ReplayMissed(registered, resume);
+  else
+    DeliverMailbox(registered, std::move(mail));
+}
+
+std::string PtxChatServer::NewSessionToken() {
+  static const char hex[] = "0123456789abcdef";
+  unsigned char rnd[RESUME_TOKEN_LEN / 2];
+  if (RAND_bytes(rnd, sizeof(rnd)) != 1)
+    return {};
+  std::string token(RESUME_TOKEN_LEN, '0');
+  for (size_t i = 0; i < sizeof(rnd); ++i) {
+    token[2 * i] = hex[rnd[i] >> 4];
+    token[2 * i + 1] = hex[rnd[i] & 0xf];
+  }
+  return token;
+}
+
+bool PtxChatServer::CheckSessionToken(const std::string& nick, const std::string& token) {
+  std::string known;
+  {
+    std::unique_lock<std::mutex> lc(session_mtx_);
+    auto it = sessions_.find(nick);
+    if (it != sessions_.end())
+      known = it->second;
+  }
+  if (known.empty()) {
+    /* Session of a client of the previous server instance */
+    known = storage_->GetSessionToken(nick);
+    if (known.empty())
+      return false;
+    std::unique_lock<std::mutex> lc(session_mtx_);
+    sessions_.emplace(nick, known);
   }
+  /* Time does not tell how much of a guess was right */
+  return known.size() == token.size() && CRYPTO_memcmp(known.data(), token.data(), known.size()) == 0;
+}
 
-  logger_->log(spdlog::level::err, "Cannot register client " + std::string(nick) + ": no such connection");
+bool PtxChatServer::KnownUser(const std::string& nick) {
+  {
+    std::unique_lock<std::mutex> lc(session_mtx_);
+    if (sessions_.count(nick))
+      return true;
+  }
+  std::string known = storage_->GetSessionToken(nick);
+  if (known.empty())
+    return false;
+  std::unique_lock<std::mutex> lc(session_mtx_);
+  sessions_.emplace(nick, known);
+  return true;
+}
+
+uint64_t PtxChatServer::GetLastPublicSeq() {
+  std::unique_lock<std::mutex> lc(seq_mtx_);
+  auto it = conv_seqs_.find(PUBLIC_CONVERSATION);
+  return it == conv_seqs_.end() ? 0 : it->second.last;
+}
+
+void PtxChatServer::ReplayMissed(std::shared_ptr<Connection> client, const ResumeReq& req) {
+  HistoryReq pub{};
+  pub.scope = HistoryScope::PUBLIC;
+  pub.after = req.public_seq;
+  pub.limit = MAX_HISTORY_PAGE;
+  SendHistory(client, pub);
+
+  /* Stored private messages include the mailbox, it would only duplicate them */
+  if (!storage_->IsConnected()) {
+    DeliverMailbox(client, mailbox_->Take(client->GetNickname()));
+    return;
+  }
+  mailbox_->Take(client->GetNickname());
+  HistoryReq priv{};
+  priv.scope = HistoryScope::PRIVATE;
+  priv.after = req.private_ts;
+  priv.limit = MAX_HISTORY_PAGE;
+  SendHistory(client, priv);
+}
+
+void PtxChatServer::DeliverMailbox(std::shared_ptr<Connection> client, std::vector<frame_t> frames) {
+  auto start = std::chrono::steady_clock::now();
+  if (frames.empty())
+    return;
+
+  /* The whole mailbox goes out as one stream */
+  if (!Connection::SendFramesToConn(frames, client)) {
+    RequestClose(client);
+    logger_->log(spdlog::level::err, "Cannot deliver mailbox of " + client->GetNickname() + ": connection lost");
+    for (auto& f : frames) {
+      ChatMsg m;
+      memcpy(&m.hdr, f->data(), sizeof(ChatMsgHdr));
+      m.buf = (uint8_t*)malloc(m.hdr.buf_len);
+      memcpy(m.buf, f->data() + sizeof(ChatMsgHdr), m.hdr.buf_len);
+      mailbox_->Put(client->GetNickname(), m);
+    }
+    return;
+  }
+  CountSent(frames);
+  uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+                  std::chrono::steady_clock::now() - start).count();
+  mailbox_->AddDelivery(frames.size(), us);
+  logger_->log(spdlog::level::info, "Mailbox of " + client->GetNickname() + ": " + std::to_string(frames.size()) +
+               " messages delivered in " + std::to_string(us) + " us");
 }
 
 void PtxChatServer::ProcessUnregMsg(std::shared_ptr<ChatMsg> msg) {
@@ -300,12 +719,15 @@ void PtxChatServer::ProcessUnregMsg(std::shared_ptr<ChatMsg> msg) {
     logger_->log(spdlog::level::err, "Cannot unregister client " + std::string(nick) + ": already unregistered");
     return;
   }
-  if (client->GetIp() == ip && client->GetPort() == port) {
+  if (client->GetIP() == ip && client->GetPort() == port) {
     client->Unregister();
+    client->SetRateUser(0);
     clients_.erase(res);
-    auto gui_repl = std::make_shared<ChatMsg>();
-    strcpy(gui_repl->hdr.from, nick);
-    PushGuiEvent(GuiEvType::CLIENT_UNREG, gui_repl);
+    if (observer_) {
+      auto gui_repl = std::make_shared<ChatMsg>();
+      strcpy(gui_repl->hdr.from, nick);
+      Notify(GuiEvType::CLIENT_UNREG, gui_repl);
+    }
     logger_->log(spdlog::level::info, "Client " + std::string(nick) + " unregistered");
     return;
   }
@@ -325,22 +747,43 @@ void PtxChatServer::ProcessPrivateMsg(std::shared_ptr<ChatMsg> msg) {
     return;
   }
 
-  auto to = clients_.find(msg->hdr.to);
-  if (to == clients_.end()) {
-    logger_->log(spdlog::level::info, "Cannot send private message to " + std::string(msg->hdr.to) + ": client not found");
+  std::string to_nick(msg->hdr.to, strnlen(msg->hdr.to, MAX_NICKNAME_LEN));
+  if (to_nick.length() <= 1) {
+    logger_->log(spdlog::level::info, "Cannot send private message to " + to_nick + ": bad nickname");
     return;
   }
-  auto client = to->second;
-  if (!client->IsRegistered()) {
-    logger_->log(spdlog::level::info, "Cannot send private message to " + std::string(msg->hdr.to) + ": client not registered");
-    return;
-  }
-  clients_mtx_.unlock();
+  std::shared_ptr<Connection> client;
+  auto to = clients_.find(to_nick);
+  if (to != clients_.end() && to->second->IsRegistered())
+    client = to->second;
+  lc.unlock();
 
-  if (!SendMsgToClient(msg, to->second))
-    client->GetConnection()->Status() = ConnStatus::ERROR;
-  else
-    storage_->AddPrivateMsg(msg);
+  std::string conv = ConversationKey(msg->hdr.from, to_nick);
+  bool numbered = StampMsg(msg, conv);
+  PTX_PROBE(route, static_cast<int>(msg->hdr.type), msg->hdr.from, msg->hdr.to, client ? client->GetSocket() : -1);
+  if (!client || !SendMsgToClient(msg, client)) {
+    /* Recipient gets it with the rest of mailbox on next login, SendMsgToClient closed the connection */
+    if (client || KnownUser(to_nick)) {
+      mailbox_->Put(to_nick, *msg);
+      if (msg->trace)
+        msg->trace->Mark(TraceStage::MAILBOX);
+      logger_->log(spdlog::level::info, "Private message to " + to_nick + " put to mailbox: client offline");
+    } else {
+      logger_->log(spdlog::level::info, "Private message to " + to_nick + " not put to mailbox: unknown user");
+    }
+  }
+  Notify(GuiEvType::PRIVATE_MSG, msg);
+  auto start = std::chrono::steady_clock::now();
+  if (numbered && storage_->AddPrivateMsg(msg)) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    m_.storage_write->Observe(us);
+    PTX_PROBE(storage_flush, static_cast<int>(msg->hdr.type), msg->hdr.seq, us);
+    if (msg->trace)
+      msg->trace->Mark(TraceStage::STORE);
+  } else {
+    KeepUnstored(*msg, conv, !numbered);
+  }
+  history_->Append(conv, *msg);
 }
 
 void PtxChatServer::ProcessPublicMsg(std::shared_ptr<ChatMsg> msg) {
@@ -358,76 +801,512 @@ void PtxChatServer::ProcessPublicMsg(std::shared_ptr<ChatMsg> msg) {
   }
   clients_mtx_.unlock();
 
+  bool numbered = StampMsg(msg, PUBLIC_CONVERSATION);
+  PTX_PROBE(route, static_cast<int>(msg->hdr.type), msg->hdr.from, msg->hdr.to, -2);
   SendMsgToAll(msg);
-  storage_->AddPublicMsg(msg);
+  auto start = std::chrono::steady_clock::now();
+  if (numbered && storage_->AddPublicMsg(msg)) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    m_.storage_write->Observe(us);
+    PTX_PROBE(storage_flush, static_cast<int>(msg->hdr.type), msg->hdr.seq, us);
+    if (msg->trace)
+      msg->trace->Mark(TraceStage::STORE);
+  } else {
+    KeepUnstored(*msg, PUBLIC_CONVERSATION, !numbered);
+  }
+  history_->Append(PUBLIC_CONVERSATION, *msg);
+}
+
+void PtxChatServer::ProcessBatch(std::shared_ptr<ChatMsg> batch) {
+  std::string from(batch->hdr.from, strnlen(batch->hdr.from, MAX_NICKNAME_LEN));
+  std::vector<std::shared_ptr<ChatMsg>> msgs;
+  if (!DecodeBatch(*batch, msgs)) {
+    logger_->log(spdlog::level::err, "Cannot process batch from " + from + ": malformed");
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lc(clients_mtx_);
+    auto client = clients_.find(from);
+    if (client == clients_.end() || !client->second->IsRegistered()) {
+      logger_->log(spdlog::level::info, "Cannot process batch from " + from + ": client not registered");
+      return;
+    }
+  }
+
+  /* Stamp in batch order and encode every message once */
+  std::vector<frame_t> frames;
+  std::vector<size_t> pub;                                   /**< Public entries */
+  std::unordered_map<std::string_view, std::vector<size_t>> priv;  /**< Private entries of every recipient */
+  std::vector<std::string> convs;
+  std::vector<bool> numbered;
+  frames.reserve(msgs.size());
+  for (size_t i = 0; i < msgs.size();) {
+    auto& msg = msgs[i];
+    if (msg->hdr.type == MsgType::PUBLIC_DATA) {
+      convs.push_back(PUBLIC_CONVERSATION);
+      pub.push_back(i);
+    } else {
+      std::string to(msg->hdr.to);
+      if (to.length() <= 1) {
+        logger_->log(spdlog::level::info, "Cannot send private message to " + to + ": bad nickname");
+        msgs.erase(msgs.begin() + static_cast<std::ptrdiff_t>(i));
+        continue;
+      }
+      convs.push_back(ConversationKey(from, to));
+      priv[std::string_view(msg->hdr.to, to.size())].push_back(i);
+    }
+    numbered.push_back(StampMsg(msg, convs.back()));
+    frames.push_back(EncodeFrame(*msg));
+    ++i;
+  }
+  if (msgs.empty()) {
+    logger_->log(spdlog::level::info, "Batch from " + from + " has no messages to send");
+    return;
+  }
+  std::vector<frame_t> pub_frames;
+  for (size_t i : pub)
+    pub_frames.push_back(frames[i]);
+
+  /* Frames of recipient in batch order: public ones unless it gets them by multicast, and its private ones */
+  auto frames_of = [&frames, &pub](const std::vector<size_t>& own, bool with_pub) {
+    std::vector<frame_t> out;
+    out.reserve(pub.size() + own.size());
+    auto p = with_pub ? pub.begin() : pub.end();
+    auto o = own.begin();
+    while (p != pub.end() || o != own.end()) {
+      if (o == own.end() || (p != pub.end() && *p < *o))
+        out.push_back(frames[*p++]);
+      else
+        out.push_back(frames[*o++]);
+    }
+    return out;
+  };
+  auto send = [this, &batch](std::shared_ptr<Connection> client, const std::vector<frame_t>& out) {
+    if (!Connection::SendFramesToConn(out, client)) {
+      RequestClose(client);
+      return false;
+    }
+    CountSent(out);
+    if (batch->trace)
+      batch->trace->Mark(TraceStage::SEND, client->GetSocket());
+    return true;
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  if (mcast_ && !pub.empty())
+    mcast_->Send(pub_frames, msgs[pub.back()]->hdr.seq);
+  /* Recipients with their private entries, priv.end() if none; sent to after clients_mtx_ is released */
+  std::vector<std::pair<std::shared_ptr<Connection>, decltype(priv)::iterator>> to;
+  {
+    std::unique_lock<std::mutex> lc(clients_mtx_);
+    if (!pub.empty()) {
+      to.reserve(clients_.size());
+      for (auto& [nick, client] : clients_) {
+        auto own = priv.find(nick);
+        if (own != priv.end() || !client->IsMulticast())
+          to.emplace_back(client, own);
+      }
+    } else {
+      for (auto own = priv.begin(); own != priv.end(); ++own) {
+        auto client = clients_.find(own->first);
+        if (client != clients_.end() && client->second->IsRegistered())
+          to.emplace_back(client->second, own);
+      }
+    }
+  }
+  for (auto& [client, own] : to) {
+    if (own == priv.end()) {
+      if (!send(client, pub_frames))
+        m_.drop_send_failed->Add(pub_frames.size());
+      continue;
+    }
+    if (send(client, frames_of(own->second, !client->IsMulticast())))
+      priv.erase(own);
+    else
+      m_.drop_send_failed->Add(pub_frames.size());
+  }
+  m_.fanout->Observe(std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now() - start).count());
+
+  /* Recipients left get their messages with the rest of mailbox on next login */
+  for (auto& [to_v, own] : priv) {
+    std::string to(to_v);
+    if (!KnownUser(to)) {
+      logger_->log(spdlog::level::info, std::to_string(own.size()) + " private messages to " + to +
+                   " not put to mailbox: unknown user");
+      continue;
+    }
+    for (size_t i : own)
+      mailbox_->Put(to, *msgs[i]);
+    logger_->log(spdlog::level::info, std::to_string(own.size()) + " private messages to " + to +
+                 " put to mailbox: client offline");
+  }
+
+  /* Messages with provisional numbers wait for the stored ones */
+  std::vector<std::shared_ptr<ChatMsg>> ready;
+  for (size_t i = 0; i < msgs.size(); ++i) {
+    if (numbered[i])
+      ready.push_back(msgs[i]);
+    else
+      KeepUnstored(*msgs[i], convs[i], true);
+  }
+  start = std::chrono::steady_clock::now();
+  if (!ready.empty() && storage_->AddMsgs(ready)) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    m_.storage_write->Observe(us);
+    PTX_PROBE(storage_flush, static_cast<int>(MsgType::BATCH), ready.back()->hdr.seq, us);
+    if (batch->trace)
+      batch->trace->Mark(TraceStage::STORE);
+  } else {
+    for (size_t i = 0; i < msgs.size(); ++i) {
+      if (numbered[i])
+        KeepUnstored(*msgs[i], convs[i], false);
+    }
+  }
+  for (size_t i = 0; i < msgs.size(); ++i) {
+    history_->Append(convs[i], *msgs[i]);
+    Notify(msgs[i]->hdr.type == MsgType::PUBLIC_DATA ? GuiEvType::PUBLIC_MSG : GuiEvType::PRIVATE_MSG, msgs[i]);
+  }
+  logger_->log(spdlog::level::debug, "Batch of " + std::to_string(msgs.size()) + " messages from " + from + ": sent");
+}
+
+void PtxChatServer::ProcessMcastJoin(std::shared_ptr<ChatMsg> msg) {
+  std::string nick(msg->hdr.from, strnlen(msg->hdr.from, MAX_NICKNAME_LEN));
+  if (!mcast_) {
+    logger_->log(spdlog::level::debug, "Multicast join of " + nick + " ignored: multicast is off");
+    return;
+  }
+  std::unique_lock<std::mutex> lc(clients_mtx_);
+  auto res = clients_.find(nick);
+  if (res == clients_.end() || !res->second->IsRegistered()) {
+    logger_->log(spdlog::level::err, "Cannot join " + nick + " to multicast: client not registered");
+    return;
+  }
+  auto client = res->second;
+  if (client->GetIP() != msg->hdr.src_ip || client->GetPort() != msg->hdr.src_port) {
+    logger_->log(spdlog::level::err, "Cannot join " + nick + " to multicast: was registered from another address");
+    return;
+  }
+  /* Fan-out runs on this thread too, so no public message falls between TCP and the group */
+  client->SetMulticast(true);
+  lc.unlock();
+
+  McastInfo info = mcast_->Info();
+  info.last_seq = GetLastPublicSeq();
+  auto reply = std::make_shared<ChatMsg>();
+  reply->hdr = ChatMsgHdr{MsgType::MCAST_INFO, ip_, port_, "ChatServer", "", sizeof(info), 0, 0};
+  std::strcpy(reply->hdr.to, nick.c_str());
+  reply->buf = (uint8_t*)malloc(sizeof(info));
+  memcpy(reply->buf, &info, sizeof(info));
+  if (!SendMsgToClient(reply, client)) {
+    logger_->log(spdlog::level::err, "Cannot join " + nick + " to multicast: connection lost");
+    return;
+  }
+  logger_->log(spdlog::level::info, "Client " + nick + " gets public messages by multicast");
+}
+
+bool PtxChatServer::StampMsg(std::shared_ptr<ChatMsg> msg, const std::string& conv) {
+  uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::system_clock::now().time_since_epoch()).count();
+  bool known;
+  bool load = false;
+  {
+    std::unique_lock<std::mutex> lc(seq_mtx_);
+    auto it = conv_seqs_.find(conv);
+    if (it == conv_seqs_.end()) {
+      it = conv_seqs_.emplace(conv, ConvSeq{}).first;
+      load = true;
+    }
+    msg->hdr.seq = ++it->second.last;
+    known = it->second.known;
+  }
+  if (load)
+    LoadSeq(conv);
+
+  /* Unique even if the clock stalls or steps back */
+  uint64_t last = last_ts_.load();
+  uint64_t ts;
+  do {
+    ts = now > last ? now : last + 1;
+  } while (!last_ts_.compare_exchange_weak(last, ts));
+  msg->hdr.ts = ts;
+  return known;
+}
+
+void PtxChatServer::LoadSeq(const std::string& conv) {
+  {
+    std::unique_lock<std::mutex> lc(startup_mtx_);
+    seq_loads_.push_back(conv);
+  }
+  startup_cv_.notify_all();
+}
+
+void PtxChatServer::ApplyLoadedSeqs() {
+  std::vector<std::pair<std::string, uint64_t>> loaded;
+  {
+    std::unique_lock<std::mutex> lc(startup_mtx_);
+    loaded.swap(loaded_seqs_);
+    seqs_loaded_ = false;
+  }
+  for (auto& [conv, stored] : loaded) {
+    uint64_t given;
+    {
+      std::unique_lock<std::mutex> lc(seq_mtx_);
+      auto& s = conv_seqs_[conv];
+      if (s.known)
+        continue;
+      given = s.last;
+      s.last += stored;
+      s.known = true;
+    }
+    /* Stored in the order given, after the messages already in storage */
+    for (auto& u : unstored_) {
+      if (u.provisional && u.conv == conv) {
+        u.msg->hdr.seq += stored;
+        u.provisional = false;
+      }
+    }
+    if (given && stored) {
+      /* Ring got the provisional numbers */
+      history_->Drop(conv);
+      logger_->log(spdlog::level::info, std::to_string(given) + " messages of a conversation were numbered "
+                   "before its stored ones were known, they are stored after " + std::to_string(stored));
+    }
+  }
+}
+
+void PtxChatServer::KeepUnstored(const ChatMsg& msg, const std::string& conv, bool provisional) {
+  if (unstored_.size() >= MAX_UNSTORED_MSGS) {
+    m_.unstored->Add();
+    return;
+  }
+  auto copy = std::make_shared<ChatMsg>();
+  copy->hdr = msg.hdr;
+  copy->buf = (uint8_t*)malloc(msg.hdr.buf_len);
+  memcpy(copy->buf, msg.buf, msg.hdr.buf_len);
+  unstored_.push_back(UnstoredMsg{std::move(copy), conv, provisional});
+  if (unstored_.size() == MAX_UNSTORED_MSGS)
+    logger_->log(spdlog::level::warn, std::to_string(MAX_UNSTORED_MSGS) + " delivered messages wait for storage, "
+                 "newer ones are not stored until it takes them");
+}
+
+void PtxChatServer::StoreUnstored() {
+  std::vector<std::shared_ptr<ChatMsg>> ready;
+  for (auto& u : unstored_) {
+    if (!u.provisional)
+      ready.push_back(u.msg);
+  }
+  if (ready.empty() || !storage_->AddMsgs(ready))
+    return;
+  unstored_.erase(std::remove_if(unstored_.begin(), unstored_.end(),
+                                 [](const UnstoredMsg& u) { return !u.provisional; }),
+                  unstored_.end());
+  logger_->log(spdlog::level::info, "Storage took " + std::to_string(ready.size()) +
+               " messages delivered while it was not available");
+}
+
+void PtxChatServer::ProcessHistoryReq(std::shared_ptr<ChatMsg> msg) {
+  std::string nick = msg->hdr.from;
+  if (msg->hdr.buf_len != sizeof(HistoryReq)) {
+    logger_->log(spdlog::level::err, "Cannot send history to " + nick + ": bad request");
+    return;
+  }
+  HistoryReq req;
+  memcpy(&req, msg->buf, sizeof(req));
+
+  std::unique_lock<std::mutex> lc(clients_mtx_);
+  auto res = clients_.find(nick);
+  if (res == clients_.end()) {
+    logger_->log(spdlog::level::err, "Cannot send history to " + nick + ": client not found");
+    return;
+  }
+  auto client = res->second;
+  if (!client->IsRegistered()) {
+    logger_->log(spdlog::level::err, "Cannot send history to " + nick + ": client not registered");
+    return;
+  }
+  if (client->GetIP() != msg->hdr.src_ip || client->GetPort() != msg->hdr.src_port) {
+    logger_->log(spdlog::level::err, "Cannot send history to " + nick + ": was registered from another address");
+    return;
+  }
+  lc.unlock();
+
+  req.limit = std::min(req.limit, MAX_HISTORY_PAGE);
+  if (SendHistory(client, req) && msg->trace)
+    msg->trace->Mark(TraceStage::SEND, client->GetSocket());
+}
+
+bool PtxChatServer::SendHistory(std::shared_ptr<Connection> client, const HistoryReq& req) {
+  const std::string& nick = client->GetNickname();
+  uint32_t limit = req.limit;
+  std::string peer(req.peer, strnlen(req.peer, MAX_NICKNAME_LEN));
+  std::vector<frame_t> frames;
+  bool has_more = false;
+
+  /* Recent pages of a single conversation are kept encoded in memory */
+  std::string conv;
+  bool single_conv = req.scope == HistoryScope::PUBLIC || !peer.empty();
+  if (single_conv)
+    conv = req.scope == HistoryScope::PUBLIC ? PUBLIC_CONVERSATION : ConversationKey(nick, peer);
+  bool cached = false;
+  if (single_conv) {
+    cached = history_->Get(conv, req.before, req.after, limit,
+                           [this, &conv](uint32_t n, msg_page_t& p) {
+                             p = storage_->GetConversationMsgs(conv, 0, 0, n);
+                             return storage_->IsConnected();
+                           }, frames, has_more);
+  }
+
+  uint64_t next = req.before;
+  if (!cached) {
+    /* Ask for one extra message to know if there is a next page */
+    msg_page_t page;
+    auto start = std::chrono::steady_clock::now();
+    if (single_conv)
+      page = storage_->GetConversationMsgs(conv, req.before, req.after, limit + 1);
+    else
+      page = storage_->GetPrivateMsgs(nick, req.before, req.after, limit + 1);
+    if (storage_->IsConnected())
+      m_.storage_read->Observe(std::chrono::duration_cast<std::chrono::microseconds>(
+                                 std::chrono::steady_clock::now() - start).count());
+
+    has_more = page.size() > limit;
+    /* The extra message is the oldest one */
+    for (size_t i = has_more ? 1 : 0; i < page.size(); ++i)
+      frames.push_back(EncodeFrame(*page[i]));
+    if (!frames.empty())
+      next = single_conv ? page[has_more ? 1 : 0]->hdr.seq : page[has_more ? 1 : 0]->hdr.ts;
+  } else if (!frames.empty()) {
+    ChatMsgHdr oldest;
+    memcpy(&oldest, frames.front()->data(), sizeof(oldest));
+    next = oldest.seq;
+  }
+
+  HistoryEnd end;
+  end.scope = req.scope;
+  end.count = static_cast<uint32_t>(frames.size());
+  end.next = next;
+  end.after = req.after;
+  end.has_more = has_more;
+  ChatMsg reply;
+  reply.hdr = ChatMsgHdr{MsgType::HISTORY_END, ip_, port_, "ChatServer", "", sizeof(end), 0, 0};
+  std::strcpy(reply.hdr.to, nick.c_str());
+  reply.buf = (uint8_t*)malloc(sizeof(end));
+  memcpy(reply.buf, &end, sizeof(end));
+  frames.push_back(EncodeFrame(reply));
+
+  if (!Connection::SendFramesToConn(frames, client)) {
+    RequestClose(client);
+    logger_->log(spdlog::level::err, "Cannot send history to " + nick + ": connection lost");
+    return false;
+  }
+  CountSent(frames);
+  logger_->log(spdlog::level::debug, "History page of " + std::to_string(end.count) + " messages sent to " + nick +
+               (cached ? " from cache" : " from storage"));
+  return true;
 }
 
 void PtxChatServer::ParseClientMsg(std::unique_ptr<ChatMsg>&& msg) {
   MsgType t = msg->hdr.type;
   std::shared_ptr<ChatMsg> s_msg(msg.release());
+  if (s_msg->trace)
+    s_msg->trace->Mark(TraceStage::DISPATCH);
   switch (t) {
     case MsgType::REGISTER:
+      process_loop_->Enter("ProcessRegMsg");
       ProcessRegMsg(s_msg);
       break;
     case MsgType::UNREGISTER:
+      process_loop_->Enter("ProcessUnregMsg");
       ProcessUnregMsg(s_msg);
       break;
     case MsgType::PRIVATE_DATA:
+      process_loop_->Enter("ProcessPrivateMsg");
       ProcessPrivateMsg(s_msg);
       break;
     case MsgType::PUBLIC_DATA:
+      process_loop_->Enter("ProcessPublicMsg");
       ProcessPublicMsg(s_msg);
       break;
+    case MsgType::BATCH:
+      process_loop_->Enter("ProcessBatch");
+      ProcessBatch(s_msg);
+      break;
+    case MsgType::MCAST_JOIN:
+      process_loop_->Enter("ProcessMcastJoin");
+      ProcessMcastJoin(s_msg);
+      break;
+    case MsgType::HISTORY_REQ:
+      process_loop_->Enter("ProcessHistoryReq");
+      ProcessHistoryReq(s_msg);
+      break;
     case MsgType::ERR_UNKNOWN:
       break;
     default:
       break;
   }
+  if (s_msg->trace)
+    tracer_->Finish(*s_msg);
 }
 
-bool PtxChatServer::SendMsgToClient(std::shared_ptr<ChatMsg> msg, std::shared_ptr<Client> client) {
-  bool res = Connection::SendMsgToConn(msg, client->GetConnection());
-  if (res)
-    PushGuiEvent(GuiEvType::PRIVATE_MSG, std::move(msg));
-  return res;
+bool PtxChatServer::SendMsgToClient(std::shared_ptr<ChatMsg> msg, std::shared_ptr<Connection> client) {
+  if (!Connection::SendMsgToConn(msg, client)) {
+    RequestClose(client);
+    return false;
+  }
+  CountSent(msg->hdr);
+  if (msg->trace)
+    msg->trace->Mark(TraceStage::SEND, client->GetSocket());
+  return true;
 }
 
-void PtxChatServer::SendMsgToAll(std::shared_ptr<ChatMsg> msg) {
-  std::unique_lock<std::mutex> lc_storage(clients_mtx_);
-  for (auto it = clients_.begin(); it != clients_.end(); ++it) {
-    auto client = it->second;
-    int c_fd = client->GetSocket();
-    ssize_t hdr_bytes_sent = send(c_fd, &msg->hdr, sizeof(ChatMsgHdr), 0);
-    if (hdr_bytes_sent == 0) {
-      logger_->log(spdlog::level::info, "Cannot send public message from " + std::string(msg->hdr.from) + ": client disconnected");
-      continue;
-    }
-    if (hdr_bytes_sent < 0) {
-      if (errno == ECONNRESET) {
-        logger_->log(spdlog::level::err, "Cannot send public message from " + std::string(msg->hdr.from) + ": connection reset");
-        continue;
-      }
-      logger_->log(spdlog::level::err, "Cannot send public message from " + std::string(msg->hdr.from) + ": " + strerror(errno));
-      continue;
-    }
+void PtxChatServer::CountSent(const ChatMsgHdr& hdr) {
+  size_t t = static_cast<size_t>(hdr.type);
+  if (t < MSG_TYPE_CNT)
+    m_.msgs_out[t]->Add();
+  m_.bytes_out->Add(sizeof(ChatMsgHdr) + hdr.buf_len);
+}
 
-    ssize_t buf_bytes_sent = send(c_fd, msg->buf, msg->hdr.buf_len, 0);
-    if (buf_bytes_sent == 0) {
-      logger_->log(spdlog::level::info, "Cannot send public message from " + std::string(msg->hdr.from) + ": client disconnected");
-      continue;
+void PtxChatServer::CountSent(const std::vector<frame_t>& frames) {
+  for (auto& f : frames) {
+    ChatMsgHdr hdr;
+    memcpy(&hdr, f->data(), sizeof(hdr));
+    CountSent(hdr);
+  }
+}
+
+void PtxChatServer::SendMsgToAll(std::shared_ptr<ChatMsg> msg) {
+  auto start = std::chrono::steady_clock::now();
+  /* Encoded once for every recipient */
+  std::vector<frame_t> frames{EncodeFrame(*msg)};
+  if (mcast_)
+    mcast_->Send(frames, msg->hdr.seq);
+  std::vector<std::shared_ptr<Connection>> to;
+  {
+    std::unique_lock<std::mutex> lc(clients_mtx_);
+    to.reserve(clients_.size());
+    for (auto& [nick, client] : clients_) {
+      if (!client->IsMulticast())
+        to.push_back(client);
     }
-    if (buf_bytes_sent < 0) {
-      if (errno == ECONNRESET) {
-        logger_->log(spdlog::level::err, "Cannot send public message from " + std::string(msg->hdr.from) + ": connection reset");
-        continue;
-      }
-      logger_->log(spdlog::level::err, "Cannot send public message from " + std::string(msg->hdr.from) + ": " + strerror(errno));
+  }
+  for (auto& client : to) {
+    if (!Connection::SendFramesToConn(frames, client)) {
+      RequestClose(client);
+      logger_->log(spdlog::level::info, "Cannot send public message from " + std::string(msg->hdr.from) + " to " +
+                   client->GetNickname() + ": connection lost");
+      m_.drop_send_failed->Add();
       continue;
     }
+    CountSent(msg->hdr);
+    if (msg->trace)
+      msg->trace->Mark(TraceStage::SEND, client->GetSocket());
   }
+  m_.fanout->Observe(std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now() - start).count());
 
   logger_->log(spdlog::level::info, "Public message from " + std::string(msg->hdr.from) + ": sent");
-  PushGuiEvent(GuiEvType::PUBLIC_MSG, msg);
+  Notify(GuiEvType::PUBLIC_MSG, msg);
 }
 
 void PtxChatServer::Stop() {
@@ -440,30 +1319,78 @@ void PtxChatServer::Stop() {
   accept_conn_thread_.stop = 1;
   process_msg_thread_.stop = 1;
 
-  connections_.clear();
+  connections_.Clear();
   clients_.clear();
   client_msgs_->stop(true);
+  if (stall_)
+    stall_->Stop();
 
   logger_->log(spdlog::level::info, "Server stopped");
-  PushGuiEvent(GuiEvType::SRV_STOP, nullptr);
+  Notify(GuiEvType::SRV_STOP, nullptr);
 }
 
 void PtxChatServer::Finalize() {
   Stop();
+  status_.reset();
+  StopStorageThread();
   if (socket_) {
     shutdown(socket_, SHUT_RDWR);
     close(socket_);
   }
+  if (wake_fd_ >= 0) {
+    close(wake_fd_);
+    wake_fd_ = -1;
+  }
 }
 
-void PtxChatServer::CloseConnection(int c) {
-  std::unique_lock<std::mutex> lc(conn_mtx_);
-  auto conn = connections_.find(c);
-  if (conn == connections_.end())
+void PtxChatServer::RequestClose(const std::shared_ptr<Connection>& conn) {
+  if (conn->Status() == ConnStatus::UP)
+    conn->SetStatus(ConnStatus::ERROR);
+  {
+    std::unique_lock<std::mutex> lc(close_mtx_);
+    close_reqs_.push_back(conn->GetHandle());
+  }
+  uint64_t one = 1;
+  if (wake_fd_ >= 0 && write(wake_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    logger_->log(spdlog::level::err, "Cannot wake reactor: " + std::string(strerror(errno)));
+}
+
+void PtxChatServer::CloseRequested() {
+  /* One read resets the counter, later requests wake the reactor again */
+  uint64_t cnt;
+  if (read(wake_fd_, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+    logger_->log(spdlog::level::err, "Cannot read wake event: " + std::string(strerror(errno)));
+  std::vector<ConnHandle> reqs;
+  {
+    std::unique_lock<std::mutex> lc(close_mtx_);
+    reqs.swap(close_reqs_);
+  }
+  for (auto h : reqs)
+    CloseConnection(h);
+}
+
+void PtxChatServer::CloseConnection(ConnHandle h) {
+  auto conn = connections_.Get(h);
+  if (!conn)
     return;
-  shutdown(conn->second->GetSocket(), SHUT_RD);
-  close(conn->second->GetSocket());
-  connections_.erase(conn);
+  {
+    /* Messages to clients of closed connection go to mailboxes */
+    std::unique_lock<std::mutex> lc_cl(clients_mtx_);
+    auto it = clients_.find(conn->GetNickname());
+    if (it != clients_.end() && it->second == conn)
+      clients_.erase(it);
+  }
+  /* Handle goes stale before the socket can be reused */
+  connections_.Remove(h);
+  int c = conn->GetSocket();
+  if (capture_)
+    capture_->Close(conn->GetId());
+  /* Senders may still hold the connection, ~Connection closes the socket after the last of them */
+  conn->Unwatch();
+  conn->SetStatus(ConnStatus::CLOSED);
+  shutdown(c, SHUT_RDWR);
+  m_.conn_closed->Add();
+  PTX_PROBE(conn_close, c);
 }
 
 bool PtxChatServer::CheckPortRange(uint16_t port) {
@@ -478,8 +1405,454 @@ bool PtxChatServer::CheckPortRange(uint16_t port) {
   return true;
 }
 
+bool PtxChatServer::SetStorageOptions(const std::string& uri, size_t pool_size) {
+  if (is_running_)
+    return false;
+  storage_uri_ = uri;
+  storage_pool_size_ = pool_size;
+  InitStorage();
+  return true;
+}
+
 void PtxChatServer::InitStorage() {
-  storage_ = std::make_unique<ServerStorage>();
+  StopStorageThread();
+  auto storage = std::make_unique<ServerStorage>(storage_uri_, storage_pool_size_);
+  auto history = std::make_unique<HistoryCache>();
+  auto mailbox = std::make_unique<Mailboxes>(storage.get());
+  {
+    /* Old ones are freed after the lock, mailbox first */
+    std::unique_lock<std::mutex> lc(storage_mtx_);
+    storage_.swap(storage);
+    history_.swap(history);
+    mailbox_.swap(mailbox);
+  }
+  {
+    /* Sequence numbers of the old storage, public ones are loaded first */
+    std::unique_lock<std::mutex> lc(seq_mtx_);
+    conv_seqs_.clear();
+    conv_seqs_.emplace(PUBLIC_CONVERSATION, ConvSeq{});
+  }
+  {
+    std::unique_lock<std::mutex> lc(startup_mtx_);
+    seq_loads_.assign(1, PUBLIC_CONVERSATION);
+    loaded_seqs_.clear();
+    seqs_loaded_ = false;
+  }
+  unstored_.clear();
+  cache_warm_ = false;
+
+  /* Server accepts clients while storage connects */
+  storage_thread_.stop = 0;
+  storage_thread_.thread = std::thread(&PtxChatServer::ConnectStorage, this);
+}
+
+void PtxChatServer::ConnectStorage() {
+  int delay = STORAGE_RETRY_MIN_MS;
+  bool connected = false;
+  while (!storage_thread_.stop) {
+    int wait = STORAGE_RETRY_MIN_MS;
+    /* A failed storage call clears IsConnected(), it is checked here to reconnect */
+    if (connected && !storage_->IsConnected()) {
+      logger_->log(spdlog::level::err, "Storage connection lost, reconnecting");
+      connected = false;
+      delay = STORAGE_RETRY_MIN_MS;
+    }
+    if (!connected) {
+      if (storage_->Connect()) {
+        logger_->log(spdlog::level::info, "Storage connected");
+        connected = true;
+      } else {
+        logger_->log(spdlog::level::warn, "Storage is not available, retry in " + std::to_string(delay) + " ms");
+        wait = delay;
+        delay = std::min(delay * 2, STORAGE_RETRY_MAX_MS);
+      }
+    }
+    /* Warm up recent history of public chat, it is requested on every login */
+    if (connected && !cache_warm_ && history_->Warm(PUBLIC_CONVERSATION, [this](uint32_t n, msg_page_t& p) {
+                                                      p = storage_->GetConversationMsgs(PUBLIC_CONVERSATION, 0, 0, n);
+                                                      return storage_->IsConnected();
+                                                    })) {
+      cache_warm_ = true;
+      logger_->log(spdlog::level::info, "History cache warmed up, server is ready");
+    }
+    if (connected)
+      LoadRequestedSeqs();
+    std::unique_lock<std::mutex> lc(startup_mtx_);
+    startup_cv_.wait_for(lc, std::chrono::milliseconds(wait), [this, connected] {
+      return storage_thread_.stop != 0 || (connected && !seq_loads_.empty());
+    });
+  }
+}
+
+void PtxChatServer::LoadRequestedSeqs() {
+  std::vector<std::string> convs;
+  {
+    std::unique_lock<std::mutex> lc(startup_mtx_);
+    convs.swap(seq_loads_);
+  }
+  std::vector<std::pair<std::string, uint64_t>> loaded;
+  size_t i = 0;
+  for (; i < convs.size(); ++i) {
+    uint64_t seq;
+    if (!storage_->GetLastSeq(convs[i], seq))
+      break;
+    loaded.emplace_back(std::move(convs[i]), seq);
+  }
+  std::unique_lock<std::mutex> lc(startup_mtx_);
+  /* The rest waits for the reconnect */
+  seq_loads_.insert(seq_loads_.end(), convs.begin() + static_cast<std::ptrdiff_t>(i), convs.end());
+  if (loaded.empty())
+    return;
+  loaded_seqs_.insert(loaded_seqs_.end(), loaded.begin(), loaded.end());
+  seqs_loaded_ = true;
+}
+
+void PtxChatServer::StopStorageThread() {
+  {
+    std::unique_lock<std::mutex> lc(startup_mtx_);
+    storage_thread_.stop = 1;
+  }
+  startup_cv_.notify_all();
+  if (storage_thread_.thread.joinable())
+    storage_thread_.thread.join();
+}
+
+bool PtxChatServer::IsReady() const {
+  std::unique_lock<std::mutex> lc(storage_mtx_);
+  return socket_ > 0 && storage_->IsConnected() && cache_warm_;
+}
+
+void PtxChatServer::SetObserver(std::shared_ptr<ServerObserver> observer) {
+  if (is_running_) {
+    logger_->log(spdlog::level::err, "Cannot set observer: server is running");
+    return;
+  }
+  observer_ = std::move(observer);
+}
+
+bool PtxChatServer::SetTraceOptions(const std::string& path, uint32_t sample_every) {
+  if (is_running_) {
+    logger_->log(spdlog::level::err, "Cannot set tracing: server is running");
+    return false;
+  }
+  tracer_.reset();
+  if (!sample_every)
+    return true;
+  auto tracer = std::make_unique<Tracer>(path, sample_every);
+  if (!tracer->IsOpen()) {
+    logger_->log(spdlog::level::err, "Cannot open trace file " + path + ": " + strerror(errno));
+    return false;
+  }
+  tracer_ = std::move(tracer);
+  logger_->log(spdlog::level::info, "Tracing 1 of " + std::to_string(sample_every) + " messages to " + path);
+  return true;
+}
+
+bool PtxChatServer::SetCaptureOptions(const std::string& path) {
+  if (is_running_) {
+    logger_->log(spdlog::level::err, "Cannot set capture: server is running");
+    return false;
+  }
+  capture_.reset();
+  if (path.empty())
+    return true;
+  auto capture = std::make_unique<CaptureWriter>(path);
+  if (!capture->IsOpen()) {
+    logger_->log(spdlog::level::err, "Cannot open capture file " + path + ": " + strerror(errno));
+    return false;
+  }
+  capture_ = std::move(capture);
+  logger_->log(spdlog::level::info, "Capturing received messages to " + path);
+  return true;
+}
+
+bool PtxChatServer::SetStallThreshold(uint32_t ms) {
+  if (is_running_) {
+    logger_->log(spdlog::level::err, "Cannot set stall threshold: server is running");
+    return false;
+  }
+  stall_ms_ = ms;
+  stall_.reset();
+  accept_loop_->SetStallThreshold(ms);
+  process_loop_->SetStallThreshold(ms);
+  return true;
+}
+
+bool PtxChatServer::SetSocketBufferSize(int bytes) {
+  if (is_running_) {
+    logger_->log(spdlog::level::err, "Cannot set socket buffer size: server is running");
+    return false;
+  }
+  sock_buf_ = bytes > 0 ? bytes : 0;
+  return true;
+}
+
+bool PtxChatServer::SetTlsOptions(const std::string& cert_path, const std::string& key_path) {
+  if (is_running_) {
+    logger_->log(spdlog::level::err, "Cannot set TLS: server is running");
+    return false;
+  }
+  if (mcast_) {
+    logger_->log(spdlog::level::err, "Cannot set TLS: multicast would send public messages in clear text");
+    return false;
+  }
+  if (!KernelTlsAvailable()) {
+    logger_->log(spdlog::level::err, "Cannot set TLS: kernel has no TLS support (modprobe tls)");
+    return false;
+  }
+  std::string err;
+  auto tls = TlsContext::NewServer(cert_path, key_path, err);
+  if (!tls) {
+    logger_->log(spdlog::level::err, "Cannot set TLS: " + err);
+    return false;
+  }
+  tls_ = std::move(tls);
+  logger_->log(spdlog::level::info, "TLS enabled with certificate " + cert_path);
+  return true;
+}
+
+bool PtxChatServer::SetRateLimitOptions(const RateLimitConfig& cfg) {
+  if (is_running_) {
+    logger_->log(spdlog::level::err, "Cannot set rate limits: server is running");
+    return false;
+  }
+  limiter_.reset();
+  if (!cfg.Enabled())
+    return true;
+  limiter_ = std::make_unique<RateLimiter>(cfg);
+  logger_->log(spdlog::level::info, "Rate limits: " + std::to_string(cfg.conn_rate) + " msg/s per connection, " +
+               std::to_string(cfg.user_rate) + " msg/s per user");
+  return true;
+}
+
+bool PtxChatServer::SetMulticastOptions(const std::string& group, uint16_t port, const std::string& iface,
+                                        int ttl) {
+  if (is_running_) {
+    logger_->log(spdlog::level::err, "Cannot set multicast: server is running");
+    return false;
+  }
+  mcast_.reset();
+  if (group.empty())
+    return true;
+  if (tls_) {
+    logger_->log(spdlog::level::err, "Cannot set multicast: datagrams are not encrypted, TLS is enabled");
+    return false;
+  }
+  in_addr group_addr{};
+  in_addr if_addr{};
+  if_addr.s_addr = INADDR_ANY;
+  if (inet_pton(AF_INET, group.c_str(), &group_addr) != 1 || !IN_MULTICAST(ntohl(group_addr.s_addr)) || !port) {
+    logger_->log(spdlog::level::err, "Cannot set multicast: bad group " + group + ":" + std::to_string(port));
+    return false;
+  }
+  if (!iface.empty() && inet_pton(AF_INET, iface.c_str(), &if_addr) != 1) {
+    logger_->log(spdlog::level::err, "Cannot set multicast: bad interface address " + iface);
+    return false;
+  }
+  auto mcast = std::make_unique<MulticastSender>(group_addr.s_addr, port, if_addr.s_addr, ttl);
+  if (!mcast->IsOpen()) {
+    logger_->log(spdlog::level::err, "Cannot set multicast: " + std::string(strerror(errno)));
+    return false;
+  }
+  mcast_ = std::move(mcast);
+  logger_->log(spdlog::level::info, "Public messages of joined clients go to " + group + ":" + std::to_string(port));
+  return true;
+}
+
+bool PtxChatServer::SetStatusPort(uint16_t port) {
+  status_port_ = port;
+  InitStatus();
+  return !port || status_->GetPort() == port;
+}
+
+void PtxChatServer::InitStatus() {
+  status_ = std::make_unique<StatusServer>();
+  status_->AddHandler("/ready", [this](std::string& body) {
+    body = IsReady() ? "ready\n" : "starting\n";
+    return IsReady() ? 200 : 503;
+  });
+  status_->AddHandler("/status", [this](std::string& body) {
+    bool storage_connected;
+    {
+      std::unique_lock<std::mutex> lc(storage_mtx_);
+      storage_connected = storage_->IsConnected();
+    }
+    body = "listening " + std::to_string(socket_ > 0) + "\n" +
+           "running " + std::to_string(is_running_) + "\n" +
+           "storage_connected " + std::to_string(storage_connected) + "\n" +
+           "cache_warm " + std::to_string(cache_warm_.load()) + "\n" +
+           "ready " + std::to_string(IsReady()) + "\n";
+    size_t conns = m_.conn_accepted->Value() - m_.conn_closed->Value();
+    size_t rss = RssBytes();
+    body += "connections " + std::to_string(conns) + "\n" +
+            "rss_bytes " + std::to_string(rss) + "\n" +
+            "rss_bytes_per_connection " + std::to_string(conns ? rss / conns : 0) + "\n" +
+            "recv_buffers_in_use " + std::to_string(Connection::RecvPool().InUse()) + "\n";
+    return 200;
+  });
+  status_->AddHandler("/metrics", [this](std::string& body) {
+    metrics_.Render(body);
+    return 200;
+  });
+  if (status_port_)
+    status_->Start(status_port_);
+}
+
+size_t PtxChatServer::RssBytes() {
+  /* Second field of statm is resident pages */
+  std::ifstream statm("/proc/self/statm");
+  size_t pages = 0;
+  size_t resident = 0;
+  if (!(statm >> pages >> resident))
+    return 0;
+  return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+void PtxChatServer::InitMetrics() {
+  m_.conn_accepted = metrics_.AddCounter("ptxchat_connections_accepted_total", "Accepted client connections");
+  m_.conn_closed = metrics_.AddCounter("ptxchat_connections_closed_total", "Closed client connections");
+  metrics_.AddGauge("ptxchat_connections", "Open client connections", [this] {
+    return static_cast<double>(m_.conn_accepted->Value() - m_.conn_closed->Value());
+  });
+  metrics_.AddGauge("ptxchat_memory_rss_bytes", "Resident memory of the server", [] {
+    return static_cast<double>(RssBytes());
+  });
+  /* Object sizes only, allocator and shared_ptr overhead come on top */
+  metrics_.AddGauge("ptxchat_memory_bytes", "Memory of connection state by part", [this] {
+    return static_cast<double>(connections_.Bytes());
+  }, "part=\"conn_table\"");
+  metrics_.AddGauge("ptxchat_memory_bytes", "", [this] {
+    return static_cast<double>((m_.conn_accepted->Value() - m_.conn_closed->Value()) * sizeof(Connection));
+  }, "part=\"connections\"");
+  metrics_.AddGauge("ptxchat_memory_bytes", "", [this] {
+    std::unique_lock<std::mutex> lc(clients_mtx_);
+    return static_cast<double>(clients_.size() * sizeof(decltype(clients_)::value_type));
+  }, "part=\"clients\"");
+  metrics_.AddGauge("ptxchat_memory_bytes", "", [] {
+    return static_cast<double>(Connection::RecvPool().Bytes());
+  }, "part=\"recv_buffers\"");
+  metrics_.AddGauge("ptxchat_recv_buffers_in_use", "Receive buffers lent to partly read frames", [] {
+    return static_cast<double>(Connection::RecvPool().InUse());
+  });
+  metrics_.AddGauge("ptxchat_memory_bytes_per_connection", "Resident memory divided by open connections", [this] {
+    uint64_t conns = m_.conn_accepted->Value() - m_.conn_closed->Value();
+    return conns ? static_cast<double>(RssBytes()) / static_cast<double>(conns) : 0.0;
+  });
+  m_.reg_new = metrics_.AddCounter("ptxchat_registrations_total", "Handled registrations", "result=\"new\"");
+  m_.reg_resumed = metrics_.AddCounter("ptxchat_registrations_total", "", "result=\"resumed\"");
+  m_.reg_rejected = metrics_.AddCounter("ptxchat_registrations_total", "", "result=\"rejected\"");
+  metrics_.AddGauge("ptxchat_clients_registered", "Registered clients", [this] {
+    std::unique_lock<std::mutex> lc(clients_mtx_);
+    return static_cast<double>(clients_.size());
+  });
+
+  for (size_t t = 0; t < MSG_TYPE_CNT; ++t)
+    m_.msgs_in[t] = metrics_.AddCounter("ptxchat_messages_received_total", "Messages received from clients",
+                                        "type=\"" + std::string(MSG_TYPE_NAMES[t]) + "\"");
+  for (size_t t = 0; t < MSG_TYPE_CNT; ++t)
+    m_.msgs_out[t] = metrics_.AddCounter("ptxchat_messages_sent_total", "Messages sent to clients",
+                                         "type=\"" + std::string(MSG_TYPE_NAMES[t]) + "\"");
+  m_.bytes_in = metrics_.AddCounter("ptxchat_received_bytes_total", "Bytes of messages received from clients");
+  m_.bytes_out = metrics_.AddCounter("ptxchat_sent_bytes_total", "Bytes of messages sent to clients");
+
+  metrics_.AddGauge("ptxchat_queue_depth", "Messages waiting in server queues", [this] {
+    return static_cast<double>(client_msgs_->size());
+  }, "queue=\"client_msgs\"");
+  metrics_.AddGauge("ptxchat_queue_depth", "", [this] {
+    std::unique_lock<std::mutex> lc(storage_mtx_);
+    return static_cast<double>(mailbox_->GetStats().depth);
+  }, "queue=\"mailbox\"");
+  metrics_.AddGauge("ptxchat_mailbox_bytes", "Size of offline private messages kept in memory", [this] {
+    std::unique_lock<std::mutex> lc(storage_mtx_);
+    return static_cast<double>(mailbox_->GetStats().bytes);
+  });
+
+  m_.fanout = metrics_.AddHistogram("ptxchat_fanout_duration_seconds", "Time to send a public message to every client");
+  m_.storage_write = metrics_.AddHistogram("ptxchat_storage_duration_seconds", "Time of storage operations",
+                                           DEF_LATENCY_BOUNDS, "op=\"write\"");
+  m_.storage_read = metrics_.AddHistogram("ptxchat_storage_duration_seconds", "", DEF_LATENCY_BOUNDS,
+                                          "op=\"read\"");
+  metrics_.AddGauge("ptxchat_storage_connected", "1 if storage is connected", [this] {
+    std::unique_lock<std::mutex> lc(storage_mtx_);
+    return storage_->IsConnected() ? 1.0 : 0.0;
+  });
+  metrics_.AddGauge("ptxchat_storage_pool_in_use", "Storage connections checked out", [this] {
+    std::unique_lock<std::mutex> lc(storage_mtx_);
+    return static_cast<double>(storage_->GetPoolStats().in_use);
+  });
+
+  m_.tls_done = metrics_.AddCounter("ptxchat_tls_handshakes_total", "TLS handshakes of client connections",
+                                    "result=\"ok\"");
+  m_.tls_failed = metrics_.AddCounter("ptxchat_tls_handshakes_total", "", "result=\"failed\"");
+  m_.tls_timeout = metrics_.AddCounter("ptxchat_tls_handshakes_total", "", "result=\"timeout\"");
+
+  m_.rate_limited = metrics_.AddCounter("ptxchat_rate_limited_total", "Received messages over a rate limit");
+  m_.rate_disconnects = metrics_.AddCounter("ptxchat_rate_limit_disconnects_total",
+                                            "Connections closed for going over a rate limit");
+  m_.banned = metrics_.AddCounter("ptxchat_banned_addresses_total", "Client addresses banned for rate limit violations");
+  m_.conn_refused = metrics_.AddCounter("ptxchat_connections_refused_total", "Connections closed right after accept",
+                                        "reason=\"banned\"");
+  m_.conn_refused_slots = metrics_.AddCounter("ptxchat_connections_refused_total", "",
+                                              "reason=\"no_slot\"");
+
+  metrics_.AddCounter("ptxchat_multicast_datagrams_total", "Datagrams sent to the multicast group", [this] {
+    return mcast_ ? static_cast<double>(mcast_->Datagrams()) : 0.0;
+  });
+  metrics_.AddCounter("ptxchat_multicast_sent_bytes_total", "Bytes sent to the multicast group", [this] {
+    return mcast_ ? static_cast<double>(mcast_->Bytes()) : 0.0;
+  });
+
+  m_.drop_queue_full = metrics_.AddCounter("ptxchat_dropped_total", "Messages or events lost",
+                                           "reason=\"queue_full\"");
+  m_.drop_send_failed = metrics_.AddCounter("ptxchat_dropped_total", "", "reason=\"send_failed\"");
+  m_.drop_rate_limited = metrics_.AddCounter("ptxchat_dropped_total", "", "reason=\"rate_limit\"");
+  m_.unstored = metrics_.AddCounter("ptxchat_unstored_total", "Delivered messages that storage never got");
+  metrics_.AddCounter("ptxchat_dropped_total", "", [this] {
+    std::unique_lock<std::mutex> lc(storage_mtx_);
+    return static_cast<double>(mailbox_->GetStats().dropped);
+  }, "reason=\"mailbox\"");
+  metrics_.AddCounter("ptxchat_dropped_total", "", [this] {
+    return observer_ ? static_cast<double>(observer_->GetStats().dropped) : 0.0;
+  }, "reason=\"observer\"");
+  metrics_.AddCounter("ptxchat_dropped_total", "", [this] {
+    return tracer_ ? static_cast<double>(tracer_->Dropped()) : 0.0;
+  }, "reason=\"tracer\"");
+  metrics_.AddCounter("ptxchat_dropped_total", "", [this] {
+    return capture_ ? static_cast<double>(capture_->Dropped()) : 0.0;
+  }, "reason=\"capture\"");
+  metrics_.AddCounter("ptxchat_dropped_total", "", [this] {
+    return mcast_ ? static_cast<double>(mcast_->Errors()) : 0.0;
+  }, "reason=\"multicast\"");
+
+  accept_loop_ = std::make_unique<LoopMonitor>("accept",
+    metrics_.AddHistogram("ptxchat_loop_iteration_seconds", "Time of one server loop iteration",
+                          LOOP_LATENCY_BOUNDS, "loop=\"accept\""),
+    metrics_.AddHistogram("ptxchat_loop_lag_seconds", "Time work waited in a server loop before its handler ran",
+                          LOOP_LATENCY_BOUNDS, "loop=\"accept\""));
+  process_loop_ = std::make_unique<LoopMonitor>("process",
+    metrics_.AddHistogram("ptxchat_loop_iteration_seconds", "", LOOP_LATENCY_BOUNDS, "loop=\"process\""),
+    metrics_.AddHistogram("ptxchat_loop_lag_seconds", "", LOOP_LATENCY_BOUNDS, "loop=\"process\""));
+  metrics_.AddCounter("ptxchat_loop_stalls_total", "Server loop iterations over the stall threshold", [this] {
+    return static_cast<double>(accept_loop_->Stalls());
+  }, "loop=\"accept\"");
+  metrics_.AddCounter("ptxchat_loop_stalls_total", "", [this] {
+    return static_cast<double>(process_loop_->Stalls());
+  }, "loop=\"process\"");
+}
+
+MailboxStats PtxChatServer::GetMailboxStats() const {
+  std::unique_lock<std::mutex> lc(storage_mtx_);
+  return mailbox_->GetStats();
+}
+
+StoragePoolStats PtxChatServer::GetStoragePoolStats() const {
+  std::unique_lock<std::mutex> lc(storage_mtx_);
+  return storage_->GetPoolStats();
+}
+
+HistoryCacheStats PtxChatServer::GetHistoryCacheStats() const {
+  std::unique_lock<std::mutex> lc(storage_mtx_);
+  return history_->GetStats();
 }
 
 PtxChatServer::~PtxChatServer() {
@@ -3,18 +3,35 @@
 
 #include <stdint.h>
 
+#include <atomic>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <memory>
+#include <deque>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <functional>
+#include <queue>
+#include <utility>
 
 #include "Threads.h"
 #include "Message.h"
-#include "PtxGuiBackend.h"
-#include "client.h"
+#include "SharedUDeque.h"
+#include "connections.h"
 #include "server_storage.h"
+#include "history_cache.h"
+#include "mailbox.h"
+#include "status_server.h"
+#include "observer.h"
+#include "metrics.h"
+#include "tracer.h"
+#include "capture.h"
+#include "loop_monitor.h"
+#include "rate_limit.h"
+#include "multicast.h"
 
 namespace ptxchat {
 
@@ -25,8 +42,44 @@ static constexpr int DEF_LISTEN_Q_LEN =     1000;
 static const char* DEF_SERVER_LOG_PATH =    "ptx_server.log";
 static constexpr size_t MAX_LOG_FILE_SIZE = 10000000;
 static constexpr size_t MAX_LOG_FILES_CNT = 10;
+static constexpr int STORAGE_RETRY_MIN_MS = 100;
+static constexpr int STORAGE_RETRY_MAX_MS = 5000;
+static constexpr size_t MAX_UNSTORED_MSGS = 10000;  /**< Delivered messages kept until storage takes them */
+static constexpr int STORE_RETRY_MS =       50;     /**< How often unstored messages check for storage */
+static constexpr int TLS_HANDSHAKE_MS =     10000;  /**< Connections that are not through TLS handshake by then are closed */
+static constexpr ConnHandle WAKE_EVENT =    UINT64_MAX;  /**< epoll data of the wake event, never a connection handle */
 
-class PtxChatServer: public GUIBackend {
+/**
+ * \brief Metrics updated on hot paths, owned by the registry
+ */
+struct ServerMetrics {
+  Counter* conn_accepted;
+  Counter* conn_closed;
+  Counter* reg_new;
+  Counter* reg_resumed;
+  Counter* reg_rejected;
+  Counter* msgs_in[MSG_TYPE_CNT];
+  Counter* msgs_out[MSG_TYPE_CNT];
+  Counter* bytes_in;
+  Counter* bytes_out;
+  Counter* drop_queue_full;    /**< Received messages lost because the queue was full */
+  Counter* drop_send_failed;   /**< Public messages not delivered to a recipient */
+  Counter* tls_done;
+  Counter* tls_failed;
+  Counter* tls_timeout;
+  Counter* drop_rate_limited;  /**< Received messages discarded over a rate limit */
+  Counter* unstored;           /**< Delivered messages never stored, MAX_UNSTORED_MSGS were waiting */
+  Counter* rate_limited;       /**< Messages over a rate limit, whatever the action */
+  Counter* rate_disconnects;
+  Counter* banned;             /**< Addresses banned for repeated violations */
+  Counter* conn_refused;       /**< Connections of banned addresses closed at accept */
+  Counter* conn_refused_slots; /**< Connections with sockets over connection table size */
+  Histogram* fanout;
+  Histogram* storage_write;
+  Histogram* storage_read;
+};
+
+class PtxChatServer {
  public:
   PtxChatServer() noexcept;
   PtxChatServer(const std::string& ip, uint16_t port) noexcept;
@@ -43,6 +96,112 @@ class PtxChatServer: public GUIBackend {
   void Stop();
 
   void SetListenQueueSize(int size);
+
+  /**
+   * \brief Reconnect storage with given MongoDB uri and connection pool size
+   * \return false if server is running
+   **/
+  bool SetStorageOptions(const std::string& uri, size_t pool_size);
+
+  /**
+   * \brief Serve status endpoint on 127.0.0.1:port, 0 (default) disables it
+   *
+   * Off unless set, so servers sharing a host do not fight over a port.
+   * \return false if the port cannot be bound
+   **/
+  bool SetStatusPort(uint16_t port);
+
+  /**
+   * \brief Tap server events, nullptr (default) disables it
+   *
+   * Must be set before Start(). Without an observer events cost nothing.
+   **/
+  void SetObserver(std::shared_ptr<ServerObserver> observer);
+
+  /**
+   * \brief Trace one of sample_every received messages to a Chrome trace file
+   *
+   * Must be set before Start(), 0 disables tracing (default).
+   * \return false if server is running or the file cannot be created
+   **/
+  bool SetTraceOptions(const std::string& path, uint32_t sample_every);
+
+  /**
+   * \brief Record every received message to a capture file for ptx-replay
+   *
+   * The file holds private messages and resume tokens, it is readable
+   * by its owner only. Must be set before Start(), empty path disables capture (default).
+   * \return false if server is running or the file cannot be created
+   **/
+  bool SetCaptureOptions(const std::string& path);
+
+  /**
+   * \brief Log server loop iterations longer than ms with the stack of the stalled thread
+   *
+   * Must be set before Start(), 0 disables stall detection (default).
+   * Loop iteration time and lag are measured anyway.
+   * \return false if server is running
+   **/
+  bool SetStallThreshold(uint32_t ms);
+
+  /**
+   * \brief Accept only TLS connections
+   *
+   * Handshake is done by OpenSSL, records are then encrypted by the kernel
+   * (kTLS), so sending and receiving work as on plain sockets. Connections
+   * not through the handshake in TLS_HANDSHAKE_MS are closed.
+   * Must be set before Start().
+   * \return false if server is running, multicast is set, the certificate
+   * or key cannot be used or the kernel has no TLS support
+   **/
+  bool SetTlsOptions(const std::string& cert_path, const std::string& key_path);
+
+  /**
+   * \brief Limit message rate of every connection and nickname
+   *
+   * Checked in the reactor right after a message is decoded. Over the
+   * limit, reading the connection is paused, the message is dropped or
+   * the connection is closed (cfg.action). Addresses that keep violating
+   * limits are refused at accept for a while.
+   * Must be set before Start(), limits are off by default.
+   * \return false if server is running
+   **/
+  bool SetRateLimitOptions(const RateLimitConfig& cfg);
+
+  /**
+   * \brief Send public messages once to a UDP multicast group
+   *
+   * Clients that send MCAST_JOIN get public messages on the group instead
+   * of their TCP connection, and repair gaps with public history requests.
+   * Private and control messages stay on TCP. Datagrams are neither
+   * encrypted nor authenticated, so it cannot be used with TLS; clients
+   * only take them from the address they connected to.
+   * Must be set before Start(), empty group disables it (default).
+   * \param iface address of the sending interface, empty for default route
+   * \return false if server is running, TLS is set, group is not a
+   * multicast address or the socket cannot be set up
+   **/
+  bool SetMulticastOptions(const std::string& group, uint16_t port, const std::string& iface, int ttl);
+
+  /**
+   * \brief Cap kernel receive and send buffers of client sockets
+   *
+   * With many idle clients, socket buffers take most of the memory of a
+   * connection. Fixed size turns off autotuning, so keep it over the
+   * largest burst a client gets (fan-out of a busy public chat).
+   * Must be set before Start(), 0 keeps kernel defaults (default).
+   * \return false if server is running
+   **/
+  bool SetSocketBufferSize(int bytes);
+
+  /**
+   * \brief True when socket listens, storage is connected and cache is warm
+   *
+   * Clients are accepted before that, history is served from storage
+   * or is empty until then. Data messages of a conversation wait for
+   * storage to give its last sequence number, then go out in order.
+   **/
+  [[nodiscard]] bool IsReady() const;
   bool SetIP_i(uint32_t ip);
   bool SetIP_s(const std::string& ip);
   bool SetPort_i(uint16_t port);
@@ -52,52 +211,233 @@ class PtxChatServer: public GUIBackend {
   [[nodiscard]] std::string GetIp_s() const { return std::to_string(ip_); }  // FIXME
   [[nodiscard]] uint16_t    GetPort() const { return port_; }
 
+  /**
+   * \brief Hit, miss and memory counters of recent history cache
+   **/
+  [[nodiscard]] HistoryCacheStats GetHistoryCacheStats() const;
+
+  /**
+   * \brief Depth and delivery time counters of offline mailboxes
+   **/
+  [[nodiscard]] MailboxStats GetMailboxStats() const;
+
+  /**
+   * \brief Checkout latency counters of storage connection pool
+   **/
+  [[nodiscard]] StoragePoolStats GetStoragePoolStats() const;
+
   /* Virtual because may be added derived class for tcp/udp server */
   virtual ~PtxChatServer();
 
  private:
+  friend class PtxChatServerBench;  /**< Drives fan-out without the network loop */
+
   uint32_t ip_;       /**< Server ip (default = 0.0.0.0) */
   uint16_t port_;     /**< Server port (default = 8080) */
   int listen_q_len_;  /**< Max amount of clients in listen queue */
   int socket_;        /**< Server socket (blocking) */
   bool is_running_;   /**< True if server is running */
   int epoll_fd_;
+  int wake_fd_ = -1;  /**< eventfd, wakes the reactor to close connections that failed on other threads */
+  std::mutex close_mtx_;
+  std::vector<ConnHandle> close_reqs_;  /**< Connections to close, under close_mtx_ */
 
+  std::string storage_uri_;    /**< MongoDB uri (default = mongodb://localhost:27017) */
+  size_t storage_pool_size_;   /**< Max storage connections (default = 8) */
+  mutable std::mutex storage_mtx_;                      /**< Status thread reads storage_, history_, mailbox_ under it */
   std::unique_ptr<ServerStorage> storage_;
+  ThreadState storage_thread_;                          /**< Connects storage, reconnects it when lost, warms up cache */
+  std::mutex startup_mtx_;
+  std::condition_variable startup_cv_;
+  std::atomic<bool> cache_warm_{false};
+  uint16_t status_port_;                                /**< Status endpoint port, 0 if off (default) */
+  std::unique_ptr<StatusServer> status_;
+  std::unique_ptr<HistoryCache> history_;               /**< Recent messages of every conversation */
+  std::unique_ptr<Mailboxes> mailbox_;                  /**< Private messages of offline clients */
+  std::shared_ptr<ServerObserver> observer_;            /**< Control panel tap, optional */
+  MetricsRegistry metrics_;                             /**< Served on status endpoint as /metrics */
+  ServerMetrics m_;
+  std::unique_ptr<Tracer> tracer_;                      /**< Message lifecycle traces, optional */
+  std::unique_ptr<CaptureWriter> capture_;              /**< Inbound traffic recording, optional */
+  std::unique_ptr<LoopMonitor> accept_loop_;            /**< Timing of AcceptClients */
+  std::unique_ptr<LoopMonitor> process_loop_;           /**< Timing of ProcessMessages */
+  uint32_t stall_ms_;
+  int sock_buf_;                                        /**< SO_RCVBUF/SO_SNDBUF of clients, 0 for default */
+  std::unique_ptr<StallDetector> stall_;                /**< Runs while server is running */
+  std::unique_ptr<TlsContext> tls_;                     /**< Clients must use TLS if set */
+  std::unique_ptr<RateLimiter> limiter_;                /**< Ingress rate limits, optional */
+  std::unique_ptr<MulticastSender> mcast_;              /**< Public messages of joined clients, optional */
+  /** Connections (resume ns, handle) not read until their time, reactor thread only */
+  using PausedConn = std::pair<uint64_t, ConnHandle>;
+  std::priority_queue<PausedConn, std::vector<PausedConn>, std::greater<PausedConn>> paused_;
+  /** TLS handshakes (deadline ns, handle) in accept order, reactor thread only */
+  std::deque<PausedConn> handshakes_;
 
   ThreadState accept_conn_thread_;                      /**< Accept client connections */
   ThreadState process_msg_thread_;                      /**< Process received messages */
   std::unique_ptr<SharedUDeque<ChatMsg>> client_msgs_;  /**< Client messages storage */
 
   std::mutex clients_mtx_;
-  std::mutex conn_mtx_;
-  std::unordered_map<int, std::shared_ptr<Connection>> connections_;
-  std::unordered_map<std::string, std::shared_ptr<Client>> clients_;
+  ConnTable connections_;                               /**< Written by reactor thread only */
+  /** Registered connections by nickname, keys view Connection::GetNickname() */
+  std::unordered_map<std::string_view, std::shared_ptr<Connection>> clients_;
+
+  /**
+   * Until the stored last number of a conversation is loaded, its
+   * numbers are provisional: they count from 0 and are moved past
+   * the stored ones once it is known.
+   */
+  struct ConvSeq {
+    uint64_t last = 0;   /**< Last sequence number given */
+    bool known = false;  /**< last continues the stored numbers */
+  };
+  std::mutex seq_mtx_;
+  std::unordered_map<std::string, ConvSeq> conv_seqs_;   /**< Every conversation seen since storage was set */
+  /* Conversations to load last numbers of and loaded ones, under startup_mtx_ */
+  std::vector<std::string> seq_loads_;
+  std::vector<std::pair<std::string, uint64_t>> loaded_seqs_;
+  std::atomic<bool> seqs_loaded_{false};
+
+  /** Delivered message storage has not taken yet */
+  struct UnstoredMsg {
+    std::shared_ptr<ChatMsg> msg;  /**< Own copy, its number may still move */
+    std::string conv;
+    bool provisional;              /**< Numbered before the last stored one of conv was known */
+  };
+  std::deque<UnstoredMsg> unstored_;                     /**< Oldest first, processing thread only */
+  std::atomic<uint64_t> last_ts_{0};                     /**< Last timestamp given to a message */
+
+  std::mutex session_mtx_;
+  std::unordered_map<std::string, std::string> sessions_;  /**< Resume token of every nickname, also stored */
 
   void InitSocket();
   void InitStorage();
+  void InitStatus();
+  void InitMetrics();
+  /**
+   * \brief Resident memory of the process, bytes
+   */
+  static size_t RssBytes();
+  void CountSent(const ChatMsgHdr& hdr);
+  void CountSent(const std::vector<frame_t>& frames);
+  void ConnectStorage();
+  /**
+   * \brief Load last stored numbers asked for by LoadSeq(), on storage thread
+   */
+  void LoadRequestedSeqs();
+  void StopStorageThread();
   void Finalize();
+  void Notify(GuiEvType t, const std::shared_ptr<ChatMsg>& msg) {
+    if (observer_)
+      observer_->Notify(t, msg);
+  }
 
   void AcceptClients();
   void ProcessMessages();
 
   void ParseClientMsg(std::unique_ptr<ChatMsg>&& msg);
 
-  void CloseConnection(int c);
+  void CloseConnection(ConnHandle h);
+  /**
+   * \brief Mark connection failed and have the reactor close it now, any thread
+   */
+  void RequestClose(const std::shared_ptr<Connection>& conn);
+  /**
+   * \brief Close connections of RequestClose(), reactor thread only
+   */
+  void CloseRequested();
   bool AddMsgFromConn(std::shared_ptr<Connection> c);
-  bool SendMsgToClient(std::shared_ptr<ChatMsg> msg, std::shared_ptr<Client> client);
+
+  /**
+   * \brief Apply rate limits to a decoded message
+   * \return false if the message must not be queued, close connection if its status is not UP
+   */
+  bool CheckRate(std::shared_ptr<Connection> conn, const ChatMsg& msg, uint64_t now);
+
+  /**
+   * \brief Read paused connections that are due again
+   * \return epoll timeout until the next one, ms
+   */
+  int ResumePaused(uint64_t now);
+
+  /**
+   * \brief Close connections whose TLS handshake is past its deadline
+   * \return epoll timeout until the next deadline, ms
+   */
+  int ExpireHandshakes(uint64_t now);
+
+  /**
+   * \brief Advance TLS handshake of connection
+   * \return false if it failed and connection must be closed
+   */
+  bool ContinueTls(std::shared_ptr<Connection> c);
+  bool SendMsgToClient(std::shared_ptr<ChatMsg> msg, std::shared_ptr<Connection> client);
   void SendMsgToAll(std::shared_ptr<ChatMsg> msg);
 
   /**
    * Register and set nickname
    */
   void ProcessRegMsg(std::shared_ptr<ChatMsg> msg);
+  /**
+   * \brief Send frames taken from the mailbox of client as one stream, put them back if it fails
+   */
+  void DeliverMailbox(std::shared_ptr<Connection> client, std::vector<frame_t> frames);
+  /**
+   * \brief Mailboxes are kept only for nicknames that have registered
+   * \return true if nick has a session here or in storage
+   */
+  bool KnownUser(const std::string& nick);
+  /**
+   * Resume tokens survive restarts in storage
+   * \return RESUME_TOKEN_LEN hex digits from the OpenSSL CSPRNG, empty if it failed
+   */
+  std::string NewSessionToken();
+  bool CheckSessionToken(const std::string& nick, const std::string& token);
+  /**
+   * Send resumed client messages it has not seen since the given bounds
+   */
+  void ReplayMissed(std::shared_ptr<Connection> client, const ResumeReq& req);
+  uint64_t GetLastPublicSeq();
+  /**
+   * Set sequence number of conversation and server time, never waits for storage
+   * \return false if the number is provisional, see ConvSeq
+   */
+  bool StampMsg(std::shared_ptr<ChatMsg> msg, const std::string& conv);
+  /**
+   * \brief Ask storage thread for the last stored number of conversation
+   */
+  void LoadSeq(const std::string& conv);
+  /**
+   * \brief Move provisional numbers of conversations whose stored ones were loaded
+   */
+  void ApplyLoadedSeqs();
+  /**
+   * \brief Keep a copy of delivered message until storage takes it
+   *
+   * Over MAX_UNSTORED_MSGS the message is not stored at all.
+   */
+  void KeepUnstored(const ChatMsg& msg, const std::string& conv, bool provisional);
+  /**
+   * \brief Store kept messages that have their final numbers
+   */
+  void StoreUnstored();
   /**
    * These functions are not under any mutex
    */
   void ProcessUnregMsg(std::shared_ptr<ChatMsg> msg);
   void ProcessPrivateMsg(std::shared_ptr<ChatMsg> msg);
   void ProcessPublicMsg(std::shared_ptr<ChatMsg> msg);
+  /**
+   * Messages of a batch are routed together: every recipient gets
+   * all of its messages in one send, storage gets one insert
+   */
+  void ProcessBatch(std::shared_ptr<ChatMsg> batch);
+  void ProcessMcastJoin(std::shared_ptr<ChatMsg> msg);
+  /**
+   * Stream a page of stored messages back to the requesting client
+   */
+  void ProcessHistoryReq(std::shared_ptr<ChatMsg> msg);
+  bool SendHistory(std::shared_ptr<Connection> client, const HistoryReq& req);
   void ProcessErrRegMsg(std::shared_ptr<ChatMsg> msg);
   void ProcessErrUnregMsg(std::shared_ptr<ChatMsg> msg);
   void ProcessErrUnkMsg(std::shared_ptr<ChatMsg> msg);
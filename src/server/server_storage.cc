@@ -1,11 +1,17 @@
 #include "server_storage.h"
 
+#include <string.h>
+
+#include <algorithm>
 #include <cstdint>
 #include <iostream>
 #include <vector>
 #include <bsoncxx/json.hpp>
 #include <mongocxx/stdx.hpp>
 #include <mongocxx/uri.hpp>
+#include <mongocxx/options/find.hpp>
+#include <mongocxx/options/update.hpp>
+#include <bsoncxx/types.hpp>
 #include <bsoncxx/builder/stream/helpers.hpp>
 #include <bsoncxx/builder/stream/document.hpp>
 #include <bsoncxx/builder/stream/array.hpp>
@@ -19,37 +25,324 @@ using bsoncxx::builder::stream::open_document;
 
 namespace ptxchat {
 
-ServerStorage::ServerStorage() {
+ServerStorage::ServerStorage(const std::string& uri, size_t pool_size):
+  StorageBase(uri, pool_size) {
 
 }
 
-void ServerStorage::AddPrivateMsg(std::shared_ptr<ChatMsg> msg) {
-  if (!isConnected)
-    return;
+bool ServerStorage::Connect() {
+  if (!StorageBase::Connect())
+    return false;
+  try {
+    CreateIndexes();
+  } catch (mongocxx::exception& ex) {
+    /* Queries still work without indexes */
+  }
+  return true;
+}
+
+void ServerStorage::CreateIndexes() {
+  auto s = Acquire();
+  auto msg_coll = s.Collection(MSG_COLL_NAME);
+  /* Range queries of a conversation and of all private messages of a client */
+  msg_coll.create_index(document{} << "Conv" << 1 << "Seq" << -1 << finalize);
+  msg_coll.create_index(document{} << "To" << 1 << "Ts" << -1 << finalize);
+  msg_coll.create_index(document{} << "From" << 1 << "Ts" << -1 << finalize);
+  s.Collection(MAILBOX_COLL_NAME).create_index(document{} << "To" << 1 << "Ts" << 1 << finalize);
+  s.Collection(SESSION_COLL_NAME).create_index(document{} << "Nick" << 1 << finalize,
+                                               mongocxx::options::index{}.unique(true));
+}
+
+bsoncxx::document::value ServerStorage::PrivateMsgDoc(const ChatMsg& msg, const std::string& conv) {
   auto builder = document{};
-  bsoncxx::document::value doc_val = builder
-  << "From" << (const char*)msg->hdr.from
-  << "IP"   << (int)msg->hdr.src_ip
-  << "Port" << (int)msg->hdr.src_port
-  << "To"   << (const char*)msg->hdr.to
-  << "Type" << (int)msg->hdr.type
-  << "Data" << (const char*)msg->buf
+  return builder
+  << "From" << (const char*)msg.hdr.from
+  << "IP"   << (int)msg.hdr.src_ip
+  << "Port" << (int)msg.hdr.src_port
+  << "To"   << (const char*)msg.hdr.to
+  << "Type" << (int)msg.hdr.type
+  << "Conv" << conv
+  << "Seq"  << (int64_t)msg.hdr.seq
+  << "Ts"   << (int64_t)msg.hdr.ts
+  << "Data" << std::string((const char*)msg.buf, msg.hdr.buf_len)
   << bsoncxx::builder::stream::finalize;
-  msg_coll_->insert_one(doc_val.view());
 }
 
-void ServerStorage::AddPublicMsg(std::shared_ptr<ChatMsg> msg) {
-  if (!isConnected)
-    return;
+bsoncxx::document::value ServerStorage::PublicMsgDoc(const ChatMsg& msg) {
   auto builder = document{};
-  bsoncxx::document::value doc_val = builder
-  << "From" << (const char*)msg->hdr.from
-  << "IP"   << (int)msg->hdr.src_ip
-  << "Port" << (int)msg->hdr.src_port
-  << "Type" << (int)msg->hdr.type
-  << "Data" << (const char*)msg->buf
+  return builder
+  << "From" << (const char*)msg.hdr.from
+  << "IP"   << (int)msg.hdr.src_ip
+  << "Port" << (int)msg.hdr.src_port
+  << "Type" << (int)msg.hdr.type
+  << "Conv" << PUBLIC_CONVERSATION
+  << "Seq"  << (int64_t)msg.hdr.seq
+  << "Ts"   << (int64_t)msg.hdr.ts
+  << "Data" << std::string((const char*)msg.buf, msg.hdr.buf_len)
   << bsoncxx::builder::stream::finalize;
-  msg_coll_->insert_one(doc_val.view());
+}
+
+bool ServerStorage::AddPrivateMsg(std::shared_ptr<ChatMsg> msg) {
+  if (!isConnected)
+    return false;
+  std::string conv = ConversationKey(msg->hdr.from, msg->hdr.to);
+  bsoncxx::document::value doc_val = PrivateMsgDoc(*msg, conv);
+  try {
+    Acquire().Collection(MSG_COLL_NAME).insert_one(doc_val.view());
+  } catch (mongocxx::exception& ex) {
+    Lost();
+    return false;
+  }
+  return true;
+}
+
+bool ServerStorage::AddPublicMsg(std::shared_ptr<ChatMsg> msg) {
+  if (!isConnected)
+    return false;
+  bsoncxx::document::value doc_val = PublicMsgDoc(*msg);
+  try {
+    Acquire().Collection(MSG_COLL_NAME).insert_one(doc_val.view());
+  } catch (mongocxx::exception& ex) {
+    Lost();
+    return false;
+  }
+  return true;
+}
+
+bool ServerStorage::AddMsgs(const std::vector<std::shared_ptr<ChatMsg>>& msgs) {
+  if (!isConnected)
+    return false;
+  if (msgs.empty())
+    return true;
+  std::vector<bsoncxx::document::value> docs;
+  docs.reserve(msgs.size());
+  for (auto& msg : msgs) {
+    if (msg->hdr.type == MsgType::PUBLIC_DATA)
+      docs.push_back(PublicMsgDoc(*msg));
+    else
+      docs.push_back(PrivateMsgDoc(*msg, ConversationKey(msg->hdr.from, msg->hdr.to)));
+  }
+  try {
+    Acquire().Collection(MSG_COLL_NAME).insert_many(docs);
+  } catch (mongocxx::exception& ex) {
+    Lost();
+    return false;
+  }
+  return true;
+}
+
+msg_page_t ServerStorage::GetConversationMsgs(const std::string& conv, uint64_t before, uint64_t after,
+                                              uint32_t limit) {
+  if (!isConnected)
+    return msg_page_t{};
+  auto filter = document{}
+  << "Conv" << conv
+  << "Seq" << open_document
+    << "$lt" << (int64_t)(before ? before : INT64_MAX)
+    << "$gt" << (int64_t)after
+  << close_document
+  << finalize;
+  return FindPage(filter.view(), "Seq", limit);
+}
+
+msg_page_t ServerStorage::GetPrivateMsgs(const std::string& nick, uint64_t before, uint64_t after,
+                                         uint32_t limit) {
+  if (!isConnected || nick.empty())
+    return msg_page_t{};
+  auto filter = document{}
+  << "Type" << (int)MsgType::PRIVATE_DATA
+  << "$or" << open_array
+    << open_document << "To" << nick << close_document
+    << open_document << "From" << nick << close_document
+  << close_array
+  << "Ts" << open_document
+    << "$lt" << (int64_t)(before ? before : INT64_MAX)
+    << "$gt" << (int64_t)after
+  << close_document
+  << finalize;
+  return FindPage(filter.view(), "Ts", limit);
+}
+
+bool ServerStorage::GetLastSeq(const std::string& conv, uint64_t& seq) {
+  if (!isConnected)
+    return false;
+  auto page = FindPage((document{} << "Conv" << conv << finalize).view(), "Seq", 1);
+  if (!isConnected)
+    return false;
+  seq = page.empty() ? 0 : page.back()->hdr.seq;
+  return true;
+}
+
+bool ServerStorage::AddMailboxFrames(const std::string& nick, const std::vector<frame_t>& frames) {
+  if (!isConnected)
+    return false;
+  if (frames.empty())
+    return true;
+  std::vector<bsoncxx::document::value> docs;
+  docs.reserve(frames.size());
+  for (auto& f : frames) {
+    ChatMsgHdr hdr;
+    memcpy(&hdr, f->data(), sizeof(hdr));
+    docs.push_back(document{}
+    << "To"    << nick
+    << "Ts"    << (int64_t)hdr.ts
+    << "Frame" << bsoncxx::types::b_binary{bsoncxx::binary_sub_type::k_binary,
+                                           static_cast<uint32_t>(f->size()), f->data()}
+    << finalize);
+  }
+  try {
+    Acquire().Collection(MAILBOX_COLL_NAME).insert_many(docs);
+  } catch (mongocxx::exception& ex) {
+    Lost();
+    return false;
+  }
+  return true;
+}
+
+std::vector<frame_t> ServerStorage::TakeMailboxFrames(const std::string& nick) {
+  std::vector<frame_t> frames{};
+  if (!isConnected)
+    return frames;
+
+  auto sort = document{} << "Ts" << 1 << finalize;
+  mongocxx::options::find opts{};
+  opts.sort(sort.view());
+  int64_t last_ts = 0;
+  try {
+    auto s = Acquire();
+    auto mailbox_coll = s.Collection(MAILBOX_COLL_NAME);
+    auto cursor = mailbox_coll.find((document{} << "To" << nick << finalize).view(), opts);
+    for (auto doc : cursor) {
+      auto f = doc.find("Frame");
+      if (f == doc.end())
+        continue;
+      auto bin = f->get_binary();
+      if (bin.size < sizeof(ChatMsgHdr))
+        continue;
+      frames.push_back(std::make_shared<std::vector<uint8_t>>(bin.bytes, bin.bytes + bin.size));
+      auto ts = doc.find("Ts");
+      if (ts != doc.end())
+        last_ts = ts->get_int64();
+    }
+    if (frames.empty())
+      return frames;
+
+    /* Frames spilled after the query stay for the next login */
+    mailbox_coll.delete_many((document{}
+    << "To" << nick
+    << "Ts" << open_document << "$lte" << last_ts << close_document
+    << finalize).view());
+  } catch (mongocxx::exception& ex) {
+    Lost();
+    /* Frames read before the failure are delivered, they may come again on next login */
+  }
+  return frames;
+}
+
+bool ServerStorage::SetSessionToken(const std::string& nick, const std::string& token) {
+  if (!isConnected)
+    return false;
+  try {
+    Acquire().Collection(SESSION_COLL_NAME).update_one(
+      (document{} << "Nick" << nick << finalize).view(),
+      (document{} << "$set" << open_document << "Token" << token << close_document << finalize).view(),
+      mongocxx::options::update{}.upsert(true));
+  } catch (mongocxx::exception& ex) {
+    Lost();
+    return false;
+  }
+  return true;
+}
+
+std::string ServerStorage::GetSessionToken(const std::string& nick) {
+  if (!isConnected)
+    return "";
+  try {
+    auto doc = Acquire().Collection(SESSION_COLL_NAME).find_one((document{} << "Nick" << nick << finalize).view());
+    if (!doc)
+      return "";
+    auto token = doc->view().find("Token");
+    if (token == doc->view().end())
+      return "";
+    return std::string(token->get_string().value);
+  } catch (mongocxx::exception& ex) {
+    Lost();
+    return "";
+  }
+}
+
+msg_page_t ServerStorage::FindPage(bsoncxx::document::view filter, const char* order, uint32_t limit) {
+  msg_page_t res{};
+  /* Newest first, so the limit cuts off the oldest messages */
+  auto sort = document{} << order << -1 << finalize;
+  mongocxx::options::find opts{};
+  opts.sort(sort.view());
+  opts.limit(limit);
+
+  try {
+    auto s = Acquire();
+    auto msg_coll = s.Collection(MSG_COLL_NAME);
+    auto cursor = msg_coll.find(filter, opts);
+    for (auto doc : cursor) {
+      auto msg = GetMsgFromDoc(doc);
+      if (msg)
+        res.push_back(msg);
+    }
+  } catch (mongocxx::exception& ex) {
+    Lost();
+    return msg_page_t{};
+  }
+  std::reverse(res.begin(), res.end());
+  return res;
+}
+
+std::shared_ptr<ChatMsg> ServerStorage::GetMsgFromDoc(bsoncxx::document::view v) {
+  auto msg = std::make_shared<ChatMsg>();
+  msg->hdr = ChatMsgHdr{};
+  auto from = v.find("From");
+  if (from == v.end())
+    return nullptr;
+  auto from_str = from->get_string().value;
+  strncpy(msg->hdr.from, from_str.data(), std::min(from_str.size(), MAX_NICKNAME_LEN - 1));
+
+  auto to = v.find("To");
+  if (to != v.end()) {
+    auto to_str = to->get_string().value;
+    strncpy(msg->hdr.to, to_str.data(), std::min(to_str.size(), MAX_NICKNAME_LEN - 1));
+  }
+
+  auto src_ip = v.find("IP");
+  if (src_ip == v.end())
+    return nullptr;
+  msg->hdr.src_ip = src_ip->get_int32();
+
+  auto src_port = v.find("Port");
+  if (src_port == v.end())
+    return nullptr;
+  msg->hdr.src_port = src_port->get_int32();
+
+  auto type = v.find("Type");
+  if (type == v.end())
+    return nullptr;
+  msg->hdr.type = (MsgType)(int)type->get_int32();
+
+  auto seq = v.find("Seq");
+  if (seq != v.end())
+    msg->hdr.seq = seq->get_int64();
+
+  auto ts = v.find("Ts");
+  if (ts != v.end())
+    msg->hdr.ts = ts->get_int64();
+
+  msg->hdr.buf_len = 0;
+  auto data = v.find("Data");
+  if (data != v.end()) {
+    auto data_str = data->get_string().value;
+    msg->hdr.buf_len = std::min(data_str.size(), MAX_MSG_BUFFER_SIZE);
+    msg->buf = (uint8_t*)malloc(msg->hdr.buf_len);
+    memcpy(msg->buf, data_str.data(), msg->hdr.buf_len);
+  }
+  return msg;
 }
 
 ServerStorage::~ServerStorage() {
@@ -1,22 +1,125 @@
 #ifndef SERVER_STORAGE_H_
 #define SERVER_STORAGE_H_
 
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "StorageBase.h"
+#include "Frame.h"
 
 namespace ptxchat {
 
+inline const char* MSG_COLL_NAME = "messages";
+inline const char* MAILBOX_COLL_NAME = "mailbox";
+inline const char* SESSION_COLL_NAME = "sessions";
+
+typedef std::vector<std::shared_ptr<ChatMsg>> msg_page_t;
+
+/**
+ * All methods may be called from any thread, each call
+ * checks out its own client of the connection pool.
+ * A call that fails marks storage as not connected, and
+ * calls do nothing until Connect() succeeds again.
+ */
 class ServerStorage: public StorageBase {
  public:
-  ServerStorage();
+  explicit ServerStorage(const std::string& uri = DEF_STORAGE_URI, size_t pool_size = DEF_STORAGE_POOL_SIZE);
+
+  /**
+   * \brief Connect and create indexes
+   */
+  bool Connect() override;
+
+  /**
+   * \return false if storage is not available
+   */
+  bool AddPublicMsg(std::shared_ptr<ChatMsg> msg);
+
+  /**
+   * \return false if storage is not available
+   */
+  bool AddPrivateMsg(std::shared_ptr<ChatMsg> msg);
+
+  /**
+   * \brief Store public and private messages with one insert
+   * \return false if storage is not available
+   */
+  bool AddMsgs(const std::vector<std::shared_ptr<ChatMsg>>& msgs);
+
+  /**
+   * \brief Get a page of conversation ordered by sequence number
+   * \param conv conversation key
+   * \param before exclusive upper bound of sequence number, 0 for the newest
+   * \param after exclusive lower bound of sequence number
+   * \param limit max amount of messages in the page
+   * \return Newest messages of the range ordered from oldest to newest,
+   * empty if storage is not available (IsConnected() turns false)
+   */
+  msg_page_t GetConversationMsgs(const std::string& conv, uint64_t before, uint64_t after, uint32_t limit);
+
+  /**
+   * \brief Get a page of private messages sent to or by nick ordered by server time
+   * \param nick client nickname
+   * \param before exclusive upper bound of timestamp, 0 for the newest
+   * \param after exclusive lower bound of timestamp
+   * \param limit max amount of messages in the page
+   * \return Newest messages of the range ordered from oldest to newest,
+   * empty if storage is not available (IsConnected() turns false)
+   */
+  msg_page_t GetPrivateMsgs(const std::string& nick, uint64_t before, uint64_t after, uint32_t limit);
+
+  /**
+   * \brief Get the greatest sequence number stored for conversation
+   * \param seq receives 0 if conversation is empty
+   * \return false if storage is not available
+   */
+  bool GetLastSeq(const std::string& conv, uint64_t& seq);
+
+  /**
+   * \brief Store frames of offline client mailbox
+   * \return false if storage is not available
+   */
+  bool AddMailboxFrames(const std::string& nick, const std::vector<frame_t>& frames);
+
+  /**
+   * \brief Get and remove stored frames of client mailbox
+   * \return Frames ordered from oldest to newest, empty if storage is not available
+   */
+  std::vector<frame_t> TakeMailboxFrames(const std::string& nick);
+
+  /**
+   * \brief Store resume token of client session, replacing the previous one
+   * \return false if storage is not available
+   */
+  bool SetSessionToken(const std::string& nick, const std::string& token);
+
+  /**
+   * \brief Get resume token of client session
+   * \return Empty string if there is no session or storage is not available
+   */
+  std::string GetSessionToken(const std::string& nick);
 
-  void AddPublicMsg(std::shared_ptr<ChatMsg> msg);
+  /**
+   * \brief Build stored document of a private message
+   * \param conv conversation key of the message
+   */
+  static bsoncxx::document::value PrivateMsgDoc(const ChatMsg& msg, const std::string& conv);
 
-  void AddPrivateMsg(std::shared_ptr<ChatMsg> msg);
+  /**
+   * \brief Build stored document of a public message
+   */
+  static bsoncxx::document::value PublicMsgDoc(const ChatMsg& msg);
 
   ~ServerStorage();
 
  private:
+  void CreateIndexes();
+  msg_page_t FindPage(bsoncxx::document::view filter, const char* order, uint32_t limit);
 
+  static std::shared_ptr<ChatMsg> GetMsgFromDoc(bsoncxx::document::view v);
 };
 
 } // namespace ptxchat
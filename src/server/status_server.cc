@@ -0,0 +1,120 @@
+#include "status_server.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "log.h"
+
+namespace ptxchat {
+
+bool StatusServer::Start(uint16_t port) {
+  int skt = socket(AF_INET, SOCK_STREAM, 0);
+  if (skt < 0)
+    return false;
+
+  int reuse_addr_opt = 1;
+  setsockopt(skt, SOL_SOCKET, SO_REUSEADDR, &reuse_addr_opt, sizeof(reuse_addr_opt));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(skt, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 || listen(skt, 16) < 0) {
+    logger_->log(spdlog::level::err, "Status endpoint cannot listen on port " + std::to_string(port) +
+                 ": " + strerror(errno));
+    close(skt);
+    return false;
+  }
+
+  socket_ = skt;
+  port_ = port;
+  thread_.stop = 0;
+  thread_.thread = std::thread(&StatusServer::Serve, this);
+  logger_->log(spdlog::level::info, "Status endpoint listens on 127.0.0.1:" + std::to_string(port));
+  return true;
+}
+
+void StatusServer::Stop() {
+  if (socket_ < 0)
+    return;
+  thread_.stop = 1;
+  if (thread_.thread.joinable())
+    thread_.thread.join();
+  close(socket_);
+  socket_ = -1;
+}
+
+void StatusServer::Serve() {
+  struct pollfd pfd;
+  pfd.fd = socket_;
+  pfd.events = POLLIN;
+  while (!thread_.stop) {
+    int res = poll(&pfd, 1, STATUS_POLL_TIMEOUT);
+    if (res <= 0)
+      continue;
+    int fd = accept(socket_, nullptr, nullptr);
+    if (fd < 0)
+      continue;
+    HandleConn(fd);
+    close(fd);
+  }
+}
+
+void StatusServer::HandleConn(int fd) {
+  struct timeval tv;
+  tv.tv_sec = 0;
+  tv.tv_usec = STATUS_RECV_TIMEOUT * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  std::string req;
+  char buf[512];
+  while (req.find("\r\n\r\n") == std::string::npos && req.size() < MAX_STATUS_REQ_SIZE) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0)
+      break;
+    req.append(buf, static_cast<size_t>(n));
+  }
+
+  /* Request line: GET <path> HTTP/1.x */
+  std::string body;
+  int code = 400;
+  if (req.compare(0, 4, "GET ") == 0) {
+    size_t end = req.find_first_of(" ?\r\n", 4);
+    std::string path = req.substr(4, end == std::string::npos ? std::string::npos : end - 4);
+    auto it = handlers_.find(path);
+    if (it != handlers_.end()) {
+      code = it->second(body);
+    } else {
+      code = 404;
+      body = "not found\n";
+    }
+  }
+
+  std::string status;
+  switch (code) {
+    case 200: status = "200 OK"; break;
+    case 404: status = "404 Not Found"; break;
+    case 503: status = "503 Service Unavailable"; break;
+    default:  status = std::to_string(code) + " Bad Request"; break;
+  }
+  std::string resp = "HTTP/1.0 " + status + "\r\n"
+                     "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                     "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                     "Connection: close\r\n\r\n" + body;
+  size_t sent = 0;
+  while (sent < resp.size()) {
+    ssize_t n = send(fd, resp.data() + sent, resp.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0)
+      break;
+    sent += static_cast<size_t>(n);
+  }
+}
+
+}  // namespace ptxchat
@@ -0,0 +1,65 @@
+#ifndef SERVER_STATUS_SERVER_H_
+#define SERVER_STATUS_SERVER_H_
+
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <string>
+
+#include "Threads.h"
+
+namespace ptxchat {
+
+static constexpr uint16_t DEF_STATUS_PORT =     9488;
+static constexpr int STATUS_POLL_TIMEOUT =      100;
+static constexpr int STATUS_RECV_TIMEOUT =      100;
+static constexpr size_t MAX_STATUS_REQ_SIZE =   2048;
+
+/**
+ * \brief Minimal HTTP endpoint on loopback for health checks and scraping
+ *
+ * Serves GET requests one at a time on its own thread. Every path
+ * is answered by a handler that fills the body and returns HTTP status.
+ */
+class StatusServer {
+ public:
+  typedef std::function<int(std::string& body)> handler_t;
+
+  StatusServer() noexcept:
+    socket_(-1),
+    port_(0) {}
+
+  /**
+   * \brief Add handler of path, must be called before Start()
+   */
+  void AddHandler(const std::string& path, handler_t h) { handlers_[path] = std::move(h); }
+
+  /**
+   * \brief Listen on 127.0.0.1:port and start serving thread
+   * \return false if the port cannot be bound
+   */
+  bool Start(uint16_t port);
+
+  /**
+   * \brief Stop serving thread and close socket
+   */
+  void Stop();
+
+  [[nodiscard]] uint16_t GetPort() const { return port_; }
+
+  ~StatusServer() { Stop(); }
+
+ private:
+  int socket_;
+  uint16_t port_;
+  ThreadState thread_;
+  std::map<std::string, handler_t> handlers_;
+
+  void Serve();
+  void HandleConn(int fd);
+};
+
+}  // namespace ptxchat
+
+#endif  // SERVER_STATUS_SERVER_H_
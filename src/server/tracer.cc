@@ -0,0 +1,125 @@
+#include "tracer.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <chrono>
+#include <thread>
+#include <utility>
+
+namespace ptxchat {
+
+static const char* STAGE_NAMES[] = {"start", "recv", "queue", "dispatch", "send", "mailbox", "store"};
+
+static uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t ThreadId() {
+  static thread_local uint32_t tid = static_cast<uint32_t>(syscall(SYS_gettid));
+  return tid;
+}
+
+/**
+ * Nicknames come from clients, keep only what is safe in a JSON string
+ */
+static std::string JsonSafe(const std::string& s) {
+  std::string res;
+  for (char c : s)
+    if (c != '"' && c != '\\' && static_cast<unsigned char>(c) >= 0x20)
+      res += c;
+  return res;
+}
+
+void MsgTrace::Mark(TraceStage s, int64_t arg) {
+  Mark(s, NowNs(), arg);
+}
+
+void MsgTrace::Mark(TraceStage s, uint64_t ns, int64_t arg) {
+  marks.push_back(TraceMark{s, ns, ThreadId(), arg});
+}
+
+Tracer::Tracer(const std::string& path, uint32_t sample_every, size_t ring_len) noexcept:
+  out_(fopen(path.c_str(), "w")),
+  first_(true),
+  sample_every_(sample_every ? sample_every : 1),
+  ring_(ring_len) {
+  if (!out_)
+    return;
+  fprintf(out_, "[\n");
+  writer_.stop = 0;
+  writer_.thread = std::thread(&Tracer::Write, this);
+}
+
+Tracer::~Tracer() {
+  if (!out_)
+    return;
+  writer_.stop = 1;
+  if (writer_.thread.joinable())
+    writer_.thread.join();
+  fprintf(out_, "\n]\n");
+  fclose(out_);
+}
+
+std::shared_ptr<MsgTrace> Tracer::Sample() {
+  uint64_t n = cnt_.fetch_add(1, std::memory_order_relaxed);
+  if (n % sample_every_)
+    return nullptr;
+  auto t = std::make_shared<MsgTrace>();
+  t->id = n / sample_every_ + 1;
+  return t;
+}
+
+void Tracer::Finish(const ChatMsg& msg) {
+  Done d{msg.trace, msg.hdr.type,
+         std::string(msg.hdr.from, strnlen(msg.hdr.from, MAX_NICKNAME_LEN)),
+         std::string(msg.hdr.to, strnlen(msg.hdr.to, MAX_NICKNAME_LEN)),
+         msg.hdr.seq};
+  if (!ring_.Push(std::move(d)))
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Tracer::Write() {
+  Done d;
+  while (1) {
+    bool stop = writer_.stop;
+    while (ring_.Pop(d))
+      WriteTrace(d);
+    fflush(out_);
+    if (stop)
+      break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(TRACE_FLUSH_MS));
+  }
+}
+
+void Tracer::WriteTrace(const Done& d) {
+  const auto& marks = d.trace->marks;
+  if (marks.size() < 2)
+    return;
+  const char* type = MsgTypeName(d.type);
+  std::string from = JsonSafe(d.from);
+  std::string to = JsonSafe(d.to);
+  pid_t pid = getpid();
+
+  /* Whole lifecycle, stages are nested in it on the same track */
+  double start_us = static_cast<double>(marks.front().ns) / 1e3;
+  fprintf(out_, "%s{\"name\":\"%s\",\"cat\":\"message\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+          "\"pid\":%d,\"tid\":%llu,\"args\":{\"from\":\"%s\",\"to\":\"%s\",\"seq\":%llu,\"fd\":%lld}}",
+          first_ ? "" : ",\n", type, start_us, static_cast<double>(marks.back().ns - marks.front().ns) / 1e3,
+          pid, static_cast<unsigned long long>(d.trace->id), from.c_str(), to.c_str(),
+          static_cast<unsigned long long>(d.seq), static_cast<long long>(marks.front().arg));
+  first_ = false;
+
+  for (size_t i = 1; i < marks.size(); ++i) {
+    const TraceMark& m = marks[i];
+    fprintf(out_, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":%d,\"tid\":%llu,\"args\":{\"thread\":%u,\"fd\":%lld}}",
+            STAGE_NAMES[static_cast<size_t>(m.stage)], type, static_cast<double>(marks[i - 1].ns) / 1e3,
+            static_cast<double>(m.ns - marks[i - 1].ns) / 1e3, pid,
+            static_cast<unsigned long long>(d.trace->id), m.tid, static_cast<long long>(m.arg));
+  }
+}
+
+}  // namespace ptxchat
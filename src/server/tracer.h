@@ -0,0 +1,115 @@
+#ifndef SERVER_TRACER_H_
+#define SERVER_TRACER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Message.h"
+#include "BoundedRing.h"
+#include "Threads.h"
+
+namespace ptxchat {
+
+constexpr uint32_t DEF_TRACE_SAMPLE =    100;   /**< One of every 100 received messages is traced */
+constexpr size_t DEF_TRACE_RING_LEN =    4096;
+constexpr int TRACE_FLUSH_MS =           100;
+
+/**
+ * Points of message lifecycle. A span of every stage ends at its
+ * mark and starts at the previous one.
+ */
+enum class TraceStage : uint8_t {
+  RECV,       /**< Before reading from connection */
+  ENQUEUE,    /**< Decoded and pushed to client_msgs_ */
+  DEQUEUE,    /**< Taken by processing thread */
+  DISPATCH,   /**< Routed by type */
+  SEND,       /**< Sent to one recipient, arg is its socket */
+  MAILBOX,    /**< Put to mailbox of offline recipient */
+  STORE,      /**< Committed to storage */
+};
+
+struct TraceMark {
+  TraceStage stage;
+  uint64_t ns;       /**< steady_clock */
+  uint32_t tid;      /**< Thread that marked it */
+  int64_t arg;
+};
+
+/**
+ * \brief Timestamps of one sampled message
+ *
+ * Attached to ChatMsg. Threads mark it one after another (hand-off
+ * goes through client_msgs_), so it needs no lock.
+ */
+struct MsgTrace {
+  uint64_t id;
+  std::vector<TraceMark> marks;
+
+  void Mark(TraceStage s, int64_t arg = -1);
+  void Mark(TraceStage s, uint64_t ns, int64_t arg);
+};
+
+/**
+ * \brief Samples received messages and writes their traces to a file
+ *
+ * Output is Chrome trace event format (chrome://tracing, Perfetto):
+ * every message is a track of spans named by stage. Finished traces
+ * go through a lock-free ring to a writer thread, and are dropped
+ * when it falls behind.
+ */
+class Tracer {
+ public:
+  /**
+   * \param sample_every trace one of sample_every messages
+   */
+  Tracer(const std::string& path, uint32_t sample_every = DEF_TRACE_SAMPLE,
+         size_t ring_len = DEF_TRACE_RING_LEN) noexcept;
+  ~Tracer();
+
+  Tracer(const Tracer&) = delete;
+  Tracer& operator=(const Tracer&) = delete;
+
+  [[nodiscard]] bool IsOpen() const { return out_ != nullptr; }
+
+  /**
+   * \brief Decide if the next received message is traced
+   * \return New trace or nullptr
+   */
+  std::shared_ptr<MsgTrace> Sample();
+
+  /**
+   * \brief Queue trace of processed message for writing
+   */
+  void Finish(const ChatMsg& msg);
+
+  [[nodiscard]] uint64_t Dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+ private:
+  struct Done {
+    std::shared_ptr<MsgTrace> trace;
+    MsgType type;
+    std::string from;
+    std::string to;
+    uint64_t seq;
+  };
+
+  FILE* out_;
+  bool first_;
+  uint32_t sample_every_;
+  std::atomic<uint64_t> cnt_{0};
+  std::atomic<uint64_t> dropped_{0};
+  BoundedRing<Done> ring_;
+  ThreadState writer_;
+
+  void Write();
+  void WriteTrace(const Done& d);
+};
+
+}  // namespace ptxchat
+
+#endif  // SERVER_TRACER_H_
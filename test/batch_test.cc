@@ -0,0 +1,157 @@
+#include <string.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "Batch.h"
+
+using namespace ptxchat;
+
+static std::vector<uint8_t> Entry(MsgType t, const std::string& to, const std::string& body) {
+  BatchEntry e{t, static_cast<uint8_t>(to.size()), static_cast<uint16_t>(body.size())};
+  auto p = reinterpret_cast<const uint8_t*>(&e);
+  std::vector<uint8_t> out(p, p + sizeof(e));
+  out.insert(out.end(), to.begin(), to.end());
+  out.insert(out.end(), body.begin(), body.end());
+  return out;
+}
+
+static ChatMsg BatchOf(const std::vector<uint8_t>& body) {
+  ChatMsg batch;
+  batch.hdr = ChatMsgHdr{};
+  batch.hdr.type = MsgType::BATCH;
+  strcpy(batch.hdr.from, "alice");
+  batch.hdr.src_ip = 0x0100007f;
+  batch.hdr.src_port = 4242;
+  batch.hdr.buf_len = body.size();
+  batch.buf = reinterpret_cast<uint8_t*>(malloc(body.size()));
+  memcpy(batch.buf, body.data(), body.size());
+  return batch;
+}
+
+static std::string Body(const ChatMsg& msg) {
+  return std::string(reinterpret_cast<const char*>(msg.buf), msg.hdr.buf_len);
+}
+
+TEST(Batch, EncodeDecodeRoundTrip) {
+  BatchEncoder enc("alice");
+  uint8_t pub[] = "hello all";
+  uint8_t priv[] = "hi bob";
+  ASSERT_TRUE(enc.Add(MsgType::PUBLIC_DATA, "", pub, sizeof(pub) - 1));
+  ASSERT_TRUE(enc.Add(MsgType::PRIVATE_DATA, "bob", priv, sizeof(priv) - 1));
+  ASSERT_TRUE(enc.Add(MsgType::PUBLIC_DATA, "", nullptr, 0));
+  auto batch = enc.Msg();
+  batch->hdr.src_ip = 0x0100007f;
+  EXPECT_EQ(BatchCount(batch->buf, batch->hdr.buf_len), 3u);
+
+  std::vector<std::shared_ptr<ChatMsg>> msgs;
+  ASSERT_TRUE(DecodeBatch(*batch, msgs));
+  ASSERT_EQ(msgs.size(), 3u);
+  EXPECT_EQ(msgs[0]->hdr.type, MsgType::PUBLIC_DATA);
+  EXPECT_EQ(Body(*msgs[0]), "hello all");
+  EXPECT_EQ(msgs[1]->hdr.type, MsgType::PRIVATE_DATA);
+  EXPECT_STREQ(msgs[1]->hdr.to, "bob");
+  EXPECT_EQ(Body(*msgs[1]), "hi bob");
+  EXPECT_EQ(msgs[2]->hdr.buf_len, 0u);
+  /* Every message gets sender and source of the batch */
+  for (auto& m : msgs) {
+    EXPECT_STREQ(m->hdr.from, "alice");
+    EXPECT_EQ(m->hdr.src_ip, 0x0100007fu);
+  }
+
+  /* Frame is the same batch as the queued message */
+  frame_t f = enc.Frame();
+  ASSERT_EQ(f->size(), sizeof(ChatMsgHdr) + batch->hdr.buf_len);
+  EXPECT_EQ(memcmp(f->data() + sizeof(ChatMsgHdr), batch->buf, batch->hdr.buf_len), 0);
+}
+
+TEST(Batch, EncoderRefusesWhatDoesNotFit) {
+  BatchEncoder enc("alice");
+  uint8_t buf[MAX_MSG_BUFFER_SIZE + 1] = {};
+  EXPECT_FALSE(enc.Add(MsgType::REGISTER, "", buf, 1));
+  EXPECT_FALSE(enc.Add(MsgType::PUBLIC_DATA, "", buf, sizeof(buf)));
+  for (size_t i = 0; i < MAX_BATCH_MSGS; ++i)
+    ASSERT_TRUE(enc.Add(MsgType::PUBLIC_DATA, "", buf, MAX_MSG_BUFFER_SIZE));
+  EXPECT_FALSE(enc.Add(MsgType::PUBLIC_DATA, "", buf, 1));
+  EXPECT_EQ(enc.Count(), MAX_BATCH_MSGS);
+  auto batch = enc.Msg();
+  EXPECT_LE(batch->hdr.buf_len, MAX_BATCH_BUFFER_SIZE);
+  EXPECT_EQ(BatchCount(batch->buf, batch->hdr.buf_len), MAX_BATCH_MSGS);
+}
+
+TEST(Batch, EmptyBodyIsMalformed) {
+  ChatMsg batch = BatchOf({});
+  EXPECT_EQ(BatchCount(batch.buf, 0), 0u);
+  std::vector<std::shared_ptr<ChatMsg>> msgs;
+  EXPECT_FALSE(DecodeBatch(batch, msgs));
+  EXPECT_TRUE(msgs.empty());
+}
+
+TEST(Batch, TruncatedEntryIsMalformed) {
+  auto body = Entry(MsgType::PUBLIC_DATA, "", "hello");
+  /* Cut inside the entry header, then inside the buffer */
+  EXPECT_EQ(BatchCount(body.data(), sizeof(BatchEntry) - 1), 0u);
+  EXPECT_EQ(BatchCount(body.data(), body.size() - 1), 0u);
+  /* Trailing bytes that are not an entry */
+  body.push_back(0);
+  EXPECT_EQ(BatchCount(body.data(), body.size()), 0u);
+}
+
+TEST(Batch, EntryLengthsOverLimitsAreMalformed) {
+  std::vector<uint8_t> body = Entry(MsgType::PUBLIC_DATA, "", std::string(MAX_MSG_BUFFER_SIZE + 1, 'x'));
+  EXPECT_EQ(BatchCount(body.data(), body.size()), 0u);
+
+  body = Entry(MsgType::PRIVATE_DATA, std::string(MAX_NICKNAME_LEN, 'b'), "hi");
+  EXPECT_EQ(BatchCount(body.data(), body.size()), 0u);
+  /* Longest nickname leaves room for the terminator */
+  body = Entry(MsgType::PRIVATE_DATA, std::string(MAX_NICKNAME_LEN - 1, 'b'), "hi");
+  EXPECT_EQ(BatchCount(body.data(), body.size()), 1u);
+}
+
+TEST(Batch, LengthsPastTheBodyAreMalformed) {
+  /* Entry claims more buffer than the body holds */
+  BatchEntry e{MsgType::PUBLIC_DATA, 0, 200};
+  std::vector<uint8_t> body(sizeof(e) + 10);
+  memcpy(body.data(), &e, sizeof(e));
+  EXPECT_EQ(BatchCount(body.data(), body.size()), 0u);
+  ChatMsg batch = BatchOf(body);
+  std::vector<std::shared_ptr<ChatMsg>> msgs;
+  EXPECT_FALSE(DecodeBatch(batch, msgs));
+}
+
+TEST(Batch, OnlyDataMessagesAreBatched) {
+  for (MsgType t : {MsgType::REGISTER, MsgType::BATCH, MsgType::HISTORY_REQ, MsgType::MCAST_JOIN}) {
+    auto body = Entry(t, "", "x");
+    EXPECT_EQ(BatchCount(body.data(), body.size()), 0u) << MsgTypeName(t);
+  }
+}
+
+TEST(Batch, TooManyEntriesAreMalformed) {
+  std::vector<uint8_t> body;
+  for (size_t i = 0; i < MAX_BATCH_MSGS; ++i) {
+    auto e = Entry(MsgType::PUBLIC_DATA, "", "");
+    body.insert(body.end(), e.begin(), e.end());
+  }
+  EXPECT_EQ(BatchCount(body.data(), body.size()), MAX_BATCH_MSGS);
+  auto e = Entry(MsgType::PUBLIC_DATA, "", "");
+  body.insert(body.end(), e.begin(), e.end());
+  EXPECT_EQ(BatchCount(body.data(), body.size()), 0u);
+}
+
+TEST(Batch, OversizedBatchFrameIsRejected) {
+  EXPECT_EQ(MaxBufLen(MsgType::BATCH), MAX_BATCH_BUFFER_SIZE);
+  EXPECT_EQ(MaxBufLen(MsgType::PUBLIC_DATA), MAX_MSG_BUFFER_SIZE);
+
+  /* Decoder of the client stream refuses the frame before reading its body */
+  ChatMsgHdr hdr{};
+  hdr.type = MsgType::BATCH;
+  hdr.buf_len = MAX_BATCH_BUFFER_SIZE + 1;
+  FrameDecoder dec;
+  bool error;
+  dec.Append(reinterpret_cast<const uint8_t*>(&hdr), sizeof(hdr));
+  EXPECT_EQ(dec.Next(error), nullptr);
+  EXPECT_TRUE(error);
+}
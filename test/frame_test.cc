@@ -0,0 +1,129 @@
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "Frame.h"
+
+using namespace ptxchat;
+
+static frame_t MakeFrame(MsgType t, const std::string& from, const std::string& body, uint64_t seq) {
+  ChatMsg msg;
+  msg.hdr = ChatMsgHdr{};
+  msg.hdr.type = t;
+  strncpy(msg.hdr.from, from.c_str(), MAX_NICKNAME_LEN - 1);
+  msg.hdr.buf_len = body.size();
+  msg.hdr.seq = seq;
+  msg.buf = reinterpret_cast<uint8_t*>(malloc(body.size()));
+  memcpy(msg.buf, body.data(), body.size());
+  return EncodeFrame(msg);
+}
+
+static std::string Body(const ChatMsg& msg) {
+  return std::string(reinterpret_cast<const char*>(msg.buf), msg.hdr.buf_len);
+}
+
+TEST(FrameDecoder, FrameSplitIntoBytes) {
+  frame_t f = MakeFrame(MsgType::PUBLIC_DATA, "alice", "hello", 7);
+  FrameDecoder dec;
+  bool error;
+  for (size_t i = 0; i + 1 < f->size(); ++i) {
+    dec.Append(f->data() + i, 1);
+    EXPECT_EQ(dec.Next(error), nullptr);
+    EXPECT_FALSE(error);
+  }
+  dec.Append(f->data() + f->size() - 1, 1);
+  auto msg = dec.Next(error);
+  ASSERT_NE(msg, nullptr);
+  EXPECT_EQ(msg->hdr.type, MsgType::PUBLIC_DATA);
+  EXPECT_STREQ(msg->hdr.from, "alice");
+  EXPECT_EQ(msg->hdr.seq, 7u);
+  EXPECT_EQ(Body(*msg), "hello");
+  EXPECT_EQ(dec.Pending(), 0u);
+}
+
+TEST(FrameDecoder, SplitInsideHeaderAndBody) {
+  frame_t a = MakeFrame(MsgType::PUBLIC_DATA, "alice", "first", 1);
+  frame_t b = MakeFrame(MsgType::PRIVATE_DATA, "bob", "second", 2);
+  std::vector<uint8_t> stream(a->begin(), a->end());
+  stream.insert(stream.end(), b->begin(), b->end());
+
+  /* First chunk ends inside the header of b, second one inside its body */
+  size_t cut1 = a->size() + sizeof(ChatMsgHdr) / 2;
+  size_t cut2 = a->size() + sizeof(ChatMsgHdr) + 3;
+  FrameDecoder dec;
+  bool error;
+  dec.Append(stream.data(), cut1);
+  auto msg = dec.Next(error);
+  ASSERT_NE(msg, nullptr);
+  EXPECT_EQ(Body(*msg), "first");
+  EXPECT_EQ(dec.Next(error), nullptr);
+  dec.Append(stream.data() + cut1, cut2 - cut1);
+  EXPECT_EQ(dec.Next(error), nullptr);
+  EXPECT_FALSE(error);
+  dec.Append(stream.data() + cut2, stream.size() - cut2);
+  msg = dec.Next(error);
+  ASSERT_NE(msg, nullptr);
+  EXPECT_EQ(msg->hdr.type, MsgType::PRIVATE_DATA);
+  EXPECT_EQ(Body(*msg), "second");
+  EXPECT_EQ(dec.Pending(), 0u);
+}
+
+TEST(FrameDecoder, CoalescedFrames) {
+  std::vector<uint8_t> stream;
+  for (uint64_t i = 1; i <= 3; ++i) {
+    frame_t f = MakeFrame(MsgType::PUBLIC_DATA, "alice", "msg" + std::to_string(i), i);
+    stream.insert(stream.end(), f->begin(), f->end());
+  }
+  /* Empty body is a frame too */
+  frame_t empty = MakeFrame(MsgType::PING, "alice", "", 0);
+  stream.insert(stream.end(), empty->begin(), empty->end());
+
+  FrameDecoder dec;
+  bool error;
+  dec.Append(stream.data(), stream.size());
+  for (uint64_t i = 1; i <= 3; ++i) {
+    auto msg = dec.Next(error);
+    ASSERT_NE(msg, nullptr);
+    EXPECT_EQ(msg->hdr.seq, i);
+    EXPECT_EQ(Body(*msg), "msg" + std::to_string(i));
+  }
+  auto msg = dec.Next(error);
+  ASSERT_NE(msg, nullptr);
+  EXPECT_EQ(msg->hdr.type, MsgType::PING);
+  EXPECT_EQ(msg->hdr.buf_len, 0u);
+  EXPECT_EQ(dec.Next(error), nullptr);
+  EXPECT_FALSE(error);
+  EXPECT_EQ(dec.Pending(), 0u);
+}
+
+TEST(FrameDecoder, TailKeptAcrossAppends) {
+  frame_t f = MakeFrame(MsgType::PUBLIC_DATA, "alice", std::string(MAX_MSG_BUFFER_SIZE, 'x'), 1);
+  FrameDecoder dec;
+  bool error;
+  /* Every append completes one frame and starts the next one */
+  size_t half = f->size() / 2;
+  dec.Append(f->data(), half);
+  for (int i = 0; i < 100; ++i) {
+    dec.Append(f->data() + half, f->size() - half);
+    dec.Append(f->data(), half);
+    auto msg = dec.Next(error);
+    ASSERT_NE(msg, nullptr);
+    EXPECT_EQ(msg->hdr.buf_len, MAX_MSG_BUFFER_SIZE);
+    EXPECT_EQ(dec.Next(error), nullptr);
+    EXPECT_EQ(dec.Pending(), half);
+  }
+}
+
+TEST(FrameDecoder, OversizedBodyIsError) {
+  ChatMsgHdr hdr{};
+  hdr.type = MsgType::PUBLIC_DATA;
+  hdr.buf_len = MAX_MSG_BUFFER_SIZE + 1;
+  FrameDecoder dec;
+  bool error;
+  dec.Append(reinterpret_cast<const uint8_t*>(&hdr), sizeof(hdr));
+  EXPECT_EQ(dec.Next(error), nullptr);
+  EXPECT_TRUE(error);
+}
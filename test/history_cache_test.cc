@@ -0,0 +1,159 @@
+#include <string.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "history_cache.h"
+
+using namespace ptxchat;
+
+static constexpr size_t BODY_LEN = 100;
+static constexpr size_t FRAME_LEN = sizeof(ChatMsgHdr) + BODY_LEN;
+
+static std::shared_ptr<ChatMsg> MakeMsg(uint64_t seq) {
+  auto msg = std::make_shared<ChatMsg>();
+  msg->hdr = ChatMsgHdr{};
+  msg->hdr.type = MsgType::PUBLIC_DATA;
+  msg->hdr.seq = seq;
+  msg->hdr.buf_len = BODY_LEN;
+  msg->buf = reinterpret_cast<uint8_t*>(calloc(1, BODY_LEN));
+  return msg;
+}
+
+/**
+ * Storage of n messages numbered from 1, counts its loads
+ */
+struct FakeStorage {
+  explicit FakeStorage(uint64_t n) : n(n) {}
+
+  HistoryCache::loader_t Loader() {
+    return [this](uint32_t limit, std::vector<std::shared_ptr<ChatMsg>>& page) {
+      ++loads;
+      if (down)
+        return false;
+      uint64_t first = n > limit ? n - limit + 1 : 1;
+      for (uint64_t s = first; s <= n; ++s)
+        page.push_back(MakeMsg(s));
+      return true;
+    };
+  }
+
+  uint64_t n;
+  int loads = 0;
+  bool down = false;
+};
+
+TEST(HistoryCache, LoadsOnceThenHits) {
+  HistoryCache cache(10, 1 << 20);
+  FakeStorage st(5);
+  std::vector<frame_t> frames;
+  bool has_more;
+  ASSERT_TRUE(cache.Get("a", 0, 0, 3, st.Loader(), frames, has_more));
+  ASSERT_EQ(frames.size(), 3u);
+  EXPECT_TRUE(has_more);
+  ASSERT_TRUE(cache.Get("a", 0, 0, 3, st.Loader(), frames, has_more));
+  EXPECT_EQ(st.loads, 1);
+
+  auto s = cache.GetStats();
+  EXPECT_EQ(s.misses, 1u);
+  EXPECT_EQ(s.hits, 1u);
+  EXPECT_EQ(s.frames, 5u);
+  EXPECT_EQ(s.bytes, 5 * FRAME_LEN);
+}
+
+TEST(HistoryCache, StorageDownIsMiss) {
+  HistoryCache cache(10, 1 << 20);
+  FakeStorage st(5);
+  st.down = true;
+  std::vector<frame_t> frames;
+  bool has_more;
+  EXPECT_FALSE(cache.Get("a", 0, 0, 3, st.Loader(), frames, has_more));
+  EXPECT_EQ(cache.GetStats().bytes, 0u);
+  /* Ring stays cold and is loaded once storage is back */
+  st.down = false;
+  EXPECT_TRUE(cache.Get("a", 0, 0, 3, st.Loader(), frames, has_more));
+  EXPECT_EQ(st.loads, 2);
+}
+
+TEST(HistoryCache, MemoryCapEvictsLeastRecentlyUsed) {
+  /* Room for two full rings of 10 frames */
+  HistoryCache cache(10, 2 * 10 * FRAME_LEN);
+  FakeStorage st(10);
+  ASSERT_TRUE(cache.Warm("a", st.Loader()));
+  ASSERT_TRUE(cache.Warm("b", st.Loader()));
+  /* a is used after b, so b is the oldest one */
+  std::vector<frame_t> frames;
+  bool has_more;
+  ASSERT_TRUE(cache.Get("a", 0, 0, 1, st.Loader(), frames, has_more));
+  EXPECT_EQ(cache.GetStats().evictions, 0u);
+
+  ASSERT_TRUE(cache.Warm("c", st.Loader()));
+  auto s = cache.GetStats();
+  EXPECT_EQ(s.evictions, 1u);
+  EXPECT_EQ(s.rings, 2u);
+  EXPECT_EQ(s.bytes, 2 * 10 * FRAME_LEN);
+  EXPECT_EQ(s.frames, 20u);
+
+  /* a and c are still in memory, b is loaded again */
+  int loads = st.loads;
+  ASSERT_TRUE(cache.Get("a", 0, 0, 1, st.Loader(), frames, has_more));
+  ASSERT_TRUE(cache.Get("c", 0, 0, 1, st.Loader(), frames, has_more));
+  EXPECT_EQ(st.loads, loads);
+  ASSERT_TRUE(cache.Get("b", 0, 0, 1, st.Loader(), frames, has_more));
+  EXPECT_EQ(st.loads, loads + 1);
+  EXPECT_LE(cache.GetStats().bytes, 2 * 10 * FRAME_LEN);
+}
+
+TEST(HistoryCache, RingInUseIsNotEvicted) {
+  /* Cap is below one ring, the ring just read stays */
+  HistoryCache cache(10, 5 * FRAME_LEN);
+  FakeStorage st(10);
+  ASSERT_TRUE(cache.Warm("a", st.Loader()));
+  ASSERT_TRUE(cache.Warm("b", st.Loader()));
+  auto s = cache.GetStats();
+  EXPECT_EQ(s.rings, 1u);
+  EXPECT_EQ(s.evictions, 1u);
+  EXPECT_EQ(s.bytes, 10 * FRAME_LEN);
+}
+
+TEST(HistoryCache, AppendOverCapEvicts) {
+  HistoryCache cache(10, 15 * FRAME_LEN);
+  FakeStorage st(5);
+  ASSERT_TRUE(cache.Warm("a", st.Loader()));
+  ASSERT_TRUE(cache.Warm("b", st.Loader()));
+  /* a fills its ring up to the cap, then old frames go */
+  for (uint64_t s = 6; s <= 12; ++s)
+    cache.Append("a", *MakeMsg(s));
+  auto s = cache.GetStats();
+  EXPECT_EQ(s.evictions, 0u);
+  EXPECT_EQ(s.frames, 15u);
+  EXPECT_EQ(s.bytes, 15 * FRAME_LEN);
+  /* Cold conversation gets no appends */
+  cache.Append("c", *MakeMsg(1));
+  EXPECT_EQ(cache.GetStats().rings, 2u);
+
+  /* Over the cap a goes: b was warmed after it, but a was used since */
+  cache.Append("b", *MakeMsg(6));
+  s = cache.GetStats();
+  EXPECT_EQ(s.evictions, 1u);
+  EXPECT_EQ(s.rings, 1u);
+  EXPECT_EQ(s.frames, 6u);
+  EXPECT_EQ(s.bytes, 6 * FRAME_LEN);
+}
+
+TEST(HistoryCache, DropForgetsRing) {
+  HistoryCache cache(10, 1 << 20);
+  FakeStorage st(5);
+  ASSERT_TRUE(cache.Warm("a", st.Loader()));
+  ASSERT_TRUE(cache.Warm("b", st.Loader()));
+  cache.Drop("a");
+  auto s = cache.GetStats();
+  EXPECT_EQ(s.rings, 1u);
+  EXPECT_EQ(s.bytes, 5 * FRAME_LEN);
+  EXPECT_EQ(s.evictions, 0u);
+  ASSERT_TRUE(cache.Warm("a", st.Loader()));
+  EXPECT_EQ(st.loads, 3);
+}
@@ -0,0 +1,185 @@
+#include <string.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "Message.h"
+#include "rate_limit.h"
+
+using namespace ptxchat;
+
+static constexpr uint64_t MS = 1000000;
+static constexpr uint64_t S = 1000 * MS;
+
+TEST(RateBucket, BurstThenInterval) {
+  /* 10 messages per second, burst of 5 */
+  const uint64_t interval = 100 * MS;
+  const uint64_t tolerance = 4 * interval;
+  RateBucket b;
+  uint64_t now = 10 * S;
+  for (int i = 0; i < 5; ++i)
+    EXPECT_EQ(b.Take(now, interval, tolerance), 0u) << i;
+  EXPECT_EQ(b.Take(now, interval, tolerance), interval);
+  /* Rejected message takes nothing */
+  EXPECT_EQ(b.Take(now + interval / 2, interval, tolerance), interval / 2);
+  EXPECT_EQ(b.Take(now + interval, interval, tolerance), 0u);
+  EXPECT_EQ(b.Take(now + interval, interval, tolerance), interval);
+}
+
+TEST(RateBucket, RefillsUpToBurst) {
+  const uint64_t interval = 100 * MS;
+  const uint64_t tolerance = 4 * interval;
+  RateBucket b;
+  uint64_t now = 10 * S;
+  for (int i = 0; i < 5; ++i)
+    ASSERT_EQ(b.Take(now, interval, tolerance), 0u);
+  /* Long idle time gives the burst back, not more */
+  now += 10 * S;
+  for (int i = 0; i < 5; ++i)
+    EXPECT_EQ(b.Take(now, interval, tolerance), 0u) << i;
+  EXPECT_NE(b.Take(now, interval, tolerance), 0u);
+}
+
+TEST(RateBucket, CostGoesIntoDebt) {
+  const uint64_t interval = 100 * MS;
+  const uint64_t tolerance = 4 * interval;
+  RateBucket b;
+  uint64_t now = 10 * S;
+  /* Batch of 8 passes on a full bucket, then the sender waits it off */
+  EXPECT_EQ(b.Take(now, interval, tolerance, 8), 0u);
+  EXPECT_EQ(b.Take(now, interval, tolerance), 4 * interval);
+  EXPECT_EQ(b.Take(now + 4 * interval, interval, tolerance), 0u);
+}
+
+TEST(RateLimiter, UserBucketIsSharedByConnections) {
+  RateLimitConfig cfg;
+  cfg.conn_rate = 100;
+  cfg.user_rate = 10;
+  cfg.user_burst = 3;
+  RateLimiter limiter(cfg);
+  RateBucket a;
+  RateBucket b;
+  uint64_t user = RateLimiter::UserKey("alice");
+  uint64_t now = 10 * S;
+  EXPECT_EQ(limiter.Check(a, user, now), 0u);
+  EXPECT_EQ(limiter.Check(b, user, now), 0u);
+  EXPECT_EQ(limiter.Check(a, user, now), 0u);
+  EXPECT_NE(limiter.Check(b, user, now), 0u);
+  /* Another user and unregistered connections have their own limits */
+  EXPECT_EQ(limiter.Check(b, RateLimiter::UserKey("bob"), now), 0u);
+  RateBucket c;
+  EXPECT_EQ(limiter.Check(c, 0, now), 0u);
+  EXPECT_EQ(limiter.Check(a, user, now + 100 * MS), 0u);
+}
+
+TEST(RateLimiter, UserKeyNeverZero) {
+  EXPECT_NE(RateLimiter::UserKey(""), 0u);
+  EXPECT_EQ(RateLimiter::UserKey("alice"), RateLimiter::UserKey("alice"));
+  EXPECT_NE(RateLimiter::UserKey("alice"), RateLimiter::UserKey("alicf"));
+  /* Nickname of max length is not terminated */
+  char nick[MAX_NICKNAME_LEN + 1];
+  memset(nick, 'x', sizeof(nick));
+  nick[MAX_NICKNAME_LEN] = 'y';
+  uint64_t k = RateLimiter::UserKey(nick);
+  nick[MAX_NICKNAME_LEN] = 'z';
+  EXPECT_EQ(RateLimiter::UserKey(nick), k);
+}
+
+static auto never_idle = [](int) { return false; };
+
+TEST(LruTable, EvictsLeastRecentlyUsed) {
+  LruTable<int, int> t(2);
+  *t.Get(1, never_idle, true) = 10;
+  *t.Get(2, never_idle, true) = 20;
+  /* 1 is used after 2, so 2 goes */
+  t.Get(1, never_idle, true);
+  *t.Get(3, never_idle, true) = 30;
+  EXPECT_EQ(t.Size(), 2u);
+  ASSERT_NE(t.Find(1), nullptr);
+  EXPECT_EQ(*t.Find(1), 10);
+  EXPECT_EQ(t.Find(2), nullptr);
+  EXPECT_EQ(*t.Find(3), 30);
+}
+
+TEST(LruTable, FullOfBusyRecords) {
+  LruTable<int, int> t(2);
+  t.Get(1, never_idle, false);
+  t.Get(2, never_idle, false);
+  EXPECT_EQ(t.Get(3, never_idle, false), nullptr);
+  EXPECT_NE(t.Find(1), nullptr);
+  EXPECT_NE(t.Find(2), nullptr);
+  /* Existing record is found even when the table is full */
+  EXPECT_NE(t.Get(1, never_idle, false), nullptr);
+}
+
+TEST(LruTable, PrunesIdleRecords) {
+  LruTable<int, int> t(100);
+  for (int i = 0; i < 10; ++i)
+    *t.Get(i, never_idle, false) = i;
+  /* Records below 5 are idle: every lookup frees RATE_PRUNE_STEP of them from the old end */
+  auto idle = [](int v) { return v < 5; };
+  t.Get(9, idle, false);
+  EXPECT_EQ(t.Size(), 10u - RATE_PRUNE_STEP);
+  for (int i = 0; i < 5; ++i)
+    t.Get(9, idle, false);
+  EXPECT_EQ(t.Size(), 5u);
+  EXPECT_EQ(t.Find(0), nullptr);
+  EXPECT_NE(t.Find(5), nullptr);
+}
+
+TEST(RateLimiter, BanAfterViolationsAndExpiry) {
+  RateLimitConfig cfg;
+  cfg.conn_rate = 1;
+  cfg.ban_after = 3;
+  cfg.ban_secs = 10;
+  RateLimiter limiter(cfg);
+  const uint32_t ip = 0x0100007f;
+  uint64_t now = 100 * S;
+  EXPECT_FALSE(limiter.Violation(ip, now));
+  EXPECT_FALSE(limiter.Violation(ip, now + 1 * S));
+  EXPECT_FALSE(limiter.Banned(ip, now + 1 * S));
+  EXPECT_TRUE(limiter.Violation(ip, now + 2 * S));
+  EXPECT_TRUE(limiter.Banned(ip, now + 2 * S));
+  EXPECT_FALSE(limiter.Banned(0x0200007f, now + 2 * S));
+  /* Violations while banned do not extend the ban */
+  EXPECT_FALSE(limiter.Violation(ip, now + 5 * S));
+  EXPECT_TRUE(limiter.Banned(ip, now + 12 * S - 1));
+  EXPECT_FALSE(limiter.Banned(ip, now + 12 * S));
+}
+
+TEST(RateLimiter, ViolationsOutsideWindowDoNotBan) {
+  RateLimitConfig cfg;
+  cfg.conn_rate = 1;
+  cfg.ban_after = 2;
+  RateLimiter limiter(cfg);
+  const uint32_t ip = 0x0100007f;
+  uint64_t now = 100 * S;
+  EXPECT_FALSE(limiter.Violation(ip, now));
+  EXPECT_FALSE(limiter.Violation(ip, now + RATE_BAN_WINDOW_S * S));
+  EXPECT_TRUE(limiter.Violation(ip, now + RATE_BAN_WINDOW_S * S + 1));
+}
+
+TEST(RateLimiter, NoBansUnlessEnabled) {
+  RateLimitConfig cfg;
+  cfg.conn_rate = 1;
+  RateLimiter limiter(cfg);
+  for (int i = 0; i < 100; ++i)
+    EXPECT_FALSE(limiter.Violation(1, 100 * S));
+  EXPECT_FALSE(limiter.Banned(1, 100 * S));
+}
+
+TEST(RateLimitConfig, ParseRate) {
+  double rate;
+  double burst;
+  EXPECT_TRUE(ParseRate("20", rate, burst));
+  EXPECT_EQ(rate, 20);
+  EXPECT_EQ(burst, 0);
+  EXPECT_TRUE(ParseRate("0.5:4", rate, burst));
+  EXPECT_EQ(rate, 0.5);
+  EXPECT_EQ(burst, 4);
+  EXPECT_FALSE(ParseRate("", rate, burst));
+  EXPECT_FALSE(ParseRate("-1", rate, burst));
+  EXPECT_FALSE(ParseRate("5:", rate, burst));
+  EXPECT_FALSE(ParseRate("5x", rate, burst));
+}